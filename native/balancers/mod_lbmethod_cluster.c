@@ -71,13 +71,15 @@ static proxy_worker *internal_find_best_byrequests(request_rec *r, proxy_balance
         if (!mycandidate) {
             mycandidate = worker;
         } else {
-            nodeinfo_t* node1;
+            nodeinfo_t *node1, *live, *live1;
             int id1;
+            /* oldelected is updated in place by the watchdog: read it in the shared memory */
             node1 = table_get_node_route(node_table, mycandidate->s->route, &id1);
-            if (node1) {
+            if (node1 && node_storage->read_node(id1, &live1) == APR_SUCCESS &&
+                node_storage->read_node(id, &live) == APR_SUCCESS) {
                 int lbstatus, lbstatus1;
-                lbstatus1 = ((mycandidate->s->elected - node1->mess.oldelected) * 1000)/mycandidate->s->lbfactor;
-                lbstatus  = ((worker->s->elected - node->mess.oldelected) * 1000)/worker->s->lbfactor;
+                lbstatus1 = ((mycandidate->s->elected - live1->mess.oldelected) * 1000)/mycandidate->s->lbfactor;
+                lbstatus  = ((worker->s->elected - live->mess.oldelected) * 1000)/worker->s->lbfactor;
                 if (lbstatus1> lbstatus) {
                     mycandidate = worker;
                 }
@@ -111,21 +113,11 @@ static proxy_worker *find_best(proxy_balancer *balancer,
                                   request_rec *r)
 {
     proxy_worker *mycandidate = NULL;
+    proxy_table_snapshot *snapshot = get_table_snapshot(r, host_storage, context_storage,
+                                                        balancer_storage, node_storage);
 
-    proxy_vhost_table *vhost_table = (proxy_vhost_table *) apr_table_get(r->notes, "vhost-table");
-    proxy_context_table *context_table  = (proxy_context_table *) apr_table_get(r->notes, "context-table");
-    proxy_node_table *node_table  = (proxy_node_table *) apr_table_get(r->notes, "node-table");
-
-    if (!vhost_table)
-        vhost_table = read_vhost_table(r->pool, host_storage);
-
-    if (!context_table)
-        context_table = read_context_table(r->pool, context_storage);
-
-    if (!node_table)
-        node_table = read_node_table(r->pool, node_storage);
-
-    mycandidate = internal_find_best_byrequests(r, balancer, vhost_table, context_table, node_table);
+    mycandidate = internal_find_best_byrequests(r, balancer, snapshot->vhost_table,
+                                                snapshot->context_table, snapshot->node_table);
 
     return mycandidate;
 }
@@ -166,7 +158,7 @@ static int lbmethod_cluster_trans(request_rec *r)
     void *sconf = r->server->module_config;
     proxy_server_conf *conf = (proxy_server_conf *)
         ap_get_module_config(sconf, &proxy_module);
-
+    proxy_table_snapshot *snapshot;
 
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server,
@@ -176,19 +168,12 @@ static int lbmethod_cluster_trans(request_rec *r)
                 "lbmethod_cluster_trans for %d", conf->balancers->nelts);
 #endif
 
-    proxy_vhost_table *vhost_table = read_vhost_table(r->pool, host_storage);
-    proxy_context_table *context_table = read_context_table(r->pool, context_storage);
-    proxy_balancer_table *balancer_table = read_balancer_table(r->pool, balancer_storage);
-    proxy_node_table *node_table = read_node_table(r->pool, node_storage);
-
-    apr_table_setn(r->notes, "vhost-table",  (char *) vhost_table);
-    apr_table_setn(r->notes, "context-table",  (char *) context_table);
-    apr_table_setn(r->notes, "balancer-table",  (char *) balancer_table);
-    apr_table_setn(r->notes, "node-table",  (char *) node_table);
-
-    balancer = get_route_balancer(r, conf, vhost_table, context_table, balancer_table, node_table, use_alias);
+    snapshot = get_table_snapshot(r, host_storage, context_storage, balancer_storage, node_storage);
+    balancer = get_route_balancer(r, conf, snapshot->vhost_table, snapshot->context_table,
+                                  snapshot->balancer_table, snapshot->node_table, use_alias);
     if (!balancer) {
-        balancer = get_context_host_balancer(r, vhost_table, context_table, node_table, use_alias);
+        balancer = get_context_host_balancer(r, snapshot->vhost_table, snapshot->context_table,
+                                             snapshot->node_table, use_alias);
     }
     
 
@@ -281,17 +266,18 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
                                 /* The lbstatus needs to be updated */
                                 nodeinfo_t *ou; 
                                 int elected, oldelected;
+                                int removed = 0;
                                 elected = worker->s->elected;
                                 oldelected = node->mess.oldelected;
-                                node_storage->lock_nodes();
+                                node_storage->lock_node(id);
                                 if (node_storage->read_node(id, &ou) != APR_SUCCESS) {
-                                    node_storage->unlock_nodes();
+                                    node_storage->unlock_node(id);
                                     workers++;
                                     continue;
                                 }
                                 if (ou->mess.remove) {
                                     /* the stored node is already marked for removal */
-                                    node_storage->unlock_nodes();
+                                    node_storage->unlock_node(id);
                                     workers++;
                                    continue;
                                 }
@@ -309,6 +295,7 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
                                             /* Failing for 5 minutes: time to mark it removed */
                                             ou->mess.remove = 1;
                                             ou->updatetime = now;
+                                            removed = 1;
                                         }
                                     } else {
                                         ou->mess.num_failure_idle = 0;
@@ -316,7 +303,9 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
                                 } else {
                                     ou->mess.num_failure_idle = 0;
                                 }
-                                node_storage->unlock_nodes();
+                                node_storage->unlock_node(id);
+                                if (removed)
+                                    node_storage->journal_node(id);
                             }
                         }
                         workers++;
@@ -410,6 +399,14 @@ static int lbmethod_cluster_post_config(apr_pool_t *p, apr_pool_t *plog,
     return OK;
 }
 
+static void lbmethod_cluster_child_init(apr_pool_t *p, server_rec *s)
+{
+    if (table_snapshot_child_init(p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "lbmethod_cluster_child_init: table_snapshot_child_init failed");
+    }
+}
+
 static void register_hooks(apr_pool_t *p)
 {
     static const char * const aszPre[]={ "mod_manager.c", "mod_rewrite.c", NULL };
@@ -419,6 +416,7 @@ static void register_hooks(apr_pool_t *p)
 
     ap_hook_translate_name(lbmethod_cluster_trans, aszPre, aszSucc, APR_HOOK_FIRST);
     ap_hook_post_config(lbmethod_cluster_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(lbmethod_cluster_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 
@@ -0,0 +1,698 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2007 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+/**
+ * @file  mod_cluster_bench.c
+ * @brief micro-benchmarks of the routing, election and slotmem logic
+ *
+ * common.c, the slotmem and the tables of mod_manager are linked without
+ * httpd against synthetic tables: the nodes of one balancer, applications
+ * deployed on all the nodes and the aliases of the virtual host of each
+ * node. The tables and the requests only depend on the parameters so the
+ * results of two builds are comparable.
+ *
+ * mod_cluster_bench [-n nodes] [-c contexts] [-a aliases] [-i iterations]
+ *                   [-r repeats] [-d directory] [benchmark prefix...]
+ *
+ * The time reported is the best of the repeats. The allocations are the
+ * malloc() calls during the operations (glibc only): the pool blocks with
+ * a regular APR, every apr_palloc() with an APR built with
+ * --enable-pool-debug.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "mod_proxy.h"
+
+#include "apr_getopt.h"
+#include "apr_file_info.h"
+#include "apr_strings.h"
+#include "apr_lib.h"
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+#endif
+
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>         /* for getpid() */
+#endif
+
+#include "slotmem.h"
+
+#include "domain.h"
+#include "node.h"
+#include "host.h"
+#include "context.h"
+#include "balancer.h"
+
+#include "mod_proxy_cluster.h"
+#include "mod_manager.h"
+
+#define BENCH_BATCH 16 /* requests prepared (out of the measure) before each batch of operations */
+#define BENCH_BALANCER "mycluster"
+
+/*
+ * The httpd and mod_proxy routines used by common.c and sharedmem_util.c
+ */
+module AP_MODULE_DECLARE_DATA proxy_module; /* module_index 0: see init_env() */
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+unixd_config_rec ap_unixd_config;
+#endif
+
+AP_DECLARE(const char *) ap_get_server_name(request_rec *r)
+{
+    return r->hostname;
+}
+
+/* the log level of the server is APLOG_EMERG: only the messages without server come here */
+#ifdef AP_HAVE_C99
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index, int level,
+                               apr_status_t status, const server_rec *s, const char *fmt, ...)
+#else
+AP_DECLARE(void) ap_log_error(const char *file, int line, int module_index, int level,
+                              apr_status_t status, const server_rec *s, const char *fmt, ...)
+#endif
+{
+}
+
+AP_DECLARE(void) ap_str_tolower(char *str)
+{
+    for (; *str; str++)
+        *str = apr_tolower(*str);
+}
+
+/*
+ * Count the allocations: the glibc allocator is wrapped.
+ */
+static apr_uint64_t bench_allocs = 0;
+#if defined(__GLIBC__) && !defined(BENCH_NO_MALLOC_COUNT)
+#define BENCH_COUNT_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    bench_allocs++;
+    return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size)
+{
+    bench_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size)
+{
+    bench_allocs++;
+    return __libc_realloc(ptr, size);
+}
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#endif
+
+/* nanoseconds */
+static apr_uint64_t bench_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (apr_uint64_t) apr_time_now() * 1000;
+#endif
+}
+
+/*
+ * The shared tables and the storage methods like mod_manager gives them
+ * to mod_proxy_cluster.
+ */
+static mem_t *nodestatsmem = NULL;
+static mem_t *contextstatsmem = NULL;
+static mem_t *hoststatsmem = NULL;
+static mem_t *balancerstatsmem = NULL;
+
+static apr_status_t loc_copy_node(int ids, nodeinfo_t *node)
+{
+    return (copy_node(nodestatsmem, node, ids));
+}
+static int loc_get_ids_used_node(int *ids)
+{
+    return (get_ids_used_node(nodestatsmem, ids));
+}
+static int loc_get_max_size_node(void)
+{
+    return (get_max_size_node(nodestatsmem));
+}
+static unsigned int loc_get_version_node(void)
+{
+    return (get_version_node(nodestatsmem));
+}
+static apr_status_t loc_copy_context(int ids, contextinfo_t *context)
+{
+    return (copy_context(contextstatsmem, context, ids));
+}
+static int loc_get_ids_used_context(int *ids)
+{
+    return (get_ids_used_context(contextstatsmem, ids));
+}
+static int loc_get_max_size_context(void)
+{
+    return (get_max_size_context(contextstatsmem));
+}
+static unsigned int loc_get_version_context(void)
+{
+    return (get_version_context(contextstatsmem));
+}
+static apr_status_t loc_copy_host(int ids, hostinfo_t *host)
+{
+    return (copy_host(hoststatsmem, host, ids));
+}
+static int loc_get_ids_used_host(int *ids)
+{
+    return (get_ids_used_host(hoststatsmem, ids));
+}
+static int loc_get_max_size_host(void)
+{
+    return (get_max_size_host(hoststatsmem));
+}
+static unsigned int loc_get_version_host(void)
+{
+    return (get_version_host(hoststatsmem));
+}
+static apr_status_t loc_copy_balancer(int ids, balancerinfo_t *balancer)
+{
+    return (copy_balancer(balancerstatsmem, balancer, ids));
+}
+static int loc_get_ids_used_balancer(int *ids)
+{
+    return (get_ids_used_balancer(balancerstatsmem, ids));
+}
+static int loc_get_max_size_balancer(void)
+{
+    return (get_max_size_balancer(balancerstatsmem));
+}
+static unsigned int loc_get_version_balancer(void)
+{
+    return (get_version_balancer(balancerstatsmem));
+}
+
+/* only the methods used by the routines measured */
+static struct node_storage_method node_storage;
+static struct context_storage_method context_storage;
+static struct host_storage_method host_storage;
+static struct balancer_storage_method balancer_storage;
+
+static void init_storage_methods(void)
+{
+    node_storage.copy_node = loc_copy_node;
+    node_storage.get_ids_used_node = loc_get_ids_used_node;
+    node_storage.get_max_size_node = loc_get_max_size_node;
+    node_storage.get_version_node = loc_get_version_node;
+    context_storage.copy_context = loc_copy_context;
+    context_storage.get_ids_used_context = loc_get_ids_used_context;
+    context_storage.get_max_size_context = loc_get_max_size_context;
+    context_storage.get_version_context = loc_get_version_context;
+    host_storage.copy_host = loc_copy_host;
+    host_storage.get_ids_used_host = loc_get_ids_used_host;
+    host_storage.get_max_size_host = loc_get_max_size_host;
+    host_storage.get_version_host = loc_get_version_host;
+    balancer_storage.copy_balancer = loc_copy_balancer;
+    balancer_storage.get_ids_used_balancer = loc_get_ids_used_balancer;
+    balancer_storage.get_max_size_balancer = loc_get_max_size_balancer;
+    balancer_storage.get_version_balancer = loc_get_version_balancer;
+}
+
+struct bench_env {
+    int nodes;
+    int contexts;
+    int aliases;
+    int apps;           /* different contexts: contexts / nodes, each one on all the nodes */
+    int *nodeids;       /* ids of the nodes in the table */
+    const slotmem_storage_method *storage;
+    ap_slotmem_t *slotmem;     /* nodes + 1 slots of nodeinfo_t, the last one is free */
+    server_rec *server;
+    proxy_server_conf *conf;
+    proxy_balancer *balancer;
+    /* copies of the tables: without index (scan) and with index (like the snapshots) */
+    proxy_vhost_table *vhost_table;
+    proxy_balancer_table *balancer_table;
+    proxy_context_table *context_table;
+    proxy_node_table *node_table;
+    proxy_context_table *context_index;
+    proxy_node_table *node_index;
+};
+typedef struct bench_env bench_env_t;
+
+/* result of the operations: prevents the compiler to remove them */
+static void * volatile bench_sink;
+
+/* fill the shared tables and copy them */
+static apr_status_t init_env(bench_env_t *env, const char *base, apr_pool_t *pool)
+{
+    char *name;
+    int num, i, j, id;
+    apr_status_t rv;
+    slotmem_storage_method *storage = (slotmem_storage_method *) env->storage;
+    void **config;
+    proxy_balancer_shared *bshared;
+
+    /* the tables */
+    name = apr_pstrcat(pool, base, "/manager", NULL);
+    num = env->nodes;
+    nodestatsmem = create_mem_node(name, &num, 0, pool, storage);
+    if ((rv = get_last_mem_error(nodestatsmem)) != APR_SUCCESS)
+        return rv;
+    num = env->contexts;
+    contextstatsmem = create_mem_context(name, &num, 0, pool, storage);
+    if ((rv = get_last_mem_error(contextstatsmem)) != APR_SUCCESS)
+        return rv;
+    num = env->nodes * env->aliases;
+    hoststatsmem = create_mem_host(name, &num, 0, pool, storage);
+    if ((rv = get_last_mem_error(hoststatsmem)) != APR_SUCCESS)
+        return rv;
+    num = 1;
+    balancerstatsmem = create_mem_balancer(name, &num, 0, pool, storage);
+    if ((rv = get_last_mem_error(balancerstatsmem)) != APR_SUCCESS)
+        return rv;
+
+    env->nodeids = apr_palloc(pool, sizeof(int) * env->nodes);
+    for (i = 0; i < env->nodes; i++) {
+        nodeinfo_t node;
+        memset(&node, 0, sizeof(nodeinfo_t));
+        strcpy(node.mess.balancer, BENCH_BALANCER);
+        apr_snprintf(node.mess.JVMRoute, sizeof(node.mess.JVMRoute), "node%d", i + 1);
+        apr_snprintf(node.mess.Host, sizeof(node.mess.Host), "10.0.%d.%d", (i + 1) / 256, (i + 1) % 256);
+        strcpy(node.mess.Port, "8009");
+        strcpy(node.mess.Type, "ajp");
+        rv = insert_update_node(nodestatsmem, &node, &env->nodeids[i]);
+        if (rv != APR_SUCCESS)
+            return rv;
+        for (j = 0; j < env->aliases; j++) {
+            hostinfo_t host;
+            memset(&host, 0, sizeof(hostinfo_t));
+            apr_snprintf(host.host, sizeof(host.host), "alias%d.example.com", j);
+            host.vhost = 1;
+            host.node = env->nodeids[i];
+            rv = insert_update_host(hoststatsmem, &host);
+            if (rv != APR_SUCCESS)
+                return rv;
+        }
+    }
+    env->apps = env->contexts / env->nodes;
+    if (env->apps == 0)
+        env->apps = 1;
+    for (i = 0; i < env->contexts; i++) {
+        contextinfo_t context;
+        memset(&context, 0, sizeof(contextinfo_t));
+        apr_snprintf(context.context, sizeof(context.context), "/app%d", i % env->apps);
+        context.vhost = 1;
+        context.node = env->nodeids[(i / env->apps) % env->nodes];
+        context.status = ENABLED;
+        rv = insert_update_context(contextstatsmem, &context);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+    {
+        balancerinfo_t balancer;
+        memset(&balancer, 0, sizeof(balancerinfo_t));
+        strcpy(balancer.balancer, BENCH_BALANCER);
+        balancer.StickySession = 1;
+        strcpy(balancer.StickySessionCookie, "JSESSIONID");
+        strcpy(balancer.StickySessionPath, "jsessionid");
+        balancer.Maxattempts = 1;
+        balancer.WarmConnections = -1;
+        balancer.SlowStart = -1;
+        rv = insert_update_balancer(balancerstatsmem, &balancer);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+
+    /* the slotmem for its own primitives */
+    rv = env->storage->ap_slotmem_create(&env->slotmem, apr_pstrcat(pool, base, "/slotmem", NULL),
+                                         sizeof(nodeinfo_t), env->nodes + 1, CREATE_SLOTMEM, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    for (i = 0; i < env->nodes; i++) {
+        void *mem;
+        rv = env->storage->ap_slotmem_alloc(env->slotmem, &id, &mem);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+
+    /* the server and the balancer of mod_proxy */
+    env->conf = apr_pcalloc(pool, sizeof(proxy_server_conf));
+    env->conf->balancers = apr_array_make(pool, 1, sizeof(proxy_balancer));
+    env->balancer = (proxy_balancer *) apr_array_push(env->conf->balancers);
+    bshared = apr_pcalloc(pool, sizeof(proxy_balancer_shared));
+    strcpy(bshared->name, "balancer://" BENCH_BALANCER);
+    strcpy(bshared->sticky, "JSESSIONID");
+    strcpy(bshared->sticky_path, "jsessionid");
+    strcpy(bshared->lbpname, "MC");
+    env->balancer->s = bshared;
+    env->server = apr_pcalloc(pool, sizeof(server_rec));
+    config = apr_pcalloc(pool, sizeof(void *));
+    config[proxy_module.module_index] = env->conf;
+    env->server->module_config = (struct ap_conf_vector_t *) config;
+
+    /* the copies of the tables */
+    env->vhost_table = read_vhost_table(pool, &host_storage);
+    env->balancer_table = read_balancer_table(pool, &balancer_storage);
+    env->context_table = read_context_table(pool, &context_storage);
+    env->node_table = read_node_table(pool, &node_storage);
+    env->context_index = read_context_table(pool, &context_storage);
+    env->node_index = read_node_table(pool, &node_storage);
+    build_node_index(pool, env->node_index);
+    env->context_index->index = build_context_index(pool, env->vhost_table, env->context_index, env->node_index);
+    return APR_SUCCESS;
+}
+
+/* request i: an application, an alias and a sessionid for one of the nodes */
+static request_rec *bench_request(bench_env_t *env, apr_pool_t *pool, int i)
+{
+    request_rec *r = apr_pcalloc(pool, sizeof(request_rec));
+
+    r->pool = pool;
+    r->server = env->server;
+    r->headers_in = apr_table_make(pool, 4);
+    r->headers_out = apr_table_make(pool, 4);
+    r->notes = apr_table_make(pool, 4);
+    r->subprocess_env = apr_table_make(pool, 4);
+    r->hostname = apr_psprintf(pool, "alias%d.example.com", i % env->aliases);
+    r->uri = apr_psprintf(pool, "/app%d/index.jsp", i % env->apps);
+    r->unparsed_uri = r->uri;
+    apr_table_setn(r->headers_in, "Cookie",
+                   apr_psprintf(pool, "JSESSIONID=%08X.node%d", (unsigned int) i * 2654435761U, i % env->nodes + 1));
+    return r;
+}
+
+typedef void bench_fn(bench_env_t *env, request_rec *r, int i);
+
+static void bench_read_node_table(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = read_node_table(r->pool, &node_storage);
+}
+static void bench_read_context_table(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = read_context_table(r->pool, &context_storage);
+}
+static void bench_read_vhost_table(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = read_vhost_table(r->pool, &host_storage);
+}
+static void bench_read_balancer_table(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = read_balancer_table(r->pool, &balancer_storage);
+}
+static void bench_find_node_context_host_scan(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = find_node_context_host(r, env->balancer, NULL, 1,
+                                        env->vhost_table, env->context_table, env->node_table);
+}
+static void bench_find_node_context_host_index(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = find_node_context_host(r, env->balancer, NULL, 1,
+                                        env->vhost_table, env->context_index, env->node_index);
+}
+static void bench_cluster_get_sessionid(bench_env_t *env, request_rec *r, int i)
+{
+    char *sticky_used;
+    bench_sink = cluster_get_sessionid(r, "JSESSIONID|jsessionid", r->uri, &sticky_used);
+}
+static void bench_get_route_balancer(bench_env_t *env, request_rec *r, int i)
+{
+    bench_sink = (void *) get_route_balancer(r, env->conf, env->vhost_table, env->context_index,
+                                             env->balancer_table, env->node_index, 1);
+}
+/*
+ * The election (internal_find_best_byrequests() of mod_proxy_cluster) needs
+ * the workers of mod_proxy, what it does with the tables is checking that
+ * each node of the balancer can serve the request.
+ */
+static void bench_election(bench_env_t *env, request_rec *r, int i)
+{
+    int n;
+    for (n = 0; n < env->node_index->sizenode; n++)
+        bench_sink = context_host_ok(r, env->balancer, env->node_index->nodes[n], 1,
+                                     env->vhost_table, env->context_index, env->node_index);
+}
+static void bench_slotmem_mem(bench_env_t *env, request_rec *r, int i)
+{
+    void *mem;
+    env->storage->ap_slotmem_mem(env->slotmem, i % env->nodes + 1, &mem);
+    bench_sink = mem;
+}
+static void bench_slotmem_alloc_free(bench_env_t *env, request_rec *r, int i)
+{
+    void *mem;
+    int id;
+    if (env->storage->ap_slotmem_alloc(env->slotmem, &id, &mem) == APR_SUCCESS)
+        env->storage->ap_slotmem_free(env->slotmem, id, mem);
+    bench_sink = mem;
+}
+static apr_status_t bench_slotmem_callback(void *mem, void **data, int id, apr_pool_t *pool)
+{
+    *data = mem;
+    return APR_NOTFOUND; /* visit all the slots */
+}
+static void bench_slotmem_do(bench_env_t *env, request_rec *r, int i)
+{
+    void *mem = NULL;
+    env->storage->ap_slotmem_do(env->slotmem, bench_slotmem_callback, &mem, r->pool);
+    bench_sink = mem;
+}
+
+struct bench {
+    const char *name;
+    bench_fn *fn;
+};
+typedef struct bench bench_t;
+
+static const bench_t benchs[] = {
+    { "read_node_table", bench_read_node_table },
+    { "read_context_table", bench_read_context_table },
+    { "read_vhost_table", bench_read_vhost_table },
+    { "read_balancer_table", bench_read_balancer_table },
+    { "find_node_context_host/scan", bench_find_node_context_host_scan },
+    { "find_node_context_host/index", bench_find_node_context_host_index },
+    { "cluster_get_sessionid", bench_cluster_get_sessionid },
+    { "get_route_balancer", bench_get_route_balancer },
+    { "election/context_host_ok", bench_election },
+    { "ap_slotmem_mem", bench_slotmem_mem },
+    { "ap_slotmem_alloc+free", bench_slotmem_alloc_free },
+    { "ap_slotmem_do", bench_slotmem_do },
+    { NULL, NULL }
+};
+
+/* run iterations operations, returns the ns/op and the allocations per op */
+static double run_bench(bench_env_t *env, const bench_t *bench, int iterations, double *allocs, apr_pool_t *pool)
+{
+    request_rec *requests[BENCH_BATCH];
+    apr_uint64_t elapsed = 0;
+    apr_uint64_t nallocs = 0;
+    apr_uint64_t start, count;
+    int i, j, n;
+
+    for (i = 0; i < iterations; i += n) {
+        n = iterations - i < BENCH_BATCH ? iterations - i : BENCH_BATCH;
+        apr_pool_clear(pool);
+        for (j = 0; j < n; j++)
+            requests[j] = bench_request(env, pool, i + j);
+        count = bench_allocs;
+        start = bench_now();
+        for (j = 0; j < n; j++)
+            bench->fn(env, requests[j], i + j);
+        elapsed += bench_now() - start;
+        nallocs += bench_allocs - count;
+    }
+    *allocs = (double) nallocs / iterations;
+    return (double) elapsed / iterations;
+}
+
+static int selected(const bench_t *bench, apr_getopt_t *opt)
+{
+    int i;
+    if (opt->ind >= opt->argc)
+        return 1;
+    for (i = opt->ind; i < opt->argc; i++) {
+        if (strncmp(bench->name, opt->argv[i], strlen(opt->argv[i])) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* remove the files of the slotmems and the directory */
+static void remove_dir(const char *dir, apr_pool_t *pool)
+{
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    if (apr_dir_open(&d, dir, pool) != APR_SUCCESS)
+        return;
+    while ((rv = apr_dir_read(&finfo, APR_FINFO_NAME | APR_FINFO_TYPE, d)) == APR_SUCCESS || rv == APR_INCOMPLETE) {
+        if (finfo.filetype == APR_REG)
+            apr_file_remove(apr_pstrcat(pool, dir, "/", finfo.name, NULL), pool);
+    }
+    apr_dir_close(d);
+    apr_dir_remove(dir, pool);
+}
+
+static const apr_getopt_option_t options[] = {
+    { "nodes", 'n', 1, "number of nodes (10)" },
+    { "contexts", 'c', 1, "number of contexts (100)" },
+    { "aliases", 'a', 1, "aliases of the virtual host of each node (2)" },
+    { "iterations", 'i', 1, "operations per repeat (10000)" },
+    { "repeats", 'r', 1, "repeats, the best one is reported (5)" },
+    { "directory", 'd', 1, "directory for the files of the slotmems (temp dir)" },
+    { "help", 'h', 0, "this help" },
+    { NULL, 0, 0, NULL }
+};
+
+static void usage(const char *name)
+{
+    int i;
+    fprintf(stderr, "Usage: %s [options] [benchmark prefix...]\n", name);
+    for (i = 0; options[i].name; i++)
+        fprintf(stderr, "  -%c, --%-12s %s\n", options[i].optch, options[i].name, options[i].description);
+    fprintf(stderr, "Benchmarks:\n");
+    for (i = 0; benchs[i].name; i++)
+        fprintf(stderr, "  %s\n", benchs[i].name);
+}
+
+int main(int argc, const char * const argv[])
+{
+    bench_env_t env;
+    apr_pool_t *pool;
+    apr_pool_t *global;
+    apr_pool_t *runpool;
+    apr_getopt_t *opt;
+    const char *arg;
+    const char *dir = NULL;
+    const char *base;
+    int iterations = 10000;
+    int repeats = 5;
+    int ch, i, j;
+    apr_status_t rv;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+
+    memset(&env, 0, sizeof(env));
+    env.nodes = 10;
+    env.contexts = 100;
+    env.aliases = 2;
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((rv = apr_getopt_long(opt, options, &ch, &arg)) == APR_SUCCESS) {
+        switch (ch) {
+        case 'n':
+            env.nodes = atoi(arg);
+            break;
+        case 'c':
+            env.contexts = atoi(arg);
+            break;
+        case 'a':
+            env.aliases = atoi(arg);
+            break;
+        case 'i':
+            iterations = atoi(arg);
+            break;
+        case 'r':
+            repeats = atoi(arg);
+            break;
+        case 'd':
+            dir = arg;
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    if (rv != APR_EOF || env.nodes <= 0 || env.contexts <= 0 || env.aliases <= 0 ||
+        iterations <= 0 || repeats <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (dir == NULL && apr_temp_dir_get(&dir, pool) != APR_SUCCESS)
+        dir = ".";
+    base = apr_psprintf(pool, "%s/mod_cluster_bench.%d", dir, (int) getpid());
+    rv = apr_dir_make(base, APR_OS_DEFAULT, pool);
+    if (rv != APR_SUCCESS) {
+        fprintf(stderr, "%s: can't create %s (%d)\n", argv[0], base, rv);
+        return 1;
+    }
+
+    /* the slotmems are destroyed with global */
+    apr_pool_create(&global, pool);
+    env.storage = mem_getstorage(global, "");
+    sharedmem_initialize_cleanup(global);
+    init_storage_methods();
+    rv = init_env(&env, base, global);
+    if (rv != APR_SUCCESS) {
+        fprintf(stderr, "%s: can't create the tables in %s (%d)\n", argv[0], base, rv);
+        apr_pool_destroy(global);
+        remove_dir(base, pool);
+        return 1;
+    }
+
+    printf("# mod_cluster_bench nodes %d contexts %d aliases %d iterations %d repeats %d\n",
+           env.nodes, env.contexts, env.aliases, iterations, repeats);
+    printf("%-32s %14s %12s\n", "benchmark", "ns/op", "allocs/op");
+    apr_pool_create(&runpool, global);
+    for (i = 0; benchs[i].name; i++) {
+        double best = 0;
+        double allocs = 0;
+        if (!selected(&benchs[i], opt))
+            continue;
+        for (j = 0; j < repeats; j++) {
+            double ns = run_bench(&env, &benchs[i], iterations, &allocs, runpool);
+            if (j == 0 || ns < best)
+                best = ns;
+        }
+#ifdef BENCH_COUNT_ALLOCS
+        printf("%-32s %14.1f %12.2f\n", benchs[i].name, best, allocs);
+#else
+        printf("%-32s %14.1f %12s\n", benchs[i].name, best, "-");
+#endif
+    }
+
+    apr_pool_destroy(global);
+    remove_dir(base, pool);
+    apr_pool_destroy(pool);
+    return 0;
+}
@@ -9,6 +9,11 @@
 #include "http_request.h"
 #include "mod_proxy.h"
 
+#include "apr_thread_mutex.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_strings.h"
+
 #include "slotmem.h"
 
 #include "domain.h"
@@ -19,11 +24,42 @@
 
 #include "mod_proxy_cluster.h"
 
+/* times 33 (like apr_hashfunc_default()) so the prefixes of an uri are hashed in one pass */
+unsigned int cluster_string_hash(const char *str, apr_size_t len)
+{
+    const unsigned char *p = (const unsigned char *) str;
+    unsigned int hash = 0;
+
+    while (len--)
+        hash = hash * 33 + *p++;
+    return hash;
+}
+
+/*
+ * Intern str in the arena of a table copy, one string for all the records
+ * with the same alias or context, it lives as long as the pool of the copy.
+ */
+static const char *intern_string(apr_pool_t *pool, apr_hash_t *arena, const char *str,
+                                 unsigned int *hash, int *len)
+{
+    apr_size_t l = strlen(str);
+    const char *interned = apr_hash_get(arena, str, l);
+
+    if (interned == NULL) {
+        interned = apr_pstrmemdup(pool, str, l);
+        apr_hash_set(arena, interned, l, interned);
+    }
+    *hash = cluster_string_hash(str, l);
+    *len = (int) l;
+    return interned;
+}
+
 /* Read the virtual host table from shared memory */
 proxy_vhost_table *read_vhost_table(apr_pool_t *pool, struct host_storage_method *host_storage)
 {
-    int i;
+    int i, j;
     int size;
+    apr_hash_t *arena;
     proxy_vhost_table *vhost_table = apr_palloc(pool, sizeof(proxy_vhost_table));
     size = host_storage->get_max_size_host();
     if (size == 0) {
@@ -33,47 +69,69 @@ proxy_vhost_table *read_vhost_table(apr_pool_t *pool, struct host_storage_method
         return vhost_table;
     }
 
+    arena = apr_hash_make(pool);
     vhost_table->vhosts =  apr_palloc(pool, sizeof(int) * host_storage->get_max_size_host());
     vhost_table->sizevhost = host_storage->get_ids_used_host(vhost_table->vhosts);
-    vhost_table->vhost_info = apr_palloc(pool, sizeof(hostinfo_t) * vhost_table->sizevhost);
-    for (i = 0; i < vhost_table->sizevhost; i++) {
-        hostinfo_t* h;
+    vhost_table->vhost_info = apr_palloc(pool, sizeof(proxy_vhost_info) * vhost_table->sizevhost);
+    for (i = 0, j = 0; i < vhost_table->sizevhost; i++) {
         int host_index = vhost_table->vhosts[i];
-        host_storage->read_host(host_index, &h);
-        vhost_table->vhost_info[i] = *h;
+        proxy_vhost_info *info = &vhost_table->vhost_info[j];
+        hostinfo_t host;
+        /* a consistent copy, skip the ones removed since get_ids_used_host() */
+        if (host_storage->copy_host(host_index, &host) != APR_SUCCESS)
+            continue;
+        info->host = intern_string(pool, arena, host.host, &info->hash, &info->len);
+        info->vhost = host.vhost;
+        info->node = host.node;
+        info->id = host.id;
+        vhost_table->vhosts[j++] = host_index;
     }
+    vhost_table->sizevhost = j;
     return vhost_table;
 }
 
 /* Read the context table from shared memory */
 proxy_context_table *read_context_table(apr_pool_t *pool, struct context_storage_method *context_storage)
 {
-    int i;
+    int i, j;
     int size;
+    apr_hash_t *arena;
     proxy_context_table *context_table = apr_palloc(pool, sizeof(proxy_context_table));
     size = context_storage->get_max_size_context();
     if (size == 0) { 
         context_table->sizecontext = 0;
         context_table->contexts = NULL;
         context_table->context_info = NULL;
+        context_table->index = NULL;
         return context_table;
     }
+    arena = apr_hash_make(pool);
     context_table->contexts =  apr_palloc(pool, sizeof(int) * size);
     context_table->sizecontext = context_storage->get_ids_used_context(context_table->contexts);
-    context_table->context_info = apr_palloc(pool, sizeof(contextinfo_t) * context_table->sizecontext);
-    for (i = 0; i < context_table->sizecontext; i++) {
-        contextinfo_t* h;
+    context_table->context_info = apr_palloc(pool, sizeof(proxy_context_info) * context_table->sizecontext);
+    for (i = 0, j = 0; i < context_table->sizecontext; i++) {
         int context_index = context_table->contexts[i];
-        context_storage->read_context(context_index, &h);
-        context_table->context_info[i] = *h;
+        proxy_context_info *info = &context_table->context_info[j];
+        contextinfo_t context;
+        /* a consistent copy, skip the ones removed since get_ids_used_context() */
+        if (context_storage->copy_context(context_index, &context) != APR_SUCCESS)
+            continue;
+        info->context = intern_string(pool, arena, context.context, &info->hash, &info->len);
+        info->vhost = context.vhost;
+        info->node = context.node;
+        info->status = context.status;
+        info->id = context.id;
+        context_table->contexts[j++] = context_index;
     }
+    context_table->sizecontext = j;
+    context_table->index = NULL;
     return context_table;
 }
 
 /* Read the balancer table from shared memory */
 proxy_balancer_table *read_balancer_table(apr_pool_t *pool, struct balancer_storage_method *balancer_storage)
 {
-    int i;
+    int i, j;
     int size;
     proxy_balancer_table *balancer_table = apr_palloc(pool, sizeof(proxy_balancer_table));
     size = balancer_storage->get_max_size_balancer();
@@ -86,19 +144,21 @@ proxy_balancer_table *read_balancer_table(apr_pool_t *pool, struct balancer_stor
     balancer_table->balancers =  apr_palloc(pool, sizeof(int) * size);
     balancer_table->sizebalancer = balancer_storage->get_ids_used_balancer(balancer_table->balancers);
     balancer_table->balancer_info = apr_palloc(pool, sizeof(balancerinfo_t) * balancer_table->sizebalancer);
-    for (i = 0; i < balancer_table->sizebalancer; i++) {
-        balancerinfo_t* h;
+    for (i = 0, j = 0; i < balancer_table->sizebalancer; i++) {
         int balancer_index = balancer_table->balancers[i];
-        balancer_storage->read_balancer(balancer_index, &h);
-        balancer_table->balancer_info[i] = *h;
+        /* a consistent copy, skip the ones removed since get_ids_used_balancer() */
+        if (balancer_storage->copy_balancer(balancer_index, &balancer_table->balancer_info[j]) != APR_SUCCESS)
+            continue;
+        balancer_table->balancers[j++] = balancer_index;
     }
+    balancer_table->sizebalancer = j;
     return balancer_table;
 }
 
 /* Read the node table from shared memory */
 proxy_node_table *read_node_table(apr_pool_t *pool, struct node_storage_method *node_storage)
 {
-    int i;
+    int i, j;
     int size;
     proxy_node_table *node_table =  apr_palloc(pool, sizeof(proxy_node_table));
     size = node_storage->get_max_size_node();
@@ -106,20 +166,550 @@ proxy_node_table *read_node_table(apr_pool_t *pool, struct node_storage_method *
         node_table->sizenode = 0;
         node_table->nodes = NULL;
         node_table->node_info = NULL;
+        node_table->routes = NULL;
+        node_table->ids = NULL;
         return node_table;
     }
     node_table->nodes =  apr_palloc(pool, sizeof(int) * size);
     node_table->sizenode = node_storage->get_ids_used_node(node_table->nodes);
     node_table->node_info = apr_palloc(pool, sizeof(nodeinfo_t) * node_table->sizenode);
-    for (i = 0; i < node_table->sizenode; i++) {
-        nodeinfo_t* h;
+    for (i = 0, j = 0; i < node_table->sizenode; i++) {
         int node_index = node_table->nodes[i];
-        node_storage->read_node(node_index, &h);
-        node_table->node_info[i] = *h;
+        /* a consistent copy, skip the ones removed since get_ids_used_node() */
+        if (node_storage->copy_node(node_index, &node_table->node_info[j]) != APR_SUCCESS)
+            continue;
+        node_table->nodes[j++] = node_index;
     }
+    node_table->sizenode = j;
+    node_table->routes = NULL;
+    node_table->ids = NULL;
     return node_table;
 }
 
+/*
+ * Build the route and id hashes of a copy of the node table.
+ */
+void build_node_index(apr_pool_t *pool, proxy_node_table *node_table)
+{
+    int i;
+
+    node_table->routes = apr_hash_make(pool);
+    node_table->ids = apr_hash_make(pool);
+    for (i = 0; i < node_table->sizenode; i++) {
+        nodeinfo_t *node = &node_table->node_info[i];
+        /* keep the first one like the scan of the table */
+        if (!apr_hash_get(node_table->routes, node->mess.JVMRoute, APR_HASH_KEY_STRING))
+            apr_hash_set(node_table->routes, node->mess.JVMRoute, APR_HASH_KEY_STRING, node);
+        if (!apr_hash_get(node_table->ids, &node_table->nodes[i], sizeof(int)))
+            apr_hash_set(node_table->ids, &node_table->nodes[i], sizeof(int), node);
+    }
+}
+
+/*
+ * Build the routing index of a copy of the tables.
+ * The index points to the content of the tables, it must be allocated
+ * in the same pool.
+ */
+proxy_context_index *build_context_index(apr_pool_t *pool, proxy_vhost_table *vhost_table,
+                                         proxy_context_table *context_table, proxy_node_table *node_table)
+{
+    int i;
+    proxy_context_index *index = apr_palloc(pool, sizeof(proxy_context_index));
+
+    index->contexts = apr_hash_make(pool);
+    for (i = 0; i < context_table->sizecontext; i++) {
+        proxy_context_info *context = &context_table->context_info[i];
+        apr_array_header_t *entries = apr_hash_get(index->contexts, context->context, context->len);
+        proxy_context_entry *entry;
+        if (entries == NULL) {
+            entries = apr_array_make(pool, 4, sizeof(proxy_context_entry));
+            apr_hash_set(index->contexts, context->context, context->len, entries);
+        }
+        entry = (proxy_context_entry *) apr_array_push(entries);
+        entry->context = i;
+        entry->node = table_get_node(node_table, context->node);
+    }
+
+    index->vhosts = apr_hash_make(pool);
+    for (i = 0; i < vhost_table->sizevhost; i++) {
+        proxy_vhost_info *vhost = &vhost_table->vhost_info[i];
+        apr_hash_t *pairs = apr_hash_get(index->vhosts, vhost->host, vhost->len);
+        proxy_vhost_node *pair;
+        if (pairs == NULL) {
+            pairs = apr_hash_make(pool);
+            apr_hash_set(index->vhosts, vhost->host, vhost->len, pairs);
+        }
+        pair = apr_pcalloc(pool, sizeof(proxy_vhost_node));
+        pair->vhost = vhost->vhost;
+        pair->node = vhost->node;
+        apr_hash_set(pairs, pair, sizeof(proxy_vhost_node), pair);
+    }
+    return index;
+}
+
+/*
+ * Objects published to the threads of the child: a reader takes a reference
+ * on the current object and the last one to release a replaced object
+ * destroys its pool. shared_mutex protects the published pointers and the
+ * refcounts, the pools of the objects are children of shared_pool (its
+ * allocator has a mutex: they are created and destroyed by any thread).
+ */
+static apr_thread_mutex_t *shared_mutex = NULL;
+static apr_pool_t *shared_pool = NULL;
+
+/* Create the mutex and the parent pool of the shared objects */
+apr_status_t cluster_shared_child_init(apr_pool_t *p)
+{
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *mutex;
+    apr_status_t rv;
+
+    rv = apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+    rv = apr_allocator_create(&allocator);
+    if (rv != APR_SUCCESS)
+        return rv;
+    apr_allocator_mutex_set(allocator, mutex);
+    rv = apr_pool_create_ex(&shared_pool, p, NULL, allocator);
+    if (rv != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, shared_pool);
+    return apr_thread_mutex_create(&shared_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+/**
+ * Create an object to publish, its first member is a cluster_shared.
+ * @param size the size of the object.
+ * @return the object (zeroed, one reference: the caller) or NULL.
+ */
+void *cluster_shared_create(apr_size_t size)
+{
+    apr_pool_t *pool;
+    cluster_shared *obj;
+
+    if (shared_mutex == NULL || apr_pool_create(&pool, shared_pool) != APR_SUCCESS)
+        return NULL;
+    obj = apr_pcalloc(pool, size);
+    obj->pool = pool;
+    obj->refcount = 1;
+    return obj;
+}
+
+/**
+ * Get a reference to the object published in where.
+ * @return the object or NULL (nothing published).
+ */
+cluster_shared *cluster_shared_acquire(cluster_shared **where)
+{
+    cluster_shared *obj;
+
+    if (shared_mutex == NULL)
+        return NULL;
+    apr_thread_mutex_lock(shared_mutex);
+    obj = *where;
+    if (obj)
+        obj->refcount++;
+    apr_thread_mutex_unlock(shared_mutex);
+    return obj;
+}
+
+/* Drop a reference to the object, destroy it when nobody is using it */
+void cluster_shared_release(cluster_shared *obj)
+{
+    int destroy;
+
+    apr_thread_mutex_lock(shared_mutex);
+    destroy = (--obj->refcount == 0);
+    apr_thread_mutex_unlock(shared_mutex);
+    if (destroy)
+        apr_pool_destroy(obj->pool);
+}
+
+/* cluster_shared_release() as a cleanup (of the request pool) */
+apr_status_t cluster_shared_release_cleanup(void *obj)
+{
+    cluster_shared_release((cluster_shared *) obj);
+    return APR_SUCCESS;
+}
+
+/**
+ * Publish the object in where (the caller keeps its reference), the
+ * reference of the replaced one is released. obj NULL unpublishes it.
+ */
+void cluster_shared_publish(cluster_shared **where, cluster_shared *obj)
+{
+    cluster_shared *old;
+
+    if (shared_mutex == NULL)
+        return;
+    apr_thread_mutex_lock(shared_mutex);
+    if (obj)
+        obj->refcount++;
+    old = *where;
+    *where = obj;
+    apr_thread_mutex_unlock(shared_mutex);
+    if (old)
+        cluster_shared_release(old);
+}
+
+/*
+ * Snapshot of the tables shared by the threads of the process.
+ * The current snapshot is rebuilt only when the version of one of the
+ * shared tables changes, the requests keep a reference on the snapshot
+ * they use and the last one to release an old snapshot destroys it.
+ * snapshot_mutex protects current_snapshot and the refcounts,
+ * snapshot_build_mutex prevents several threads to rebuild the same snapshot.
+ */
+static proxy_table_snapshot *current_snapshot = NULL;
+static apr_thread_mutex_t *snapshot_mutex = NULL;
+static apr_thread_mutex_t *snapshot_build_mutex = NULL;
+
+/* Read the versions of the shared tables */
+static void read_table_versions(unsigned int *versions,
+                                struct host_storage_method *host_storage,
+                                struct context_storage_method *context_storage,
+                                struct balancer_storage_method *balancer_storage,
+                                struct node_storage_method *node_storage)
+{
+    versions[0] = host_storage->get_version_host();
+    versions[1] = context_storage->get_version_context();
+    versions[2] = balancer_storage->get_version_balancer();
+    versions[3] = node_storage->get_version_node();
+}
+
+static int snapshot_is_current(proxy_table_snapshot *snapshot, unsigned int *versions)
+{
+    return (snapshot->vhost_version == versions[0] &&
+            snapshot->context_version == versions[1] &&
+            snapshot->balancer_version == versions[2] &&
+            snapshot->node_version == versions[3]);
+}
+
+/* Copy the shared tables in pool, the versions must be read before the copy */
+static proxy_table_snapshot *build_table_snapshot(apr_pool_t *pool, unsigned int *versions,
+                                struct host_storage_method *host_storage,
+                                struct context_storage_method *context_storage,
+                                struct balancer_storage_method *balancer_storage,
+                                struct node_storage_method *node_storage)
+{
+    proxy_table_snapshot *snapshot = apr_pcalloc(pool, sizeof(proxy_table_snapshot));
+    snapshot->vhost_version = versions[0];
+    snapshot->context_version = versions[1];
+    snapshot->balancer_version = versions[2];
+    snapshot->node_version = versions[3];
+    snapshot->vhost_table = read_vhost_table(pool, host_storage);
+    snapshot->context_table = read_context_table(pool, context_storage);
+    snapshot->balancer_table = read_balancer_table(pool, balancer_storage);
+    snapshot->node_table = read_node_table(pool, node_storage);
+    build_node_index(pool, snapshot->node_table);
+    snapshot->context_table->index = build_context_index(pool, snapshot->vhost_table,
+                                                         snapshot->context_table, snapshot->node_table);
+    return snapshot;
+}
+
+/* Drop a reference to the snapshot, destroy it when nobody is using it */
+static apr_status_t release_table_snapshot(void *data)
+{
+    proxy_table_snapshot *snapshot = data;
+    int destroy;
+
+    apr_thread_mutex_lock(snapshot_mutex);
+    destroy = (--snapshot->refcount == 0);
+    apr_thread_mutex_unlock(snapshot_mutex);
+    if (destroy)
+        apr_pool_destroy(snapshot->pool);
+    return APR_SUCCESS;
+}
+
+/* Get a reference to the current snapshot, rebuild it if it is out of date */
+static proxy_table_snapshot *acquire_table_snapshot(unsigned int *versions,
+                                struct host_storage_method *host_storage,
+                                struct context_storage_method *context_storage,
+                                struct balancer_storage_method *balancer_storage,
+                                struct node_storage_method *node_storage)
+{
+    proxy_table_snapshot *snapshot;
+    proxy_table_snapshot *old;
+    apr_pool_t *pool;
+    int destroy = 0;
+
+    apr_thread_mutex_lock(snapshot_mutex);
+    snapshot = current_snapshot;
+    if (snapshot && snapshot_is_current(snapshot, versions)) {
+        snapshot->refcount++;
+        apr_thread_mutex_unlock(snapshot_mutex);
+        return snapshot;
+    }
+    apr_thread_mutex_unlock(snapshot_mutex);
+
+    apr_thread_mutex_lock(snapshot_build_mutex);
+    /* Another thread may have rebuilt it while we were waiting */
+    read_table_versions(versions, host_storage, context_storage, balancer_storage, node_storage);
+    apr_thread_mutex_lock(snapshot_mutex);
+    snapshot = current_snapshot;
+    if (snapshot && snapshot_is_current(snapshot, versions)) {
+        snapshot->refcount++;
+        apr_thread_mutex_unlock(snapshot_mutex);
+        apr_thread_mutex_unlock(snapshot_build_mutex);
+        return snapshot;
+    }
+    apr_thread_mutex_unlock(snapshot_mutex);
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+        apr_thread_mutex_unlock(snapshot_build_mutex);
+        return NULL;
+    }
+    snapshot = build_table_snapshot(pool, versions, host_storage, context_storage, balancer_storage, node_storage);
+    snapshot->pool = pool;
+    snapshot->refcount = 2; /* the current one and the caller */
+
+    apr_thread_mutex_lock(snapshot_mutex);
+    old = current_snapshot;
+    current_snapshot = snapshot;
+    if (old)
+        destroy = (--old->refcount == 0);
+    apr_thread_mutex_unlock(snapshot_mutex);
+    apr_thread_mutex_unlock(snapshot_build_mutex);
+
+    if (destroy)
+        apr_pool_destroy(old->pool);
+    return snapshot;
+}
+
+/* Create the mutexes used for the snapshot of the tables */
+apr_status_t table_snapshot_child_init(apr_pool_t *p)
+{
+    apr_status_t rv;
+    rv = apr_thread_mutex_create(&snapshot_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS)
+        return rv;
+    return apr_thread_mutex_create(&snapshot_build_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+}
+
+/*
+ * Get the snapshot of the tables for the request.
+ * The snapshot already used by the request is reused as long as the shared tables
+ * don't change, otherwise the request gets a reference to the process snapshot
+ * (released with the request pool).
+ * Without the mutexes (table_snapshot_child_init() not called) a copy is made
+ * in the request pool.
+ */
+proxy_table_snapshot *get_table_snapshot(request_rec *r,
+                                struct host_storage_method *host_storage,
+                                struct context_storage_method *context_storage,
+                                struct balancer_storage_method *balancer_storage,
+                                struct node_storage_method *node_storage)
+{
+    unsigned int versions[4];
+    proxy_table_snapshot *snapshot = (proxy_table_snapshot *) apr_table_get(r->notes, "table-snapshot");
+
+    read_table_versions(versions, host_storage, context_storage, balancer_storage, node_storage);
+    if (snapshot && snapshot_is_current(snapshot, versions))
+        return snapshot;
+
+    if (snapshot_mutex)
+        snapshot = acquire_table_snapshot(versions, host_storage, context_storage, balancer_storage, node_storage);
+    else
+        snapshot = NULL;
+    if (snapshot)
+        apr_pool_cleanup_register(r->pool, snapshot, release_table_snapshot, apr_pool_cleanup_null);
+    else
+        snapshot = build_table_snapshot(r->pool, versions, host_storage, context_storage, balancer_storage, node_storage);
+
+    apr_table_setn(r->notes, "table-snapshot", (char *) snapshot);
+    return snapshot;
+}
+
+/*
+ * The name maps of each proxy_server_conf, the hash is filled by
+ * cluster_maps_child_init() and never changed after that.
+ * The maps are rebuilt by the thread changing the balancers or the workers
+ * (mod_proxy_cluster with its lock held) and published with
+ * cluster_shared_publish(), without cluster_maps_child_init()
+ * (mod_lbmethod_cluster) there are no maps and the lookups scan the arrays.
+ */
+struct cluster_maps_slot
+{
+    proxy_server_conf *conf;   /* key of the slot */
+    cluster_shared *maps;      /* proxy_cluster_maps, NULL: scan the arrays */
+    int changed;               /* the balancers or the workers changed since the build */
+    apr_uint32_t generation;   /* changes of the workers (atomic) */
+};
+typedef struct cluster_maps_slot cluster_maps_slot;
+
+static apr_hash_t *conf_maps = NULL;
+
+/* Create the slots of the maps of the VirtualHosts */
+apr_status_t cluster_maps_child_init(apr_pool_t *p, server_rec *s)
+{
+    conf_maps = apr_hash_make(p);
+    while (s) {
+        proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(s->module_config, &proxy_module);
+        if (conf && apr_hash_get(conf_maps, &conf, sizeof(proxy_server_conf *)) == NULL) {
+            cluster_maps_slot *slot = apr_pcalloc(p, sizeof(cluster_maps_slot));
+            slot->conf = conf;
+            slot->changed = 1;
+            apr_hash_set(conf_maps, &slot->conf, sizeof(proxy_server_conf *), slot);
+        }
+        s = s->next;
+    }
+    return APR_SUCCESS;
+}
+
+static cluster_maps_slot *get_maps_slot(proxy_server_conf *conf)
+{
+    if (conf_maps == NULL)
+        return NULL;
+    return apr_hash_get(conf_maps, &conf, sizeof(proxy_server_conf *));
+}
+
+/* Build the maps of the balancers and workers of the conf (one reference: the caller) */
+static proxy_cluster_maps *build_cluster_maps(proxy_server_conf *conf)
+{
+    apr_pool_t *pool;
+    proxy_cluster_maps *maps;
+    char *ptr = conf->balancers->elts;
+    int sizeb = conf->balancers->elt_size;
+    int i;
+
+    maps = cluster_shared_create(sizeof(proxy_cluster_maps));
+    if (maps == NULL)
+        return NULL;
+    pool = maps->shared.pool;
+    maps->balancers = apr_hash_make(pool);
+    maps->maps = apr_hash_make(pool);
+    for (i = 0; i < conf->balancers->nelts; i++, ptr=ptr+sizeb) {
+        proxy_balancer *balancer = (proxy_balancer *) ptr;
+        proxy_balancer_map *map = apr_palloc(pool, sizeof(proxy_balancer_map));
+        char *ptrw = balancer->workers->elts;
+        int sizew = balancer->workers->elt_size;
+        int j;
+
+        /* like the scans: the first balancer with the name wins */
+        if (strlen(balancer->s->name) > 11) {
+            char *name = apr_pstrdup(pool, &balancer->s->name[11]);
+            ap_str_tolower(name);
+            if (apr_hash_get(maps->balancers, name, APR_HASH_KEY_STRING) == NULL)
+                apr_hash_set(maps->balancers, name, APR_HASH_KEY_STRING, balancer);
+        }
+
+        map->balancer = balancer;
+        map->routes = apr_hash_make(pool);
+        map->workers = apr_hash_make(pool);
+        for (j = 0; j < balancer->workers->nelts; j++, ptrw=ptrw+sizew) {
+            proxy_worker *worker = *(proxy_worker **) ptrw;
+            apr_array_header_t *workers;
+
+            if (apr_hash_get(map->workers, &worker->hash, sizeof(proxy_hashes)) == NULL)
+                apr_hash_set(map->workers, &worker->hash, sizeof(proxy_hashes), worker);
+            if (!worker->s || worker->s->route[0] == '\0')
+                continue;
+            workers = apr_hash_get(map->routes, worker->s->route, APR_HASH_KEY_STRING);
+            if (workers == NULL) {
+                workers = apr_array_make(pool, 1, sizeof(proxy_worker *));
+                apr_hash_set(map->routes, apr_pstrdup(pool, worker->s->route), APR_HASH_KEY_STRING, workers);
+            }
+            *(proxy_worker **) apr_array_push(workers) = worker;
+        }
+        apr_hash_set(maps->maps, &map->balancer, sizeof(proxy_balancer *), map);
+    }
+    return maps;
+}
+
+/* The balancers or the workers of the conf changed: the maps need a rebuild */
+void cluster_maps_changed(proxy_server_conf *conf)
+{
+    cluster_maps_slot *slot = get_maps_slot(conf);
+    if (slot) {
+        slot->changed = 1;
+        apr_atomic_inc32(&slot->generation);
+    }
+}
+
+/**
+ * Get the generation of the workers of the conf, it changes each time
+ * cluster_maps_changed() is called for the conf.
+ * @return the generation (always 0 without cluster_maps_child_init()).
+ */
+unsigned int get_workers_generation(proxy_server_conf *conf)
+{
+    cluster_maps_slot *slot = get_maps_slot(conf);
+    return slot ? apr_atomic_read32(&slot->generation) : 0;
+}
+
+/*
+ * Rebuild the maps of the conf if its balancers or workers changed.
+ * Called with the lock protecting conf->balancers and balancer->workers held.
+ */
+void update_cluster_maps(proxy_server_conf *conf)
+{
+    cluster_maps_slot *slot = get_maps_slot(conf);
+    proxy_cluster_maps *maps;
+
+    if (slot == NULL || !slot->changed)
+        return;
+    /* if it fails the lookups scan the arrays until the next change */
+    maps = build_cluster_maps(conf);
+    slot->changed = 0;
+    cluster_shared_publish(&slot->maps, maps ? &maps->shared : NULL);
+    if (maps)
+        cluster_shared_release(&maps->shared);
+}
+
+/**
+ * Find the balancer of the conf using its name.
+ * @param conf the proxy_server_conf.
+ * @param name the name without balancer://.
+ * @return the balancer or NULL if not found.
+ */
+proxy_balancer *find_cluster_balancer(proxy_server_conf *conf, const char *name)
+{
+    cluster_maps_slot *slot = get_maps_slot(conf);
+    proxy_cluster_maps *maps = slot ? (proxy_cluster_maps *) cluster_shared_acquire(&slot->maps) : NULL;
+    proxy_balancer *balancer;
+    char *ptr;
+    int sizeb, i;
+
+    if (maps) {
+        char lname[PROXY_BALANCER_MAX_NAME_SIZE];
+        if (apr_cpystrn(lname, name, sizeof(lname)) - lname < (int) sizeof(lname) - 1) {
+            ap_str_tolower(lname);
+            /* the balancers belong to the conf, not to the maps */
+            balancer = apr_hash_get(maps->balancers, lname, APR_HASH_KEY_STRING);
+            cluster_shared_release(&maps->shared);
+            return balancer;
+        }
+        cluster_shared_release(&maps->shared);
+    }
+    ptr = conf->balancers->elts;
+    sizeb = conf->balancers->elt_size;
+    for (i = 0; i < conf->balancers->nelts; i++, ptr=ptr+sizeb) {
+        balancer = (proxy_balancer *) ptr;
+        if (strlen(balancer->s->name) > 11 && strcasecmp(&balancer->s->name[11], name) == 0)
+            return balancer;
+    }
+    return NULL;
+}
+
+/**
+ * Get the maps of the routes and the workers of the balancer.
+ * The request keeps a reference to the maps (released with its pool).
+ * @return the map or NULL (no maps: scan balancer->workers).
+ */
+proxy_balancer_map *get_balancer_map(request_rec *r, proxy_server_conf *conf, proxy_balancer *balancer)
+{
+    cluster_maps_slot *slot = get_maps_slot(conf);
+    proxy_cluster_maps *maps = slot ? (proxy_cluster_maps *) cluster_shared_acquire(&slot->maps) : NULL;
+
+    if (maps == NULL)
+        return NULL;
+    apr_pool_cleanup_register(r->pool, &maps->shared, cluster_shared_release_cleanup, apr_pool_cleanup_null);
+    return apr_hash_get(maps->maps, &balancer, sizeof(proxy_balancer *));
+}
+
 /*
  * Read the cookie corresponding to name
  * @param r request.
@@ -205,6 +795,80 @@ char *get_path_param(apr_pool_t *pool, char *url,
     return NULL;
 }
 
+/**
+ * The session information of the request, created on first use.
+ * @param r the request_rec.
+ */
+proxy_cluster_session *get_cluster_session(request_rec *r)
+{
+    proxy_cluster_session *session;
+
+    session = (proxy_cluster_session *) apr_table_get(r->notes, "cluster-session");
+    if (session == NULL) {
+        session = apr_pcalloc(r->pool, sizeof(proxy_cluster_session));
+        session->params = apr_array_make(r->pool, 2, sizeof(proxy_session_param));
+        apr_table_setn(r->notes, "cluster-session", (char *) session);
+    }
+    return session;
+}
+
+/**
+ * Forget the cookies and path parameters already read
+ * (the request was changed by remove_session_route()).
+ * @param r the request_rec.
+ */
+void clear_cluster_session_params(request_rec *r)
+{
+    apr_array_clear(get_cluster_session(r)->params);
+}
+
+/*
+ * Read a session cookie (uri NULL) or path parameter once per request.
+ * The uri is compared by address: r->uri, r->unparsed_uri and r->filename
+ * don't change between the lookups.
+ */
+static char *get_session_param(request_rec *r, const char *name, char *uri)
+{
+    proxy_cluster_session *session = get_cluster_session(r);
+    proxy_session_param *param = (proxy_session_param *) session->params->elts;
+    int i;
+
+    for (i = 0; i < session->params->nelts; i++, param++) {
+        if (param->uri == uri && strcmp(param->name, name) == 0)
+            return param->value;
+    }
+    param = apr_array_push(session->params);
+    param->name = name;
+    param->uri = uri;
+    if (uri)
+        param->value = get_path_param(r->pool, uri, name);
+    else
+        param->value = get_cookie_param(r, name, 1);
+    return param->value;
+}
+
+/**
+ * Check that the request has a sessionid with a route
+ * @param r the request_rec.
+ * @param sticky the cookie name.
+ * @param sticky_path the parameter name.
+ * @param uri part of the URL to for the session parameter.
+ * @param sticky_used the string that was used to find the route
+ */
+char *cluster_find_sessionid(request_rec *r, const char *sticky, const char *sticky_path, char *uri,
+                             const char **sticky_used)
+{
+    char *route;
+
+    *sticky_used = sticky_path;
+    route = get_session_param(r, sticky, NULL);
+    if (!route) {
+        route = get_session_param(r, sticky_path, uri);
+        *sticky_used = sticky;
+    }
+    return route;
+}
+
 /**
  * Check that the request has a sessionid with a route
  * @param r the request_rec.
@@ -216,6 +880,7 @@ char *cluster_get_sessionid(request_rec *r, const char *stickyval, char *uri, ch
 {
     char *sticky, *sticky_path;
     char *path;
+    const char *used;
     char *route;
 
     /* for 2.2.x the sticky parameter may contain 2 values */
@@ -224,12 +889,8 @@ char *cluster_get_sessionid(request_rec *r, const char *stickyval, char *uri, ch
         *path++ = '\0';
          sticky_path = path;
     }
-    *sticky_used = sticky_path;
-    route = get_cookie_param(r, sticky, 1);
-    if (!route) {
-        route = get_path_param(r->pool, uri, sticky_path);
-        *sticky_used = sticky;
-    }
+    route = cluster_find_sessionid(r, sticky, sticky_path, uri, &used);
+    *sticky_used = (char *) used;
     return route;
 }
 
@@ -238,49 +899,37 @@ char *cluster_get_sessionid(request_rec *r, const char *stickyval, char *uri, ch
  * @param r the request_rec.
  * @param nodeid the node id.
  * @param route (if received)
+ * @param balancer the balancer of the node if the caller knows it (or NULL).
  * @return 1 is it finds a sessionid 0 otherwise.
  */
-int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_node_table *node_table)
+int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_balancer *balancer,
+                      proxy_node_table *node_table)
 {
-    proxy_balancer *balancer = NULL;
     char *sessionid;
     char *uri;
-    char *sticky_used;
-    char *sticky;
-    int i;
-    proxy_server_conf *conf;
+    const char *sticky_used;
     nodeinfo_t *node;
-    int sizeb;
-    char *ptr;
 
     /* well we already have it */
     if (route != NULL && (*route != '\0'))
         return 1;
 
-    /* read the node */
-    node = table_get_node(node_table, nodeid);
-    if (node == NULL)
-        return 0; /* failed */
+    if (balancer == NULL || strlen(balancer->s->name) <= 11) {
+        proxy_server_conf *conf;
 
-    conf = (proxy_server_conf *) ap_get_module_config(r->server->module_config, &proxy_module);
-    sizeb = conf->balancers->elt_size;
-    ptr = conf->balancers->elts;
-    for (i = 0; i < conf->balancers->nelts; i++, ptr=ptr+sizeb) {
-        balancer = (proxy_balancer *) ptr;
-        if (strlen(balancer->s->name) > 11 && strcasecmp(&balancer->s->name[11], node->mess.balancer) == 0)
-            break;
+        /* read the node */
+        node = table_get_node(node_table, nodeid);
+        if (node == NULL)
+            return 0; /* failed */
+
+        conf = (proxy_server_conf *) ap_get_module_config(r->server->module_config, &proxy_module);
+        balancer = find_cluster_balancer(conf, node->mess.balancer);
     }
-    if (i == conf->balancers->nelts)
-        balancer = NULL;
 
     /* XXX: We don't find the balancer, that is BAD */
     if (balancer == NULL)
         return 0;
 
-    sticky = apr_psprintf(r->pool, "%s|%s", balancer->s->sticky, balancer->s->sticky_path);
-    if (sticky == NULL)
-        return 0;
-
     if (r->filename)
         uri = r->filename + 6;
     else {
@@ -288,7 +937,7 @@ int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_node_
         uri = r->unparsed_uri;
     }
 
-    sessionid = cluster_get_sessionid(r, sticky, uri, &sticky_used);
+    sessionid = cluster_find_sessionid(r, balancer->s->sticky, balancer->s->sticky_path, uri, &sticky_used);
     if (sessionid) {
 #if HAVE_CLUSTER_EX_DEBUG
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -307,19 +956,12 @@ int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_node_
  * @param use_alias compare alias with server_name
  * @return a pointer to a list of nodes.
  */
-node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, const char *route, int use_alias, proxy_vhost_table* vhost_table, proxy_context_table* context_table, proxy_node_table *node_table)
+/* use r->uri (trans) or r->filename (after canon or rewrite) without the parameters */
+static const char *get_context_uri(request_rec *r)
 {
-    int sizecontext = context_table->sizecontext;
-    int *contexts;
-    int *length;
-    int *status;
-    int i, j, max;
-    node_context *best;
-    int nbest;
     const char *uri = NULL;
     const char *luri = NULL;
 
-    /* use r->uri (trans) or r->filename (after canon or rewrite) */
     if (r->filename) {
         const char *scheme = strstr(r->filename, "://");
         if (scheme)
@@ -337,10 +979,121 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
        else
           uri = luri;
     }
+    return uri;
+}
+
+/*
+ * Same logic as the scan of find_node_context_host() using the routing index:
+ * the contexts that can match the uri are the prefixes of the uri that end
+ * before a '/' (or at the end of the uri) plus the first character, the
+ * longest prefix with a context usable for the balancer and virtual host wins.
+ */
+static node_context *find_node_context_host_index(request_rec *r, proxy_balancer *balancer, const char *route, int use_alias,
+                                                  const char *uri, proxy_context_table *context_table,
+                                                  proxy_node_table *node_table)
+{
+    proxy_context_index *index = context_table->index;
+    apr_hash_t *pairs = NULL;
+    apr_array_header_t *entries;
+    proxy_context_entry *entry;
+    node_context *best;
+    int *ok;
+    int len, j, nok, nbest;
+
+    if (use_alias) {
+        const char *hostname = ap_get_server_name(r);
+#if HAVE_CLUSTER_EX_DEBUG
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                     "find_node_context_host: Host: %s", hostname);
+#endif
+        pairs = apr_hash_get(index->vhosts, hostname, APR_HASH_KEY_STRING);
+        if (pairs == NULL)
+            return NULL;
+    }
+
+    for (len = strlen(uri); len > 0; len--) {
+        if (uri[len] != '\0' && uri[len] != '/' && len != 1)
+            continue;
+        entries = apr_hash_get(index->contexts, uri, len);
+        if (entries == NULL)
+            continue;
+
+        /* keep only the contexts corresponding to our balancer and virtual host */
+        ok = apr_pcalloc(r->pool, sizeof(int) * entries->nelts);
+        nok = 0;
+        entry = (proxy_context_entry *) entries->elts;
+        for (j = 0; j < entries->nelts; j++, entry++) {
+            proxy_context_info *context = &context_table->context_info[entry->context];
+            if (pairs) {
+                proxy_vhost_node pair;
+                pair.vhost = context->vhost;
+                pair.node = context->node;
+                if (apr_hash_get(pairs, &pair, sizeof(proxy_vhost_node)) == NULL)
+                    continue;
+            }
+            if (balancer != NULL) {
+                if (entry->node == NULL)
+                    continue;
+                if (strlen(balancer->s->name) > 11 && strcasecmp(&balancer->s->name[11], entry->node->mess.balancer) != 0)
+                    continue;
+            }
+            ok[j] = 1;
+            nok++;
+        }
+        if (nok == 0)
+            continue; /* try a shorter context */
+
+        /* Check status */
+        best =  apr_palloc(r->pool, sizeof(node_context) * (nok + 1));
+        nbest = 0;
+        entry = (proxy_context_entry *) entries->elts;
+        for (j = 0; j < entries->nelts; j++, entry++) {
+            proxy_context_info *context = &context_table->context_info[entry->context];
+            int usable = 0;
+            if (!ok[j])
+                continue;
+            switch (context->status) {
+                case ENABLED:
+                    usable = -1;
+                    break;
+                case DISABLED:
+                    /* Only the request with sessionid ok for it */
+                    if (hassession_byname(r, context->node, route, balancer, node_table)) {
+                        usable = -1;
+                    }
+                    break;
+            }
+            if (usable) {
+                best[nbest].node = context->node;
+                best[nbest].context = context->id;
+                nbest++;
+            }
+        }
+        if (nbest == 0)
+            return NULL;
+        best[nbest].node = -1;
+        return best;
+    }
+    return NULL;
+}
+
+node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, const char *route, int use_alias, proxy_vhost_table* vhost_table, proxy_context_table* context_table, proxy_node_table *node_table)
+{
+    int sizecontext = context_table->sizecontext;
+    int *contexts;
+    int *length;
+    int *status;
+    unsigned int *hashes;
+    int i, j, max, ulen;
+    node_context *best;
+    int nbest;
+    const char *uri = get_context_uri(r);
 
     /* read the contexts */
     if (sizecontext == 0)
         return NULL;
+    if (context_table->index)
+        return find_node_context_host_index(r, balancer, route, use_alias, uri, context_table, node_table);
     contexts =  apr_palloc(r->pool, sizeof(int)*sizecontext);
     for (i=0; i < sizecontext; i++)
         contexts[i] = i;
@@ -352,17 +1105,19 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
         int sizevhost;
         int *contextsok = apr_pcalloc(r->pool, sizeof(int)*sizecontext);
         const char *hostname = ap_get_server_name(r);
+        int hlen = strlen(hostname);
+        unsigned int hhash = cluster_string_hash(hostname, hlen);
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                      "find_node_context_host: Host: %s", hostname);
 #endif
         sizevhost = vhost_table->sizevhost;
         for (i=0; i<sizevhost; i++) {
-            hostinfo_t *vhost = vhost_table->vhost_info + i;
-            if (strcmp(hostname, vhost->host) == 0) {
+            proxy_vhost_info *vhost = vhost_table->vhost_info + i;
+            if (vhost->hash == hhash && vhost->len == hlen && strcmp(hostname, vhost->host) == 0) {
                 /* add the contexts that match */
                 for (j=0; j<sizecontext; j++) {
-                    contextinfo_t *context = &context_table->context_info[j];
+                    proxy_context_info *context = &context_table->context_info[j];
                     if (context->vhost == vhost->vhost && context->node == vhost->node)
                         contextsok[j] = 1;
                 }
@@ -375,7 +1130,7 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
     }
 #if HAVE_CLUSTER_EX_DEBUG
     for (j=0; j<sizecontext; j++) {
-        contextinfo_t *context;
+        proxy_context_info *context;
         if (contexts[j] == -1) continue;
         context = &context_table->context_info[j]; 
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -384,14 +1139,28 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
     }
 #endif
 
+    /* hashes[len]: hash of the len first characters of the uri */
+    ulen = strlen(uri);
+    hashes = apr_palloc(r->pool, sizeof(unsigned int)*(ulen+1));
+    hashes[0] = 0;
+    for (i=0; i<ulen; i++)
+        hashes[i+1] = hashes[i] * 33 + (unsigned char) uri[i];
+
     /* Check the contexts */
     max = 0;
     for (j=0; j<sizecontext; j++) {
-        contextinfo_t *context;
+        proxy_context_info *context;
         int len;
         if (contexts[j] == -1) continue;
         context = &context_table->context_info[j];
 
+        /* the context must be a prefix of the uri that ends before a '/' */
+        len = context->len;
+        if (len > ulen || (uri[len] != '\0' && uri[len] != '/' && len != 1))
+            continue;
+        if (hashes[len] != context->hash || strncmp(uri, context->context, len) != 0)
+            continue;
+
         /* keep only the contexts corresponding to our balancer */
         if (balancer != NULL) {
 
@@ -401,16 +1170,11 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
             if (strlen(balancer->s->name) > 11 && strcasecmp(&balancer->s->name[11], node->mess.balancer) != 0)
                 continue;
         }
-        len = strlen(context->context);
-        if (strncmp(uri, context->context, len) == 0) {
-            if (uri[len] == '\0' || uri[len] == '/' || len==1) {
-                status[j] = context->status;
-                length[j] = len;
-                if (len > max) {
-                    max = len;
-                } 
-            }
-        }
+        status[j] = context->status;
+        length[j] = len;
+        if (len > max) {
+            max = len;
+        } 
     }
     if (max == 0)
         return NULL;
@@ -425,7 +1189,7 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
     nbest  = 0;
     for (j=0; j<sizecontext; j++)
         if (length[j] == max) {
-            contextinfo_t *context;
+            proxy_context_info *context;
             int ok = 0;
             context = &context_table->context_info[j];
             /* Check status */
@@ -435,7 +1199,7 @@ node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, c
                     break;
                 case DISABLED:
                     /* Only the request with sessionid ok for it */
-                    if (hassession_byname(r, context->node, route, node_table)) {
+                    if (hassession_byname(r, context->node, route, balancer, node_table)) {
                         ok = -1;
                     }
                     break;
@@ -499,8 +1263,8 @@ const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
 {
     char *route = NULL;
     char *sessionid = NULL;
-    char *sticky_used;
-    char *sticky;
+    const char *sticky_used;
+    proxy_cluster_session *session = get_cluster_session(r);
     int i;
     char *ptr = conf->balancers->elts;
     int sizeb = conf->balancers->elt_size;
@@ -512,17 +1276,18 @@ const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
             continue;
         if (strlen(balancer->s->name)<=11)
             continue;
-        sticky = apr_psprintf(r->pool, "%s|%s", balancer->s->sticky, balancer->s->sticky_path);
         /* XXX ; that looks fishy, lb needs to start with MC? */
         if (strncmp(balancer->s->lbpname, "MC", 2))
             continue;
 
-        sessionid = cluster_get_sessionid(r, sticky, r->uri, &sticky_used);
+        sessionid = cluster_find_sessionid(r, balancer->s->sticky, balancer->s->sticky_path, r->uri, &sticky_used);
         if (sessionid) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "cluster: %s Found value %s for "
-                         "stickysession %s",
-                         balancer->s->name, sessionid, sticky);
+                         "stickysession %s|%s",
+                         balancer->s->name, sessionid, balancer->s->sticky, balancer->s->sticky_path);
+            session->sessionid = sessionid;
+            /* the string notes are kept for the other modules */
             apr_table_setn(r->notes, "session-id", sessionid);
             if ((route = strchr(sessionid, '.')) != NULL )
                 route++;
@@ -545,6 +1310,8 @@ const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
                                  &balancer->s->name[11], route);
 #endif
                     /* here we have the route and domain for find_session_route ... */
+                    session->sticky_used = sticky_used;
+                    session->route = route;
                     apr_table_setn(r->notes, "session-sticky", sticky_used);
                     apr_table_setn(r->notes, "session-route", route);
 
@@ -555,6 +1322,7 @@ const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
                         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                                     "cluster: Found domain %s for %s", domain, route);
 #endif
+                        session->domain = domain;
                         apr_table_setn(r->notes, "CLUSTER_DOMAIN", domain);
                     }
                     return &balancer->s->name[11];
@@ -569,6 +1337,8 @@ const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
 nodeinfo_t* table_get_node(proxy_node_table *node_table, int id)
 {
     int i;
+    if (node_table->ids)
+        return apr_hash_get(node_table->ids, &id, sizeof(int));
     for (i = 0; i < node_table->sizenode; i++) {
         if (node_table->nodes[i] == id)
             return &node_table->node_info[i];
@@ -579,6 +1349,12 @@ nodeinfo_t* table_get_node(proxy_node_table *node_table, int id)
 nodeinfo_t* table_get_node_route(proxy_node_table *node_table, char *route, int *id)
 {
     int i;
+    if (node_table->routes) {
+        nodeinfo_t *node = apr_hash_get(node_table->routes, route, APR_HASH_KEY_STRING);
+        if (node)
+            *id = node_table->nodes[node - node_table->node_info];
+        return node;
+    }
     for (i = 0; i < node_table->sizenode; i++) {
         if (!strcmp(node_table->node_info[i].mess.JVMRoute, route)) {
             *id = node_table->nodes[i];
@@ -611,13 +1387,12 @@ const char *get_context_host_balancer(request_rec *r,
         if (node != NULL) {
             if (node->mess.balancer[0] != '\0') {
                 /* Check that it is in our proxy_server_conf */
-                char *name = apr_pstrcat(r->pool, "balancer://", node->mess.balancer, NULL);
-                proxy_balancer *balancer = ap_proxy_get_balancer(r->pool, conf, name, 0);
+                proxy_balancer *balancer = find_cluster_balancer(conf, node->mess.balancer);
                 if (balancer)
                     return node->mess.balancer;
                 else
                      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                                 "get_context_host_balancer: balancer %s not found", name);
+                                 "get_context_host_balancer: balancer balancer://%s not found", node->mess.balancer);
             }
         }
         nodes++;
@@ -638,7 +1413,7 @@ node_context *context_host_ok(request_rec *r, proxy_balancer *balancer, int node
 {
     const char *route;
     node_context *best;
-    route = apr_table_get(r->notes, "session-route");
+    route = get_cluster_session(r)->route;
     best = find_node_context_host(r, balancer, route, use_alias, vhost_table, context_table, node_table);
     if (best == NULL)
         return NULL;
@@ -46,6 +46,16 @@ typedef struct mem mem_t;
 
 #include "mod_clustersize.h"
 
+/* election methods of the balancers (ElectionMethod of httpd or of the CONFIG message) */
+#define ELECTION_BYREQUESTS       0 /* lbfactor/lbstatus/elected (default) */
+#define ELECTION_LEASTOUTSTANDING 1 /* less outstanding requests/lbfactor */
+#define ELECTION_P2C              2 /* power of two random choices, less outstanding requests/lbfactor of the two */
+#define ELECTION_LATENCY          3 /* (outstanding requests + 1) * EWMA of the response time and errors / lbfactor */
+
+/* names of the ELECTION_ (index) */
+#define ELECTION_NAMES { "byrequests", "leastoutstanding", "p2c", "latency" }
+#define ELECTION_COUNT 4
+
 /* status of the balancer as read/store in httpd. */
 struct balancerinfo {
     char balancer[BALANCERSZ]; /* Name of the balancer */
@@ -56,6 +66,9 @@ struct balancerinfo {
     int StickySessionForce;  /* 0: Don't force, 1: return error */
     int Timeout;
     int	Maxattempts;
+    int WarmConnections; /* connections each child opens to a node that joins (-1: WarmConnections of httpd) */
+    int SlowStart;       /* seconds for the lbfactor of a node that joins to ramp up (-1: SlowStart of httpd) */
+    int ElectionMethod;  /* ELECTION_ (-1: ElectionMethod of httpd) */
 
     apr_time_t updatetime; /* time of last received message */
     int id;           /* id in table */
@@ -88,6 +101,15 @@ balancerinfo_t * read_balancer(mem_t *s, balancerinfo_t *balancer);
  */
 apr_status_t get_balancer(mem_t *s, balancerinfo_t **balancer, int ids);
 
+/**
+ * copy a balancer record from the shared table, consistent even if it is being updated
+ * @param pointer to the shared table.
+ * @param balancer address where to copy the balancer.
+ * @param ids  in the balancer table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_balancer(mem_t *s, balancerinfo_t *balancer, int ids);
+
 /**
  * remove(free) a balancer record from the shared table
  * @param pointer to the shared table.
@@ -111,6 +133,13 @@ int get_ids_used_balancer(mem_t *s, int *ids);
  */
 int get_max_size_balancer(mem_t *s);
 
+/*
+ * get the version of the table (each update of the table changes version)
+ * @param pointer to the shared table.
+ * @return version the actual version in the table.
+ */
+unsigned int get_version_balancer(mem_t *s);
+
 /**
  * attach to the shared balancer table
  * @param name of an existing shared table.
@@ -150,5 +179,13 @@ int (* get_ids_used_balancer)(int *ids);
  * read the max number of balancers in the shared table
  */
 int (*get_max_size_balancer)(void);
+/**
+ * read the version of the balancers table (changes each time a balancer is added, removed or updated)
+ */
+unsigned int (*get_version_balancer)(void);
+/**
+ * copy the balancer record, consistent even if a writer is changing it.
+ */
+apr_status_t (*copy_balancer)(int ids, balancerinfo_t *balancer);
 };
 #endif /*BALANCER_H*/
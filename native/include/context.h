@@ -91,6 +91,15 @@ contextinfo_t * read_context(mem_t *s, contextinfo_t *context);
  */
 apr_status_t get_context(mem_t *s, contextinfo_t **context, int ids);
 
+/**
+ * copy a context record from the shared table, consistent even if it is being updated
+ * @param pointer to the shared table.
+ * @param context address where to copy the context.
+ * @param ids  in the context table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_context(mem_t *s, contextinfo_t *context, int ids);
+
 /**
  * remove(free) a context record from the shared table
  * @param pointer to the shared table.
@@ -114,6 +123,13 @@ int get_ids_used_context(mem_t *s, int *ids);
  */
 int get_max_size_context(mem_t *s);
 
+/*
+ * get the version of the table (each update of the table changes version)
+ * @param pointer to the shared table.
+ * @return version the actual version in the table.
+ */
+unsigned int get_version_context(mem_t *s);
+
 /**
  * attach to the shared context table
  * @param name of an existing shared table.
@@ -162,5 +178,14 @@ apr_status_t (*lock_contexts)(void);
  */
 apr_status_t (*unlock_contexts)(void);
 
+/*
+ * read the version of the contexts table (changes each time a context is added, removed or updated)
+ */
+unsigned int (*get_version_context)(void);
+
+/*
+ * copy the context record, consistent even if a writer is changing it.
+ */
+apr_status_t (*copy_context)(int ids, contextinfo_t *context);
 };
 #endif /*CONTEXT_H*/
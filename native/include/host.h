@@ -83,6 +83,15 @@ hostinfo_t * read_host(mem_t *s, hostinfo_t *host);
  */
 apr_status_t get_host(mem_t *s, hostinfo_t **host, int ids);
 
+/**
+ * copy a host record from the shared table, consistent even if it is being updated
+ * @param pointer to the shared table.
+ * @param host address where to copy the host.
+ * @param ids  in the host table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_host(mem_t *s, hostinfo_t *host, int ids);
+
 /**
  * remove(free) a host record from the shared table
  * @param pointer to the shared table.
@@ -106,6 +115,13 @@ int get_ids_used_host(mem_t *s, int *ids);
  */
 int get_max_size_host(mem_t *s);
 
+/*
+ * get the version of the table (each update of the table changes version)
+ * @param pointer to the shared table.
+ * @return version the actual version in the table.
+ */
+unsigned int get_version_host(mem_t *s);
+
 /**
  * attach to the shared host table
  * @param name of an existing shared table.
@@ -145,5 +161,13 @@ int (* get_ids_used_host)(int *ids);
  * read the max number of hosts in the shared table
  */
 int (*get_max_size_host)(void);
+/**
+ * read the version of the hosts table (changes each time a host is added, removed or updated)
+ */
+unsigned int (*get_version_host)(void);
+/**
+ * copy the host record, consistent even if a writer is changing it.
+ */
+apr_status_t (*copy_host)(int ids, hostinfo_t *host);
 };
 #endif /*HOST_H*/
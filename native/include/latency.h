@@ -0,0 +1,121 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2007 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "apr_atomic.h"
+
+/**
+ * @file  latency.h
+ * @brief cost of a node for ElectionMethod latency
+ *
+ * The EWMA of the response time and of the error rate of the nodes are
+ * kept in their hot line (node.h) by mod_proxy_cluster, the cost of a node
+ * is its outstanding requests times its weight divided by its lbfactor.
+ *
+ * @defgroup MEM latency
+ * @ingroup  APACHE_MODS
+ * @{
+ */
+
+#define EWMA_SHIFT           3         /* weight of a new response: 1/8 */
+#define LATENCY_MIN          1000      /* microseconds, faster nodes (or nodes without responses) count as that */
+#define LATENCY_MAX          60000000  /* microseconds, longer responses (and the failed ones) count as that */
+#define LATENCY_ERROR_WEIGHT 16        /* a node where all the requests fail costs 17 times more */
+#define LATENCY_FAILING      (NODE_HOT_ERRORS_ALL / 2) /* more errors: only elected if all the nodes fail */
+
+/* move the average toward the sample by 1/2^EWMA_SHIFT of the difference (no lock) */
+static APR_INLINE void cluster_ewma_update(volatile apr_uint32_t *avg, apr_uint32_t sample, int start_with_sample)
+{
+    apr_uint32_t old, value;
+    do {
+        old = apr_atomic_read32(avg);
+        if (old == 0 && start_with_sample)
+            value = sample;
+        else
+            value = (apr_uint32_t) ((apr_int64_t) old + ((apr_int64_t) sample - old) / (1 << EWMA_SHIFT));
+    } while (apr_atomic_cas32(avg, value, old) != old);
+}
+/* halve the average: a node that didn't get requests is tried again */
+static APR_INLINE void cluster_ewma_decay(volatile apr_uint32_t *avg)
+{
+    apr_uint32_t old;
+    do {
+        old = apr_atomic_read32(avg);
+    } while (apr_atomic_cas32(avg, old / 2, old) != old);
+}
+
+/* the response time sample of a response: a failed one counts as the longest */
+static APR_INLINE apr_uint32_t cluster_latency_sample(apr_interval_time_t elapsed, int failed)
+{
+    if (failed || elapsed > LATENCY_MAX)
+        return LATENCY_MAX;
+    if (elapsed < 0)
+        return 0;
+    return (apr_uint32_t) elapsed;
+}
+
+/* add a response to the averages of a node */
+static APR_INLINE void cluster_latency_record(volatile apr_uint32_t *rt, volatile apr_uint32_t *errors,
+                                              apr_interval_time_t elapsed, int failed)
+{
+    /* a node failing fast must not look faster than the working ones */
+    cluster_ewma_update(rt, cluster_latency_sample(elapsed, failed), 1);
+    cluster_ewma_update(errors, failed ? NODE_HOT_ERRORS_ALL : 0, 0);
+}
+
+/* the response time of the node increased by its errors */
+static APR_INLINE apr_uint64_t cluster_latency_weight(apr_uint32_t rt, apr_uint32_t errors)
+{
+    apr_uint64_t weight = rt < LATENCY_MIN ? LATENCY_MIN : rt;
+    return (weight * (NODE_HOT_ERRORS_ALL + LATENCY_ERROR_WEIGHT * (apr_uint64_t) errors)) / NODE_HOT_ERRORS_ALL;
+}
+
+/*
+ * compare the costs of 2 nodes (busy: outstanding requests).
+ * return < 0 if the first one is better, > 0 if the second one is, 0 if they cost the same.
+ */
+static APR_INLINE int cluster_latency_compare(apr_size_t busy, apr_uint32_t rt, apr_uint32_t errors, int lbfactor,
+                                              apr_size_t busy1, apr_uint32_t rt1, apr_uint32_t errors1, int lbfactor1)
+{
+    apr_uint64_t cost, cost1;
+    int failing = errors > LATENCY_FAILING;
+    int failing1 = errors1 > LATENCY_FAILING;
+
+    /* a node failing most of its requests costs more than any other one */
+    if (failing != failing1)
+        return failing ? 1 : -1;
+    cost = (apr_uint64_t) (busy + 1) * cluster_latency_weight(rt, errors) * lbfactor1;
+    cost1 = (apr_uint64_t) (busy1 + 1) * cluster_latency_weight(rt1, errors1) * lbfactor;
+    if (cost == cost1)
+        return 0;
+    return cost < cost1 ? -1 : 1;
+}
+
+/** @} */
+#endif /*LATENCY_H*/
@@ -0,0 +1,116 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2007 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+/**
+ * @file  metrics.h
+ * @brief latency histograms in shared memory
+ *
+ * The histograms are in a shared memory segment created by mod_manager,
+ * every child adds its observations with atomic increments so the
+ * cluster-metrics handler reports one aggregate. Needs mod_proxy_cluster.h
+ * for the atomic operations.
+ *
+ * @defgroup MEM metrics
+ * @ingroup  APACHE_MODS
+ * @{
+ */
+
+/* upper bounds of the buckets in microseconds, the last bucket is +Inf */
+#define CLUSTER_HIST_BUCKETS 14
+#define CLUSTER_HIST_BOUNDS { 500, 1000, 2500, 5000, 10000, 25000, 50000, \
+                              100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 }
+/* the same bounds in seconds for the le labels */
+#define CLUSTER_HIST_LABELS { "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", \
+                              "0.1", "0.25", "0.5", "1", "2.5", "5", "10" }
+
+/* the buckets aren't cumulative, the count is their sum */
+struct cluster_hist {
+    volatile apr_uint64_t buckets[CLUSTER_HIST_BUCKETS + 1];
+    volatile apr_uint64_t sum;    /* microseconds */
+};
+typedef struct cluster_hist cluster_hist_t;
+
+/* MCMP commands holding the nodes lock */
+#define CLUSTER_LOCK_OTHER      0
+#define CLUSTER_LOCK_CONFIG     1
+#define CLUSTER_LOCK_ENABLE     2
+#define CLUSTER_LOCK_DISABLE    3
+#define CLUSTER_LOCK_STOP       4
+#define CLUSTER_LOCK_REMOVE     5
+#define CLUSTER_LOCK_BATCH      6
+#define CLUSTER_LOCK_COMMANDS   7
+
+struct cluster_metrics {
+    cluster_hist_t election;   /* internal_find_best_byrequests() */
+    cluster_hist_t sweep;      /* a run of the watchdog */
+    cluster_hist_t cping;      /* CPING/CPONG round trip */
+    cluster_hist_t lock[CLUSTER_LOCK_COMMANDS]; /* nodes lock held by the MCMP commands */
+    cluster_hist_t lock_wait;  /* wait for the nodes lock */
+    int maxnode;               /* response time of the nodes: ids 0 to maxnode */
+    int maxcontext;            /* response time of the contexts: ids 0 to maxcontext */
+};
+typedef struct cluster_metrics cluster_metrics_t;
+
+/* the histograms of the nodes then the ones of the contexts follow the header */
+#define CLUSTER_METRICS_HEAD APR_ALIGN(sizeof(cluster_metrics_t), CLUSTER_CACHE_LINE)
+#define CLUSTER_METRICS_SIZE(maxnode, maxcontext) \
+    (CLUSTER_METRICS_HEAD + sizeof(cluster_hist_t) * ((maxnode) + 1 + (maxcontext) + 1))
+
+static APR_INLINE cluster_hist_t *cluster_metrics_node(cluster_metrics_t *metrics, int id)
+{
+    if (metrics == NULL || id <= 0 || id > metrics->maxnode)
+        return NULL;
+    return (cluster_hist_t *) ((char *) metrics + CLUSTER_METRICS_HEAD) + id;
+}
+static APR_INLINE cluster_hist_t *cluster_metrics_context(cluster_metrics_t *metrics, int id)
+{
+    if (metrics == NULL || id <= 0 || id > metrics->maxcontext)
+        return NULL;
+    return (cluster_hist_t *) ((char *) metrics + CLUSTER_METRICS_HEAD) + metrics->maxnode + 1 + id;
+}
+
+/* add an observation (no lock) */
+static APR_INLINE void cluster_hist_observe(cluster_hist_t *hist, apr_interval_time_t t)
+{
+    static const apr_interval_time_t bounds[CLUSTER_HIST_BUCKETS] = CLUSTER_HIST_BOUNDS;
+    int i;
+
+    if (hist == NULL)
+        return;
+    if (t < 0)
+        t = 0;
+    for (i = 0; i < CLUSTER_HIST_BUCKETS && t > bounds[i]; i++)
+        ;
+    CLUSTER_ATOMIC_ADD64(&hist->buckets[i], 1);
+    CLUSTER_ATOMIC_ADD64(&hist->sum, (apr_uint64_t) t);
+}
+
+/** @} */
+#endif /*METRICS_H*/
@@ -30,6 +30,43 @@
 
 #define MOD_CLUSTER_EXPOSED_VERSION "mod_cluster/2.0.0.Alpha1-SNAPSHOT"
 
+/* size of a cache line, used to prevent false sharing of the counters */
+#define CLUSTER_CACHE_LINE 64
+
+#include "apr_version.h"
+#include "apr_atomic.h"
+
+/*
+ * update a counter of the proxy_worker_shared (apr_size_t) without lock,
+ * CLUSTER_ATOMIC_ADD64() adds to an apr_uint64_t (the histograms).
+ * The counters of mod_cluster itself are apr_uint32_t: apr_atomic_*32().
+ */
+#if defined(__GNUC__)
+#define CLUSTER_ATOMIC_INC(p) __sync_fetch_and_add((p), 1)
+#define CLUSTER_ATOMIC_CAS(p, with, cmp) __sync_val_compare_and_swap((p), (cmp), (with))
+#define CLUSTER_ATOMIC_ADD64(p, v) __sync_fetch_and_add((p), (v))
+#elif defined(_WIN64)
+#define CLUSTER_ATOMIC_INC(p) InterlockedIncrement64((volatile LONG64 *) (p))
+#define CLUSTER_ATOMIC_CAS(p, with, cmp) InterlockedCompareExchange64((volatile LONG64 *) (p), (with), (cmp))
+#define CLUSTER_ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64 *) (p), (LONG64) (v))
+#elif defined(WIN32)
+#define CLUSTER_ATOMIC_INC(p) InterlockedIncrement((volatile LONG *) (p))
+#define CLUSTER_ATOMIC_CAS(p, with, cmp) InterlockedCompareExchange((volatile LONG *) (p), (with), (cmp))
+#define CLUSTER_ATOMIC_ADD64(p, v) InterlockedExchangeAdd64((volatile LONG64 *) (p), (LONG64) (v))
+#elif APR_VERSION_AT_LEAST(1,7,0)
+/* APR uses a mutex where the platform has no atomic operations */
+#if APR_SIZEOF_VOIDP == 8
+#define CLUSTER_ATOMIC_INC(p) apr_atomic_inc64((volatile apr_uint64_t *) (p))
+#define CLUSTER_ATOMIC_CAS(p, with, cmp) apr_atomic_cas64((volatile apr_uint64_t *) (p), (with), (cmp))
+#else
+#define CLUSTER_ATOMIC_INC(p) apr_atomic_inc32((volatile apr_uint32_t *) (p))
+#define CLUSTER_ATOMIC_CAS(p, with, cmp) apr_atomic_cas32((volatile apr_uint32_t *) (p), (with), (cmp))
+#endif
+#define CLUSTER_ATOMIC_ADD64(p, v) apr_atomic_add64((p), (v))
+#else
+#error "mod_cluster needs the atomic builtins of the compiler or APR 1.7 (apr_atomic_add64)"
+#endif
+
 struct balancer_method {
 /**
  * Check that the node is responding
@@ -48,15 +85,54 @@ int (* proxy_node_isup)(request_rec *r, int id, int load);
  * @return 0: All OK 500 : Error
  */ 
 int (* proxy_host_isup)(request_rec *r, char *scheme, char *host, char *port);
+/**
+ * Set the load factor of the node without ping/pong
+ * (the STATUS replicated by a PeerSync proxy)
+ * @param r request_rec structure.
+ * @param id ident of the worker.
+ * @param load load factor to set.
+ * @return 0: All OK 500 : Error
+ */
+int (* proxy_node_setload)(request_rec *r, int id, int load);
 };
 typedef struct balancer_method balancer_method;
 
+/*
+ * Compact copies of the host and context records for local use: the strings
+ * are interned in the pool of the table (the copies of an alias or a context
+ * registered by several nodes share one string) with their hash and length,
+ * the comparisons reject the mismatches by hash before comparing the strings.
+ */
+struct proxy_context_info
+{
+	const char *context;  /* Context where the application is mapped. */
+	unsigned int hash;    /* cluster_string_hash() of context */
+	int len;              /* length of context */
+	int vhost;
+	int node;
+	int status;
+	int id;
+};
+typedef struct proxy_context_info proxy_context_info;
+
+struct proxy_vhost_info
+{
+	const char *host;     /* Alias element of the virtual host */
+	unsigned int hash;    /* cluster_string_hash() of host */
+	int len;              /* length of host */
+	int vhost;
+	int node;
+	int id;
+};
+typedef struct proxy_vhost_info proxy_vhost_info;
+
 /* Context table copy for local use */
 struct proxy_context_table
 {
 	int sizecontext;
 	int* contexts;
-	contextinfo_t* context_info;
+	proxy_context_info* context_info;
+	struct proxy_context_index *index; /* routing index (NULL: scan the table) */
 };
 typedef struct proxy_context_table proxy_context_table;
 
@@ -66,7 +142,7 @@ struct proxy_vhost_table
 {
 	int sizevhost;
 	int* vhosts;
-	hostinfo_t* vhost_info;
+	proxy_vhost_info* vhost_info;
 };
 typedef struct proxy_vhost_table proxy_vhost_table;
 
@@ -85,9 +161,59 @@ struct proxy_node_table
 	int sizenode;
 	int* nodes;
 	nodeinfo_t*  node_info;
+	struct apr_hash_t *routes; /* JVMRoute -> node_info (NULL: scan the table) */
+	struct apr_hash_t *ids;    /* id -> node_info */
 };
 typedef struct proxy_node_table proxy_node_table;
 
+/* A context of the context table and its node (NULL if not in the node table) */
+struct proxy_context_entry
+{
+	int context;       /* index in context_info */
+	nodeinfo_t *node;
+};
+typedef struct proxy_context_entry proxy_context_entry;
+
+/* (vhost, node) pair of an alias in the host table */
+struct proxy_vhost_node
+{
+	int vhost;
+	int node;
+};
+typedef struct proxy_vhost_node proxy_vhost_node;
+
+/*
+ * Routing index built with the snapshot of the tables:
+ * contexts: context path -> array of proxy_context_entry (in the order of the context table).
+ * vhosts: alias -> apr_hash_t of proxy_vhost_node (used as key).
+ */
+struct proxy_context_index
+{
+	struct apr_hash_t *contexts;
+	struct apr_hash_t *vhosts;
+};
+typedef struct proxy_context_index proxy_context_index;
+
+/*
+ * Snapshot of the tables for local use, shared by the requests of the process.
+ * The snapshot is immutable: the fields updated in place by the proxy logic
+ * (nbrequests, oldelected, stat...) must be read from the shared memory.
+ */
+struct proxy_table_snapshot
+{
+	apr_pool_t *pool;          /* pool of the snapshot (NULL: copy in the request pool) */
+	unsigned int refcount;     /* requests using it (+1 while it is the current one) */
+	unsigned int vhost_version;
+	unsigned int context_version;
+	unsigned int balancer_version;
+	unsigned int node_version;
+	proxy_vhost_table *vhost_table;
+	proxy_context_table *context_table;
+	proxy_balancer_table *balancer_table;
+	proxy_node_table *node_table;
+};
+typedef struct proxy_table_snapshot proxy_table_snapshot;
+
 /* table of node and context selected by find_node_context_host() */
 struct node_context
 {
@@ -96,11 +222,90 @@ struct node_context
 };
 typedef struct node_context node_context;
 
+/*
+ * Header of an object published to the threads of a child (the candidates
+ * of a balancer, the maps of a VirtualHost), see cluster_shared_create().
+ * The object is allocated in its pool, the last reference released destroys it.
+ */
+struct cluster_shared
+{
+	apr_pool_t *pool;
+	int refcount;        /* protected by the mutex of cluster_shared_child_init() */
+};
+typedef struct cluster_shared cluster_shared;
+
+/*
+ * Name maps of the balancers and workers of a proxy_server_conf, so the request
+ * path doesn't scan conf->balancers or balancer->workers.
+ * The maps are never modified once published: when the workers are added or
+ * removed new ones are published and the old ones are destroyed with their
+ * last reference.
+ */
+struct proxy_balancer_map
+{
+	proxy_balancer *balancer;    /* key of the map */
+	struct apr_hash_t *routes;   /* route -> apr_array_header_t of proxy_worker * (order of balancer->workers) */
+	struct apr_hash_t *workers;  /* proxy_hashes of the name -> proxy_worker */
+};
+typedef struct proxy_balancer_map proxy_balancer_map;
+
+struct proxy_cluster_maps
+{
+	cluster_shared shared;         /* first: the pool and the references */
+	struct apr_hash_t *balancers;  /* name without balancer:// (lower case) -> proxy_balancer */
+	struct apr_hash_t *maps;       /* proxy_balancer * -> proxy_balancer_map */
+};
+typedef struct proxy_cluster_maps proxy_cluster_maps;
+
+/*
+ * Session information of a request, parsed once and shared by the stages
+ * (trans, canon, election, post_request) through the "cluster-session" note.
+ * The string notes session-id, session-route, session-sticky, CLUSTER_DOMAIN
+ * and session-domain-ok are still set for the other modules and the logs.
+ */
+struct proxy_session_param
+{
+	const char *name;   /* cookie or path parameter name */
+	const char *uri;    /* uri searched for the parameter (NULL: Cookie header) */
+	char *value;        /* NULL: not in the request */
+};
+typedef struct proxy_session_param proxy_session_param;
+
+struct proxy_cluster_session
+{
+	const char *sessionid;       /* sessionid found by get_route_balancer() */
+	const char *route;           /* route of sessionid served by the balancer */
+	const char *sticky_used;     /* name of the cookie or parameter holding the route */
+	const char *domain;          /* domain of the node of the route */
+	int domain_ok;               /* the election didn't leave the domain */
+	struct apr_array_header_t *params; /* proxy_session_param already read */
+};
+typedef struct proxy_cluster_session proxy_cluster_session;
+
 /* common routines */
+/* hash (the one of apr_hashfunc_default()) of the len first characters of str */
+unsigned int cluster_string_hash(const char *str, apr_size_t len);
 proxy_vhost_table *read_vhost_table(apr_pool_t *pool, struct host_storage_method *host_storage);
 proxy_context_table *read_context_table(apr_pool_t *pool, struct context_storage_method *context_storage);
 proxy_balancer_table *read_balancer_table(apr_pool_t *pool, struct balancer_storage_method *balancer_storage);
 proxy_node_table *read_node_table(apr_pool_t *pool, struct node_storage_method *node_storage);
+proxy_context_index *build_context_index(apr_pool_t *pool, proxy_vhost_table *vhost_table,
+                                         proxy_context_table *context_table, proxy_node_table *node_table);
+void build_node_index(apr_pool_t *pool, proxy_node_table *node_table);
+
+apr_status_t cluster_shared_child_init(apr_pool_t *p);
+void *cluster_shared_create(apr_size_t size);
+cluster_shared *cluster_shared_acquire(cluster_shared **where);
+void cluster_shared_release(cluster_shared *obj);
+apr_status_t cluster_shared_release_cleanup(void *obj);
+void cluster_shared_publish(cluster_shared **where, cluster_shared *obj);
+
+apr_status_t table_snapshot_child_init(apr_pool_t *p);
+proxy_table_snapshot *get_table_snapshot(request_rec *r,
+                                struct host_storage_method *host_storage,
+                                struct context_storage_method *context_storage,
+                                struct balancer_storage_method *balancer_storage,
+                                struct node_storage_method *node_storage);
 
 const char *get_route_balancer(request_rec *r, proxy_server_conf *conf,
                                       proxy_vhost_table *vhost_table,
@@ -116,13 +321,25 @@ const char *get_context_host_balancer(request_rec *r,
                 int use_alias);
 
 nodeinfo_t* table_get_node(proxy_node_table *node_table, int id);
+apr_status_t cluster_maps_child_init(apr_pool_t *p, server_rec *s);
+void cluster_maps_changed(proxy_server_conf *conf);
+unsigned int get_workers_generation(proxy_server_conf *conf);
+void update_cluster_maps(proxy_server_conf *conf);
+proxy_balancer *find_cluster_balancer(proxy_server_conf *conf, const char *name);
+proxy_balancer_map *get_balancer_map(request_rec *r, proxy_server_conf *conf, proxy_balancer *balancer);
+
+proxy_cluster_session *get_cluster_session(request_rec *r);
+void clear_cluster_session_params(request_rec *r);
+char *cluster_find_sessionid(request_rec *r, const char *sticky, const char *sticky_path, char *uri,
+                             const char **sticky_used);
 char *cluster_get_sessionid(request_rec *r, const char *stickyval, char *uri, char **sticky_used);
 char *get_cookie_param(request_rec *r, const char *name, int in);
 char *get_path_param(apr_pool_t *pool, char *url,
                             const char *name);
 node_context *find_node_context_host(request_rec *r, proxy_balancer *balancer, const char *route, int use_alias,
                                      proxy_vhost_table* vhost_table, proxy_context_table* context_table, proxy_node_table *node_table);
-int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_node_table *node_table);
+int hassession_byname(request_rec *r, int nodeid, const char *route, proxy_balancer *balancer,
+                      proxy_node_table *node_table);
 
 nodeinfo_t* table_get_node_route(proxy_node_table *node_table, char *route, int *id);
 
@@ -92,6 +92,52 @@ struct nodeinfo {
 };
 typedef struct nodeinfo nodeinfo_t; 
 
+/*
+ * Hot runtime state of a node: the fields of its proxy_worker_shared used to
+ * elect a worker and to calculate the lbstatus, one cache line per node id
+ * in a shared array so the election doesn't read the whole node records.
+ * mod_proxy_cluster keeps it mirrored with the proxy_worker_shared.
+ */
+#define NODE_HOT_LINE 64
+struct node_hot_state {
+    int id;                   /* id of the node (0: the line isn't valid) */
+    unsigned int status;      /* PROXY_WORKER_* status */
+    int lbfactor;
+    int lbstatus;
+    apr_uint32_t elected;     /* apr_atomic_*32() */
+    apr_uint32_t oldelected;  /* like nodemess_t oldelected */
+    apr_uint32_t busy;        /* apr_atomic_*32() */
+    apr_off_t read;
+    apr_uint32_t rt;          /* EWMA of the response time in microseconds (0: no response yet) */
+    apr_uint32_t errors;      /* EWMA of the error rate (NODE_HOT_ERRORS_ALL: all requests failed) */
+    apr_uint32_t rampstart;   /* apr_time_sec() when the node became usable (0: no slow start) */
+    apr_uint32_t ramp;        /* seconds of the slow start */
+};
+#define NODE_HOT_ERRORS_ALL 65536
+union node_hot {
+    struct node_hot_state s;
+    char line[NODE_HOT_LINE];
+};
+typedef union node_hot node_hot_t;
+
+/* tables of the change journal */
+#define TABLE_NODE    1
+#define TABLE_HOST    2
+#define TABLE_CONTEXT 3
+
+/* operations of the change journal */
+#define CHANGE_UPDATE 1 /* inserted or updated */
+#define CHANGE_REMOVE 2
+
+/* entry of the change journal (see journal.c) */
+struct table_change {
+    apr_uint32_t seq;  /* sequence of the change (0: being written) */
+    int table;         /* TABLE_ */
+    int id;            /* id of the slot in the table */
+    int op;            /* CHANGE_ */
+};
+typedef struct table_change table_change_t;
+
 /**
  * return the last stored in the mem structure
  * @param pointer to the shared table
@@ -109,6 +155,15 @@ apr_status_t get_last_mem_error(mem_t *mem);
  */
 apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id);
 
+/**
+ * mark a node record as removed (the slot is freed later by the watchdog).
+ * @param pointer to the shared table.
+ * @param ids  in the node table.
+ * @param rename 1: the JVMRoute becomes "REMOVED" so that a new node can use it.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t mark_removed_node(mem_t *s, int ids, int rename);
+
 /**
  * read a node record from the shared table
  * @param pointer to the shared table.
@@ -125,6 +180,15 @@ nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node);
  */
 apr_status_t get_node(mem_t *s, nodeinfo_t **node, int ids);
 
+/**
+ * copy a node record from the shared table, consistent even if it is being updated
+ * @param pointer to the shared table.
+ * @param node address where to copy the node.
+ * @param ids  in the node table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_node(mem_t *s, nodeinfo_t *node, int ids);
+
 /**
  * remove(free) a node record from the shared table
  * @param pointer to the shared table.
@@ -192,6 +256,8 @@ mem_t * get_mem_node(char *string, int *num, apr_pool_t *p, slotmem_storage_meth
  */
 mem_t * create_mem_node(char *string, int *num, int persist, apr_pool_t *p, slotmem_storage_method *storage);
 
+struct cluster_metrics; /* metrics.h */
+
 /**
  * provider for the mod_proxy_cluster or mod_jk modules.
  */
@@ -245,5 +311,68 @@ apr_status_t (*lock_nodes)(void);
  */
 apr_status_t (*unlock_nodes)(void);
 
+/*
+ * read the version of the nodes table (changes each time a node is added, removed or updated)
+ */
+unsigned int (*get_version_node)(void);
+
+/*
+ * wait until the nodes are changed (the version returned by worker_nodes_need_update()
+ * is not last anymore) or the timeout is elapsed.
+ * @return the actual version.
+ */
+unsigned int (*wait_nodes_update)(unsigned int last, apr_interval_time_t timeout);
+
+/*
+ * read the changes of the nodes, hosts and contexts tables made after the sequence last.
+ * @param last the sequence of the last change already processed, updated to the last one read.
+ * @param changes array to store the changes.
+ * @param max size of changes (0: just set last to the actual sequence).
+ * @return the number of changes read or -1 if the changes were lost (the journal
+ *         has overflowed), last is then the actual sequence and the caller must
+ *         read the whole tables.
+ */
+int (*get_changes)(unsigned int *last, table_change_t *changes, int max);
+
+/*
+ * get the hot runtime state of the node.
+ * @param ids ident of the node.
+ * @return the cache line of the node or NULL.
+ */
+node_hot_t *(*get_node_hot)(int ids);
+
+/*
+ * get the latency histograms shared by the children (see metrics.h).
+ * @return the histograms or NULL.
+ */
+struct cluster_metrics *(*get_metrics)(void);
+
+/*
+ * lock one node for an in place update of its record, without waiting for
+ * the MCMP commands holding the nodes table (lock_nodes). Every in place
+ * store to the record must be done until unlock_node(): the copies of
+ * copy_node() are retried until it.
+ * @param ids ident of the node.
+ */
+apr_status_t (*lock_node)(int ids);
+
+/*
+ * unlock a node locked by lock_node
+ */
+apr_status_t (*unlock_node)(int ids);
+
+/*
+ * copy the node record, consistent even if a writer is changing it.
+ * @param ids ident of the node.
+ * @param node where to copy it.
+ */
+apr_status_t (*copy_node)(int ids, nodeinfo_t *node);
+
+/*
+ * record an in place change of the node record (done under lock_node) in
+ * the change journal, like the MCMP commands do for theirs.
+ * @param ids ident of the node.
+ */
+void (*journal_node)(int ids);
 };
 #endif /*NODE_H*/
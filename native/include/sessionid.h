@@ -90,6 +90,14 @@ apr_status_t get_sessionid(mem_t *s, sessionidinfo_t **sessionid, int ids);
  */
 apr_status_t remove_sessionid(mem_t *s, sessionidinfo_t *sessionid);
 
+/**
+ * remove(free) the sessionid records not updated since a given time
+ * @param pointer to the shared table.
+ * @param before time (in seconds) of the oldest update to keep.
+ * @return number of sessionids removed.
+ */
+int remove_expired_sessionid(mem_t *s, apr_time_t before);
+
 /*
  * get the ids for the used (not free) sessionids in the table
  * @param pointer to the shared table.
@@ -152,5 +160,11 @@ apr_status_t (*remove_sessionid)(sessionidinfo_t *sessionid);
  * Insert a new sessionid or update existing one.
  */
 apr_status_t (*insert_update_sessionid)(sessionidinfo_t *sessionid);
+/*
+ * Remove the sessionids not updated since before (in seconds)
+ * using the update order of the table.
+ * @return number of sessionids removed.
+ */
+int (*remove_expired_sessionid)(apr_time_t before);
 };
 #endif /*SESSIONID_H*/
@@ -49,6 +49,7 @@
 #define ATTACH_SLOTMEM 0 /* Attach to existing slotmem */
 #define CREATE_SLOTMEM 1 /* create a not persistent slotmem */
 #define CREPER_SLOTMEM 2 /* create a persisitent slotmem */
+#define CREMAP_SLOTMEM 4 /* with CREPER_SLOTMEM: the slotmem is a mapped file */
 
 typedef struct ap_slotmem ap_slotmem_t; 
 
@@ -144,6 +145,60 @@ apr_status_t (* ap_slotmem_lock)(ap_slotmem_t *s);
  * @return APR_SUCCESS if all went well
  */
 apr_status_t (* ap_slotmem_unlock)(ap_slotmem_t *s);
+/**
+ * Return the version of the slotmem, the version changes each time
+ * a slot is allocated, freed or touched.
+ * @param s ap_slotmem_t to use.
+ * @return the version stored in the shared memory.
+ */
+unsigned int (* ap_slotmem_get_version)(ap_slotmem_t *s);
+/**
+ * Mark the slotmem as modified after an in place update of a slot.
+ * (to be called once the slot is completely written).
+ * @param s ap_slotmem_t to use.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_touch)(ap_slotmem_t *s);
+/**
+ * Lock one slot for an in place update without locking the table,
+ * the writers holding the table lock must lock the slot too.
+ * (the slots share SLOTMEM_STRIPES locks).
+ * @param s ap_slotmem_t to use.
+ * @param item_id the id of the slot.
+ * @return APR_SUCCESS if all went well, APR_ENOTIMPL if the table lock must be used.
+ */
+apr_status_t (* ap_slotmem_lock_slot)(ap_slotmem_t *s, int item_id);
+/**
+ * Unlock a slot locked by ap_slotmem_lock_slot.
+ * @param s ap_slotmem_t to use.
+ * @param item_id the id of the slot.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_unlock_slot)(ap_slotmem_t *s, int item_id);
+/**
+ * Mark the start of an in place update of a slot for the readers using
+ * ap_slotmem_read (the writers must hold the lock of the table or of the slot).
+ * @param s ap_slotmem_t to use.
+ * @param item_id the id of the slot.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_write_begin)(ap_slotmem_t *s, int item_id);
+/**
+ * Mark the end of the update started by ap_slotmem_write_begin.
+ * @param s ap_slotmem_t to use.
+ * @param item_id the id of the slot.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t (* ap_slotmem_write_end)(ap_slotmem_t *s, int item_id);
+/**
+ * Copy a slot without lock, retrying while a writer changes it.
+ * @param s ap_slotmem_t to use.
+ * @param item_id the id of the slot.
+ * @param dest where to copy the slot.
+ * @param size size of dest.
+ * @return APR_SUCCESS if all went well (the slot must be an allocated slot).
+ */
+apr_status_t (* ap_slotmem_read)(ap_slotmem_t *s, int item_id, void *dest, apr_size_t size);
 };
 
 typedef struct slotmem_storage_method slotmem_storage_method;
@@ -34,10 +34,17 @@
 #include "apr_strings.h"
 #include "apr_pools.h"
 #include "apr_shm.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
+#include "apr_thread_proc.h"
+#if APR_HAS_MMAP
+#include "apr_mmap.h"
+#endif
 
 #include "slotmem.h"
 
 #include "httpd.h"
+#include "http_log.h"
 #ifdef AP_NEED_SET_MUTEX_PERMS
 #include "unixd.h"
 #endif
@@ -46,6 +53,23 @@
 #include <unistd.h>         /* for getpid() */
 #endif
 
+#if APR_HAS_MMAP && !defined(WIN32)
+#include <sys/mman.h>       /* for msync() */
+#endif
+
+/*
+ * With process-shared pthread mutexes the locks are in the slotmem: no lock
+ * file and the tables don't share a mutex. They must be robust (POSIX 2008):
+ * a child dying with the lock must not block the others, without that the
+ * file lock (released by the kernel) is used.
+ */
+#if APR_HAS_PROC_PTHREAD_SERIALIZE && defined(_POSIX_THREAD_PROCESS_SHARED) && (_POSIX_THREAD_PROCESS_SHARED > 0) && \
+    defined(_POSIX_THREADS) && (_POSIX_THREADS >= 200809L)
+#define SLOTMEM_PTHREAD 1
+#include <pthread.h>
+#include <errno.h>
+#endif
+
 #if HAVE_SYS_SEM_H
 #include <sys/shm.h>
 #if !defined(SHM_R)
@@ -56,16 +80,79 @@
 #endif
 #endif
 
+/*
+ * Version of the layout of the shared memory:
+ * 1: description, idents, slots.
+ * 2: description, in use bitmap, idents, slots.
+ * 3: description, locks (empty without SLOTMEM_PTHREAD), in use bitmap, idents, slots.
+ * 4: description, locks, in use bitmap, sequences of the slots, idents, slots.
+ * The persisted file (idents and slots) is the same in all the formats.
+ */
+#define SLOTMEM_FORMAT 4
+
 /* The description of the slots to reuse the slotmem */
 struct sharedslotdesc {
     apr_size_t item_size;
     int item_num;
     unsigned int version; /* integer updated each time we make a change through the API */
+    int format;           /* SLOTMEM_FORMAT of the process that created the slotmem */
 };
 
+/* bitmap of the slots in use: bit id is set when the slot id is allocated */
+#define SLOTMEM_WORDS(num)  (((num) + 1 + 63) / 64)
+#define SLOTMEM_WORD(id)    ((id) >> 6)
+#define SLOTMEM_BIT(id)     (((apr_uint64_t) 1) << ((id) & 63))
+#define SLOTMEM_INUSE(s, id) ((s)->inuse[SLOTMEM_WORD(id)] & SLOTMEM_BIT(id))
+
+#ifdef SLOTMEM_PTHREAD
+/*
+ * The lock of the table and the striped locks of the slots (slot id modulo
+ * SLOTMEM_STRIPES) that protect the in place updates of a slot without
+ * waiting for the table. The lock of a slot is taken after the table one.
+ */
+#define SLOTMEM_STRIPES 64 /* power of 2 */
+struct sharedslotlocks {
+    pthread_mutex_t table;
+    pthread_mutex_t stripes[SLOTMEM_STRIPES];
+};
+#define SLOTMEM_LSIZE APR_ALIGN_DEFAULT(sizeof(struct sharedslotlocks))
+#else
+#define SLOTMEM_LSIZE 0
+#endif
+
+/*
+ * Sequence of a slot (seqlock): odd while a writer changes the slot, the
+ * readers copy the slot until they get the same even sequence before and
+ * after the copy. The writers are serialized by the locks.
+ */
+#define SLOTMEM_SEQS(inuse, num) ((volatile apr_uint32_t *) ((char *) (inuse) + APR_ALIGN_DEFAULT(sizeof(apr_uint64_t) * SLOTMEM_WORDS(num))))
+#define SLOTMEM_READ_SPINS 64   /* retries before yielding */
+#define SLOTMEM_READ_TRIES 1024 /* a writer died in the middle: use the copy */
+
+#if defined(__GNUC__)
+#define SLOTMEM_BARRIER() __sync_synchronize()
+#elif defined(WIN32)
+#define SLOTMEM_BARRIER() MemoryBarrier()
+#else
+static volatile apr_uint32_t slotmem_barrier;
+#define SLOTMEM_BARRIER() apr_atomic_cas32(&slotmem_barrier, 0, 0)
+#endif
+
+/* size of the parts of the slotmem: description (and locks), bitmap (and sequences), idents, slots */
+#define SLOTMEM_DSIZE        (APR_ALIGN_DEFAULT(sizeof(struct sharedslotdesc)) + SLOTMEM_LSIZE)
+#define SLOTMEM_BSIZE(num)   (APR_ALIGN_DEFAULT(sizeof(apr_uint64_t) * SLOTMEM_WORDS(num)) + \
+                              APR_ALIGN_DEFAULT(sizeof(apr_uint32_t) * ((num) + 1)))
+#define SLOTMEM_TSIZE(num)   APR_ALIGN_DEFAULT(sizeof(int) * ((num) + 1))
+#define SLOTMEM_BYTES(size, num) (SLOTMEM_DSIZE + SLOTMEM_BSIZE(num) + SLOTMEM_TSIZE(num) + (size) * (num))
+
+/* the dirty pages of a mapped slotmem are scheduled for write at most every SLOTMEM_SYNC */
+#define SLOTMEM_SYNC apr_time_from_sec(1)
+
 struct ap_slotmem {
     char *name;
     apr_shm_t *shm;
+    apr_uint64_t *inuse; /* bitmap of the used slots (O(1) check) */
+    volatile apr_uint32_t *seqs; /* sequences of the slots */
     int *ident; /* integer table to process a fast alloc/free */
     unsigned int *version; /* address of version */
     void *base;
@@ -73,13 +160,22 @@ struct ap_slotmem {
     int num;
     apr_pool_t *globalpool;
     apr_file_t *global_lock; /* file used for the locks */
+#ifdef SLOTMEM_PTHREAD
+    struct sharedslotlocks *locks; /* in the shared memory */
+#endif
+    apr_thread_mutex_t *mutex; /* with global_lock if there isn't locks */
+#if APR_HAS_MMAP
+    apr_mmap_t *map;         /* the file mapped instead of the shared memory (CREMAP_SLOTMEM) */
+    apr_time_t synced;       /* last msync() of the map */
+    unsigned int synced_version;
+#endif
     struct ap_slotmem *next;
 };
 
 /* global pool and list of slotmem we are handling */
 static struct ap_slotmem *globallistmem = NULL;
 static apr_pool_t *globalpool = NULL;
-static apr_thread_mutex_t *globalmutex_lock = NULL;
+static apr_thread_mutex_t *globalmutex_lock = NULL; /* creation of the slotmems */
 
 static apr_status_t unixd_set_shm_perms(const char *fname)
 {
@@ -116,6 +212,89 @@ static apr_status_t unixd_set_shm_perms(const char *fname)
 #endif
 }
 
+#ifdef SLOTMEM_PTHREAD
+static apr_status_t init_mutex(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    int rc;
+
+    rc = pthread_mutexattr_init(&attr);
+    if (rc)
+        return rc;
+    rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!rc)
+        rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (!rc)
+        rc = pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return rc;
+}
+/* Initialise the locks of a new slotmem (base is the description) */
+static apr_status_t init_locks(char *base)
+{
+    struct sharedslotlocks *locks = (struct sharedslotlocks *) (base + APR_ALIGN_DEFAULT(sizeof(struct sharedslotdesc)));
+    apr_status_t rv;
+    int i;
+
+    rv = init_mutex(&locks->table);
+    for (i = 0; i < SLOTMEM_STRIPES && rv == APR_SUCCESS; i++)
+        rv = init_mutex(&locks->stripes[i]);
+    return rv;
+}
+/*
+ * The owner of the table lock died: it may have been in the middle of an
+ * alloc or a free. A slot is used while its ident is 0 (that is written
+ * last by alloc and first by free), relink the other ones in the free list
+ * and rebuild the in use bitmap from that.
+ */
+static void repair_table(ap_slotmem_t *s)
+{
+    int i, last = 0;
+
+    for (i = 1; i < s->num + 1; i++) {
+        if (s->ident[i] == 0)
+            s->inuse[SLOTMEM_WORD(i)] |= SLOTMEM_BIT(i);
+        else {
+            s->inuse[SLOTMEM_WORD(i)] &= ~SLOTMEM_BIT(i);
+            s->ident[last] = i;
+            last = i;
+        }
+    }
+    s->ident[last] = s->num + 1;
+    (*s->version)++;
+}
+/*
+ * The owner of the lock of a stripe died: a slot it was writing keeps an odd
+ * sequence, the slot may be incomplete but make it readable again.
+ */
+static void repair_stripe(ap_slotmem_t *s, int stripe)
+{
+    int id;
+
+    for (id = stripe ? stripe : SLOTMEM_STRIPES; id < s->num + 1; id += SLOTMEM_STRIPES) {
+        if (apr_atomic_read32(&s->seqs[id]) & 1)
+            apr_atomic_inc32(&s->seqs[id]);
+    }
+}
+/* lock the table (stripe -1) or a stripe, repair what a dead owner left */
+static apr_status_t lock_mutex(ap_slotmem_t *s, int stripe)
+{
+    pthread_mutex_t *mutex = stripe < 0 ? &s->locks->table : &s->locks->stripes[stripe];
+    int rc = pthread_mutex_lock(mutex);
+
+    if (rc == EOWNERDEAD) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL,
+                     "slotmem %s: the owner of a lock died, repairing %s", s->name, stripe < 0 ? "the table" : "its slots");
+        if (stripe < 0)
+            repair_table(s);
+        else
+            repair_stripe(s, stripe);
+        rc = pthread_mutex_consistent(mutex);
+    }
+    return rc;
+}
+#endif
+
 /*
  * Persiste the slotmem in a file
  * slotmem name and file name.
@@ -152,6 +331,65 @@ static void store_slotmem(ap_slotmem_t *slotmem)
     apr_file_write(fp, slotmem->ident, &nbytes);
     apr_file_close(fp);
 }
+
+/* Initialise the idents (all the slots free) and clean the slots */
+static void init_slots(int *ident, char *base, apr_size_t item_size, int item_num)
+{
+    int i;
+    for (i = 0; i < item_num + 1; i++) {
+        ident[i] = i + 1;
+    }
+    memset(base, 0, item_size * item_num);
+}
+
+/* Check that the idents read from a file are a free list of the slots */
+static int valid_idents(const int *ident, int item_num)
+{
+    int i, ff, free_slots = 0;
+    for (i = 0; i < item_num + 1; i++) {
+        if (ident[i] < 0 || ident[i] > item_num + 1)
+            return 0;
+    }
+    for (ff = ident[0]; ff <= item_num; ff = ident[ff]) {
+        if (ff == 0 || ++free_slots > item_num)
+            return 0; /* a used slot or a loop in the list */
+    }
+    return 1;
+}
+
+/*
+ * Copy the used slots of the old_num slots table into the item_num slots
+ * table (initialised by init_slots()) and chain the other slots in the
+ * free list.
+ * @return the number of used slots that don't fit in the new table.
+ */
+static int migrate_slots(int *ident, char *base, const int *old_ident, const char *old_base,
+                         apr_size_t item_size, int old_num, int item_num)
+{
+    int i, last = 0, lost = 0;
+
+    for (i = 1; i < item_num + 1; i++) {
+        if (i <= old_num && old_ident[i] == 0) {
+            memcpy(base + item_size * (i - 1), old_base + item_size * (i - 1), item_size);
+            ident[i] = 0;
+        }
+        else {
+            ident[last] = i;
+            last = i;
+        }
+    }
+    ident[last] = item_num + 1;
+    for (i = item_num + 1; i < old_num + 1; i++) {
+        if (old_ident[i] == 0)
+            lost++;
+    }
+    return lost;
+}
+
+/*
+ * Restore the idents and slots from the persisted file, a file written with
+ * another number of slots is migrated (the slots with ids over item_num are lost).
+ */
 static void restore_slotmem(void *ptr, const char *name, apr_size_t item_size, int item_num, apr_pool_t *pool)
 {
     const char *storename;
@@ -166,8 +404,20 @@ static void restore_slotmem(void *ptr, const char *name, apr_size_t item_size, i
     if (rv == APR_SUCCESS) {
         apr_finfo_t fi;
         if (apr_file_info_get(&fi, APR_FINFO_SIZE, fp) == APR_SUCCESS) {
+            /* the file is item_size * old_num + sizeof(int) * (old_num + 1) bytes */
+            int old_num = (int) ((fi.size - (apr_off_t) sizeof(int)) / (apr_off_t) (item_size + sizeof(int)));
+            apr_size_t old_bytes = item_size * old_num + sizeof(int) * (old_num + 1);
+
             if (fi.size == nbytes) {
                 apr_file_read(fp, ptr, &nbytes);
+                if (!valid_idents((int *) ptr, item_num))
+                    init_slots((int *) ptr, (char *) ptr + SLOTMEM_TSIZE(item_num), item_size, item_num);
+            }
+            else if (old_num > 0 && fi.size == old_bytes) {
+                char *old = apr_pcalloc(pool, SLOTMEM_TSIZE(old_num) + item_size * old_num);
+                if (apr_file_read_full(fp, old, old_bytes, NULL) == APR_SUCCESS && valid_idents((int *) old, old_num))
+                    migrate_slots((int *) ptr, (char *) ptr + SLOTMEM_TSIZE(item_num),
+                                  (int *) old, old + SLOTMEM_TSIZE(old_num), item_size, old_num, item_num);
             }
             else {
                 apr_file_close(fp);
@@ -179,6 +429,190 @@ static void restore_slotmem(void *ptr, const char *name, apr_size_t item_size, i
     }
 }
 
+/* Rebuild the in use bitmap from the idents table (free slots have an ident), reset the sequences */
+static void rebuild_inuse(apr_uint64_t *inuse, int *ident, int item_num)
+{
+    int i;
+    memset(inuse, 0, SLOTMEM_BSIZE(item_num));
+    for (i = 1; i < item_num + 1; i++) {
+        if (ident[i] == 0)
+            inuse[SLOTMEM_WORD(i)] |= SLOTMEM_BIT(i);
+    }
+}
+
+#if APR_HAS_MMAP
+/*
+ * The file mapped for CREMAP_SLOTMEM has the same layout as the shared memory.
+ * for example:
+ * :module.c : $server_root/logs/module.c.slotmap
+ */
+static const char *map_filename(apr_pool_t *pool, const char *slotmemname)
+{
+    return apr_pstrcat(pool, slotmemname , ".slotmap", NULL);
+}
+
+/* Schedule (or wait for) the write of the dirty pages of a mapped slotmem */
+static void sync_slotmem(ap_slotmem_t *s, int wait)
+{
+    if (s->map == NULL)
+        return;
+#ifndef WIN32
+    msync(s->map->mm, s->map->size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+    s->synced = apr_time_now();
+    s->synced_version = *s->version;
+}
+
+/*
+ * Map the file of the slotmem: reattach to it when its description matches,
+ * migrate its slots when only the number of slots has changed or initialise
+ * it (from the file of PersistSlots on if there is one).
+ * A file that isn't reused is never changed: on a graceful restart the
+ * children of the old generation still map it, the new one is built under
+ * a temporary name and renamed over it.
+ */
+static apr_status_t map_slotmem(ap_slotmem_t *res, const char *fname, apr_size_t item_size, int item_num, apr_pool_t *pool)
+{
+    apr_file_t *fp;
+    apr_finfo_t fi;
+    apr_status_t rv;
+    struct sharedslotdesc desc, *new_desc;
+    apr_size_t nbytes = SLOTMEM_BYTES(item_size, item_num);
+    const char *mapname = map_filename(pool, fname);
+    const char *tmpname;
+    char *ptr;
+    char *old = NULL;
+    int *ident;
+    int reuse = 0;
+
+    rv = apr_file_open(&fp, mapname, APR_CREATE | APR_READ | APR_WRITE | APR_BINARY,
+                       APR_FPROT_UREAD | APR_FPROT_UWRITE, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    if (apr_file_info_get(&fi, APR_FINFO_SIZE, fp) == APR_SUCCESS && fi.size >= (apr_off_t) sizeof(desc) &&
+        apr_file_read_full(fp, &desc, sizeof(desc), NULL) == APR_SUCCESS &&
+        desc.format == SLOTMEM_FORMAT && desc.item_size == item_size && desc.item_num > 0 &&
+        fi.size == (apr_off_t) SLOTMEM_BYTES(item_size, desc.item_num)) {
+        if (desc.item_num == item_num) {
+            reuse = 1;
+        }
+        else {
+            /* MaxNode/MaxContext etc changed: keep a copy to migrate the slots */
+            apr_off_t off = 0;
+            old = apr_palloc(pool, fi.size);
+            if (apr_file_seek(fp, APR_SET, &off) != APR_SUCCESS ||
+                apr_file_read_full(fp, old, fi.size, NULL) != APR_SUCCESS)
+                old = NULL;
+        }
+    }
+    if (reuse) {
+        rv = apr_mmap_create(&res->map, fp, 0, nbytes, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+        apr_file_close(fp);
+        if (rv != APR_SUCCESS) {
+            res->map = NULL;
+            return rv;
+        }
+        ptr = res->map->mm;
+        new_desc = (struct sharedslotdesc *) ptr;
+        ident = (int *) (ptr + SLOTMEM_DSIZE + SLOTMEM_BSIZE(item_num));
+        if (valid_idents(ident, item_num)) {
+            /* the bitmap is rebuilt and the readers must see the slots as changed */
+            rebuild_inuse((apr_uint64_t *) (ptr + SLOTMEM_DSIZE), ident, item_num);
+            new_desc->version++;
+            res->version = &new_desc->version;
+            sync_slotmem(res, 1);
+            return APR_SUCCESS;
+        }
+        /* broken idents: build a new file too */
+        apr_mmap_delete(res->map);
+        res->map = NULL;
+    }
+    else {
+        apr_file_close(fp);
+    }
+
+    tmpname = apr_pstrcat(pool, mapname, ".new", NULL);
+    rv = apr_file_open(&fp, tmpname, APR_CREATE | APR_TRUNCATE | APR_READ | APR_WRITE | APR_BINARY,
+                       APR_FPROT_UREAD | APR_FPROT_UWRITE, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    /* the new file is filled with zeros */
+    rv = apr_file_trunc(fp, nbytes);
+    if (rv == APR_SUCCESS)
+        rv = apr_mmap_create(&res->map, fp, 0, nbytes, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS) {
+        res->map = NULL;
+        apr_file_remove(tmpname, pool);
+        return rv;
+    }
+
+    ptr = res->map->mm;
+    new_desc = (struct sharedslotdesc *) ptr;
+    ident = (int *) (ptr + SLOTMEM_DSIZE + SLOTMEM_BSIZE(item_num));
+    desc.item_size = item_size;
+    desc.item_num = item_num;
+    desc.version = 0;
+    desc.format = SLOTMEM_FORMAT;
+    memcpy(new_desc, &desc, sizeof(desc));
+    init_slots(ident, (char *) ident + SLOTMEM_TSIZE(item_num), item_size, item_num);
+    if (old) {
+        int old_num = ((struct sharedslotdesc *) old)->item_num;
+        int *old_ident = (int *) (old + SLOTMEM_DSIZE + SLOTMEM_BSIZE(old_num));
+        if (valid_idents(old_ident, old_num))
+            migrate_slots(ident, (char *) ident + SLOTMEM_TSIZE(item_num),
+                          old_ident, (char *) old_ident + SLOTMEM_TSIZE(old_num),
+                          item_size, old_num, item_num);
+    }
+    else {
+        restore_slotmem(ident, fname, item_size, item_num, pool);
+    }
+    rebuild_inuse((apr_uint64_t *) (ptr + SLOTMEM_DSIZE), ident, item_num);
+    res->version = &new_desc->version;
+#ifdef SLOTMEM_PTHREAD
+    /* the locks of the old file stay with the children of the old generation */
+    rv = init_locks(ptr);
+#endif
+    if (rv == APR_SUCCESS) {
+        sync_slotmem(res, 1);
+        /* the old children keep the old file, the new ones attach to this one */
+        rv = apr_file_rename(tmpname, mapname, pool);
+    }
+    if (rv != APR_SUCCESS) {
+        apr_mmap_delete(res->map);
+        res->map = NULL;
+        apr_file_remove(tmpname, pool);
+    }
+    return rv;
+}
+
+/* Map the file of a slotmem created with CREMAP_SLOTMEM by another process */
+static apr_status_t map_attach_slotmem(ap_slotmem_t *res, const char *fname, apr_pool_t *pool)
+{
+    apr_file_t *fp;
+    apr_finfo_t fi;
+    apr_status_t rv;
+    struct sharedslotdesc desc;
+
+    rv = apr_file_open(&fp, map_filename(pool, fname), APR_READ | APR_WRITE | APR_BINARY, APR_OS_DEFAULT, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    rv = apr_file_info_get(&fi, APR_FINFO_SIZE, fp);
+    if (rv == APR_SUCCESS)
+        rv = apr_file_read_full(fp, &desc, sizeof(desc), NULL);
+    if (rv == APR_SUCCESS &&
+        (desc.format != SLOTMEM_FORMAT || desc.item_num <= 0 ||
+         fi.size != (apr_off_t) SLOTMEM_BYTES(desc.item_size, desc.item_num)))
+        rv = APR_EINVAL;
+    if (rv == APR_SUCCESS)
+        rv = apr_mmap_create(&res->map, fp, 0, fi.size, APR_MMAP_READ | APR_MMAP_WRITE, globalpool);
+    apr_file_close(fp);
+    if (rv != APR_SUCCESS)
+        res->map = NULL;
+    return rv;
+}
+#endif
+
 static apr_status_t cleanup_slotmem(void *param)
 {
     ap_slotmem_t **mem = param;
@@ -186,8 +620,19 @@ static apr_status_t cleanup_slotmem(void *param)
     if (*mem) {
         ap_slotmem_t *next = *mem;
         while (next) {
-            store_slotmem(next);
-            apr_shm_destroy(next->shm);
+#if APR_HAS_MMAP
+            if (next->map) {
+                /* the file is the slotmem: just make sure it is written */
+                sync_slotmem(next, 1);
+                apr_mmap_delete(next->map);
+                next->map = NULL;
+            }
+            else
+#endif
+            {
+                store_slotmem(next);
+                apr_shm_destroy(next->shm);
+            }
             /* XXX: remove the lock file ? */
             if (next->global_lock) {
                 apr_file_close(next->global_lock);
@@ -201,7 +646,8 @@ static apr_status_t cleanup_slotmem(void *param)
 
 static apr_status_t ap_slotmem_do(ap_slotmem_t *mem, mc_slotmem_callback_fn_t *func, void *data, apr_pool_t *pool)
 {
-    int i, j, isfree, *ident;
+    int w, i, words;
+    apr_uint64_t bits;
     char *ptr;
     apr_status_t rv;
 
@@ -209,43 +655,79 @@ static apr_status_t ap_slotmem_do(ap_slotmem_t *mem, mc_slotmem_callback_fn_t *f
         return APR_ENOSHMAVAIL;
     }
 
-    /* performs the func only on allocated slots! */
-    ptr = mem->base;
-    for (i = 1; i < mem->num+1; i++) {
-        ident = mem->ident;
-        isfree = 0;
-        for (j=0; j<mem->num+1; j++) {
-            if (ident[j] == i) {
-                isfree = 1;
-                break;
-            }
-        }
-        if (!isfree) {
+    /* performs the func only on allocated slots! (skip the empty words of the bitmap) */
+    words = SLOTMEM_WORDS(mem->num);
+    for (w = 0; w < words; w++) {
+        bits = mem->inuse[w];
+        for (i = w * 64; bits; i++, bits >>= 1) {
+            if (!(bits & 1))
+                continue;
+            if (i < 1 || i > mem->num)
+                continue;
+            ptr = (char *) mem->base + mem->size * (i - 1);
             rv = func((void *)ptr, data, i, pool);
             if (rv == APR_SUCCESS) {
                 return(rv);
             }
         }
-        ptr = ptr + mem->size;
     }
     return APR_NOTFOUND;
 }
 /* Lock the file lock (between processes) and then the mutex */
-static apr_status_t ap_slotmem_lock(ap_slotmem_t *s)
+static apr_status_t lock_file_mutex(apr_file_t *file, apr_thread_mutex_t *mutex)
 {
     apr_status_t rv;
-    rv = apr_file_lock(s->global_lock, APR_FLOCK_EXCLUSIVE);
+    rv = apr_file_lock(file, APR_FLOCK_EXCLUSIVE);
     if (rv != APR_SUCCESS)
         return rv;
-    rv = apr_thread_mutex_lock(globalmutex_lock);
+    rv = apr_thread_mutex_lock(mutex);
     if (rv != APR_SUCCESS)
-        apr_file_unlock(s->global_lock);
+        apr_file_unlock(file);
     return rv;
 }
+static apr_status_t unlock_file_mutex(apr_file_t *file, apr_thread_mutex_t *mutex)
+{
+    apr_thread_mutex_unlock(mutex);
+    return(apr_file_unlock(file));
+}
+/* Lock the table: the lock in the shared memory or the file lock and the mutex of the table */
+static apr_status_t ap_slotmem_lock(ap_slotmem_t *s)
+{
+#ifdef SLOTMEM_PTHREAD
+    if (s->locks)
+        return lock_mutex(s, -1);
+#endif
+    return lock_file_mutex(s->global_lock, s->mutex);
+}
 static apr_status_t ap_slotmem_unlock(ap_slotmem_t *s)
 {
-    apr_thread_mutex_unlock(globalmutex_lock);
-    return(apr_file_unlock(s->global_lock));
+#if APR_HAS_MMAP
+    /* the kernel writes the pages in the background, msync() just schedules them */
+    if (s->map && *s->version != s->synced_version && apr_time_now() - s->synced > SLOTMEM_SYNC)
+        sync_slotmem(s, 0);
+#endif
+#ifdef SLOTMEM_PTHREAD
+    if (s->locks)
+        return pthread_mutex_unlock(&s->locks->table);
+#endif
+    return unlock_file_mutex(s->global_lock, s->mutex);
+}
+/* Lock the stripe of the slot, APR_ENOTIMPL: the table lock is the only one */
+static apr_status_t ap_slotmem_lock_slot(ap_slotmem_t *s, int id)
+{
+#ifdef SLOTMEM_PTHREAD
+    if (s->locks)
+        return lock_mutex(s, id & (SLOTMEM_STRIPES - 1));
+#endif
+    return APR_ENOTIMPL;
+}
+static apr_status_t ap_slotmem_unlock_slot(ap_slotmem_t *s, int id)
+{
+#ifdef SLOTMEM_PTHREAD
+    if (s->locks)
+        return pthread_mutex_unlock(&s->locks->stripes[id & (SLOTMEM_STRIPES - 1)]);
+#endif
+    return APR_ENOTIMPL;
 }
 
 /* Create the whole slotmem array */
@@ -259,12 +741,15 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     const char *fname;
     const char *filename;
     apr_size_t nbytes;
-    int i, *ident;
-    apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(desc));
+    int *ident;
+    apr_size_t dsize = SLOTMEM_DSIZE;
+    apr_size_t bsize = SLOTMEM_BSIZE(item_num);
     apr_size_t tsize = APR_ALIGN_DEFAULT(sizeof(int) * (item_num + 1));
+    apr_uint64_t *inuse;
+    int mapped = 0;
 
     item_size = APR_ALIGN_DEFAULT(item_size);
-    nbytes = item_size * item_num + tsize + dsize;
+    nbytes = item_size * item_num + tsize + bsize + dsize;
     if (globalpool == NULL)
         return APR_ENOSHMAVAIL;
     if (name) {
@@ -298,34 +783,60 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     }
     if (globalmutex_lock == NULL)
         apr_thread_mutex_create(&globalmutex_lock, APR_THREAD_MUTEX_DEFAULT, globalpool);
+    rv = apr_thread_mutex_create(&res->mutex, APR_THREAD_MUTEX_DEFAULT, globalpool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
     /* lock for creation */
-    ap_slotmem_lock(res);
+    lock_file_mutex(res->global_lock, globalmutex_lock);
 
+#if APR_HAS_MMAP
+    if (name && (persist & CREMAP_SLOTMEM))
+        mapped = 1;
+#endif
     /* first try to attach to existing shared memory */
-    if (name) {
+    if (name && !mapped) {
         rv = apr_shm_attach(&res->shm, fname, globalpool);
     }
     else {
         rv = APR_EINVAL;
     }
+#if APR_HAS_MMAP
+    if (mapped) {
+        /* the slotmem is the mapped file */
+        rv = map_slotmem(res, fname, item_size, item_num, pool);
+        if (rv != APR_SUCCESS) {
+            unlock_file_mutex(res->global_lock, globalmutex_lock);
+            return rv;
+        }
+        ptr = res->map->mm;
+        new_desc = (struct sharedslotdesc *) ptr;
+        ptr = ptr +  dsize;
+        inuse = (apr_uint64_t *) ptr;
+        ptr = ptr + bsize;
+    }
+    else
+#endif
     if (rv == APR_SUCCESS) {
         /* check size */
         if (apr_shm_size_get(res->shm) != nbytes) {
             apr_shm_detach(res->shm);
             res->shm = NULL;
-            ap_slotmem_unlock(res);
+            unlock_file_mutex(res->global_lock, globalmutex_lock);
             return APR_EINVAL;
         }
         ptr = apr_shm_baseaddr_get(res->shm);
         memcpy(&desc, ptr, sizeof(desc));
-        if (desc.item_size != item_size || desc.item_num != item_num) {
+        if (desc.item_size != item_size || desc.item_num != item_num || desc.format != SLOTMEM_FORMAT) {
             apr_shm_detach(res->shm);
             res->shm = NULL;
-            ap_slotmem_unlock(res);
+            unlock_file_mutex(res->global_lock, globalmutex_lock);
             return APR_EINVAL;
         }
         new_desc = (struct sharedslotdesc *) ptr;
         ptr = ptr +  dsize;
+        inuse = (apr_uint64_t *) ptr;
+        ptr = ptr + bsize;
     }
     else  {
         if (name) {
@@ -344,7 +855,7 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
             rv = apr_shm_create(&res->shm, nbytes, NULL, globalpool);
         }
         if (rv != APR_SUCCESS) {
-            ap_slotmem_unlock(res);
+            unlock_file_mutex(res->global_lock, globalmutex_lock);
             return rv;
         }
         if (name) {
@@ -357,28 +868,42 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
         ptr = apr_shm_baseaddr_get(res->shm);
         desc.item_size = item_size;
         desc.item_num = item_num;
+        desc.version = 0;
+        desc.format = SLOTMEM_FORMAT;
         new_desc = (struct sharedslotdesc *) ptr;
         memcpy(ptr, &desc, sizeof(desc));
+#ifdef SLOTMEM_PTHREAD
+        rv = init_locks(ptr);
+        if (rv != APR_SUCCESS) {
+            unlock_file_mutex(res->global_lock, globalmutex_lock);
+            return rv;
+        }
+#endif
         ptr = ptr +  dsize;
-        /* write the idents table */
+        inuse = (apr_uint64_t *) ptr;
+        ptr = ptr + bsize;
+        /* write the idents table and clean the slots table */
         ident = (int *) ptr;
-        for (i=0; i<item_num+1; i++) {
-            ident[i] = i + 1;
-        }
-        /* clean the slots table */
-        memset(ptr + sizeof(int) * (item_num + 1), 0, item_size * item_num);
+        init_slots(ident, ptr + tsize, item_size, item_num);
         /* try to restore the _whole_ stuff from a persisted location */
         if (persist & CREPER_SLOTMEM)
             restore_slotmem(ptr, fname, item_size, item_num, pool);
+        /* the bitmap isn't persisted, use the idents to fill it */
+        rebuild_inuse(inuse, ident, item_num);
     }
 
     /* For the chained slotmem stuff */
     res->name = apr_pstrdup(globalpool, fname);
+    res->inuse = inuse;
+    res->seqs = SLOTMEM_SEQS(inuse, item_num);
     res->ident = (int *) ptr;
     res->base = ptr + tsize;
     res->size = item_size;
     res->num = item_num;
     res->version = &(new_desc->version);
+#ifdef SLOTMEM_PTHREAD
+    res->locks = (struct sharedslotlocks *) ((char *) new_desc + APR_ALIGN_DEFAULT(sizeof(desc)));
+#endif
     res->globalpool = globalpool;
     res->next = NULL;
     if (globallistmem==NULL) {
@@ -389,7 +914,7 @@ static apr_status_t ap_slotmem_create(ap_slotmem_t **new, const char *name, apr_
     }
 
     *new = res;
-    ap_slotmem_unlock(res);
+    unlock_file_mutex(res->global_lock, globalmutex_lock);
     return APR_SUCCESS;
 }
 static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_size_t *item_size, int *item_num, apr_pool_t *pool)
@@ -401,7 +926,8 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     const char *fname;
     const char *filename;
     apr_status_t rv;
-    apr_size_t dsize = APR_ALIGN_DEFAULT(sizeof(desc));
+    apr_size_t dsize = SLOTMEM_DSIZE;
+    apr_size_t bsize;
     apr_size_t tsize;
 
     *item_size = APR_ALIGN_DEFAULT(*item_size);
@@ -435,6 +961,13 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     /* first try to attach to existing shared memory */
     res = (ap_slotmem_t *) apr_pcalloc(globalpool, sizeof(ap_slotmem_t));
     rv = apr_shm_attach(&res->shm, fname, globalpool);
+#if APR_HAS_MMAP
+    if (rv != APR_SUCCESS) {
+        /* created with CREMAP_SLOTMEM? */
+        res->shm = NULL;
+        rv = map_attach_slotmem(res, fname, pool);
+    }
+#endif
     if (rv != APR_SUCCESS) {
         return rv;
     }
@@ -444,20 +977,41 @@ static apr_status_t ap_slotmem_attach(ap_slotmem_t **new, const char *name, apr_
     if (rv != APR_SUCCESS) {
         return rv;
     }
+    rv = apr_thread_mutex_create(&res->mutex, APR_THREAD_MUTEX_DEFAULT, globalpool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
 
     /* Read the description of the slotmem */
+#if APR_HAS_MMAP
+    if (res->map)
+        ptr = res->map->mm;
+    else
+#endif
     ptr = apr_shm_baseaddr_get(res->shm);
+    res->version = &(((struct sharedslotdesc *) ptr)->version);
+#ifdef SLOTMEM_PTHREAD
+    res->locks = (struct sharedslotlocks *) (ptr + APR_ALIGN_DEFAULT(sizeof(desc)));
+#endif
     memcpy(&desc, ptr, sizeof(desc));
+    if (desc.format != SLOTMEM_FORMAT) {
+        if (res->shm)
+            apr_shm_detach(res->shm);
+        return APR_EINVAL;
+    }
     ptr = ptr + dsize;
+    bsize = SLOTMEM_BSIZE(desc.item_num);
     tsize = APR_ALIGN_DEFAULT(sizeof(int) * (desc.item_num + 1));
 
     /* For the chained slotmem stuff */
     res->name = apr_pstrdup(globalpool, fname);
+    res->inuse = (apr_uint64_t *)ptr;
+    res->seqs = SLOTMEM_SEQS(ptr, desc.item_num);
+    ptr = ptr + bsize;
     res->ident = (int *)ptr;
     res->base = ptr + tsize;
     res->size = desc.item_size;
     res->num = desc.item_num;
-    *res->version = 0;
     res->globalpool = globalpool;
     res->next = NULL;
     if (globallistmem==NULL) {
@@ -476,8 +1030,6 @@ static apr_status_t ap_slotmem_mem(ap_slotmem_t *score, int id, void**mem)
 {
 
     char *ptr;
-    int i;
-    int *ident;
 
     if (!score) {
         return APR_ENOSHMAVAIL;
@@ -487,11 +1039,8 @@ static apr_status_t ap_slotmem_mem(ap_slotmem_t *score, int id, void**mem)
     }
 
     /* Check that it is not a free slot */
-    ident = score->ident;
-    for (i=0; i<score->num+1; i++) {
-        if (ident[i] == id)
-            return APR_NOTFOUND;
-    } 
+    if (!SLOTMEM_INUSE(score, id))
+        return APR_NOTFOUND;
 
     ptr = (char *) score->base + score->size * (id - 1);
     if (!ptr) {
@@ -513,6 +1062,7 @@ static apr_status_t ap_slotmem_alloc(ap_slotmem_t *score, int *item_id, void**me
     } else {
         ident[0] = ident[ff];
         ident[ff] = 0;
+        score->inuse[SLOTMEM_WORD(ff)] |= SLOTMEM_BIT(ff);
         *item_id = ff;
         *mem = (char *) score->base + score->size * (ff - 1);
         (*score->version)++;
@@ -528,6 +1078,7 @@ static apr_status_t ap_slotmem_free(ap_slotmem_t *score, int item_id, void*mem)
     if (item_id > score->num || item_id <=0) {
         return APR_EINVAL;
     } else {
+        apr_status_t rv;
         ap_slotmem_lock(score);
         ident = score->ident;
         if (ident[item_id]) {
@@ -535,9 +1086,14 @@ static apr_status_t ap_slotmem_free(ap_slotmem_t *score, int item_id, void*mem)
             (*score->version)++;
             return APR_SUCCESS;
         }
+        /* the writers of the slot hold its stripe: don't free it under them */
+        rv = ap_slotmem_lock_slot(score, item_id);
         ff = ident[0];
         ident[0] = item_id;
         ident[item_id] = ff;
+        score->inuse[SLOTMEM_WORD(item_id)] &= ~SLOTMEM_BIT(item_id);
+        if (rv == APR_SUCCESS)
+            ap_slotmem_unlock_slot(score, item_id);
         ap_slotmem_unlock(score);
         (*score->version)++;
         return APR_SUCCESS;
@@ -545,15 +1101,18 @@ static apr_status_t ap_slotmem_free(ap_slotmem_t *score, int item_id, void*mem)
 }
 static int ap_slotmem_get_used(ap_slotmem_t *score, int *ids)
 {
-    int i, ret = 0;
-    int *ident;
+    int w, i, words, ret = 0;
+    apr_uint64_t bits;
 
-    ident = score->ident;
-    for (i=0; i<score->num+1; i++) {
-        if (ident[i] == 0) {
-            *ids = i;
-            ids++;
-            ret++;
+    words = SLOTMEM_WORDS(score->num);
+    for (w = 0; w < words; w++) {
+        bits = score->inuse[w];
+        for (i = w * 64; bits; i++, bits >>= 1) {
+            if (bits & 1) {
+                *ids = i;
+                ids++;
+                ret++;
+            }
         }
     }
     return ret;
@@ -564,6 +1123,73 @@ static int ap_slotmem_get_max_size(ap_slotmem_t *score)
         return 0;
     return score->num;
 }
+static unsigned int ap_slotmem_get_version(ap_slotmem_t *score)
+{
+    if (score == NULL)
+        return 0;
+    return *score->version;
+}
+static apr_status_t ap_slotmem_touch(ap_slotmem_t *score)
+{
+    if (score == NULL)
+        return APR_ENOSHMAVAIL;
+    (*score->version)++;
+    return APR_SUCCESS;
+}
+/*
+ * a writer is going to change the slot (the caller holds the lock of the table or of the slot)
+ * APR_EGENERAL: the sequence was odd, another writer is in the middle of a change (a missing
+ * lock) or died in it.
+ */
+static apr_status_t ap_slotmem_write_begin(ap_slotmem_t *score, int id)
+{
+    if (score == NULL || id <= 0 || id > score->num)
+        return APR_EINVAL;
+    if (apr_atomic_inc32(&score->seqs[id]) & 1) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, NULL,
+                     "slotmem %s: slot %d changed by 2 writers (or its writer died)", score->name, id);
+        AP_DEBUG_ASSERT(0);
+        /* odd again after our change: the readers retry until write_end() */
+        apr_atomic_inc32(&score->seqs[id]);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+static apr_status_t ap_slotmem_write_end(ap_slotmem_t *score, int id)
+{
+    if (score == NULL || id <= 0 || id > score->num)
+        return APR_EINVAL;
+    apr_atomic_inc32(&score->seqs[id]);
+    return APR_SUCCESS;
+}
+/* copy the slot without lock: retry while a writer changes it */
+static apr_status_t ap_slotmem_read(ap_slotmem_t *score, int id, void *dest, apr_size_t size)
+{
+    apr_status_t rv;
+    apr_uint32_t seq;
+    void *ptr;
+    int tries;
+
+    rv = ap_slotmem_mem(score, id, &ptr);
+    if (rv != APR_SUCCESS)
+        return rv;
+    if (size > score->size)
+        size = score->size;
+    for (tries = 0; tries < SLOTMEM_READ_TRIES; tries++) {
+        seq = apr_atomic_read32(&score->seqs[id]);
+        if (!(seq & 1)) {
+            SLOTMEM_BARRIER();
+            memcpy(dest, ptr, size);
+            SLOTMEM_BARRIER();
+            if (apr_atomic_read32(&score->seqs[id]) == seq)
+                return APR_SUCCESS;
+        }
+        if (tries >= SLOTMEM_READ_SPINS)
+            apr_thread_yield();
+    }
+    memcpy(dest, ptr, size);
+    return APR_SUCCESS;
+}
 static const slotmem_storage_method storage = {
     &ap_slotmem_do,
     &ap_slotmem_create,
@@ -574,7 +1200,14 @@ static const slotmem_storage_method storage = {
     &ap_slotmem_get_used,
     &ap_slotmem_get_max_size,
     &ap_slotmem_lock,
-    &ap_slotmem_unlock
+    &ap_slotmem_unlock,
+    &ap_slotmem_get_version,
+    &ap_slotmem_touch,
+    &ap_slotmem_lock_slot,
+    &ap_slotmem_unlock_slot,
+    &ap_slotmem_write_begin,
+    &ap_slotmem_write_end,
+    &ap_slotmem_read
 };
 
 /* make the storage usuable from outside
@@ -590,8 +1223,14 @@ void sharedmem_initialize_cleanup(apr_pool_t *p)
 {
     apr_pool_cleanup_register(p, &globallistmem, cleanup_slotmem, apr_pool_cleanup_null);
 }
-/* Create the mutex for insert/remove logic */
+/* Create the mutexes for insert/remove logic (the ones of the tables if the locks are files) */
 apr_status_t sharedmem_initialize_child(apr_pool_t *p)
 {
-    return (apr_thread_mutex_create(&globalmutex_lock, APR_THREAD_MUTEX_DEFAULT, globalpool));
+    ap_slotmem_t *next;
+    apr_status_t rv;
+
+    rv = apr_thread_mutex_create(&globalmutex_lock, APR_THREAD_MUTEX_DEFAULT, globalpool);
+    for (next = globallistmem; next && rv == APR_SUCCESS; next = next->next)
+        rv = apr_thread_mutex_create(&next->mutex, APR_THREAD_MUTEX_DEFAULT, globalpool);
+    return rv;
 }
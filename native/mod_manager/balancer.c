@@ -80,9 +80,8 @@ static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *po
     balancerinfo_t *in = (balancerinfo_t *)*data;
     balancerinfo_t *ou = (balancerinfo_t *)mem;
     if (strcmp(in->balancer, ou->balancer) == 0) {
-        memcpy(ou, in, sizeof(balancerinfo_t));
-        ou->id = id;
-        ou->updatetime = apr_time_sec(apr_time_now());
+        /* insert_update_balancer() updates it */
+        in->id = id;
         *data = ou;
         return APR_SUCCESS;
     }
@@ -95,9 +94,15 @@ apr_status_t insert_update_balancer(mem_t *s, balancerinfo_t *balancer)
     int ident;
 
     balancer->id = 0;
+    ou = balancer;
     s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &balancer, s->p);
+    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &ou, s->p);
     if (balancer->id != 0 && rv == APR_SUCCESS) {
+        s->storage->ap_slotmem_write_begin(s->slotmem, balancer->id);
+        memcpy(ou, balancer, sizeof(balancerinfo_t));
+        ou->updatetime = apr_time_sec(apr_time_now());
+        s->storage->ap_slotmem_write_end(s->slotmem, balancer->id);
+        s->storage->ap_slotmem_touch(s->slotmem);
         s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
     }
@@ -108,10 +113,13 @@ apr_status_t insert_update_balancer(mem_t *s, balancerinfo_t *balancer)
         s->storage->ap_slotmem_unlock(s->slotmem);
         return rv;
     }
+    s->storage->ap_slotmem_write_begin(s->slotmem, ident);
     memcpy(ou, balancer, sizeof(balancerinfo_t));
     ou->id = ident;
-    s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
+    s->storage->ap_slotmem_write_end(s->slotmem, ident);
+    s->storage->ap_slotmem_touch(s->slotmem);
+    s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
@@ -158,6 +166,18 @@ apr_status_t get_balancer(mem_t *s, balancerinfo_t **balancer, int ids)
   return(s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) balancer));
 }
 
+/**
+ * copy a balancer record from the shared table (retries while a writer changes it).
+ * @param pointer to the shared table.
+ * @param balancer address where to copy the balancer.
+ * @param ids  in the balancer table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_balancer(mem_t *s, balancerinfo_t *balancer, int ids)
+{
+  return(s->storage->ap_slotmem_read(s->slotmem, ids, balancer, sizeof(balancerinfo_t)));
+}
+
 /**
  * remove(free) a balancer record from the shared table
  * @param pointer to the shared table.
@@ -200,6 +220,18 @@ int get_max_size_balancer(mem_t *s)
     return (s->storage->ap_slotmem_get_max_size(s->slotmem));
 }
 
+/*
+ * read the version of the table.
+ * @param pointer to the shared table.
+ * @return the version of the table or 0 if error.
+ */
+unsigned int get_version_balancer(mem_t *s)
+{
+    if (s == NULL || s->storage == NULL)
+        return 0;
+    return (s->storage->ap_slotmem_get_version(s->slotmem));
+}
+
 /**
  * attach to the shared balancer table
  * @param name of an existing shared table.
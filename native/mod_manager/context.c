@@ -41,6 +41,7 @@
 
 #include "slotmem.h"
 #include "context.h"
+#include "node.h"
 
 #include "mod_manager.h"
 
@@ -81,10 +82,8 @@ static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *po
     contextinfo_t *ou = (contextinfo_t *)mem;
     if (strcmp(in->context, ou->context) == 0 &&
                in->vhost == ou->vhost && in->node == ou->node) {
-        /* We don't update nbrequests it belongs to mod_proxy_cluster logic */
-        ou->status = in->status;
-        ou->id = id;
-        ou->updatetime = apr_time_sec(apr_time_now());
+        /* insert_update_context() updates it */
+        in->id = id;
         *data = ou;
         return APR_SUCCESS;
     }
@@ -97,9 +96,18 @@ apr_status_t insert_update_context(mem_t *s, contextinfo_t *context)
     int ident;
 
     context->id = 0;
+    ou = context;
     s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &context, s->p);
+    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &ou, s->p);
     if (context->id != 0 && rv == APR_SUCCESS) {
+        /* We don't update nbrequests it belongs to mod_proxy_cluster logic */
+        s->storage->ap_slotmem_write_begin(s->slotmem, context->id);
+        ou->status = context->status;
+        ou->id = context->id;
+        ou->updatetime = apr_time_sec(apr_time_now());
+        s->storage->ap_slotmem_write_end(s->slotmem, context->id);
+        add_mem_journal(s, context->id, CHANGE_UPDATE);
+        s->storage->ap_slotmem_touch(s->slotmem);
         s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
     }
@@ -110,11 +118,17 @@ apr_status_t insert_update_context(mem_t *s, contextinfo_t *context)
         s->storage->ap_slotmem_unlock(s->slotmem);
         return rv;
     }
+    s->storage->ap_slotmem_write_begin(s->slotmem, ident);
     memcpy(ou, context, sizeof(contextinfo_t));
     ou->id = ident;
     ou->nbrequests = 0;
-    s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
+    s->storage->ap_slotmem_write_end(s->slotmem, ident);
+    if (s->inserted)
+        s->inserted(ident);
+    add_mem_journal(s, ident, CHANGE_UPDATE);
+    s->storage->ap_slotmem_touch(s->slotmem);
+    s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
@@ -161,6 +175,18 @@ apr_status_t get_context(mem_t *s, contextinfo_t **context, int ids)
   return(s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) context));
 }
 
+/**
+ * copy a context record from the shared table (retries while a writer changes it).
+ * @param pointer to the shared table.
+ * @param context address where to copy the context.
+ * @param ids  in the context table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_context(mem_t *s, contextinfo_t *context, int ids)
+{
+  return(s->storage->ap_slotmem_read(s->slotmem, ids, context, sizeof(contextinfo_t)));
+}
+
 /**
  * remove(free) a context record from the shared table
  * @param pointer to the shared table.
@@ -171,14 +197,20 @@ apr_status_t remove_context(mem_t *s, contextinfo_t *context)
 {
     apr_status_t rv;
     contextinfo_t *ou = context;
+    int ident;
     if (context->id) {
-        rv = s->storage->ap_slotmem_free(s->slotmem, context->id, context);
+        ident = context->id;
+        rv = s->storage->ap_slotmem_free(s->slotmem, ident, context);
     } else {
         /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
         rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_context, &ou, s->p);
-        if (rv == APR_SUCCESS)
-            rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, context);
+        if (rv != APR_SUCCESS)
+            return rv;
+        ident = ou->id;
+        rv = s->storage->ap_slotmem_free(s->slotmem, ident, context);
     }
+    if (rv == APR_SUCCESS)
+        add_mem_journal(s, ident, CHANGE_REMOVE);
     return rv;
 }
 
@@ -203,6 +235,18 @@ int get_max_size_context(mem_t *s)
     return (s->storage->ap_slotmem_get_max_size(s->slotmem));
 }
 
+/*
+ * read the version of the table.
+ * @param pointer to the shared table.
+ * @return the version of the table or 0 if error.
+ */
+unsigned int get_version_context(mem_t *s)
+{
+    if (s == NULL || s->storage == NULL)
+        return 0;
+    return (s->storage->ap_slotmem_get_version(s->slotmem));
+}
+
 /**
  * attach to the shared context table
  * @param name of an existing shared table.
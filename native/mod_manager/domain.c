@@ -44,6 +44,22 @@
 
 #include "mod_manager.h"
 
+static const char *domain_key(void *slot)
+{
+    return ((domaininfo_t *) slot)->JVMRoute;
+}
+static apr_time_t domain_time(void *slot)
+{
+    return ((domaininfo_t *) slot)->updatetime;
+}
+/* the same JVMRoute may be in several balancers */
+static int domain_match(void *slot, void *data)
+{
+    domaininfo_t *in = (domaininfo_t *) data;
+    domaininfo_t *ou = (domaininfo_t *) slot;
+    return (strcmp(in->JVMRoute, ou->JVMRoute) == 0 && strcmp(in->balancer, ou->balancer) == 0);
+}
+
 static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
@@ -66,6 +82,11 @@ static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_po
     }
     ptr->num = *num;
     ptr->p = p;
+    /* the domains are searched by JVMRoute and balancer, index them */
+    rv = create_mem_index(ptr, storename, type, domain_key, domain_time);
+    if (rv != APR_SUCCESS) {
+        return NULL;
+    }
     return ptr;
 }
 /**
@@ -75,19 +96,6 @@ static mem_t * create_attach_mem_domain(char *string, int *num, int type, apr_po
  * @return APR_SUCCESS if all went well
  *
  */
-static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *pool)
-{
-    domaininfo_t *in = (domaininfo_t *)*data;
-    domaininfo_t *ou = (domaininfo_t *)mem;
-    if (strcmp(in->JVMRoute, ou->JVMRoute) == 0 && strcmp(in->balancer, ou->balancer) == 0) {
-        memcpy(ou, in, sizeof(domaininfo_t));
-        ou->id = id;
-        ou->updatetime = apr_time_sec(apr_time_now());
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
 apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
 {
     apr_status_t rv;
@@ -96,9 +104,13 @@ apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
 
     domain->id = 0;
     s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &domain, s->p);
-    if (domain->id != 0 && rv == APR_SUCCESS) {
-         s->storage->ap_slotmem_unlock(s->slotmem);
+    ident = find_mem_index(s, domain->JVMRoute, domain_match, domain);
+    if (ident != 0 && s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou) == APR_SUCCESS) {
+        memcpy(ou, domain, sizeof(domaininfo_t));
+        ou->id = ident;
+        ou->updatetime = apr_time_sec(apr_time_now());
+        touch_mem_index(s, ident);
+        s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
     }
 
@@ -110,8 +122,9 @@ apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
     }
     memcpy(ou, domain, sizeof(domaininfo_t));
     ou->id = ident;
-    s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
+    insert_mem_index(s, ident);
+    s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
@@ -122,26 +135,17 @@ apr_status_t insert_update_domain(mem_t *s, domaininfo_t *domain)
  * @param domain domain to read from the shared table.
  * @return address of the read domain or NULL if error.
  */
-static apr_status_t loc_read_domain(void* mem, void **data, int id, apr_pool_t *pool) {
-    domaininfo_t *in = (domaininfo_t *)*data;
-    domaininfo_t *ou = (domaininfo_t *)mem;
-
-    if (strcmp(in->JVMRoute, ou->JVMRoute) == 0 && strcmp(in->balancer, ou->balancer) == 0) {
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
 domaininfo_t * read_domain(mem_t *s, domaininfo_t *domain)
 {
     apr_status_t rv;
     domaininfo_t *ou = domain;
+    int ident = domain->id;
 
-    if (domain->id)
-        rv = s->storage->ap_slotmem_mem(s->slotmem, domain->id, (void **) &ou);
-    else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, &ou, s->p);
-    }
+    if (!ident)
+        ident = find_mem_index(s, domain->JVMRoute, domain_match, domain);
+    if (!ident)
+        return NULL;
+    rv = s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou);
     if (rv == APR_SUCCESS)
         return ou;
     return NULL;
@@ -166,17 +170,20 @@ apr_status_t get_domain(mem_t *s, domaininfo_t **domain, int ids)
  */
 apr_status_t remove_domain(mem_t *s, domaininfo_t *domain)
 {
-    apr_status_t rv;
-    domaininfo_t *ou = domain;
-    if (domain->id) {
-        rv = s->storage->ap_slotmem_free(s->slotmem, domain->id, domain);
-    } else {
-        /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, &ou, s->p);
-        if (rv == APR_SUCCESS)
-            rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, domain);
+    int ident;
+
+    s->storage->ap_slotmem_lock(s->slotmem);
+    ident = domain->id;
+    if (!ident)
+        ident = find_mem_index(s, domain->JVMRoute, domain_match, domain);
+    if (!ident) {
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        return APR_NOTFOUND;
     }
-    return rv;
+    remove_mem_index(s, ident);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+    /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
+    return s->storage->ap_slotmem_free(s->slotmem, ident, domain);
 }
 
 /**
@@ -189,18 +196,18 @@ apr_status_t remove_domain(mem_t *s, domaininfo_t *domain)
 apr_status_t find_domain(mem_t *s, domaininfo_t **domain, const char *route, const char *balancer)
 {
     domaininfo_t ou;
-    apr_status_t rv;
+    int ident;
 
     strncpy(ou.JVMRoute, route, sizeof(ou.JVMRoute));
     ou.JVMRoute[sizeof(ou.JVMRoute) - 1] = '\0';
     strncpy(ou.balancer, balancer, sizeof(ou.balancer));
     ou.balancer[sizeof(ou.balancer) - 1] = '\0';
-    *domain = &ou;
-    rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_domain, domain, s->p);
-    return rv;
+    ident = find_mem_index(s, ou.JVMRoute, domain_match, &ou);
+    if (!ident)
+        return APR_NOTFOUND;
+    return s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) domain);
 }
 
-
 /*
  * get the ids for the used (not free) domains in the table
  * @param pointer to the shared table.
@@ -41,6 +41,7 @@
 
 #include "slotmem.h"
 #include "host.h"
+#include "node.h"
 
 #include "mod_manager.h"
 
@@ -80,9 +81,8 @@ static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *po
     hostinfo_t *in = (hostinfo_t *)*data;
     hostinfo_t *ou = (hostinfo_t *)mem;
     if (strcmp(in->host, ou->host) == 0 && in->vhost == ou->vhost && in->node == ou->node) {
-        memcpy(ou, in, sizeof(hostinfo_t));
-        ou->id = id;
-        ou->updatetime = apr_time_sec(apr_time_now());
+        /* insert_update_host() updates it */
+        in->id = id;
         *data = ou;
         return APR_SUCCESS;
     }
@@ -95,9 +95,16 @@ apr_status_t insert_update_host(mem_t *s, hostinfo_t *host)
     int ident;
 
     host->id = 0;
+    ou = host;
     s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &host, s->p);
+    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &ou, s->p);
     if (host->id != 0 && rv == APR_SUCCESS) {
+        s->storage->ap_slotmem_write_begin(s->slotmem, host->id);
+        memcpy(ou, host, sizeof(hostinfo_t));
+        ou->updatetime = apr_time_sec(apr_time_now());
+        s->storage->ap_slotmem_write_end(s->slotmem, host->id);
+        add_mem_journal(s, host->id, CHANGE_UPDATE);
+        s->storage->ap_slotmem_touch(s->slotmem);
         s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
     }
@@ -108,10 +115,14 @@ apr_status_t insert_update_host(mem_t *s, hostinfo_t *host)
         s->storage->ap_slotmem_unlock(s->slotmem);
         return rv;
     }
+    s->storage->ap_slotmem_write_begin(s->slotmem, ident);
     memcpy(ou, host, sizeof(hostinfo_t));
     ou->id = ident;
-    s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
+    s->storage->ap_slotmem_write_end(s->slotmem, ident);
+    add_mem_journal(s, ident, CHANGE_UPDATE);
+    s->storage->ap_slotmem_touch(s->slotmem);
+    s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
@@ -158,6 +169,18 @@ apr_status_t get_host(mem_t *s, hostinfo_t **host, int ids)
   return(s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) host));
 }
 
+/**
+ * copy a host record from the shared table (retries while a writer changes it).
+ * @param pointer to the shared table.
+ * @param host address where to copy the host.
+ * @param ids  in the host table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_host(mem_t *s, hostinfo_t *host, int ids)
+{
+  return(s->storage->ap_slotmem_read(s->slotmem, ids, host, sizeof(hostinfo_t)));
+}
+
 /**
  * remove(free) a host record from the shared table
  * @param pointer to the shared table.
@@ -168,14 +191,20 @@ apr_status_t remove_host(mem_t *s, hostinfo_t *host)
 {
     apr_status_t rv;
     hostinfo_t *ou = host;
+    int ident;
     if (host->id) {
-        rv = s->storage->ap_slotmem_free(s->slotmem, host->id, host);
+        ident = host->id;
+        rv = s->storage->ap_slotmem_free(s->slotmem, ident, host);
     } else {
         /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
         rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_host, &ou, s->p);
-        if (rv == APR_SUCCESS)
-            rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, host);
+        if (rv != APR_SUCCESS)
+            return rv;
+        ident = ou->id;
+        rv = s->storage->ap_slotmem_free(s->slotmem, ident, host);
     }
+    if (rv == APR_SUCCESS)
+        add_mem_journal(s, ident, CHANGE_REMOVE);
     return rv;
 }
 
@@ -200,6 +229,18 @@ int get_max_size_host(mem_t *s)
     return (s->storage->ap_slotmem_get_max_size(s->slotmem));
 }
 
+/*
+ * read the version of the table.
+ * @param pointer to the shared table.
+ * @return the version of the table or 0 if error.
+ */
+unsigned int get_version_host(mem_t *s)
+{
+    if (s == NULL || s->storage == NULL)
+        return 0;
+    return (s->storage->ap_slotmem_get_version(s->slotmem));
+}
+
 /**
  * attach to the shared host table
  * @param name of an existing shared table.
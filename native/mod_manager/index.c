@@ -0,0 +1,332 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2009 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+/**
+ * @file  index.c
+ * @brief hash index of the shared tables
+ *
+ * The index is an open addressing (linear probing) hash table of slot ids,
+ * the removals use backward shifting so there are no deleted markers.
+ * A double linked list of the slot ids in update order allows to expire
+ * the old records without reading the whole table.
+ * The index lives in a slotmem of one slot, it is shared by all the
+ * processes and must be modified with the table locked.
+ *
+ * @defgroup MEM index
+ * @ingroup  APACHE_MODS
+ * @{
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr.h"
+#include "apr_strings.h"
+#include "apr_pools.h"
+#include "apr_time.h"
+
+#include "slotmem.h"
+
+#include "mod_manager.h"
+
+#define INDEXEXE ".index"
+
+/* header of the index in shared memory */
+struct mem_index {
+    int size;   /* number of buckets (power of 2) */
+    int num;    /* number of slots in the table */
+    int head;   /* least recently updated slot (0: empty) */
+    int tail;   /* most recently updated slot */
+    /* followed by:
+     * int buckets[size]           slot ids (0: empty bucket).
+     * unsigned int hashes[num+1]  hash of the key of each slot.
+     * int prev[num+1]             update order list.
+     * int next[num+1]
+     */
+};
+
+#define INDEX_BUCKETS(i) ((int *) ((char *) (i) + APR_ALIGN_DEFAULT(sizeof(mem_index_t))))
+#define INDEX_HASHES(i)  ((unsigned int *) (INDEX_BUCKETS(i) + (i)->size))
+#define INDEX_PREV(i)    ((int *) (INDEX_HASHES(i) + (i)->num + 1))
+#define INDEX_NEXT(i)    (INDEX_PREV(i) + (i)->num + 1)
+
+static apr_size_t index_size(int size, int num)
+{
+    return APR_ALIGN_DEFAULT(sizeof(mem_index_t)) + sizeof(int) * size +
+           (sizeof(unsigned int) + 2 * sizeof(int)) * (num + 1);
+}
+
+/* FNV-1a */
+static unsigned int index_hash(const char *key)
+{
+    unsigned int hash = 2166136261U;
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void *index_slot(mem_t *s, int id)
+{
+    void *slot;
+    if (s->storage->ap_slotmem_mem(s->slotmem, id, &slot) != APR_SUCCESS)
+        return NULL;
+    return slot;
+}
+
+static void list_unlink(mem_index_t *index, int id)
+{
+    int *prev = INDEX_PREV(index);
+    int *next = INDEX_NEXT(index);
+
+    if (prev[id])
+        next[prev[id]] = next[id];
+    else if (index->head == id)
+        index->head = next[id];
+    if (next[id])
+        prev[next[id]] = prev[id];
+    else if (index->tail == id)
+        index->tail = prev[id];
+    prev[id] = 0;
+    next[id] = 0;
+}
+
+static void list_append(mem_index_t *index, int id)
+{
+    int *prev = INDEX_PREV(index);
+    int *next = INDEX_NEXT(index);
+
+    prev[id] = index->tail;
+    next[id] = 0;
+    if (index->tail)
+        next[index->tail] = id;
+    else
+        index->head = id;
+    index->tail = id;
+}
+
+int find_mem_index(mem_t *s, const char *key, mem_index_match_fn *match, void *data)
+{
+    mem_index_t *index = s->index;
+    int *buckets;
+    unsigned int *hashes;
+    unsigned int hash, mask;
+    int i, id, n;
+
+    if (index == NULL)
+        return 0;
+    buckets = INDEX_BUCKETS(index);
+    hashes = INDEX_HASHES(index);
+    mask = index->size - 1;
+    hash = index_hash(key);
+    for (i = hash & mask, n = 0; n < index->size; i = (i + 1) & mask, n++) {
+        void *slot;
+        id = buckets[i];
+        if (id == 0)
+            break;
+        if (id > index->num || hashes[id] != hash)
+            continue;
+        slot = index_slot(s, id);
+        if (slot == NULL)
+            continue;
+        if (match) {
+            if (match(slot, data))
+                return id;
+        } else if (strcmp(s->key(slot), key) == 0)
+            return id;
+    }
+    return 0;
+}
+
+void insert_mem_index(mem_t *s, int id)
+{
+    mem_index_t *index = s->index;
+    int *buckets;
+    unsigned int *hashes;
+    unsigned int mask;
+    void *slot;
+    int i;
+
+    if (index == NULL || id <= 0 || id > index->num)
+        return;
+    slot = index_slot(s, id);
+    if (slot == NULL)
+        return;
+    buckets = INDEX_BUCKETS(index);
+    hashes = INDEX_HASHES(index);
+    mask = index->size - 1;
+    hashes[id] = index_hash(s->key(slot));
+    /* size > num: there is always an empty bucket */
+    for (i = hashes[id] & mask; buckets[i] != 0; i = (i + 1) & mask) {
+        if (buckets[i] == id)
+            break; /* already there */
+    }
+    if (buckets[i] == 0)
+        buckets[i] = id;
+    else
+        list_unlink(index, id);
+    list_append(index, id);
+}
+
+void remove_mem_index(mem_t *s, int id)
+{
+    mem_index_t *index = s->index;
+    int *buckets;
+    unsigned int *hashes;
+    unsigned int mask;
+    int i, j, n;
+
+    if (index == NULL || id <= 0 || id > index->num)
+        return;
+    buckets = INDEX_BUCKETS(index);
+    hashes = INDEX_HASHES(index);
+    mask = index->size - 1;
+    for (i = hashes[id] & mask, n = 0; buckets[i] != id; i = (i + 1) & mask, n++) {
+        if (buckets[i] == 0 || n == index->size)
+            return; /* not in the index */
+    }
+    list_unlink(index, id);
+
+    /* shift back the following buckets that can't be reached otherwise */
+    j = i;
+    for (;;) {
+        unsigned int home;
+        j = (j + 1) & mask;
+        if (buckets[j] == 0)
+            break;
+        home = hashes[buckets[j]] & mask;
+        if ((j > i && (home <= (unsigned int) i || home > (unsigned int) j)) ||
+            (j < i && (home <= (unsigned int) i && home > (unsigned int) j))) {
+            buckets[i] = buckets[j];
+            i = j;
+        }
+    }
+    buckets[i] = 0;
+}
+
+void touch_mem_index(mem_t *s, int id)
+{
+    mem_index_t *index = s->index;
+
+    if (index == NULL || id <= 0 || id > index->num)
+        return;
+    if (index->tail == id)
+        return;
+    list_unlink(index, id);
+    list_append(index, id);
+}
+
+int oldest_mem_index(mem_t *s)
+{
+    if (s->index == NULL)
+        return 0;
+    return s->index->head;
+}
+
+/* order the slots in update order when rebuilding the index */
+struct index_rebuild {
+    int id;
+    apr_time_t updatetime;
+};
+static int index_rebuild_cmp(const void *a, const void *b)
+{
+    const struct index_rebuild *ra = a;
+    const struct index_rebuild *rb = b;
+    if (ra->updatetime < rb->updatetime)
+        return -1;
+    if (ra->updatetime > rb->updatetime)
+        return 1;
+    return ra->id - rb->id;
+}
+
+/* Fill the index with the used slots of the table (persisted ones for example) */
+static void rebuild_mem_index(mem_t *s, mem_index_time_fn *time)
+{
+    mem_index_t *index = s->index;
+    int *ids;
+    struct index_rebuild *order;
+    int i, n;
+
+    memset(INDEX_BUCKETS(index), 0, index_size(index->size, index->num) - APR_ALIGN_DEFAULT(sizeof(mem_index_t)));
+    index->head = 0;
+    index->tail = 0;
+
+    ids = apr_palloc(s->p, sizeof(int) * (index->num + 1));
+    order = apr_palloc(s->p, sizeof(struct index_rebuild) * (index->num + 1));
+    n = s->storage->ap_slotmem_get_used(s->slotmem, ids);
+    for (i = 0; i < n; i++) {
+        void *slot = index_slot(s, ids[i]);
+        order[i].id = ids[i];
+        order[i].updatetime = (time && slot) ? time(slot) : 0;
+    }
+    qsort(order, n, sizeof(struct index_rebuild), index_rebuild_cmp);
+    for (i = 0; i < n; i++)
+        insert_mem_index(s, order[i].id);
+}
+
+apr_status_t create_mem_index(mem_t *s, const char *name, int type, mem_index_key_fn *key, mem_index_time_fn *time)
+{
+    ap_slotmem_t *slotmem;
+    apr_size_t size;
+    int num = 1;
+    int buckets;
+    void *ptr;
+    apr_status_t rv;
+    const char *storename = apr_pstrcat(s->p, name, INDEXEXE, NULL);
+
+    /* at least twice the number of slots to keep the probes short */
+    for (buckets = 16; buckets < 2 * s->num; buckets = buckets * 2);
+    size = index_size(buckets, s->num);
+
+    s->key = key;
+    if (type) {
+        int id;
+        rv = s->storage->ap_slotmem_create(&slotmem, storename, size, 1, CREATE_SLOTMEM, s->p);
+        if (rv != APR_SUCCESS)
+            return rv;
+        /* the slotmem may already exist (restart), its slot is already allocated */
+        if (s->storage->ap_slotmem_mem(slotmem, 1, &ptr) != APR_SUCCESS) {
+            rv = s->storage->ap_slotmem_alloc(slotmem, &id, &ptr);
+            if (rv != APR_SUCCESS)
+                return rv;
+        }
+        s->index = ptr;
+        s->index->size = buckets;
+        s->index->num = s->num;
+        rebuild_mem_index(s, time);
+    } else {
+        rv = s->storage->ap_slotmem_attach(&slotmem, storename, &size, &num, s->p);
+        if (rv != APR_SUCCESS)
+            return rv;
+        rv = s->storage->ap_slotmem_mem(slotmem, 1, &ptr);
+        if (rv != APR_SUCCESS)
+            return rv;
+        s->index = ptr;
+    }
+    return APR_SUCCESS;
+}
@@ -0,0 +1,147 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2009 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+/**
+ * @file  journal.c
+ * @brief change journal of the shared tables
+ *
+ * The journal is a ring of the last JOURNAL_SIZE changes (table, slot id,
+ * operation) made to the nodes, hosts and contexts tables. The tables
+ * have different locks so a writer claims its sequence with an atomic
+ * increment and publishes the entry by storing the sequence in it last.
+ * A reader that is more than JOURNAL_SIZE changes late (or that sees its
+ * entry overwritten) has lost changes and must read the whole tables.
+ *
+ * @defgroup MEM journal
+ * @ingroup  APACHE_MODS
+ * @{
+ */
+
+#include <string.h>
+
+#include "apr.h"
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
+
+#include "slotmem.h"
+#include "node.h"
+
+#include "mod_manager.h"
+
+#define JOURNAL_SIZE 1024 /* power of 2 */
+#define JOURNAL_MASK (JOURNAL_SIZE - 1)
+
+struct mem_journal {
+    apr_uint32_t seq;    /* sequence of the last change claimed */
+    table_change_t changes[JOURNAL_SIZE];
+};
+
+apr_size_t size_mem_journal(void)
+{
+    return sizeof(mem_journal_t);
+}
+
+mem_journal_t *init_mem_journal(void *base)
+{
+    mem_journal_t *journal = (mem_journal_t *) base;
+    memset(journal, 0, sizeof(mem_journal_t));
+    return journal;
+}
+
+void set_mem_journal(mem_t *s, mem_journal_t *journal, int table)
+{
+    if (s == NULL)
+        return;
+    s->journal = journal;
+    s->table = table;
+}
+
+void add_mem_journal(mem_t *s, int id, int op)
+{
+    mem_journal_t *journal = s->journal;
+    table_change_t *change;
+    apr_uint32_t seq;
+
+    if (journal == NULL)
+        return;
+    seq = apr_atomic_inc32(&journal->seq) + 1;
+    if (seq == 0)
+        seq = apr_atomic_inc32(&journal->seq) + 1; /* 0 marks the entries being written */
+    change = &journal->changes[seq & JOURNAL_MASK];
+    apr_atomic_xchg32(&change->seq, 0);
+    change->table = s->table;
+    change->id = id;
+    change->op = op;
+    apr_atomic_xchg32(&change->seq, seq);
+}
+
+int read_mem_journal(mem_journal_t *journal, unsigned int *last, table_change_t *changes, int max)
+{
+    apr_uint32_t head = apr_atomic_read32(&journal->seq);
+    apr_uint32_t seq = *last;
+    int n = 0;
+
+    if (max == 0) {
+        /* just get the actual sequence */
+        *last = head;
+        return 0;
+    }
+    if (head - seq > JOURNAL_SIZE) {
+        *last = head;
+        return -1;
+    }
+    while (seq != head && n < max) {
+        table_change_t *change;
+        apr_uint32_t got;
+
+        if (seq + 1 == 0) {
+            seq++; /* never used */
+            continue;
+        }
+        change = &journal->changes[(seq + 1) & JOURNAL_MASK];
+        got = apr_atomic_read32(&change->seq);
+        if (got != seq + 1) {
+            if (got != 0 && (apr_int32_t) (got - (seq + 1)) > 0)
+                break; /* overwritten */
+            /* not yet published, the next call will read it */
+            *last = seq;
+            return n;
+        }
+        changes[n] = *change;
+        if (apr_atomic_read32(&change->seq) != got)
+            break; /* overwritten while copying */
+        seq++;
+        n++;
+    }
+    if (seq != head && n < max) {
+        *last = apr_atomic_read32(&journal->seq);
+        return -1;
+    }
+    *last = seq;
+    return n;
+}
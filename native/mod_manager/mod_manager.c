@@ -28,6 +28,9 @@
 #include "apr_strings.h"
 #include "apr_lib.h"
 #include "apr_uuid.h"
+#include "apr_general.h"
+#include "apr_network_io.h"
+#include "apr_thread_proc.h"
 
 #define CORE_PRIVATE
 #include "httpd.h"
@@ -51,6 +54,15 @@
 #include "domain.h"
 
 #include "mod_proxy_cluster.h"
+#include "metrics.h"
+
+#if defined(__linux__)
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 #define DEFMAXCONTEXT   100
 #define DEFMAXNODE      20
@@ -80,6 +92,9 @@
 #define SMULALB "SYNTAX: Only one Alias in APP command"
 #define SMULCTB "SYNTAX: Only one Context in APP command"
 #define SREADER "SYNTAX: %s can't read POST data"
+#define SBATCMD "SYNTAX: Command %s is not supported in BATCH"
+#define SBATBIG "SYNTAX: Too many commands in BATCH"
+#define SELEBAD "SYNTAX: ElectionMethod must be byrequests, leastoutstanding, p2c or latency"
 
 #define SJIDBIG "SYNTAX: JGroupUuid field too big"
 #define SJDDBIG "SYNTAX: JGroupData field too big"
@@ -100,9 +115,22 @@
 /* Protocol version supported */
 #define VERSION_PROTOCOL "0.2.1"
 
+/* Max number of commands in a BATCH (advertised by VERSION) */
+#define BATCH_MAX_ITEMS 512
+
 /* Internal substitution for node commands */
 #define NODE_COMMAND "/NODE_COMMAND"
 
+/* header of the BATCH sent to the PeerSync proxies (ServerName of the sender) */
+#define PEER_HEADER  "MCMP-Peer"
+/* the changes of PEER_WAIT are sent together */
+#define PEER_WAIT    apr_time_from_msec(100)
+#define PEER_TIMEOUT apr_time_from_sec(5)
+/* wait before trying again an unreachable peer */
+#define PEER_RETRY   apr_time_from_sec(5)
+/* what a BATCH can hold (see manager_handler()) */
+#define PEER_BATCHSZ (MAXMESSSIZE * BATCH_MAX_ITEMS)
+
 /* range of the commands */
 #define RANGECONTEXT 0
 #define RANGENODE    1
@@ -114,12 +142,18 @@
 /* define content-type */
 #define TEXT_PLAIN 1
 #define TEXT_XML 2
+#define TEXT_JSON 3
+#define TEXT_OPENMETRICS 4
 
 /* Data structure for shared memory block */
 typedef struct version_data {
     apr_uint64_t counter;
+    apr_uint32_t event;    /* changed with counter, the waiters sleep on it */
 } version_data;
 
+/* poll interval of wait_nodes_update() when futex isn't available */
+#define WAIT_NODES_STEP apr_time_from_msec(100)
+
 /* mutex and lock for tables/slotmen */
 static apr_thread_mutex_t *nodes_global_mutex = NULL;
 static apr_file_t *nodes_global_lock = NULL;
@@ -129,6 +163,27 @@ static apr_file_t *contexts_global_lock = NULL;
 /* counter for the version (nodes) */
 static apr_shm_t *versionipc_shm = NULL;
 
+/* change journal of the nodes, hosts and contexts tables */
+static apr_shm_t *journalipc_shm = NULL;
+static mem_journal_t *journal = NULL;
+
+/* commands to replicate to the PeerSync proxies */
+static apr_shm_t *peeripc_shm = NULL;
+static mem_peer_t *peer_changes = NULL;
+
+/* hot runtime state of the nodes: a cache line per node id */
+static apr_shm_t *hotipc_shm = NULL;
+static node_hot_t *hot_nodes = NULL;
+static int hot_nodes_size = 0;
+
+/* latency histograms (cluster-metrics handler) */
+static apr_shm_t *metricsipc_shm = NULL;
+static cluster_metrics_t *metrics = NULL;
+
+/* to measure how long the MCMP commands hold the nodes lock */
+static apr_time_t nodes_locked_time;
+static int nodes_lock_command = CLUSTER_LOCK_OTHER;
+
 /* shared memory */
 static mem_t *contextstatsmem = NULL;
 static mem_t *nodestatsmem = NULL;
@@ -188,9 +243,19 @@ typedef struct mod_manager_config
     char *ws_upgrade_header;
     /* AJP secret */
     char *ajp_secret;
+    /* PeerSync proxies (struct manager_peer) */
+    apr_array_header_t *peers;
 
 } mod_manager_config;
 
+/* a proxy the MCMP commands are replicated to */
+struct manager_peer {
+    char *host;
+    apr_port_t port;
+    char *name;         /* host:port as configured */
+    apr_sockaddr_t *addr; /* addresses of host, the BATCHs of the peer come from one of them */
+};
+
 /*
  * routines for the node_storage_method
  */
@@ -198,6 +263,10 @@ static apr_status_t loc_read_node(int ids, nodeinfo_t **node)
 {
     return (get_node(nodestatsmem, node, ids));
 }
+static apr_status_t loc_copy_node(int ids, nodeinfo_t *node)
+{
+    return (copy_node(nodestatsmem, node, ids));
+}
 static int loc_get_ids_used_node(int *ids)
 {
     return(get_ids_used_node(nodestatsmem, ids)); 
@@ -226,6 +295,11 @@ static void inc_version_node(void)
     version_data *base;
     base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
     base->counter++;
+    base->event++;
+#if defined(__linux__)
+    /* wake up the processes waiting in wait_nodes_update() */
+    syscall(SYS_futex, &base->event, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
 }
 
 /* Check is the nodes (in shared memory) were modified since last
@@ -253,6 +327,42 @@ static unsigned int loc_worker_nodes_need_update(void *data, apr_pool_t *pool)
         return last;
     return (0);
 }
+/*
+ * Wait until the version of the nodes is not last anymore or timeout.
+ * return the version.
+ */
+static unsigned int loc_wait_nodes_update(unsigned int last, apr_interval_time_t timeout)
+{
+    version_data *base;
+    apr_time_t end = apr_time_now() + timeout;
+
+    if (versionipc_shm == NULL) {
+        apr_sleep(timeout);
+        return last;
+    }
+    base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
+    for (;;) {
+        apr_uint32_t event = base->event;
+        unsigned int counter = (unsigned int) base->counter;
+        apr_interval_time_t left;
+
+        if (counter != last)
+            return counter;
+        left = end - apr_time_now();
+        if (left <= 0)
+            return counter;
+#if defined(__linux__)
+        {
+            struct timespec ts;
+            ts.tv_sec = apr_time_sec(left);
+            ts.tv_nsec = apr_time_usec(left) * 1000;
+            syscall(SYS_futex, &base->event, FUTEX_WAIT, event, &ts, NULL, 0);
+        }
+#else
+        apr_sleep(left < WAIT_NODES_STEP ? left : WAIT_NODES_STEP);
+#endif
+    }
+}
 /* Store the last version update in the proccess config */
 static int loc_worker_nodes_are_updated(void *data, unsigned int last)
 {
@@ -279,12 +389,70 @@ static apr_status_t unlock_memory(apr_file_t *file, apr_thread_mutex_t *mutex)
 }
 static apr_status_t loc_lock_nodes(void)
 {
-    return(lock_memory(nodes_global_lock, nodes_global_mutex));
+    apr_time_t start = metrics ? apr_time_now() : 0;
+    apr_status_t rv = lock_memory(nodes_global_lock, nodes_global_mutex);
+    if (rv == APR_SUCCESS && metrics) {
+        nodes_locked_time = apr_time_now();
+        nodes_lock_command = CLUSTER_LOCK_OTHER;
+        cluster_hist_observe(&metrics->lock_wait, nodes_locked_time - start);
+    }
+    return rv;
 }
 static apr_status_t loc_unlock_nodes(void)
 {
+    if (metrics)
+        cluster_hist_observe(&metrics->lock[nodes_lock_command], apr_time_now() - nodes_locked_time);
     return(unlock_memory(nodes_global_lock, nodes_global_mutex));
 }
+/*
+ * Lock one node: its stripe in the nodes table when the slotmem has them,
+ * otherwise the whole table like the MCMP commands. The record is changed
+ * until loc_unlock_node(): the readers of copy_node() wait for it.
+ */
+static apr_status_t loc_lock_node(int ids)
+{
+    apr_status_t rv = APR_ENOTIMPL;
+    if (nodestatsmem)
+        rv = nodestatsmem->storage->ap_slotmem_lock_slot(nodestatsmem->slotmem, ids);
+    if (rv == APR_ENOTIMPL)
+        rv = loc_lock_nodes();
+    if (rv == APR_SUCCESS && nodestatsmem)
+        nodestatsmem->storage->ap_slotmem_write_begin(nodestatsmem->slotmem, ids);
+    return rv;
+}
+static apr_status_t loc_unlock_node(int ids)
+{
+    apr_status_t rv = APR_ENOTIMPL;
+    if (nodestatsmem) {
+        nodestatsmem->storage->ap_slotmem_write_end(nodestatsmem->slotmem, ids);
+        rv = nodestatsmem->storage->ap_slotmem_unlock_slot(nodestatsmem->slotmem, ids);
+    }
+    if (rv == APR_ENOTIMPL)
+        rv = loc_unlock_nodes();
+    return rv;
+}
+/* an in place change the readers of the journal must see (the node marked removed) */
+static void loc_journal_node(int ids)
+{
+    if (nodestatsmem)
+        add_mem_journal(nodestatsmem, ids, CHANGE_UPDATE);
+}
+/* tell which MCMP command holds the nodes lock (NOTE: the nodes are locked) */
+static void set_nodes_lock_command(request_rec *r)
+{
+    if (strcasecmp(r->method, "CONFIG") == 0)
+        nodes_lock_command = CLUSTER_LOCK_CONFIG;
+    else if (strcasecmp(r->method, "ENABLE-APP") == 0)
+        nodes_lock_command = CLUSTER_LOCK_ENABLE;
+    else if (strcasecmp(r->method, "DISABLE-APP") == 0)
+        nodes_lock_command = CLUSTER_LOCK_DISABLE;
+    else if (strcasecmp(r->method, "STOP-APP") == 0)
+        nodes_lock_command = CLUSTER_LOCK_STOP;
+    else if (strcasecmp(r->method, "REMOVE-APP") == 0)
+        nodes_lock_command = CLUSTER_LOCK_REMOVE;
+    else if (strcasecmp(r->method, "BATCH") == 0)
+        nodes_lock_command = CLUSTER_LOCK_BATCH;
+}
 static int loc_get_max_size_context(void)
 {
     if (contextstatsmem)
@@ -332,6 +500,48 @@ static void loc_remove_host_context(int node, apr_pool_t *pool)
             remove_context(contextstatsmem, context);
     }
 }
+static unsigned int loc_get_version_node(void)
+{
+    if (nodestatsmem)
+        return(get_version_node(nodestatsmem));
+    else
+        return 0;
+}
+static int loc_get_changes(unsigned int *last, table_change_t *changes, int max)
+{
+    if (journal == NULL)
+        return -1;
+    return(read_mem_journal(journal, last, changes, max));
+}
+static node_hot_t *loc_get_node_hot(int ids)
+{
+    if (hot_nodes == NULL || ids <= 0 || ids > hot_nodes_size)
+        return NULL;
+    return (&hot_nodes[ids]);
+}
+static cluster_metrics_t *loc_get_metrics(void)
+{
+    return metrics;
+}
+/*
+ * The line and the histograms of a new node (the histograms of a new context)
+ * mustn't keep the values of the one previously using the id.
+ */
+static void node_inserted(int ids)
+{
+    node_hot_t *hot = loc_get_node_hot(ids);
+    cluster_hist_t *hist = cluster_metrics_node(metrics, ids);
+    if (hot)
+        memset(hot, 0, sizeof(node_hot_t));
+    if (hist)
+        memset((void *) hist, 0, sizeof(cluster_hist_t));
+}
+static void context_inserted(int ids)
+{
+    cluster_hist_t *hist = cluster_metrics_context(metrics, ids);
+    if (hist)
+        memset((void *) hist, 0, sizeof(cluster_hist_t));
+}
 static const struct node_storage_method node_storage =
 {
     loc_read_node,
@@ -343,7 +553,16 @@ static const struct node_storage_method node_storage =
     loc_find_node,
     loc_remove_host_context,
     loc_lock_nodes,
-    loc_unlock_nodes
+    loc_unlock_nodes,
+    loc_get_version_node,
+    loc_wait_nodes_update,
+    loc_get_changes,
+    loc_get_node_hot,
+    loc_get_metrics,
+    loc_lock_node,
+    loc_unlock_node,
+    loc_copy_node,
+    loc_journal_node
 };
 
 /*
@@ -353,6 +572,10 @@ static apr_status_t loc_read_context(int ids, contextinfo_t **context)
 {
     return (get_context(contextstatsmem, context, ids));
 }
+static apr_status_t loc_copy_context(int ids, contextinfo_t *context)
+{
+    return (copy_context(contextstatsmem, context, ids));
+}
 static int loc_get_ids_used_context(int *ids)
 {
     return(get_ids_used_context(contextstatsmem, ids)); 
@@ -365,13 +588,22 @@ static apr_status_t loc_unlock_contexts(void)
 {
     return(unlock_memory(contexts_global_lock, contexts_global_mutex));
 }
+static unsigned int loc_get_version_context(void)
+{
+    if (contextstatsmem)
+        return(get_version_context(contextstatsmem));
+    else
+        return 0;
+}
 static const struct context_storage_method context_storage =
 {
     loc_read_context,
     loc_get_ids_used_context,
     loc_get_max_size_context,
     loc_lock_contexts,
-    loc_unlock_contexts
+    loc_unlock_contexts,
+    loc_get_version_context,
+    loc_copy_context
 };
 
 /*
@@ -381,15 +613,28 @@ static apr_status_t loc_read_host(int ids, hostinfo_t **host)
 {
     return (get_host(hoststatsmem, host, ids));
 }
+static apr_status_t loc_copy_host(int ids, hostinfo_t *host)
+{
+    return (copy_host(hoststatsmem, host, ids));
+}
 static int loc_get_ids_used_host(int *ids)
 {
     return(get_ids_used_host(hoststatsmem, ids)); 
 }
+static unsigned int loc_get_version_host(void)
+{
+    if (hoststatsmem)
+        return(get_version_host(hoststatsmem));
+    else
+        return 0;
+}
 static const struct host_storage_method host_storage =
 {
     loc_read_host,
     loc_get_ids_used_host,
-    loc_get_max_size_host
+    loc_get_max_size_host,
+    loc_get_version_host,
+    loc_copy_host
 };
 
 /*
@@ -399,6 +644,10 @@ static apr_status_t loc_read_balancer(int ids, balancerinfo_t **balancer)
 {
     return (get_balancer(balancerstatsmem, balancer, ids));
 }
+static apr_status_t loc_copy_balancer(int ids, balancerinfo_t *balancer)
+{
+    return (copy_balancer(balancerstatsmem, balancer, ids));
+}
 static int loc_get_ids_used_balancer(int *ids)
 {
     return(get_ids_used_balancer(balancerstatsmem, ids)); 
@@ -410,11 +659,20 @@ static int loc_get_max_size_balancer(void)
     else
         return 0;
 }
+static unsigned int loc_get_version_balancer(void)
+{
+    if (balancerstatsmem)
+        return(get_version_balancer(balancerstatsmem));
+    else
+        return 0;
+}
 static const struct balancer_storage_method balancer_storage =
 {
     loc_read_balancer,
     loc_get_ids_used_balancer,
-    loc_get_max_size_balancer
+    loc_get_max_size_balancer,
+    loc_get_version_balancer,
+    loc_copy_balancer
 };
 /*
  * routines for the sessionid_storage_method
@@ -442,13 +700,20 @@ static apr_status_t loc_insert_update_sessionid(sessionidinfo_t *sessionid)
 {
     return (insert_update_sessionid(sessionidstatsmem, sessionid));
 }
+static int loc_remove_expired_sessionid(apr_time_t before)
+{
+    if (sessionidstatsmem)
+        return (remove_expired_sessionid(sessionidstatsmem, before));
+    return 0;
+}
 static const struct  sessionid_storage_method sessionid_storage =
 {
     loc_read_sessionid,
     loc_get_ids_used_sessionid,
     loc_get_max_size_sessionid,
     loc_remove_sessionid,
-    loc_insert_update_sessionid
+    loc_insert_update_sessionid,
+    loc_remove_expired_sessionid
 };
 
 /*
@@ -522,6 +787,26 @@ static apr_status_t cleanup_manager(void *param)
         apr_shm_destroy(versionipc_shm);
         versionipc_shm = NULL;
     }
+    if (journalipc_shm) {
+        apr_shm_destroy(journalipc_shm);
+        journalipc_shm = NULL;
+    }
+    journal = NULL;
+    if (peeripc_shm) {
+        apr_shm_destroy(peeripc_shm);
+        peeripc_shm = NULL;
+    }
+    peer_changes = NULL;
+    if (hotipc_shm) {
+        apr_shm_destroy(hotipc_shm);
+        hotipc_shm = NULL;
+    }
+    hot_nodes = NULL;
+    if (metricsipc_shm) {
+        apr_shm_destroy(metricsipc_shm);
+        metricsipc_shm = NULL;
+    }
+    metrics = NULL;
     return APR_SUCCESS;
 }
 static void mc_initialize_cleanup(apr_pool_t *p)
@@ -572,6 +857,12 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
     char *sessionid;
     char *domain;
     char *version;
+    char *journalname;
+    char *peername;
+    char *hotname;
+    apr_size_t hotsize;
+    char *metricsname;
+    apr_size_t metricssize;
     char *filename;
     version_data *base;
     void *data;
@@ -594,6 +885,10 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
         sessionid = apr_pstrcat(ptemp, mconf->basefilename, "/manager.sessionid", NULL);
         domain = apr_pstrcat(ptemp, mconf->basefilename, "/manager.domain", NULL);
         version = apr_pstrcat(ptemp, mconf->basefilename, "/manager.version", NULL);
+        journalname = apr_pstrcat(ptemp, mconf->basefilename, "/manager.journal", NULL);
+        peername = apr_pstrcat(ptemp, mconf->basefilename, "/manager.peer", NULL);
+        hotname = apr_pstrcat(ptemp, mconf->basefilename, "/manager.hot", NULL);
+        metricsname = apr_pstrcat(ptemp, mconf->basefilename, "/manager.metrics", NULL);
     } else {
         node = ap_server_root_relative(ptemp, "logs/manager.node");
         context = ap_server_root_relative(ptemp, "logs/manager.context");
@@ -602,6 +897,10 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
         sessionid = ap_server_root_relative(ptemp, "logs/manager.sessionid");
         domain = ap_server_root_relative(ptemp, "logs/manager.domain");
         version = ap_server_root_relative(ptemp, "logs/manager.version");
+        journalname = ap_server_root_relative(ptemp, "logs/manager.journal");
+        peername = ap_server_root_relative(ptemp, "logs/manager.peer");
+        hotname = ap_server_root_relative(ptemp, "logs/manager.hot");
+        metricsname = ap_server_root_relative(ptemp, "logs/manager.metrics");
     }
 
     /* Do some sanity checks */
@@ -694,6 +993,95 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
     }
     base = (version_data *)apr_shm_baseaddr_get(versionipc_shm);
     base->counter = 0;
+    base->event = 0;
+
+    if (is_child_process()) {
+        rv = apr_shm_attach(&journalipc_shm, (const char *) journalname, p);
+    } else {
+        rv = apr_shm_create(&journalipc_shm, size_mem_journal(), NULL, p);
+        if ( rv == APR_ENOTIMPL ) 
+        {
+            apr_shm_remove((const char *) journalname, p);
+            rv = apr_shm_create(&journalipc_shm, size_mem_journal(), (const char *) journalname, p);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "create_share_journal failed");
+        return  !OK;
+    }
+    if (is_child_process())
+        journal = (mem_journal_t *)apr_shm_baseaddr_get(journalipc_shm);
+    else
+        journal = init_mem_journal(apr_shm_baseaddr_get(journalipc_shm));
+    set_mem_journal(nodestatsmem, journal, TABLE_NODE);
+    set_mem_journal(hoststatsmem, journal, TABLE_HOST);
+    set_mem_journal(contextstatsmem, journal, TABLE_CONTEXT);
+    nodestatsmem->inserted = node_inserted;
+    contextstatsmem->inserted = context_inserted;
+
+    if (mconf->peers) {
+        if (is_child_process()) {
+            rv = apr_shm_attach(&peeripc_shm, (const char *) peername, p);
+        } else {
+            rv = apr_shm_create(&peeripc_shm, size_mem_peer(), NULL, p);
+            if ( rv == APR_ENOTIMPL ) 
+            {
+                apr_shm_remove((const char *) peername, p);
+                rv = apr_shm_create(&peeripc_shm, size_mem_peer(), (const char *) peername, p);
+            }
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "create_share_peer failed");
+            return  !OK;
+        }
+        if (is_child_process())
+            peer_changes = (mem_peer_t *)apr_shm_baseaddr_get(peeripc_shm);
+        else
+            peer_changes = init_mem_peer(apr_shm_baseaddr_get(peeripc_shm));
+    }
+
+    /* the node ids start at 1, one more line to align the array on a line */
+    hotsize = sizeof(node_hot_t) * (mconf->maxnode + 2);
+    if (is_child_process()) {
+        rv = apr_shm_attach(&hotipc_shm, (const char *) hotname, p);
+    } else {
+        rv = apr_shm_create(&hotipc_shm, hotsize, NULL, p);
+        if ( rv == APR_ENOTIMPL ) 
+        {
+            apr_shm_remove((const char *) hotname, p);
+            rv = apr_shm_create(&hotipc_shm, hotsize, (const char *) hotname, p);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "create_share_hot failed");
+        return  !OK;
+    }
+    hot_nodes = (node_hot_t *) APR_ALIGN((apr_size_t) apr_shm_baseaddr_get(hotipc_shm), NODE_HOT_LINE);
+    hot_nodes_size = mconf->maxnode;
+    if (!is_child_process())
+        memset(hot_nodes, 0, sizeof(node_hot_t) * (mconf->maxnode + 1));
+
+    metricssize = CLUSTER_METRICS_SIZE(mconf->maxnode, mconf->maxcontext);
+    if (is_child_process()) {
+        rv = apr_shm_attach(&metricsipc_shm, (const char *) metricsname, p);
+    } else {
+        rv = apr_shm_create(&metricsipc_shm, metricssize, NULL, p);
+        if ( rv == APR_ENOTIMPL ) 
+        {
+            apr_shm_remove((const char *) metricsname, p);
+            rv = apr_shm_create(&metricsipc_shm, metricssize, (const char *) metricsname, p);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s, "create_share_metrics failed");
+        return  !OK;
+    }
+    metrics = (cluster_metrics_t *) apr_shm_baseaddr_get(metricsipc_shm);
+    if (!is_child_process()) {
+        memset(metrics, 0, metricssize);
+        metrics->maxnode = mconf->maxnode;
+        metrics->maxcontext = mconf->maxcontext;
+    }
 
     /* Get a provider to ping/pong logics */
 
@@ -718,37 +1106,192 @@ static int manager_init(apr_pool_t *p, apr_pool_t *plog,
 
     return OK;
 }
-static apr_status_t decodeenc(char **ptr);
-static char **process_buff(request_rec *r, char *buff)
+/*
+ * The fields of the MCMP messages, the index in mcmp_fields[]
+ */
+enum mcmp_field {
+    MCMP_UNKNOWN = 0,
+    MCMP_ALIAS,
+    MCMP_BALANCER,
+    MCMP_CONTEXT,
+    MCMP_DOMAIN,
+    MCMP_ELECTIONMETHOD,
+    MCMP_FLUSHPACKETS,
+    MCMP_FLUSHWAIT,
+    MCMP_HOST,
+    MCMP_JVMROUTE,
+    MCMP_LOAD,
+    MCMP_MAXATTEMPTS,
+    MCMP_PING,
+    MCMP_PORT,
+    MCMP_REVERSED,
+    MCMP_SCHEME,
+    MCMP_SLOWSTART,
+    MCMP_SMAX,
+    MCMP_STICKYSESSION,
+    MCMP_STICKYSESSIONCOOKIE,
+    MCMP_STICKYSESSIONFORCE,
+    MCMP_STICKYSESSIONPATH,
+    MCMP_STICKYSESSIONREMOVE,
+    MCMP_TIMEOUT,
+    MCMP_TTL,
+    MCMP_TYPE,
+    MCMP_WAITWORKER,
+    MCMP_WARMCONNECTIONS
+};
+
+/*
+ * name, size of the field the value is copied in (0: not limited) and
+ * the error when the value doesn't fit.
+ */
+static const struct mcmp_field_desc {
+    const char *name;
+    apr_size_t size;
+    char *toobig;
+} mcmp_fields[] = {
+    { NULL, 0, NULL },
+    { "Alias", 0, NULL },
+    { "Balancer", BALANCERSZ, SBALBIG },
+    { "Context", 0, NULL },
+    { "Domain", DOMAINNDSZ, SDOMBIG },
+    { "ElectionMethod", 0, NULL },
+    { "flushpackets", 0, NULL },
+    { "flushwait", 0, NULL },
+    { "Host", HOSTNODESZ, SHOSBIG },
+    { "JVMRoute", JVMROUTESZ, SROUBIG },
+    { "Load", 0, NULL },
+    { "Maxattempts", 0, NULL },
+    { "ping", 0, NULL },
+    { "Port", PORTNODESZ, SPORBIG },
+    { "Reversed", 0, NULL },
+    { "Scheme", 0, NULL },
+    { "SlowStart", 0, NULL },
+    { "smax", 0, NULL },
+    { "StickySession", 0, NULL },
+    { "StickySessionCookie", COOKNAMESZ, SBAFBIG },
+    { "StickySessionForce", 0, NULL },
+    { "StickySessionPath", PATHNAMESZ, SBAFBIG },
+    { "StickySessionRemove", 0, NULL },
+    { "Timeout", 0, NULL },
+    { "ttl", 0, NULL },
+    { "Type", SCHEMENDSZ, STYPBIG },
+    { "WaitWorker", 0, NULL },
+    { "WarmConnections", 0, NULL }
+};
+
+/* the values of ElectionMethod */
+static const char *election_names[] = ELECTION_NAMES;
+#define ELECTION_NAME(method) ((method) >= 0 && (method) < ELECTION_COUNT ? election_names[method] : "default")
+
+#define MCMP_KEY(len, c) (((len) << 8) | (c))
+
+/*
+ * Find the field of a name: the length and the first character select
+ * the only candidate, one strncasecmp() confirms it.
+ */
+static int mcmp_field_len(const char *name, apr_size_t len)
+{
+    int field;
+
+    if (len == 0 || len > 19)
+        return MCMP_UNKNOWN;
+    switch (MCMP_KEY(len, apr_tolower(name[0]))) {
+    case MCMP_KEY(3, 't'):  field = MCMP_TTL; break;
+    case MCMP_KEY(4, 'h'):  field = MCMP_HOST; break;
+    case MCMP_KEY(4, 'l'):  field = MCMP_LOAD; break;
+    case MCMP_KEY(4, 'p'):  field = (apr_tolower(name[1]) == 'o') ? MCMP_PORT : MCMP_PING; break;
+    case MCMP_KEY(4, 's'):  field = MCMP_SMAX; break;
+    case MCMP_KEY(4, 't'):  field = MCMP_TYPE; break;
+    case MCMP_KEY(5, 'a'):  field = MCMP_ALIAS; break;
+    case MCMP_KEY(6, 'd'):  field = MCMP_DOMAIN; break;
+    case MCMP_KEY(6, 's'):  field = MCMP_SCHEME; break;
+    case MCMP_KEY(7, 'c'):  field = MCMP_CONTEXT; break;
+    case MCMP_KEY(7, 't'):  field = MCMP_TIMEOUT; break;
+    case MCMP_KEY(8, 'b'):  field = MCMP_BALANCER; break;
+    case MCMP_KEY(8, 'j'):  field = MCMP_JVMROUTE; break;
+    case MCMP_KEY(8, 'r'):  field = MCMP_REVERSED; break;
+    case MCMP_KEY(9, 'f'):  field = MCMP_FLUSHWAIT; break;
+    case MCMP_KEY(9, 's'):  field = MCMP_SLOWSTART; break;
+    case MCMP_KEY(10, 'w'): field = MCMP_WAITWORKER; break;
+    case MCMP_KEY(11, 'm'): field = MCMP_MAXATTEMPTS; break;
+    case MCMP_KEY(12, 'f'): field = MCMP_FLUSHPACKETS; break;
+    case MCMP_KEY(13, 's'): field = MCMP_STICKYSESSION; break;
+    case MCMP_KEY(14, 'e'): field = MCMP_ELECTIONMETHOD; break;
+    case MCMP_KEY(15, 'w'): field = MCMP_WARMCONNECTIONS; break;
+    case MCMP_KEY(17, 's'): field = MCMP_STICKYSESSIONPATH; break;
+    case MCMP_KEY(18, 's'): field = MCMP_STICKYSESSIONFORCE; break;
+    case MCMP_KEY(19, 's'):
+        field = (apr_tolower(name[13]) == 'c') ? MCMP_STICKYSESSIONCOOKIE : MCMP_STICKYSESSIONREMOVE;
+        break;
+    default:
+        return MCMP_UNKNOWN;
+    }
+    if (strncasecmp(name, mcmp_fields[field].name, len) != 0)
+        return MCMP_UNKNOWN;
+    return field;
+}
+static int mcmp_field(const char *name)
+{
+    return mcmp_field_len(name, strlen(name));
+}
+
+static int mod_manager_hex2c(const char *x);
+/*
+ * Split the message in name/value pairs, in place and in one pass: the
+ * %xx are decoded while copying the characters down, the illegal ones are
+ * rejected and the values of the known fields are checked against the
+ * size they are copied in, so the process_* don't need to check them.
+ * A name without value gets an empty one.
+ * Returns NULL and the error in errstring if the message can't be used.
+ */
+static char **process_buff(request_rec *r, char *buff, char **errstring)
 {
     int i = 0;
+    int field = MCMP_UNKNOWN;
     char *s = buff;
+    char *d;
     char **ptr = NULL;
     for (; *s != '\0'; s++) {
         if (*s == '&' || *s == '=') {
             i++;
         }
     }
-    ptr = apr_palloc(r->pool, sizeof(char *) * (i + 2));
-    if (ptr == NULL)
-        return NULL;
+    ptr = apr_palloc(r->pool, sizeof(char *) * (i + 3));
 
-    s = buff;
-    ptr[0] = s;
-    ptr[i+1] = NULL;
+    ptr[0] = d = buff;
     i = 1;
-    for (; *s != '\0'; s++) {
-        /* our separators */
-        if (*s == '&' || *s == '=') {
-            *s = '\0';
-            ptr[i] = s + 1;
-            i++;
+    for (s = buff; ; s++) {
+        char ch = *s;
+
+        /* our separators, the decoded & and = are legit characters */
+        if (ch == '&' || ch == '=' || ch == '\0') {
+            *d = '\0';
+            if (i % 2) {
+                field = mcmp_field_len(ptr[i - 1], d - ptr[i - 1]);
+            } else if (mcmp_fields[field].size && (apr_size_t) (d - ptr[i - 1]) >= mcmp_fields[field].size) {
+                *errstring = mcmp_fields[field].toobig;
+                return NULL;
+            }
+            if (ch == '\0')
+                break;
+            ptr[i++] = d = s + 1;
+            continue;
         }
-    }
 
-    if (decodeenc(ptr) != APR_SUCCESS) {
-        return NULL;
+        if (ch == '%' && apr_isxdigit(s[1]) && apr_isxdigit(s[2])) {
+            ch = (char) mod_manager_hex2c(s + 1);
+            s += 2;
+        }
+        /* from apr_escape_entity() and apr_escape_shell() */
+        if (ch == '<' || ch == '>' || ch == '\"' || ch == '\'' || ch == '\r' || ch == '\n') {
+            *errstring = SMESPAR;
+            return NULL;
+        }
+        *d++ = ch;
     }
+    if (i % 2)
+        ptr[i++] = d;
+    ptr[i] = NULL;
 
     return ptr;
 }
@@ -923,7 +1466,7 @@ static apr_status_t mod_manager_manage_worker(request_rec *r, nodeinfo_t *node,
  * Balancer: <Balancer name>
  * <balancer configuration>
  * StickySession	StickySessionCookie	StickySessionPath	StickySessionRemove
- * StickySessionForce	Timeout	Maxattempts
+ * StickySessionForce	Timeout	Maxattempts	WarmConnections	SlowStart	ElectionMethod
  * JvmRoute?: <JvmRoute>
  * Domain: <Domain>
  * <Host: <Node IP>
@@ -1001,78 +1544,77 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
     strcpy(balancerinfo.StickySessionPath, "jsessionid");
     balancerinfo.Maxattempts = 1;
     balancerinfo.Timeout = 0;
+    balancerinfo.WarmConnections = -1; /* use the ones of mod_proxy_cluster */
+    balancerinfo.SlowStart = -1;
+    balancerinfo.ElectionMethod = -1;
 
+    /* the lengths of the values were checked by process_buff() */
     while (ptr[i]) {
+        switch (mcmp_field(ptr[i])) {
         /* XXX: balancer part */
-        if (strcasecmp(ptr[i], "Balancer") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.balancer)) {
-                *errtype = TYPESYNTAX;
-                return SBALBIG;
-            }
+        case MCMP_BALANCER:
             normalize_balancer_name(ptr[i+1], r->server);
-            strncpy(nodeinfo.mess.balancer, ptr[i+1], sizeof(nodeinfo.mess.balancer));
-            nodeinfo.mess.balancer[sizeof(nodeinfo.mess.balancer) - 1] = '\0';
-            strncpy(balancerinfo.balancer, ptr[i+1], sizeof(balancerinfo.balancer));
-            balancerinfo.balancer[sizeof(balancerinfo.balancer) - 1] = '\0';
-        }
-        if (strcasecmp(ptr[i], "StickySession") == 0) {
+            strcpy(nodeinfo.mess.balancer, ptr[i+1]);
+            strcpy(balancerinfo.balancer, ptr[i+1]);
+            break;
+        case MCMP_STICKYSESSION:
             if (strcasecmp(ptr[i+1], "no") == 0)
                 balancerinfo.StickySession = 0;
-        }
-        if (strcasecmp(ptr[i], "StickySessionCookie") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(balancerinfo.StickySessionCookie)) {
-                *errtype = TYPESYNTAX;
-                return SBAFBIG;
-            }
+            break;
+        case MCMP_STICKYSESSIONCOOKIE:
             strcpy(balancerinfo.StickySessionCookie, ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "StickySessionPath") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(balancerinfo.StickySessionPath)) {
-                *errtype = TYPESYNTAX;
-                return SBAFBIG;
-            }
+            break;
+        case MCMP_STICKYSESSIONPATH:
             strcpy(balancerinfo.StickySessionPath, ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "StickySessionRemove") == 0) {
+            break;
+        case MCMP_STICKYSESSIONREMOVE:
             if (strcasecmp(ptr[i+1], "yes") == 0)
                 balancerinfo.StickySessionRemove = 1;
-        }
+            break;
         /* The java part assumes default = yes and sents only StickySessionForce=No */
-        if (strcasecmp(ptr[i], "StickySessionForce") == 0) {
+        case MCMP_STICKYSESSIONFORCE:
             if (strcasecmp(ptr[i+1], "no") == 0)
                 balancerinfo.StickySessionForce = 0;
-        }
+            break;
         /* Note that it is workerTimeout (set/getWorkerTimeout in java code) */ 
-        if (strcasecmp(ptr[i], "WaitWorker") == 0) {
+        case MCMP_WAITWORKER:
             balancerinfo.Timeout = apr_time_from_sec(atoi(ptr[i+1]));
-        }
-        if (strcasecmp(ptr[i], "Maxattempts") == 0) {
+            break;
+        case MCMP_MAXATTEMPTS:
             balancerinfo.Maxattempts = atoi(ptr[i+1]);
-        }
-
-        /* XXX: Node part */
-        if (strcasecmp(ptr[i], "JVMRoute") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.JVMRoute)) {
+            break;
+        case MCMP_WARMCONNECTIONS:
+            balancerinfo.WarmConnections = atoi(ptr[i+1]);
+            if (balancerinfo.WarmConnections < 0)
+                balancerinfo.WarmConnections = 0;
+            break;
+        case MCMP_SLOWSTART:
+            balancerinfo.SlowStart = atoi(ptr[i+1]);
+            if (balancerinfo.SlowStart < 0)
+                balancerinfo.SlowStart = 0;
+            break;
+        case MCMP_ELECTIONMETHOD:
+            for (balancerinfo.ElectionMethod = 0; balancerinfo.ElectionMethod < ELECTION_COUNT; balancerinfo.ElectionMethod++) {
+                if (strcasecmp(ptr[i+1], election_names[balancerinfo.ElectionMethod]) == 0)
+                    break;
+            }
+            if (balancerinfo.ElectionMethod == ELECTION_COUNT) {
                 *errtype = TYPESYNTAX;
-                return SROUBIG;
+                return SELEBAD;
             }
+            break;
+
+        /* XXX: Node part */
+        case MCMP_JVMROUTE:
             strcpy(nodeinfo.mess.JVMRoute, ptr[i+1]);
-        }
+            break;
         /* We renamed it LBGroup */
-        if (strcasecmp(ptr[i], "Domain") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.Domain)) {
-                *errtype = TYPESYNTAX;
-                return SDOMBIG;
-            }
+        case MCMP_DOMAIN:
             strcpy(nodeinfo.mess.Domain, ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "Host") == 0) {
+            break;
+        case MCMP_HOST: {
             char *p_read = ptr[i+1], *p_write = ptr[i+1];
             int flag = 0;
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.Host)) {
-                *errtype = TYPESYNTAX;
-                return SHOSBIG;
-            }
 
             /* Removes %zone from an address */
             if (*p_read == '[') {
@@ -1088,52 +1630,45 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
             }
 
             strcpy(nodeinfo.mess.Host, ptr[i+1]);
+            break;
         }
-        if (strcasecmp(ptr[i], "Port") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.Port)) {
-                *errtype = TYPESYNTAX;
-                return SPORBIG;
-            }
+        case MCMP_PORT:
             strcpy(nodeinfo.mess.Port, ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "Type") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.Type)) {
-                *errtype = TYPESYNTAX;
-                return STYPBIG;
-            }
+            break;
+        case MCMP_TYPE:
             strcpy(nodeinfo.mess.Type, ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "Reversed") == 0) {
+            break;
+        case MCMP_REVERSED:
             if (strcasecmp(ptr[i+1], "yes") == 0) {
             nodeinfo.mess.reversed = 1;
             }
-        }
-        if (strcasecmp(ptr[i], "flushpackets") == 0) {
+            break;
+        case MCMP_FLUSHPACKETS:
             if (strcasecmp(ptr[i+1], "on") == 0) {
                 nodeinfo.mess.flushpackets = flush_on;
             }
             else if (strcasecmp(ptr[i+1], "auto") == 0) {
                 nodeinfo.mess.flushpackets = flush_auto;
             }
-        }
-        if (strcasecmp(ptr[i], "flushwait") == 0) {
+            break;
+        case MCMP_FLUSHWAIT:
             nodeinfo.mess.flushwait = atoi(ptr[i+1]) * 1000;
-        }
-        if (strcasecmp(ptr[i], "ping") == 0) {
+            break;
+        case MCMP_PING:
             nodeinfo.mess.ping = apr_time_from_sec(atoi(ptr[i+1]));
-        }
-        if (strcasecmp(ptr[i], "smax") == 0) {
+            break;
+        case MCMP_SMAX:
             nodeinfo.mess.smax = atoi(ptr[i+1]);
-        }
-        if (strcasecmp(ptr[i], "ttl") == 0) {
+            break;
+        case MCMP_TTL:
             nodeinfo.mess.ttl = apr_time_from_sec(atoi(ptr[i+1]));
-        }
-        if (strcasecmp(ptr[i], "Timeout") == 0) {
+            break;
+        case MCMP_TIMEOUT:
             nodeinfo.mess.timeout = apr_time_from_sec(atoi(ptr[i+1]));
-        }
+            break;
 
         /* Hosts and contexts (optional paramters) */
-        if (strcasecmp(ptr[i], "Alias") == 0) {
+        case MCMP_ALIAS:
             if (phost->host && !phost->context) {
                 *errtype = TYPESYNTAX;
                 return SALIBAD;
@@ -1147,13 +1682,14 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
             } else {
                phost->host = ptr[i+1];
             }
-        }
-        if (strcasecmp(ptr[i], "Context") == 0) {
+            break;
+        case MCMP_CONTEXT:
             if (phost->context) {
                 *errtype = TYPESYNTAX;
                 return SCONBAD;
             }
             phost->context = ptr[i+1];
+            break;
         }
         i++;
         i++;
@@ -1194,21 +1730,21 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
 
     /* check for removed node */
     loc_lock_nodes();
+    set_nodes_lock_command(r);
     node = read_node(nodestatsmem, &nodeinfo);
     if (node != NULL) {
         /* If the node is removed (or kill and restarted) and recreated unchanged that is ok: network problems */
         if (! is_same_node(node, &nodeinfo)) {
             /* Here we can't update it because the old one is still in */
+            int ident = node->mess.id;
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "process_config: node %s already exist", node->mess.JVMRoute);
-            strcpy(node->mess.JVMRoute, "REMOVED");
-            node->mess.remove = 1;
-            insert_update_node(nodestatsmem, node, &id);
-            loc_remove_host_context(node->mess.id, r->pool);
+            mark_removed_node(nodestatsmem, ident, 1);
+            loc_remove_host_context(ident, r->pool);
             inc_version_node();
             loc_unlock_nodes();
             *errtype = TYPEMEM;
-            return apr_psprintf(r->pool, MNODERM, node->mess.JVMRoute);
+            return apr_psprintf(r->pool, MNODERM, nodeinfo.mess.JVMRoute);
         }
     }
     /* check if a node corresponding to the same worker already exists */
@@ -1268,44 +1804,227 @@ static char * process_config(request_rec *r, char **ptr, int *errtype)
     return NULL;
 }
 /*
- * Process a DUMP command.
+ * Snapshot of the tables for the DUMP / INFO / mod_cluster-manager output:
+ * the used records of each table are copied under the lock of the table so
+ * the renderers read a consistent view. The buffers are sized for the full
+ * tables and go back to a free list of the child after the request, the
+ * memory used doesn't depend on the number of records listed.
  */
-static char * process_dump(request_rec *r, int *errtype)
+typedef struct mcmp_table {
+    char *recs;       /* copies of the used records */
+    int *ids;         /* ids of the copied records */
+    apr_size_t item;  /* size of a record */
+    int max;          /* number of records the buffers can hold */
+    int num;          /* number of records copied */
+} mcmp_table_t;
+#define SNAPSHOT_REC(table, i) ((void *) ((table)->recs + (table)->item * (i)))
+
+typedef struct mcmp_snapshot {
+    mcmp_table_t balancers;
+    mcmp_table_t nodes;
+    mcmp_table_t hosts;
+    mcmp_table_t contexts;
+    nodeinfo_t **sorted;          /* nodes sorted by domain (manager_info()) */
+    nodeinfo_t **byid;            /* nodes by id (manager_metrics()) */
+    int *done;                    /* hosts already displayed (manager_info_hosts()) */
+    struct mcmp_snapshot *next;   /* free list */
+} mcmp_snapshot_t;
+
+static apr_pool_t *snapshot_pool = NULL;
+static apr_thread_mutex_t *snapshot_mutex = NULL;
+static mcmp_snapshot_t *snapshot_free = NULL;
+
+static apr_status_t snapshot_record(void *mem, void **data, int ident, apr_pool_t *pool)
 {
-    int size, i;
-    int *id;
+    mcmp_table_t *table = (mcmp_table_t *) *data;
+    if (table->num >= table->max)
+        return APR_SUCCESS; /* full: stop */
+    memcpy(SNAPSHOT_REC(table, table->num), mem, table->item);
+    table->ids[table->num] = ident;
+    table->num++;
+    return APR_NOTFOUND;
+}
+static void snapshot_table(mem_t *s, mcmp_table_t *table)
+{
+    table->num = 0;
+    if (s == NULL || table->max == 0)
+        return;
+    s->storage->ap_slotmem_lock(s->slotmem);
+    s->storage->ap_slotmem_do(s->slotmem, snapshot_record, &table, s->p);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+}
+static void init_snapshot_table(apr_pool_t *p, mcmp_table_t *table, int max, apr_size_t item)
+{
+    table->item = item;
+    table->max = max;
+    table->num = 0;
+    table->recs = max ? apr_palloc(p, item * max) : NULL;
+    table->ids = max ? apr_palloc(p, sizeof(int) * max) : NULL;
+}
+static apr_status_t release_snapshot(void *data)
+{
+    mcmp_snapshot_t *snapshot = data;
+    apr_thread_mutex_lock(snapshot_mutex);
+    snapshot->next = snapshot_free;
+    snapshot_free = snapshot;
+    apr_thread_mutex_unlock(snapshot_mutex);
+    return APR_SUCCESS;
+}
+/*
+ * Get a snapshot of the balancers, nodes, hosts and contexts tables,
+ * it is returned to the free list when the request is done.
+ */
+static mcmp_snapshot_t *get_snapshot(request_rec *r)
+{
+    mcmp_snapshot_t *snapshot = NULL;
+    apr_pool_t *p = r->pool;
+
+    if (snapshot_mutex) {
+        apr_thread_mutex_lock(snapshot_mutex);
+        if (snapshot_free) {
+            snapshot = snapshot_free;
+            snapshot_free = snapshot->next;
+        }
+        p = snapshot_pool;
+    }
+    if (snapshot == NULL) {
+        snapshot = apr_pcalloc(p, sizeof(mcmp_snapshot_t));
+        init_snapshot_table(p, &snapshot->balancers, loc_get_max_size_balancer(), sizeof(balancerinfo_t));
+        init_snapshot_table(p, &snapshot->nodes, loc_get_max_size_node(), sizeof(nodeinfo_t));
+        init_snapshot_table(p, &snapshot->hosts, loc_get_max_size_host(), sizeof(hostinfo_t));
+        init_snapshot_table(p, &snapshot->contexts, loc_get_max_size_context(), sizeof(contextinfo_t));
+        snapshot->sorted = apr_palloc(p, sizeof(nodeinfo_t *) * (snapshot->nodes.max + 1));
+        snapshot->byid = apr_palloc(p, sizeof(nodeinfo_t *) * (snapshot->nodes.max + 1));
+        snapshot->done = apr_palloc(p, sizeof(int) * (snapshot->hosts.max + 1));
+    }
+    if (snapshot_mutex) {
+        apr_thread_mutex_unlock(snapshot_mutex);
+        apr_pool_cleanup_register(r->pool, snapshot, release_snapshot, apr_pool_cleanup_null);
+    }
+
+    snapshot_table(balancerstatsmem, &snapshot->balancers);
+    snapshot_table(nodestatsmem, &snapshot->nodes);
+    snapshot_table(hoststatsmem, &snapshot->hosts);
+    snapshot_table(contextstatsmem, &snapshot->contexts);
+    return snapshot;
+}
 
+/*
+ * Output of DUMP / INFO: the writes are coalesced in the heap buckets of a
+ * brigade (apr_brigade_printf()) that passes them to the output filters
+ * when they are full, instead of a trip through the filters per item.
+ */
+typedef struct mcmp_out {
+    request_rec *r;
+    apr_bucket_brigade *bb;
     unsigned char type;
+} mcmp_out_t;
+
+static void out_printf(mcmp_out_t *out, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    apr_brigade_vprintf(out->bb, ap_filter_flush, out->r->output_filters, fmt, args);
+    va_end(args);
+}
+static void out_puts(mcmp_out_t *out, const char *str)
+{
+    apr_brigade_puts(out->bb, ap_filter_flush, out->r->output_filters, str);
+}
+/* write a quoted JSON string of at most len characters */
+static void out_json_string(mcmp_out_t *out, const char *str, apr_size_t len)
+{
+    apr_size_t i, start = 0;
+
+    out_puts(out, "\"");
+    for (i = 0; i < len && str[i] != '\0'; i++) {
+        unsigned char c = (unsigned char) str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        if (i > start)
+            apr_brigade_write(out->bb, ap_filter_flush, out->r->output_filters, str + start, i - start);
+        if (c == '"' || c == '\\')
+            out_printf(out, "\\%c", c);
+        else
+            out_printf(out, "\\u%04x", c);
+        start = i + 1;
+    }
+    if (i > start)
+        apr_brigade_write(out->bb, ap_filter_flush, out->r->output_filters, str + start, i - start);
+    out_puts(out, "\"");
+}
+#define OUT_JSON_FIELD(out, name, field) \
+    do { out_puts((out), "\"" name "\":"); out_json_string((out), (field), sizeof(field)); } while (0)
+
+/* select the format from the Accept header */
+static void out_init(mcmp_out_t *out, request_rec *r)
+{
     const char *accept_header = apr_table_get(r->headers_in, "Accept");
 
+    out->r = r;
+    out->bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     if (accept_header && strstr((char *)accept_header, "text/xml") != NULL )  {
         ap_set_content_type(r, "text/xml");
-        type = TEXT_XML;
-        ap_rprintf(r, "<?xml version=\"1.0\" standalone=\"yes\" ?>\n");
+        out->type = TEXT_XML;
+        out_puts(out, "<?xml version=\"1.0\" standalone=\"yes\" ?>\n");
+    } else if (accept_header && strstr((char *)accept_header, "application/json") != NULL )  {
+        ap_set_content_type(r, "application/json");
+        out->type = TEXT_JSON;
     } else {
         ap_set_content_type(r, "text/plain");
-        type = TEXT_PLAIN;
+        out->type = TEXT_PLAIN;
     }
+}
+static void out_done(mcmp_out_t *out)
+{
+    ap_pass_brigade(out->r->output_filters, out->bb);
+    apr_brigade_cleanup(out->bb);
+}
 
-    size = loc_get_max_size_balancer();
-    if (size == 0)
-       return NULL;
+static const char *context_status_string(int status)
+{
+    switch (status) {
+        case ENABLED:
+            return "ENABLED";
+        case DISABLED:
+            return "DISABLED";
+        case STOPPED:
+            return "STOPPED";
+    }
+    return "REMOVED";
+}
 
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "<Dump><Balancers>");
+/*
+ * Process a DUMP command.
+ */
+static char * process_dump(request_rec *r, int *errtype)
+{
+    int i;
+    mcmp_out_t out;
+    mcmp_snapshot_t *snapshot;
+    mcmp_table_t *table;
+
+    out_init(&out, r);
+    if (loc_get_max_size_balancer() == 0) {
+        out_done(&out);
+        return NULL;
     }
+    snapshot = get_snapshot(r);
 
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_balancer(balancerstatsmem, id);
-    for (i=0; i<size; i++) {
-        balancerinfo_t *ou;
-        if (get_balancer(balancerstatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "<Dump><Balancers>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "{\"balancers\":[");
+    }
 
-        switch (type) {
+    table = &snapshot->balancers;
+    for (i=0; i<table->num; i++) {
+        balancerinfo_t *ou = SNAPSHOT_REC(table, i);
+
+        switch (out.type) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Balancer id=\"%d\" name=\"%.*s\">\
+                out_printf(&out, "<Balancer id=\"%d\" name=\"%.*s\">\
                                 <StickySession>\
                                     <Enabled>%d</Enabled>\
                                     <Cookie>%.*s</Cookie>\
@@ -1315,48 +2034,59 @@ static char * process_dump(request_rec *r, int *errtype)
                                 </StickySession>\
                                 <Timeout>%d</Timeout>\
                                 <MaxAttempts>%d</MaxAttempts>\
+                                <WarmConnections>%d</WarmConnections>\
+                                <SlowStart>%d</SlowStart>\
+                                <ElectionMethod>%s</ElectionMethod>\
                                 </Balancer>",
-                           id[i], (int) sizeof(ou->balancer), ou->balancer, ou->StickySession,
+                           table->ids[i], (int) sizeof(ou->balancer), ou->balancer, ou->StickySession,
                            (int) sizeof(ou->StickySessionCookie), ou->StickySessionCookie, (int) sizeof(ou->StickySessionPath), ou->StickySessionPath,
                            ou->StickySessionRemove, ou->StickySessionForce,
                            (int) apr_time_sec(ou->Timeout),
-                           ou->Maxattempts);
+                           ou->Maxattempts, ou->WarmConnections, ou->SlowStart, ELECTION_NAME(ou->ElectionMethod));
                            break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,", i ? "," : "", table->ids[i]);
+                OUT_JSON_FIELD(&out, "name", ou->balancer);
+                out_printf(&out, ",\"stickySession\":{\"enabled\":%d,", ou->StickySession);
+                OUT_JSON_FIELD(&out, "cookie", ou->StickySessionCookie);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "path", ou->StickySessionPath);
+                out_printf(&out, ",\"remove\":%d,\"force\":%d},\"timeout\":%d,\"maxAttempts\":%d,\"warmConnections\":%d,\"slowStart\":%d,\"electionMethod\":\"%s\"}",
+                           ou->StickySessionRemove, ou->StickySessionForce,
+                           (int) apr_time_sec(ou->Timeout),
+                           ou->Maxattempts, ou->WarmConnections, ou->SlowStart, ELECTION_NAME(ou->ElectionMethod));
+                break;
+            }
             case TEXT_PLAIN:
             default: {
 
-                ap_rprintf(r, "balancer: [%d] Name: %.*s Sticky: %d [%.*s]/[%.*s] remove: %d force: %d Timeout: %d maxAttempts: %d\n",
-                           id[i], (int) sizeof(ou->balancer), ou->balancer, ou->StickySession,
+                out_printf(&out, "balancer: [%d] Name: %.*s Sticky: %d [%.*s]/[%.*s] remove: %d force: %d Timeout: %d maxAttempts: %d warmConnections: %d slowStart: %d electionMethod: %s\n",
+                           table->ids[i], (int) sizeof(ou->balancer), ou->balancer, ou->StickySession,
                            (int) sizeof(ou->StickySessionCookie), ou->StickySessionCookie, (int) sizeof(ou->StickySessionPath), ou->StickySessionPath,
                            ou->StickySessionRemove, ou->StickySessionForce,
                            (int) apr_time_sec(ou->Timeout),
-                           ou->Maxattempts);
+                           ou->Maxattempts, ou->WarmConnections, ou->SlowStart, ELECTION_NAME(ou->ElectionMethod));
                 break;
             }
 
         }
     }
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "</Balancers>");
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "</Balancers><Nodes>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "],\"nodes\":[");
     }
 
-    size = loc_get_max_size_node();
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_node(nodestatsmem, id);
-
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "<Nodes>");
-    }
-    for (i=0; i<size; i++) {
-        nodeinfo_t *ou;
-        if (get_node(nodestatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    table = &snapshot->nodes;
+    for (i=0; i<table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
 
-        switch(type) {
+        switch(out.type) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Node id=\"%d\">\
+                out_printf(&out, "<Node id=\"%d\">\
                                     <Balancer>%.*s</Balancer>\
                                     <JVMRoute>%.*s</JVMRoute>\
                                     <LBGroup>%.*s</LBGroup>\
@@ -1381,11 +2111,30 @@ static char * process_dump(request_rec *r, int *errtype)
                            (int) apr_time_sec(ou->mess.ttl), (int) apr_time_sec(ou->mess.timeout));
                 break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,\"nodeId\":%d,", i ? "," : "", table->ids[i], ou->mess.id);
+                OUT_JSON_FIELD(&out, "balancer", ou->mess.balancer);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "jvmRoute", ou->mess.JVMRoute);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "lbGroup", ou->mess.Domain);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "host", ou->mess.Host);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "port", ou->mess.Port);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "type", ou->mess.Type);
+                out_printf(&out, ",\"flushPackets\":%d,\"flushWait\":%d,\"ping\":%d,\"smax\":%d,\"ttl\":%d,\"timeout\":%d}",
+                           ou->mess.flushpackets, ou->mess.flushwait/1000, (int) apr_time_sec(ou->mess.ping), ou->mess.smax,
+                           (int) apr_time_sec(ou->mess.ttl), (int) apr_time_sec(ou->mess.timeout));
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "node: [%d:%d],Balancer: %.*s,JVMRoute: %.*s,LBGroup: [%.*s],Host: %.*s,Port: %.*s,Type: %.*s,flushpackets: %d,flushwait: %d,ping: %d,smax: %d,ttl: %d,timeout: %d\n",
-                           id[i], ou->mess.id,
+                out_printf(&out, "node: [%d:%d],Balancer: %.*s,JVMRoute: %.*s,LBGroup: [%.*s],Host: %.*s,Port: %.*s,Type: %.*s,flushpackets: %d,flushwait: %d,ping: %d,smax: %d,ttl: %d,timeout: %d\n",
+                           table->ids[i], ou->mess.id,
                            (int) sizeof(ou->mess.balancer), ou->mess.balancer,
                            (int) sizeof(ou->mess.JVMRoute), ou->mess.JVMRoute,
                            (int) sizeof(ou->mess.Domain), ou->mess.Domain,
@@ -1400,78 +2149,77 @@ static char * process_dump(request_rec *r, int *errtype)
         }
     }
 
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "</Nodes><Hosts>");
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "</Nodes><Hosts>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "],\"hosts\":[");
     }
 
-    size = loc_get_max_size_host();
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_host(hoststatsmem, id);
-    for (i=0; i<size; i++) {
-        hostinfo_t *ou;
-        if (get_host(hoststatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    table = &snapshot->hosts;
+    for (i=0; i<table->num; i++) {
+        hostinfo_t *ou = SNAPSHOT_REC(table, i);
 
-        switch (type) {
+        switch (out.type) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Host id=\"%d\" alias=\"%.*s\">\
+                out_printf(&out, "<Host id=\"%d\" alias=\"%.*s\">\
                                     <Vhost>%d</Vhost>\
                                     <Node>%d</Node>\
                                 </Host>",
-                 id[i], (int) sizeof(ou->host), ou->host, ou->vhost,ou->node);
+                 table->ids[i], (int) sizeof(ou->host), ou->host, ou->vhost,ou->node);
                  break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,", i ? "," : "", table->ids[i]);
+                OUT_JSON_FIELD(&out, "alias", ou->host);
+                out_printf(&out, ",\"vhost\":%d,\"node\":%d}", ou->vhost, ou->node);
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "host: %d [%.*s] vhost: %d node: %d\n", id[i], (int) sizeof(ou->host), ou->host, ou->vhost,
+                out_printf(&out, "host: %d [%.*s] vhost: %d node: %d\n", table->ids[i], (int) sizeof(ou->host), ou->host, ou->vhost,
                           ou->node);
                 break;
 
             }
         }
     }
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "</Hosts><Contexts>");
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "</Hosts><Contexts>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "],\"contexts\":[");
     }
 
-    size = loc_get_max_size_context();
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_context(contextstatsmem, id);
-    for (i=0; i<size; i++) {
-        contextinfo_t *ou;
-        if (get_context(contextstatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    table = &snapshot->contexts;
+    for (i=0; i<table->num; i++) {
+        contextinfo_t *ou = SNAPSHOT_REC(table, i);
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:
             {
-                char *status;
-                status = "REMOVED";
-                switch (ou->status) {
-                    case ENABLED:
-                        status = "ENABLED";
-                        break;
-                    case DISABLED:
-                        status = "DISABLED";
-                        break;
-                    case STOPPED:
-                        status = "STOPPED";
-                        break;
-                }
-                ap_rprintf(r, "<Context id=\"%d\" path=\"%.*s\">\
+                out_printf(&out, "<Context id=\"%d\" path=\"%.*s\">\
                                 <Vhost>%d</Vhost>\
                                 <Node>%d</Node>\
                                 <Status id=\"%d\">%s</Status>\
                                </Context>",
-                    id[i], (int) sizeof(ou->context), ou->context, ou->vhost, ou->node,ou->status, status);        
+                    table->ids[i], (int) sizeof(ou->context), ou->context, ou->vhost, ou->node,ou->status,
+                    context_status_string(ou->status));
                     break;
                 }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,", i ? "," : "", table->ids[i]);
+                OUT_JSON_FIELD(&out, "path", ou->context);
+                out_printf(&out, ",\"vhost\":%d,\"node\":%d,\"statusId\":%d,\"status\":\"%s\"}",
+                           ou->vhost, ou->node, ou->status, context_status_string(ou->status));
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "context: %d [%.*s] vhost: %d node: %d status: %d\n", id[i],
+                out_printf(&out, "context: %d [%.*s] vhost: %d node: %d status: %d\n", table->ids[i],
                            (int) sizeof(ou->context), ou->context,
                            ou->vhost, ou->node,
                            ou->status);
@@ -1480,9 +2228,12 @@ static char * process_dump(request_rec *r, int *errtype)
         }
     }
 
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "</Contexts></Dump>");
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "</Contexts></Dump>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "]}\n");
     }
+    out_done(&out);
     return NULL;
 }
 /*
@@ -1491,49 +2242,41 @@ static char * process_dump(request_rec *r, int *errtype)
  */
 static char * process_info(request_rec *r, int *errtype)
 {
-    int size, i;
-    int *id;
-
-    unsigned char type;
-    const char *accept_header = apr_table_get(r->headers_in, "Accept");
-
-    if (accept_header && strstr((char *)accept_header, "text/xml") != NULL )  {
-        ap_set_content_type(r, "text/xml");
-        type = TEXT_XML;
-        ap_rprintf(r, "<?xml version=\"1.0\" standalone=\"yes\" ?>\n");
-    } else {
-        ap_set_content_type(r, "text/plain");
-        type = TEXT_PLAIN;
-    }
+    int i;
+    mcmp_out_t out;
+    mcmp_snapshot_t *snapshot;
+    mcmp_table_t *table;
 
-    size = loc_get_max_size_node();
-    if (size == 0)
+    out_init(&out, r);
+    if (loc_get_max_size_node() == 0) {
+        out_done(&out);
         return NULL;
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_node(nodestatsmem, id);
+    }
+    snapshot = get_snapshot(r);
 
-    if ( type == TEXT_XML ) {
-       ap_rprintf(r, "<Info><Nodes>");
+    if ( out.type == TEXT_XML ) {
+       out_puts(&out, "<Info><Nodes>");
+    } else if ( out.type == TEXT_JSON ) {
+       out_puts(&out, "{\"nodes\":[");
     }
 
-    for (i=0; i<size; i++) {
-        nodeinfo_t *ou;
+    table = &snapshot->nodes;
+    for (i=0; i<table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
         proxy_worker_shared *proxystat;
         char *flushpackets;
         char *pptr;
-        if (get_node(nodestatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Node id=\"%d\" name=\"%.*s\">\
+                out_printf(&out, "<Node id=\"%d\" name=\"%.*s\">\
                     <Balancer>%.*s</Balancer>\
                     <LBGroup>%.*s</LBGroup>\
                     <Host>%.*s</Host>\
                     <Port>%.*s</Port>\
                     <Type>%.*s</Type>", 
-                       id[i],
+                       table->ids[i],
                        (int) sizeof(ou->mess.JVMRoute), ou->mess.JVMRoute,
                        (int) sizeof(ou->mess.balancer), ou->mess.balancer,
                        (int) sizeof(ou->mess.Domain), ou->mess.Domain,
@@ -1542,11 +2285,27 @@ static char * process_info(request_rec *r, int *errtype)
                        (int) sizeof(ou->mess.Type), ou->mess.Type);
                 break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,", i ? "," : "", table->ids[i]);
+                OUT_JSON_FIELD(&out, "name", ou->mess.JVMRoute);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "balancer", ou->mess.balancer);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "lbGroup", ou->mess.Domain);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "host", ou->mess.Host);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "port", ou->mess.Port);
+                out_puts(&out, ",");
+                OUT_JSON_FIELD(&out, "type", ou->mess.Type);
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "Node: [%d],Name: %.*s,Balancer: %.*s,LBGroup: %.*s,Host: %.*s,Port: %.*s,Type: %.*s",
-                           id[i],
+                out_printf(&out, "Node: [%d],Name: %.*s,Balancer: %.*s,LBGroup: %.*s,Host: %.*s,Port: %.*s,Type: %.*s",
+                           table->ids[i],
                            (int) sizeof(ou->mess.JVMRoute), ou->mess.JVMRoute,
                            (int) sizeof(ou->mess.balancer), ou->mess.balancer,
                            (int) sizeof(ou->mess.Domain), ou->mess.Domain,
@@ -1566,10 +2325,10 @@ static char * process_info(request_rec *r, int *errtype)
                 flushpackets = "Auto";
         }
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Flushpackets>%s</Flushpackets>\
+                out_printf(&out, "<Flushpackets>%s</Flushpackets>\
                               <Flushwait>%d</Flushwait>\
                               <Ping>%d</Ping>\
                               <Smax>%d</Smax>\
@@ -1580,10 +2339,19 @@ static char * process_info(request_rec *r, int *errtype)
                            (int) apr_time_sec(ou->mess.ttl));
                 break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, ",\"flushPackets\":\"%s\",\"flushWait\":%d,\"ping\":%d,\"smax\":%d,\"ttl\":%d",
+                           flushpackets, ou->mess.flushwait/1000,
+                           (int) apr_time_sec(ou->mess.ping),
+                           ou->mess.smax,
+                           (int) apr_time_sec(ou->mess.ttl));
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, ",Flushpackets: %s,Flushwait: %d,Ping: %d,Smax: %d,Ttl: %d",
+                out_printf(&out, ",Flushpackets: %s,Flushwait: %d,Ping: %d,Smax: %d,Ttl: %d",
                            flushpackets, ou->mess.flushwait/1000,
                            (int) apr_time_sec(ou->mess.ping),
                            ou->mess.smax,
@@ -1596,10 +2364,10 @@ static char * process_info(request_rec *r, int *errtype)
         pptr = pptr + ou->offset;
         proxystat  = (proxy_worker_shared *) pptr;
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:  
             {
-                ap_rprintf(r, "<Elected>%d</Elected>\
+                out_printf(&out, "<Elected>%d</Elected>\
                                 <Read>%d</Read>\
                                 <Transfered>%d</Transfered>\
                                 <Connected>%d</Connected>\
@@ -1609,10 +2377,17 @@ static char * process_info(request_rec *r, int *errtype)
                            (int) proxystat->busy, proxystat->lbfactor);
                 break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, ",\"elected\":%" APR_SIZE_T_FMT ",\"read\":%" APR_OFF_T_FMT ",\"transferred\":%" APR_OFF_T_FMT ",\"connected\":%" APR_SIZE_T_FMT ",\"load\":%d}",
+                           proxystat->elected, proxystat->read, proxystat->transferred,
+                           proxystat->busy, proxystat->lbfactor);
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, ",Elected: %d,Read: %d,Transfered: %d,Connected: %d,Load: %d\n",
+                out_printf(&out, ",Elected: %d,Read: %d,Transfered: %d,Connected: %d,Load: %d\n",
                            (int) proxystat->elected, (int) proxystat->read, (int) proxystat->transferred,
                            (int) proxystat->busy, proxystat->lbfactor);
                 break;
@@ -1621,90 +2396,80 @@ static char * process_info(request_rec *r, int *errtype)
         
     }
 
-    if ( type == TEXT_XML ) {
-        ap_rprintf(r, "</Nodes>");
-    }
-
     /* Process the Vhosts */
-    size = loc_get_max_size_host();
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_host(hoststatsmem, id);
-    if ( type == TEXT_XML ) {
-        ap_rprintf(r, "<Vhosts>");
+    if ( out.type == TEXT_XML ) {
+        out_puts(&out, "</Nodes><Vhosts>");
+    } else if ( out.type == TEXT_JSON ) {
+        out_puts(&out, "],\"vhosts\":[");
     }
-    for (i=0; i<size; i++) {
-        hostinfo_t *ou;
-        if (get_host(hoststatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    table = &snapshot->hosts;
+    for (i=0; i<table->num; i++) {
+        hostinfo_t *ou = SNAPSHOT_REC(table, i);
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Vhost id=\"%d\" alias=\"%.*s\">\
+                out_printf(&out, "<Vhost id=\"%d\" alias=\"%.*s\">\
                                 <Node id=\"%d\"/>\
                                 </Vhost>\
                 ",
                     ou->vhost, (int ) sizeof(ou->host), ou->host, ou->node);
                 break;
             }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,\"vhost\":%d,", i ? "," : "", table->ids[i], ou->vhost);
+                OUT_JSON_FIELD(&out, "alias", ou->host);
+                out_printf(&out, ",\"node\":%d}", ou->node);
+                break;
+            }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "Vhost: [%d:%d:%d], Alias: %.*s\n",
-                           ou->node, ou->vhost, id[i], (int ) sizeof(ou->host), ou->host);
+                out_printf(&out, "Vhost: [%d:%d:%d], Alias: %.*s\n",
+                           ou->node, ou->vhost, table->ids[i], (int ) sizeof(ou->host), ou->host);
                 break;
             }
         }
     }
 
-    if ( type == TEXT_XML ) {
-        ap_rprintf(r, "</Vhosts>");
-    }
-
     /* Process the Contexts */
-    size = loc_get_max_size_context();
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_context(contextstatsmem, id);
-
-    if ( type == TEXT_XML ) {
-        ap_rprintf(r, "<Contexts>");
+    if ( out.type == TEXT_XML ) {
+        out_puts(&out, "</Vhosts><Contexts>");
+    } else if ( out.type == TEXT_JSON ) {
+        out_puts(&out, "],\"contexts\":[");
     }
 
-    for (i=0; i<size; i++) {
-        contextinfo_t *ou;
-        char *status;
-        if (get_context(contextstatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
-        status = "REMOVED";
-        switch (ou->status) {
-            case ENABLED:
-                status = "ENABLED";
-                break;
-            case DISABLED:
-                status = "DISABLED";
-                break;
-            case STOPPED:
-                status = "STOPPED";
-                break;
-        }
+    table = &snapshot->contexts;
+    for (i=0; i<table->num; i++) {
+        contextinfo_t *ou = SNAPSHOT_REC(table, i);
+        const char *status = context_status_string(ou->status);
 
-        switch ( type ) {
+        switch ( out.type ) {
             case TEXT_XML:
             {
-                ap_rprintf(r, "<Context id=\"%d\">\
+                out_printf(&out, "<Context id=\"%d\">\
                                  <Status id=\"%d\">%s</Status>\
                                  <Context>%.*s</Context>\
                                  <Node id=\"%d\"/>\
                                  <Vhost id=\"%d\"/>\
                                 </Context>",
-                                id[i], ou->status, status, (int) sizeof(ou->context), ou->context, ou->node, ou->vhost);
+                                table->ids[i], ou->status, status, (int) sizeof(ou->context), ou->context, ou->node, ou->vhost);
+                break;
+            }
+            case TEXT_JSON:
+            {
+                out_printf(&out, "%s{\"id\":%d,\"statusId\":%d,\"status\":\"%s\",", i ? "," : "",
+                           table->ids[i], ou->status, status);
+                OUT_JSON_FIELD(&out, "context", ou->context);
+                out_printf(&out, ",\"node\":%d,\"vhost\":%d}", ou->node, ou->vhost);
                 break;
             }
             case TEXT_PLAIN:
             default:
             {
-                ap_rprintf(r, "Context: [%d:%d:%d], Context: %.*s, Status: %s\n",
-                           ou->node, ou->vhost, id[i],
+                out_printf(&out, "Context: [%d:%d:%d], Context: %.*s, Status: %s\n",
+                           ou->node, ou->vhost, table->ids[i],
                            (int) sizeof(ou->context), ou->context,
                            status);
                 break;
@@ -1712,12 +2477,143 @@ static char * process_info(request_rec *r, int *errtype)
         }
     }
 
-    if ( type == TEXT_XML ) {
-        ap_rprintf(r, "</Contexts></Info>");
+    if ( out.type == TEXT_XML ) {
+        out_puts(&out, "</Contexts></Info>");
+    } else if ( out.type == TEXT_JSON ) {
+        out_puts(&out, "]}\n");
     }
+    out_done(&out);
     return NULL;
 }
 
+/*
+ * A BATCH request takes the nodes lock once for its commands and changes
+ * the version of the nodes once (see process_batch()).
+ * Its responses are kept in a brigade and written once the nodes are
+ * unlocked: a slow client must not hold the lock of all the processes.
+ */
+struct mcmp_batch {
+    int locked;   /* the nodes are locked */
+    int changed;  /* the version has to be changed */
+    apr_bucket_brigade *bb; /* the responses */
+};
+static struct mcmp_batch *get_batch(request_rec *r)
+{
+    return (struct mcmp_batch *) ap_get_module_config(r->request_config, &manager_module);
+}
+/* write (or keep for the end of the BATCH) a part of the response of a command */
+static void mcmp_printf(request_rec *r, const char *fmt, ...)
+{
+    struct mcmp_batch *batch = get_batch(r);
+    va_list args;
+
+    va_start(args, fmt);
+    if (batch == NULL)
+        ap_vrprintf(r, fmt, args);
+    else
+        apr_brigade_vprintf(batch->bb, NULL, NULL, fmt, args);
+    va_end(args);
+}
+static void mcmp_lock_nodes(request_rec *r)
+{
+    struct mcmp_batch *batch = get_batch(r);
+    if (batch == NULL) {
+        loc_lock_nodes();
+        set_nodes_lock_command(r);
+    } else if (!batch->locked) {
+        loc_lock_nodes();
+        set_nodes_lock_command(r);
+        batch->locked = 1;
+    }
+}
+static void mcmp_unlock_nodes(request_rec *r)
+{
+    if (get_batch(r) == NULL)
+        loc_unlock_nodes();
+}
+static void mcmp_inc_version_node(request_rec *r)
+{
+    struct mcmp_batch *batch = get_batch(r);
+    if (batch == NULL)
+        inc_version_node();
+    else
+        batch->changed = 1;
+}
+/* apply what the batch commands have delayed */
+static void flush_batch(struct mcmp_batch *batch)
+{
+    if (batch->changed)
+        inc_version_node();
+    batch->changed = 0;
+    if (batch->locked)
+        loc_unlock_nodes();
+    batch->locked = 0;
+}
+
+/*
+ * PeerSync: the commands a node sends to this proxy are recorded and sent
+ * to the other proxies in BATCHs (see peer_sync()), the BATCHs of the
+ * peers (with the PEER_HEADER) are not replicated again.
+ * The PEER_HEADER is only trusted from the address of a PeerSync proxy:
+ * the nodes would skip the ping/pong and the replication with it.
+ */
+static int from_peer(request_rec *r)
+{
+    mod_manager_config *mconf;
+    int i;
+
+    if (apr_table_get(r->headers_in, PEER_HEADER) == NULL)
+        return 0;
+    mconf = ap_get_module_config(r->server->module_config, &manager_module);
+    if (mconf->peers == NULL || r->useragent_addr == NULL)
+        return 0;
+    for (i = 0; i < mconf->peers->nelts; i++) {
+        struct manager_peer *peer = &((struct manager_peer *) mconf->peers->elts)[i];
+        apr_sockaddr_t *sa;
+        for (sa = peer->addr; sa; sa = sa->next) {
+            if (apr_sockaddr_equal(sa, r->useragent_addr))
+                return 1;
+        }
+    }
+    return 0;
+}
+/* keep the message (process_buff() decodes it in place) if it is to replicate */
+static char *peer_message(request_rec *r, const char *method, const char *buff)
+{
+    if (peer_changes == NULL || from_peer(r))
+        return NULL;
+    if (strcasecmp(method, "CONFIG") && strcasecmp(method, "ENABLE-APP") && strcasecmp(method, "DISABLE-APP") &&
+        strcasecmp(method, "STOP-APP") && strcasecmp(method, "REMOVE-APP"))
+        return NULL; /* STATUS is replicated with its result by process_status() */
+    return apr_pstrdup(r->pool, buff);
+}
+static void replicate(request_rec *r, const char *method, int global, const char *params)
+{
+    char *line;
+    if (peer_changes == NULL || from_peer(r))
+        return;
+    line = apr_pstrcat(r->pool, method, global ? " * " : " / ", params, NULL);
+    add_mem_peer(peer_changes, line, strlen(line));
+}
+/* %xx encode what process_buff() would take for a separator */
+static const char *peer_escape(apr_pool_t *p, const char *str)
+{
+    char *res, *d;
+    const char *s;
+    if (strpbrk(str, "&=% ") == NULL)
+        return str;
+    res = d = apr_palloc(p, strlen(str) * 3 + 1);
+    for (s = str; *s; s++) {
+        if (*s == '&' || *s == '=' || *s == '%' || *s == ' ') {
+            apr_snprintf(d, 4, "%%%02X", (unsigned char) *s);
+            d += 3;
+        } else
+            *d++ = *s;
+    }
+    *d = '\0';
+    return res;
+}
+
 /* Process a *-APP command that applies to the node NOTE: the node is locked */
 static char * process_node_cmd(request_rec *r, int status, int *errtype, nodeinfo_t *node)
 {
@@ -1766,11 +2662,8 @@ static char * process_node_cmd(request_rec *r, int status, int *errtype, nodeinf
     }
 
     /* The REMOVE-APP * removes the node (well mark it removed) */
-    if (status == REMOVE) {
-        int id;
-        node->mess.remove = 1;
-        insert_update_node(nodestatsmem, node, &id);
-    }
+    if (status == REMOVE)
+        mark_removed_node(nodestatsmem, node->mess.id, 0);
     return NULL;
 
 }
@@ -1795,15 +2688,17 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
     vhost->next = NULL;
 
     while (ptr[i]) {
-        if (strcasecmp(ptr[i], "JVMRoute") == 0) {
+        switch (mcmp_field(ptr[i])) {
+        case MCMP_JVMROUTE:
+            /* the manager page doesn't go through process_buff() */
             if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.JVMRoute)) {
                 *errtype = TYPESYNTAX;
                 return SROUBIG;
             }
             strcpy(nodeinfo.mess.JVMRoute, ptr[i+1]);
             nodeinfo.mess.id = 0;
-        }
-        if (strcasecmp(ptr[i], "Alias") == 0) {
+            break;
+        case MCMP_ALIAS:
             if (vhost->host) {
                 *errtype = TYPESYNTAX;
                 return SMULALB;
@@ -1815,13 +2710,14 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
                 ++p_tmp;
             }
             vhost->host = ptr[i+1];
-        }
-        if (strcasecmp(ptr[i], "Context") == 0) {
+            break;
+        case MCMP_CONTEXT:
             if (vhost->context) {
                 *errtype = TYPESYNTAX;
                 return SMULCTB;
             }
             vhost->context = ptr[i+1];
+            break;
         }
         i++;
         i++;
@@ -1842,10 +2738,10 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
     }
 
     /* Read the node */
-    loc_lock_nodes();
+    mcmp_lock_nodes(r);
     node = read_node(nodestatsmem, &nodeinfo);
     if (node == NULL) {
-        loc_unlock_nodes();
+        mcmp_unlock_nodes(r);
         if (status == REMOVE)
             return NULL; /* Already done */
         *errtype = TYPEMEM;
@@ -1854,7 +2750,7 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
 
     /* If the node is marked removed check what to do */
     if (node->mess.remove) {
-        loc_unlock_nodes();
+        mcmp_unlock_nodes(r);
         if (status == REMOVE)
             return NULL; /* Already done */
         else {
@@ -1863,13 +2759,13 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
             return apr_psprintf(r->pool, MNODERD, node->mess.JVMRoute);
         }
     }
-    inc_version_node();
+    mcmp_inc_version_node(r);
 
     /* Process the * APP commands */
     if (global) {
         char *ret;
         ret = process_node_cmd(r, status, errtype, node);
-        loc_unlock_nodes();
+        mcmp_unlock_nodes(r);
         return ret;
     }
 
@@ -1892,7 +2788,7 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
     if (host == NULL) {
         /* If REMOVE ignores it */
         if (status == REMOVE) {
-            loc_unlock_nodes();
+            mcmp_unlock_nodes(r);
             return NULL;
         } else {
             int vid, size, *id;
@@ -1915,7 +2811,7 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
 
             /* If the Host doesn't exist yet create it */
             if (insert_update_hosts(hoststatsmem, vhost->host, node->mess.id, vid) != APR_SUCCESS) {
-                loc_unlock_nodes();
+                mcmp_unlock_nodes(r);
                 *errtype = TYPEMEM;
                 return apr_psprintf(r->pool, MHOSTUI, nodeinfo.mess.JVMRoute);
             }
@@ -1929,7 +2825,7 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
             }
             host = read_host(hoststatsmem, &hostinfo);
             if (host == NULL) {
-                loc_unlock_nodes();
+                mcmp_unlock_nodes(r);
                 *errtype = TYPEMEM;
                 return apr_psprintf(r->pool, MHOSTRD, node->mess.JVMRoute);
             }
@@ -1962,7 +2858,7 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
 
     /* Now update each context from Context: part */
     if (insert_update_contexts(contextstatsmem, vhost->context, node->mess.id, host->vhost, status) != APR_SUCCESS) {
-        loc_unlock_nodes();
+        mcmp_unlock_nodes(r);
         *errtype = TYPEMEM;
         return apr_psprintf(r->pool, MCONTUI, node->mess.JVMRoute);
     }
@@ -2006,18 +2902,18 @@ static char * process_appl_cmd(request_rec *r, char **ptr, int status, int *errt
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "process_appl_cmd: STOP-APP nbrequests %d", ou->nbrequests);
             if (fromnode) {
                 ap_set_content_type(r, "text/plain");
-                ap_rprintf(r, "Type=STOP-APP-RSP&JvmRoute=%.*s&Alias=%.*s&Context=%.*s&Requests=%d",
+                mcmp_printf(r, "Type=STOP-APP-RSP&JvmRoute=%.*s&Alias=%.*s&Context=%.*s&Requests=%d",
                            (int) sizeof(nodeinfo.mess.JVMRoute), nodeinfo.mess.JVMRoute,
                            (int) sizeof(vhost->host), vhost->host,
                            (int) sizeof(vhost->context), vhost->context,
                            ou->nbrequests);
-                ap_rprintf(r, "\n");
+                mcmp_printf(r, "\n");
             }
         } else {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "process_appl_cmd: STOP-APP can't read_context");
         }
     } 
-    loc_unlock_nodes();
+    mcmp_unlock_nodes(r);
     return NULL;
 }
 static char * process_enable(request_rec *r, char **ptr, int *errtype, int global)
@@ -2068,6 +2964,7 @@ static int ishost_up(request_rec *r, char *scheme, char *host, char *port)
 static char * process_status(request_rec *r, char **ptr, int *errtype)
 {
     int Load = -1;
+    int up;
     nodeinfo_t nodeinfo;
     nodeinfo_t *node;
 
@@ -2075,18 +2972,15 @@ static char * process_status(request_rec *r, char **ptr, int *errtype)
 
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "Processing STATUS");
     while (ptr[i]) {
-        if (strcasecmp(ptr[i], "JVMRoute") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.JVMRoute)) {
-                *errtype = TYPESYNTAX;
-                return SROUBIG;
-            }
+        switch (mcmp_field(ptr[i])) {
+        case MCMP_JVMROUTE:
             strcpy(nodeinfo.mess.JVMRoute, ptr[i+1]);
             nodeinfo.mess.id = 0;
-        }
-        else if (strcasecmp(ptr[i], "Load") == 0) {
+            break;
+        case MCMP_LOAD:
             Load = atoi(ptr[i+1]);
-        }
-        else {
+            break;
+        default:
             *errtype = TYPESYNTAX;
             return apr_psprintf(r->pool, SBADFLD, ptr[i]);
         }
@@ -2106,15 +3000,26 @@ static char * process_status(request_rec *r, char **ptr, int *errtype)
      * and update the worker status and load factor acccording to the test result.
      */
     ap_set_content_type(r, "text/plain");
-    ap_rprintf(r, "Type=STATUS-RSP&JVMRoute=%.*s", (int) sizeof(nodeinfo.mess.JVMRoute), nodeinfo.mess.JVMRoute);
+    mcmp_printf(r, "Type=STATUS-RSP&JVMRoute=%.*s", (int) sizeof(nodeinfo.mess.JVMRoute), nodeinfo.mess.JVMRoute);
 
-    if (isnode_up(r, node->mess.id, Load) != OK)
-        ap_rprintf(r, "&State=NOTOK");
+    if (from_peer(r)) {
+        /* the peer has done the ping/pong */
+        if (balancerhandler != NULL)
+            up = balancerhandler->proxy_node_setload(r, node->mess.id, Load);
+        else
+            up = OK;
+    } else {
+        up = isnode_up(r, node->mess.id, Load);
+        replicate(r, "STATUS", 0, apr_psprintf(r->pool, "JVMRoute=%s&Load=%d",
+                                               peer_escape(r->pool, nodeinfo.mess.JVMRoute), up == OK ? Load : -1));
+    }
+    if (up != OK)
+        mcmp_printf(r, "&State=NOTOK");
     else
-        ap_rprintf(r, "&State=OK");
-    ap_rprintf(r, "&id=%d", (int) ap_scoreboard_image->global->restart_time);
+        mcmp_printf(r, "&State=OK");
+    mcmp_printf(r, "&id=%d", (int) ap_scoreboard_image->global->restart_time);
 
-    ap_rprintf(r, "\n");
+    mcmp_printf(r, "\n");
     return NULL;
 }
 
@@ -2128,14 +3033,106 @@ static char * process_version(request_rec *r, char **ptr, int *errtype)
     if (accept_header && strstr((char *)accept_header, "text/xml") != NULL )  {
         ap_set_content_type(r, "text/xml");
         ap_rprintf(r, "<?xml version=\"1.0\" standalone=\"yes\" ?>\n");
-        ap_rprintf(r, "<version><release>%s</release><protocol>%s</protocol></version>", MOD_CLUSTER_EXPOSED_VERSION, VERSION_PROTOCOL);
+        ap_rprintf(r, "<version><release>%s</release><protocol>%s</protocol><batch>%d</batch></version>",
+                   MOD_CLUSTER_EXPOSED_VERSION, VERSION_PROTOCOL, BATCH_MAX_ITEMS);
     } else {
         ap_set_content_type(r, "text/plain");
-        ap_rprintf(r, "release: %s, protocol: %s", MOD_CLUSTER_EXPOSED_VERSION, VERSION_PROTOCOL);
+        ap_rprintf(r, "release: %s, protocol: %s, batch: %d", MOD_CLUSTER_EXPOSED_VERSION, VERSION_PROTOCOL, BATCH_MAX_ITEMS);
     }
     ap_rprintf(r, "\n");
     return NULL;
 }
+/*
+ * Process the BATCH command (advertised by VERSION).
+ * Each line of the message is a command: "METHOD PATH PARAMETERS"
+ * where PATH is "/" or "*" (like the URL of the command).
+ * The CONFIG, STATUS and *-APP commands are supported, the *-APP commands are
+ * processed with the nodes locked once and the version of the nodes is
+ * changed once (the STATUS commands do ping/pong so they release the lock,
+ * CONFIG takes it itself).
+ * The response of each command (if any) is followed by a line (they are
+ * sent once the commands are done, see mcmp_printf()):
+ * Type=BATCH-RSP&Item=n&Command=METHOD&State=OK
+ * or Type=BATCH-RSP&Item=n&Command=METHOD&State=ERROR&ErrType=SYNTAX|MEM&Mess=...
+ */
+static void process_batch(request_rec *r, char *buff)
+{
+    struct mcmp_batch batch;
+    char *line;
+    char *last;
+    int item = 0;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    ap_set_module_config(r->request_config, &manager_module, &batch);
+    ap_set_content_type(r, "text/plain");
+
+    for (line = apr_strtok(buff, "\r\n", &last); line; line = apr_strtok(NULL, "\r\n", &last)) {
+        char *method;
+        char *path;
+        char *params;
+        char *tok;
+        char **ptr;
+        char *errstring = NULL;
+        char *raw = NULL;
+        int itemerrtype = TYPESYNTAX;
+        int global;
+
+        method = apr_strtok(line, " ", &tok);
+        if (method == NULL)
+            continue; /* empty line */
+        item++;
+        if (item > BATCH_MAX_ITEMS) {
+            mcmp_printf(r, "Type=BATCH-RSP&Item=%d&Command=%s&State=ERROR&ErrType=SYNTAX&Mess=%s\n",
+                        item, method, SBATBIG);
+            break;
+        }
+        path = apr_strtok(NULL, " ", &tok);
+        params = apr_strtok(NULL, "", &tok);
+        global = (path && (strcmp(path, "*") == 0 || strcmp(path, "/*") == 0));
+
+        if (params != NULL)
+            raw = peer_message(r, method, params);
+        if (params == NULL || *params == '\0')
+            errstring = SMISFLD;
+        else if ((ptr = process_buff(r, params, &errstring)) == NULL)
+            ;
+        else if (strcasecmp(method, "CONFIG") == 0) {
+            flush_batch(&batch);
+            errstring = process_config(r, ptr, &itemerrtype);
+        } else if (strcasecmp(method, "ENABLE-APP") == 0)
+            errstring = process_enable(r, ptr, &itemerrtype, global);
+        else if (strcasecmp(method, "DISABLE-APP") == 0)
+            errstring = process_disable(r, ptr, &itemerrtype, global);
+        else if (strcasecmp(method, "STOP-APP") == 0)
+            errstring = process_stop(r, ptr, &itemerrtype, global, 1);
+        else if (strcasecmp(method, "REMOVE-APP") == 0)
+            errstring = process_remove(r, ptr, &itemerrtype, global);
+        else if (strcasecmp(method, "STATUS") == 0) {
+            flush_batch(&batch);
+            errstring = process_status(r, ptr, &itemerrtype);
+        } else
+            errstring = apr_psprintf(r->pool, SBATCMD, method);
+
+        if (errstring) {
+            ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r->server,
+                         "manager_handler BATCH %s (item %d) error: %s", method, item, errstring);
+            mcmp_printf(r, "Type=BATCH-RSP&Item=%d&Command=%s&State=ERROR&ErrType=%s&Mess=%s\n",
+                        item, method, itemerrtype == TYPEMEM ? "MEM" : "SYNTAX", errstring);
+        } else {
+            if (raw)
+                replicate(r, method, global, raw);
+            mcmp_printf(r, "Type=BATCH-RSP&Item=%d&Command=%s&State=OK\n", item, method);
+        }
+    }
+
+    flush_batch(&batch);
+    ap_set_module_config(r->request_config, &manager_module, NULL);
+    /* the nodes are unlocked now */
+    ap_pass_brigade(r->output_filters, batch.bb);
+    apr_brigade_cleanup(batch.bb);
+}
+
 /*
  * Process the PING command
  * With a JVMRoute does a cping/cpong in the node.
@@ -2156,21 +3153,22 @@ static char * process_ping(request_rec *r, char **ptr, int *errtype)
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "Processing PING");
     nodeinfo.mess.id = -1;
     while (ptr[i] && ptr[i][0] != '\0') {
-        if (strcasecmp(ptr[i], "JVMRoute") == 0) {
-            if (strlen(ptr[i+1])>=sizeof(nodeinfo.mess.JVMRoute)) {
-                *errtype = TYPESYNTAX;
-                return SROUBIG;
-            }
+        /* the values live in the request buffer, no need to copy them */
+        switch (mcmp_field(ptr[i])) {
+        case MCMP_JVMROUTE:
             strcpy(nodeinfo.mess.JVMRoute, ptr[i+1]);
             nodeinfo.mess.id = 0;
-        }
-        else if (strcasecmp(ptr[i], "Scheme") == 0)
-            scheme = apr_pstrdup(r->pool, ptr[i+1]);
-        else if (strcasecmp(ptr[i], "Host") == 0)
-            host = apr_pstrdup(r->pool, ptr[i+1]);
-        else if (strcasecmp(ptr[i], "Port") == 0)
-            port = apr_pstrdup(r->pool, ptr[i+1]);
-        else {
+            break;
+        case MCMP_SCHEME:
+            scheme = ptr[i+1];
+            break;
+        case MCMP_HOST:
+            host = ptr[i+1];
+            break;
+        case MCMP_PORT:
+            port = ptr[i+1];
+            break;
+        default:
             *errtype = TYPESYNTAX;
             return apr_psprintf(r->pool, SBADFLD, ptr[i]);
         }
@@ -2283,42 +3281,6 @@ static int mod_manager_hex2c(const char *x)
 #endif /*APR_CHARSET_EBCDIC*/
 }
 
-/* Processing of decoded characters */
-static apr_status_t decodeenc(char **ptr)
-{
-    int val, i, j;
-    char ch;
-    val = 0;
-    while (NULL != ptr[val]) {
-        if (ptr[val][0] == '\0') {
-            return APR_SUCCESS;   /* special case for no characters */
-        }
-        for (i = 0, j = 0; ptr[val][i] != '\0'; i++, j++) {
-            /* decode it if not already done */
-            ch = ptr[val][i];
-            if (ch == '%' && apr_isxdigit(ptr[val][i + 1]) && apr_isxdigit(ptr[val][i + 2])) {
-                ch = (char) mod_manager_hex2c(&(ptr[val][i + 1]));
-                i += 2;
-            }
-
-            /* process decoded, = and & are legit characters */
-            /* from apr_escape_entity() */
-            if (ch == '<' || ch == '>' || ch == '\"' || ch == '\'') {
-                return TYPESYNTAX;
-            }
-            /* from apr_escape_shell() */
-            if (ch == '\r' || ch == '\n') {
-                return TYPESYNTAX;
-            }
-
-            ptr[val][j] = ch;
-        }
-        ptr[val][j] = '\0';
-        val++;
-    }
-    return APR_SUCCESS;
-}
-
 /* Check that the method is one of ours */
 static int check_method(request_rec *r)
 {
@@ -2351,6 +3313,8 @@ static int check_method(request_rec *r)
         ours = 1;
     else if (strcasecmp(r->method, "VERSION") == 0)
         ours = 1;
+    else if (strcasecmp(r->method, "BATCH") == 0)
+        ours = 1;
     return ours;
 }
 /*
@@ -2373,6 +3337,12 @@ static int manager_trans(request_rec *r)
         r->filename = apr_pstrdup(r->pool, r->uri);
         return OK;
     }
+    if (conf && conf->handler && r->method_number == M_GET &&
+        strcmp(conf->handler, "cluster-metrics") == 0) {
+        r->handler = "cluster-metrics";
+        r->filename = apr_pstrdup(r->pool, r->uri);
+        return OK;
+    }
     if (r->method_number != M_INVALID)
         return DECLINED;
     if (!mconf->enable_mcpm_receive)
@@ -2464,62 +3434,42 @@ static void domain_command_string(request_rec *r, char *Domain)
 /*
  * Process the parameters and display corresponding informations.
  */
-static void manager_info_contexts(request_rec *r, int reduce_display, int allow_cmd, int node, int host, char *Alias, char *JVMRoute)
+static void manager_info_contexts(request_rec *r, mcmp_snapshot_t *snapshot, int reduce_display, int allow_cmd, int node, int host, char *Alias, char *JVMRoute)
 {
-    int size, i;
-    int *id;
+    int i;
+    mcmp_table_t *table = &snapshot->contexts;
     /* Process the Contexts */
     if (!reduce_display)
         ap_rprintf(r, "<h3>Contexts:</h3>");
     ap_rprintf(r, "<pre>");
-    size = loc_get_max_size_context();
-    if (size == 0)
+    if (table->max == 0)
         return;
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_context(contextstatsmem, id);
-    for (i=0; i<size; i++) {
-        contextinfo_t *ou;
-        char *status;
-        if (get_context(contextstatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+    for (i=0; i<table->num; i++) {
+        contextinfo_t *ou = SNAPSHOT_REC(table, i);
         if (ou->node != node || ou->vhost != host)
             continue;
-        status = "REMOVED";
-        switch (ou->status) {
-            case ENABLED:
-                status = "ENABLED";
-                break;
-            case DISABLED:
-                status = "DISABLED";
-                break;
-            case STOPPED:
-                status = "STOPPED";
-                break;
-        }
-        ap_rprintf(r, "%.*s, Status: %s Request: %d ", (int) sizeof(ou->context), ou->context, status, ou->nbrequests);
+        ap_rprintf(r, "%.*s, Status: %s Request: %d ", (int) sizeof(ou->context), ou->context,
+                   context_status_string(ou->status), ou->nbrequests);
         if (allow_cmd)
             context_command_string(r, ou, Alias, JVMRoute);
         ap_rprintf(r, "\n");
     }
     ap_rprintf(r, "</pre>");
 }
-static void manager_info_hosts(request_rec *r, int reduce_display, int allow_cmd, int node, char *JVMRoute)
+static void manager_info_hosts(request_rec *r, mcmp_snapshot_t *snapshot, int reduce_display, int allow_cmd, int node, char *JVMRoute)
 {
     int size, i, j;
-    int *id, *idChecker;
+    int *idChecker = snapshot->done;
     int vhost = 0;
+    mcmp_table_t *table = &snapshot->hosts;
 
     /* Process the Vhosts */
-    size = loc_get_max_size_host();
-    if (size == 0)
+    if (table->max == 0)
         return;
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_host(hoststatsmem, id);
-    idChecker = apr_pcalloc(r->pool, sizeof(int) * size);
+    size = table->num;
+    memset(idChecker, 0, sizeof(int) * size);
     for (i=0; i<size; i++) {
-        hostinfo_t *ou;
-        if (get_host(hoststatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
+        hostinfo_t *ou = SNAPSHOT_REC(table, i);
         if (ou->node != node)
             continue;
         if (ou->vhost != vhost) {
@@ -2530,7 +3480,7 @@ static void manager_info_hosts(request_rec *r, int reduce_display, int allow_cmd
                 ap_rprintf(r, "</pre>");
             if (!reduce_display)
                 ap_rprintf(r, "<h2> Virtual Host %d:</h2>", ou->vhost);
-            manager_info_contexts(r, reduce_display, allow_cmd, ou->node, ou->vhost, ou->host, JVMRoute);
+            manager_info_contexts(r, snapshot, reduce_display, allow_cmd, ou->node, ou->vhost, ou->host, JVMRoute);
             if (reduce_display)
                 ap_rprintf(r, "Aliases: ");
             else {
@@ -2546,9 +3496,7 @@ static void manager_info_hosts(request_rec *r, int reduce_display, int allow_cmd
             
             /* Go ahead and check for any other later alias entries for this vhost and print them now */
             for (j=i+1; j<size; j++) {
-                hostinfo_t *pv;
-                if (get_host(hoststatsmem, &pv, id[j]) != APR_SUCCESS)
-                    continue;
+                hostinfo_t *pv = SNAPSHOT_REC(table, j);
                 if (pv->node != node)
                     continue;
                 if (pv->vhost != vhost)
@@ -2666,24 +3614,21 @@ static void process_error(request_rec *r, char *errstring, int errtype)
     ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_WARNING, 0, r->server,
             "manager_handler %s error: %s", r->method, errstring);
 }
-static void sort_nodes(nodeinfo_t *nodes, int nbnodes)
+/* order by domain, equal domains keep the order of the table */
+static int compare_nodes_domain(const void *a, const void *b)
+{
+    const nodeinfo_t *n1 = *(nodeinfo_t * const *) a;
+    const nodeinfo_t *n2 = *(nodeinfo_t * const *) b;
+    int rv = strncmp(n1->mess.Domain, n2->mess.Domain, sizeof(n1->mess.Domain));
+    if (rv)
+        return rv;
+    return (n1 < n2) ? -1 : (n1 > n2);
+}
+static void sort_nodes(nodeinfo_t **nodes, int nbnodes)
 {
-    int i;
-    int changed = -1;
     if (nbnodes <=1)
         return;
-    while(changed) {
-        changed = 0;
-        for (i=0; i<nbnodes-1; i++) {
-            if (strcmp(nodes[i].mess.Domain, nodes[i+1].mess.Domain)> 0) {
-                nodeinfo_t node;
-                node = nodes[i+1];
-                nodes[i+1] = nodes[i];
-                nodes[i] = node;
-                changed = -1;
-            }
-        }
-    }
+    qsort(nodes, nbnodes, sizeof(nodeinfo_t *), compare_nodes_domain);
 }
 static char *process_domain(request_rec *r, char **ptr, int *errtype, const char *cmd, const char *domain)
 {
@@ -2766,15 +3711,255 @@ static void modules_info(request_rec *r)
         ap_rputs("mod_advertise.c: not loaded<br/>", r);
 
 }
+/*
+ * cluster-metrics handler: the counters of the nodes and the latency
+ * histograms in the Prometheus text format (OpenMetrics if accepted).
+ */
+static const char *lock_command_names[CLUSTER_LOCK_COMMANDS] = {
+    "other", "CONFIG", "ENABLE-APP", "DISABLE-APP", "STOP-APP", "REMOVE-APP", "BATCH"
+};
+
+/* escape a label value in dst (2 * len + 1 bytes) */
+static char *label_escape(char *dst, const char *src, apr_size_t len)
+{
+    char *ptr = dst;
+    apr_size_t i;
+    for (i = 0; i < len && src[i] != '\0'; i++) {
+        if (src[i] == '\\' || src[i] == '"') {
+            *ptr++ = '\\';
+            *ptr++ = src[i];
+        } else if (src[i] == '\n') {
+            *ptr++ = '\\';
+            *ptr++ = 'n';
+        } else
+            *ptr++ = src[i];
+    }
+    *ptr = '\0';
+    return dst;
+}
+/* counters have the _total suffix in the Prometheus family name, not in the OpenMetrics one */
+static void out_family(mcmp_out_t *out, const char *name, const char *type, const char *help)
+{
+    const char *suffix = "";
+    if (out->type != TEXT_OPENMETRICS && strcmp(type, "counter") == 0)
+        suffix = "_total";
+    out_printf(out, "# HELP mod_cluster_%s%s %s\n# TYPE mod_cluster_%s%s %s\n",
+               name, suffix, help, name, suffix, type);
+}
+static void out_hist(mcmp_out_t *out, const char *name, const char *labels, cluster_hist_t *hist)
+{
+    static const char *le[CLUSTER_HIST_BUCKETS] = CLUSTER_HIST_LABELS;
+    const char *sep = *labels ? "," : "";
+    apr_uint64_t count = 0, sum;
+    int i;
+
+    for (i = 0; i < CLUSTER_HIST_BUCKETS; i++) {
+        count += hist->buckets[i];
+        out_printf(out, "mod_cluster_%s_bucket{%s%sle=\"%s\"} %" APR_UINT64_T_FMT "\n",
+                   name, labels, sep, le[i], count);
+    }
+    count += hist->buckets[CLUSTER_HIST_BUCKETS];
+    sum = hist->sum;
+    out_printf(out, "mod_cluster_%s_bucket{%s%sle=\"+Inf\"} %" APR_UINT64_T_FMT "\n",
+               name, labels, sep, count);
+    out_printf(out, "mod_cluster_%s_sum{%s} %" APR_UINT64_T_FMT ".%06" APR_UINT64_T_FMT "\n",
+               name, labels, sum / APR_USEC_PER_SEC, sum % APR_USEC_PER_SEC);
+    out_printf(out, "mod_cluster_%s_count{%s} %" APR_UINT64_T_FMT "\n", name, labels, count);
+}
+static void add_hist(cluster_hist_t *to, cluster_hist_t *from)
+{
+    int i;
+    for (i = 0; i <= CLUSTER_HIST_BUCKETS; i++)
+        to->buckets[i] += from->buckets[i];
+    to->sum += from->sum;
+}
+
+static int manager_metrics(request_rec *r)
+{
+    const char *accept_header = apr_table_get(r->headers_in, "Accept");
+    mcmp_out_t out;
+    mcmp_snapshot_t *snapshot;
+    mcmp_table_t *table;
+    char route[JVMROUTESZ * 2 + 1];
+    char balancer[BALANCERSZ * 2 + 1];
+    char context[CONTEXTSZ * 2 + 1];
+    char labels[sizeof(route) + sizeof(balancer) + sizeof(context) + 64];
+    int i, j;
+
+    out.r = r;
+    out.bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    if (accept_header && strstr(accept_header, "application/openmetrics-text") != NULL) {
+        ap_set_content_type(r, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+        out.type = TEXT_OPENMETRICS;
+    } else {
+        ap_set_content_type(r, "text/plain; version=0.0.4; charset=utf-8");
+        out.type = TEXT_PLAIN;
+    }
+    if (r->header_only)
+        return OK;
+
+    snapshot = get_snapshot(r);
+    memset(snapshot->byid, 0, sizeof(nodeinfo_t *) * (snapshot->nodes.max + 1));
+    for (i = 0; i < snapshot->nodes.num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(&snapshot->nodes, i);
+        if (ou->mess.id > 0 && ou->mess.id <= snapshot->nodes.max)
+            snapshot->byid[ou->mess.id] = ou;
+    }
+
+    /* the counters of mod_proxy for the nodes */
+    table = &snapshot->nodes;
+    out_family(&out, "node_elected", "counter", "Requests sent to the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        proxy_worker_shared *proxystat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+        out_printf(&out, "mod_cluster_node_elected_total{node=\"%s\",balancer=\"%s\"} %" APR_SIZE_T_FMT "\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   proxystat->elected);
+    }
+    out_family(&out, "node_read_bytes", "counter", "Bytes read from the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        proxy_worker_shared *proxystat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+        out_printf(&out, "mod_cluster_node_read_bytes_total{node=\"%s\",balancer=\"%s\"} %" APR_OFF_T_FMT "\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   proxystat->read);
+    }
+    out_family(&out, "node_transferred_bytes", "counter", "Bytes sent to the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        proxy_worker_shared *proxystat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+        out_printf(&out, "mod_cluster_node_transferred_bytes_total{node=\"%s\",balancer=\"%s\"} %" APR_OFF_T_FMT "\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   proxystat->transferred);
+    }
+    out_family(&out, "node_busy", "gauge", "Requests being processed by the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        proxy_worker_shared *proxystat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+        out_printf(&out, "mod_cluster_node_busy{node=\"%s\",balancer=\"%s\"} %" APR_SIZE_T_FMT "\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   proxystat->busy);
+    }
+    out_family(&out, "node_load", "gauge", "Load factor of the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        proxy_worker_shared *proxystat = (proxy_worker_shared *) ((char *) ou + ou->offset);
+        out_printf(&out, "mod_cluster_node_load{node=\"%s\",balancer=\"%s\"} %d\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   proxystat->lbfactor);
+    }
+    /* the averages kept by mod_proxy_cluster for ElectionMethod latency */
+    out_family(&out, "node_latency_seconds", "gauge", "Moving average of the response time of the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        node_hot_t *hot = loc_get_node_hot(ou->mess.id);
+        out_printf(&out, "mod_cluster_node_latency_seconds{node=\"%s\",balancer=\"%s\"} %.6f\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   hot ? hot->s.rt / 1000000.0 : 0.0);
+    }
+    out_family(&out, "node_error_ratio", "gauge", "Moving average of the error rate of the node.");
+    for (i = 0; i < table->num; i++) {
+        nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+        node_hot_t *hot = loc_get_node_hot(ou->mess.id);
+        out_printf(&out, "mod_cluster_node_error_ratio{node=\"%s\",balancer=\"%s\"} %.4f\n",
+                   label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                   label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)),
+                   hot ? (double) hot->s.errors / NODE_HOT_ERRORS_ALL : 0.0);
+    }
+    table = &snapshot->contexts;
+    out_family(&out, "context_requests", "gauge", "Requests being processed by the context.");
+    for (i = 0; i < table->num; i++) {
+        contextinfo_t *ou = SNAPSHOT_REC(table, i);
+        nodeinfo_t *node = (ou->node > 0 && ou->node <= snapshot->nodes.max) ? snapshot->byid[ou->node] : NULL;
+        if (node == NULL)
+            continue;
+        out_printf(&out, "mod_cluster_context_requests{context=\"%s\",node=\"%s\",vhost=\"%d\"} %d\n",
+                   label_escape(context, ou->context, sizeof(ou->context)),
+                   label_escape(route, node->mess.JVMRoute, sizeof(node->mess.JVMRoute)),
+                   ou->vhost, ou->nbrequests);
+    }
+
+    if (metrics) {
+        /* the response time of the nodes, balancers (sum of their nodes) and contexts */
+        table = &snapshot->nodes;
+        out_family(&out, "node_response_seconds", "histogram", "Response time of the node.");
+        for (i = 0; i < table->num; i++) {
+            nodeinfo_t *ou = SNAPSHOT_REC(table, i);
+            cluster_hist_t *hist = cluster_metrics_node(metrics, ou->mess.id);
+            if (hist == NULL)
+                continue;
+            apr_snprintf(labels, sizeof(labels), "node=\"%s\",balancer=\"%s\"",
+                         label_escape(route, ou->mess.JVMRoute, sizeof(ou->mess.JVMRoute)),
+                         label_escape(balancer, ou->mess.balancer, sizeof(ou->mess.balancer)));
+            out_hist(&out, "node_response_seconds", labels, hist);
+        }
+        table = &snapshot->balancers;
+        out_family(&out, "balancer_response_seconds", "histogram", "Response time of the nodes of the balancer.");
+        for (i = 0; i < table->num; i++) {
+            balancerinfo_t *ou = SNAPSHOT_REC(table, i);
+            cluster_hist_t hist;
+            memset(&hist, 0, sizeof(hist));
+            for (j = 0; j < snapshot->nodes.num; j++) {
+                nodeinfo_t *node = SNAPSHOT_REC(&snapshot->nodes, j);
+                cluster_hist_t *nhist = cluster_metrics_node(metrics, node->mess.id);
+                if (nhist && strncmp(node->mess.balancer, ou->balancer, sizeof(ou->balancer)) == 0)
+                    add_hist(&hist, nhist);
+            }
+            apr_snprintf(labels, sizeof(labels), "balancer=\"%s\"",
+                         label_escape(balancer, ou->balancer, sizeof(ou->balancer)));
+            out_hist(&out, "balancer_response_seconds", labels, &hist);
+        }
+        table = &snapshot->contexts;
+        out_family(&out, "context_response_seconds", "histogram", "Response time of the context.");
+        for (i = 0; i < table->num; i++) {
+            contextinfo_t *ou = SNAPSHOT_REC(table, i);
+            cluster_hist_t *hist = cluster_metrics_context(metrics, table->ids[i]);
+            nodeinfo_t *node = (ou->node > 0 && ou->node <= snapshot->nodes.max) ? snapshot->byid[ou->node] : NULL;
+            if (hist == NULL || node == NULL)
+                continue;
+            apr_snprintf(labels, sizeof(labels), "context=\"%s\",node=\"%s\",vhost=\"%d\"",
+                         label_escape(context, ou->context, sizeof(ou->context)),
+                         label_escape(route, node->mess.JVMRoute, sizeof(node->mess.JVMRoute)),
+                         ou->vhost);
+            out_hist(&out, "context_response_seconds", labels, hist);
+        }
+
+        /* the internal timings */
+        out_family(&out, "election_seconds", "histogram", "Time to elect a worker.");
+        out_hist(&out, "election_seconds", "", &metrics->election);
+        out_family(&out, "sweep_seconds", "histogram", "Duration of the watchdog runs.");
+        out_hist(&out, "sweep_seconds", "", &metrics->sweep);
+        out_family(&out, "cping_seconds", "histogram", "CPING/CPONG round trip time.");
+        out_hist(&out, "cping_seconds", "", &metrics->cping);
+        out_family(&out, "lock_hold_seconds", "histogram", "Time the nodes lock is held by the MCMP commands.");
+        for (i = 0; i < CLUSTER_LOCK_COMMANDS; i++) {
+            apr_snprintf(labels, sizeof(labels), "command=\"%s\"", lock_command_names[i]);
+            out_hist(&out, "lock_hold_seconds", labels, &metrics->lock[i]);
+        }
+        out_family(&out, "lock_wait_seconds", "histogram", "Time waiting for the nodes lock.");
+        out_hist(&out, "lock_wait_seconds", "", &metrics->lock_wait);
+    }
+
+    if (out.type == TEXT_OPENMETRICS)
+        out_puts(&out, "# EOF\n");
+    out_done(&out);
+    return OK;
+}
+
 /* Process INFO message and mod_cluster_manager pages generation */
 static int manager_info(request_rec *r)
 {
-    int size, i, sizesessionid;
-    int *id;
+    int i, sizesessionid;
     apr_table_t *params = apr_table_make(r->pool, 10);
     int access_status;
     const char *name;
-    nodeinfo_t *nodes;
+    mcmp_snapshot_t *snapshot;
     int nbnodes = 0;
     char *domain = "";
     char *errstring = NULL;
@@ -2924,28 +4109,20 @@ static int manager_info(request_rec *r)
 
     sizesessionid = loc_get_max_size_sessionid();
 
-    size = loc_get_max_size_node();
-    if (size == 0)
+    if (loc_get_max_size_node() == 0)
         return OK;
-    id = apr_palloc(r->pool, sizeof(int) * size);
-    size = get_ids_used_node(nodestatsmem, id);
-
 
-    /* read the node to sort them by domain */
-    nodes = apr_palloc(r->pool, sizeof(nodeinfo_t) * size);
-    for (i=0; i<size; i++) {
-        nodeinfo_t *ou;
-        if (get_node(nodestatsmem, &ou, id[i]) != APR_SUCCESS)
-            continue;
-        memcpy(&nodes[nbnodes],ou, sizeof(nodeinfo_t));
-        nbnodes++;
-    }
-    sort_nodes(nodes, nbnodes);
+    /* sort the nodes of the snapshot by domain */
+    snapshot = get_snapshot(r);
+    nbnodes = snapshot->nodes.num;
+    for (i=0; i<nbnodes; i++)
+        snapshot->sorted[i] = SNAPSHOT_REC(&snapshot->nodes, i);
+    sort_nodes(snapshot->sorted, nbnodes);
 
     /* display the ordered nodes */
-    for (i=0; i<size; i++) {
+    for (i=0; i<nbnodes; i++) {
         char *flushpackets;
-        nodeinfo_t *ou = &nodes[i];
+        nodeinfo_t *ou = snapshot->sorted[i];
         char *pptr = (char *) ou;
 
         if (strcmp(domain, ou->mess.Domain) != 0) {
@@ -3007,7 +4184,7 @@ static int manager_info(request_rec *r)
         ap_rprintf(r, "\n");
 
         /* Process the Vhosts */
-        manager_info_hosts(r, mconf->reduce_display, mconf->allow_cmd, ou->mess.id, ou->mess.JVMRoute); 
+        manager_info_hosts(r, snapshot, mconf->reduce_display, mconf->allow_cmd, ou->mess.id, ou->mess.JVMRoute); 
     }
     /* Display the sessions */
     if (sizesessionid)
@@ -3029,10 +4206,12 @@ static int manager_handler(request_rec *r)
     int errtype = 0;
     char *buff;
     apr_size_t bufsiz=0, maxbufsiz, len;
+    const char *clength;
     apr_status_t status;
     int global = 0;
     int ours = 0;
     char **ptr;
+    char *raw;
     void *sconf = r->server->module_config;
     mod_manager_config *mconf;
   
@@ -3042,6 +4221,11 @@ static int manager_handler(request_rec *r)
             return DECLINED;
         return(manager_info(r));
     }
+    if (strcmp(r->handler, "cluster-metrics") == 0) {
+        if (r->method_number != M_GET)
+            return DECLINED;
+        return(manager_metrics(r));
+    }
 
     mconf = ap_get_module_config(sconf, &manager_module);
     if (!mconf->enable_mcpm_receive)
@@ -3062,7 +4246,18 @@ static int manager_handler(request_rec *r)
     }
     if (maxbufsiz< MAXMESSSIZE)
        maxbufsiz = MAXMESSSIZE;
-    buff = apr_pcalloc(r->pool, maxbufsiz);
+    /* a BATCH holds at most BATCH_MAX_ITEMS of them */
+    if (strcasecmp(r->method, "BATCH") == 0)
+       maxbufsiz = maxbufsiz * BATCH_MAX_ITEMS;
+    /* a message that tells its length doesn't need the whole buffer */
+    clength = apr_table_get(r->headers_in, "Content-Length");
+    if (clength != NULL) {
+        apr_off_t length;
+        if (apr_strtoff(&length, clength, NULL, 10) == APR_SUCCESS && length >= 0 && length < (apr_off_t) maxbufsiz)
+            maxbufsiz = (apr_size_t) length;
+    }
+    /* one more for the terminating NUL */
+    buff = apr_pcalloc(r->pool, maxbufsiz + 1);
     input_brigade = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     len = maxbufsiz;
     while ((status = ap_get_brigade(r->input_filters, input_brigade, AP_MODE_READBYTES, APR_BLOCK_READ, len)) == APR_SUCCESS) {
@@ -3089,9 +4284,17 @@ static int manager_handler(request_rec *r)
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                 "manager_handler %s (%s) processing: \"%s\"", r->method, r->filename, buff);
 
-    ptr = process_buff(r, buff);
+    if (strcasecmp(r->method, "BATCH") == 0) {
+        /* each line is a command, parsed by process_batch() */
+        process_batch(r, buff);
+        ap_rflush(r);
+        return (OK);
+    }
+
+    raw = peer_message(r, r->method, buff);
+    ptr = process_buff(r, buff, &errstring);
     if (ptr == NULL) {
-        process_error(r, SMESPAR, TYPESYNTAX);
+        process_error(r, errstring, TYPESYNTAX);
         return 500;
     }
     if (strstr(r->filename, NODE_COMMAND))
@@ -3130,6 +4333,9 @@ static int manager_handler(request_rec *r)
         return 500;
     }
 
+    if (raw)
+        replicate(r, r->method, global, raw);
+
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                 "manager_handler %s  OK", r->method);
 
@@ -3137,6 +4343,357 @@ static int manager_handler(request_rec *r)
     return (OK);
 }
 
+#if APR_HAS_THREADS
+/*
+ * PeerSync sender: a thread in each child, the child that owns the changes
+ * (lock_mem_peer()) sends them to each peer in a BATCH every PEER_WAIT.
+ */
+static apr_thread_t *peer_thread = NULL;
+static volatile int peer_stop = 0;
+static apr_uint32_t peer_owner;
+static apr_time_t peer_retry[PEER_MAX]; /* don't try the unreachable peer before */
+
+static apr_status_t peer_send_all(apr_socket_t *sock, const char *buf, apr_size_t len)
+{
+    while (len > 0) {
+        apr_size_t n = len;
+        apr_status_t rv = apr_socket_send(sock, buf, &n);
+        if (rv != APR_SUCCESS)
+            return rv;
+        buf += n;
+        len -= n;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Send a BATCH to the peer, errors is the number of commands that failed
+ * because the peer doesn't have the node (it needs the whole tables), the
+ * CONFIG and REMOVE-APP of a node it already has (re)moved don't count.
+ */
+static apr_status_t send_peer(server_rec *s, struct manager_peer *peer, const char *body, apr_size_t len,
+                              int *errors, apr_pool_t *pool)
+{
+    apr_sockaddr_t *sa;
+    apr_socket_t *sock;
+    apr_status_t rv;
+    char buf[PEER_LINESZ];
+    apr_size_t got = 0;
+    int status = 0;
+
+    *errors = 0;
+    rv = apr_sockaddr_info_get(&sa, peer->host, APR_UNSPEC, peer->port, 0, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    rv = apr_socket_create(&sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, pool);
+    if (rv != APR_SUCCESS)
+        return rv;
+    apr_socket_timeout_set(sock, PEER_TIMEOUT);
+    rv = apr_socket_connect(sock, sa);
+    if (rv == APR_SUCCESS) {
+        char *head = apr_psprintf(pool, "BATCH / HTTP/1.0\r\nHost: %s\r\n%s: %s\r\nContent-Length: %" APR_SIZE_T_FMT "\r\n\r\n",
+                                  peer->name, PEER_HEADER, s->server_hostname, len);
+        rv = peer_send_all(sock, head, strlen(head));
+    }
+    if (rv == APR_SUCCESS)
+        rv = peer_send_all(sock, body, len);
+
+    /* read the status line and the BATCH-RSP lines until the peer closes */
+    while (rv == APR_SUCCESS) {
+        apr_size_t n = sizeof(buf) - 1 - got;
+        char *line;
+        char *eol;
+
+        rv = apr_socket_recv(sock, buf + got, &n);
+        got += n;
+        buf[got] = '\0';
+        line = buf;
+        while ((eol = strchr(line, '\n')) != NULL) {
+            *eol = '\0';
+            if (status == 0)
+                status = (strncmp(line, "HTTP/", 5) == 0 && strchr(line, ' ')) ? atoi(strchr(line, ' ') + 1) : -1;
+            else if (strncmp(line, "Type=BATCH-RSP&", 15) == 0 && strstr(line, "&ErrType=MEM") &&
+                     !strstr(line, "&Command=CONFIG&") && !strstr(line, "&Command=REMOVE-APP&"))
+                (*errors)++;
+            line = eol + 1;
+        }
+        got = strlen(line);
+        if (got == sizeof(buf) - 1)
+            got = 0; /* not one of our lines */
+        else
+            memmove(buf, line, got);
+    }
+    apr_socket_close(sock);
+    if (rv != APR_EOF)
+        return rv;
+    if (status != 200) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "PeerSync: %s answered %d", peer->name, status);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+/* the CONFIG of the node (with the one of its balancer) */
+static char *peer_config(apr_pool_t *pool, nodeinfo_t *node, balancerinfo_t *balancer)
+{
+    const char *type = node->mess.Type;
+    const char *flush = "off";
+    char *line;
+
+    /* the peer does its own EnableWsTunnel */
+    if (strcmp(type, "ws") == 0)
+        type = "http";
+    else if (strcmp(type, "wss") == 0)
+        type = "https";
+    if (node->mess.flushpackets == flush_on)
+        flush = "on";
+    else if (node->mess.flushpackets == flush_auto)
+        flush = "auto";
+    line = apr_psprintf(pool, "CONFIG / JVMRoute=%s&Balancer=%s&Host=%s&Port=%s&Type=%s&Reversed=%s"
+                        "&flushpackets=%s&flushwait=%d&ping=%d&smax=%d&ttl=%d&Timeout=%d",
+                        peer_escape(pool, node->mess.JVMRoute), peer_escape(pool, node->mess.balancer),
+                        peer_escape(pool, node->mess.Host), peer_escape(pool, node->mess.Port), type,
+                        node->mess.reversed ? "yes" : "no", flush, node->mess.flushwait / 1000,
+                        (int) apr_time_sec(node->mess.ping), node->mess.smax,
+                        (int) apr_time_sec(node->mess.ttl), (int) apr_time_sec(node->mess.timeout));
+    if (node->mess.Domain[0])
+        line = apr_pstrcat(pool, line, "&Domain=", peer_escape(pool, node->mess.Domain), NULL);
+    if (balancer == NULL)
+        return line;
+    line = apr_psprintf(pool, "%s&StickySession=%s&StickySessionCookie=%s&StickySessionPath=%s"
+                        "&StickySessionRemove=%s&StickySessionForce=%s&WaitWorker=%d&Maxattempts=%d",
+                        line, balancer->StickySession ? "yes" : "no",
+                        peer_escape(pool, balancer->StickySessionCookie), peer_escape(pool, balancer->StickySessionPath),
+                        balancer->StickySessionRemove ? "yes" : "no", balancer->StickySessionForce ? "yes" : "no",
+                        (int) apr_time_sec(balancer->Timeout), balancer->Maxattempts);
+    if (balancer->WarmConnections >= 0)
+        line = apr_psprintf(pool, "%s&WarmConnections=%d", line, balancer->WarmConnections);
+    if (balancer->SlowStart >= 0)
+        line = apr_psprintf(pool, "%s&SlowStart=%d", line, balancer->SlowStart);
+    if (balancer->ElectionMethod >= 0 && balancer->ElectionMethod < ELECTION_COUNT)
+        line = apr_psprintf(pool, "%s&ElectionMethod=%s", line, ELECTION_NAME(balancer->ElectionMethod));
+    return line;
+}
+
+/*
+ * The whole tables as BATCH lines: for each node its CONFIG, its load
+ * (when it has one) and a *-APP per context with the aliases of its host.
+ */
+static apr_array_header_t *peer_tables(apr_pool_t *pool)
+{
+    apr_array_header_t *lines = apr_array_make(pool, 64, sizeof(char *));
+    int *ids;
+    int size, i, j, k;
+    int nhost = 0, ncontext = 0, nbalancer = 0;
+    hostinfo_t *hosts;
+    contextinfo_t *contexts;
+    balancerinfo_t *balancers;
+
+    size = get_max_size_host(hoststatsmem);
+    hosts = apr_palloc(pool, sizeof(hostinfo_t) * (size + 1));
+    ids = apr_palloc(pool, sizeof(int) * (size + 1));
+    size = get_ids_used_host(hoststatsmem, ids);
+    for (i = 0; i < size; i++) {
+        if (copy_host(hoststatsmem, &hosts[nhost], ids[i]) == APR_SUCCESS)
+            nhost++;
+    }
+    size = get_max_size_context(contextstatsmem);
+    contexts = apr_palloc(pool, sizeof(contextinfo_t) * (size + 1));
+    ids = apr_palloc(pool, sizeof(int) * (size + 1));
+    size = get_ids_used_context(contextstatsmem, ids);
+    for (i = 0; i < size; i++) {
+        if (copy_context(contextstatsmem, &contexts[ncontext], ids[i]) == APR_SUCCESS)
+            ncontext++;
+    }
+    size = get_max_size_balancer(balancerstatsmem);
+    balancers = apr_palloc(pool, sizeof(balancerinfo_t) * (size + 1));
+    ids = apr_palloc(pool, sizeof(int) * (size + 1));
+    size = get_ids_used_balancer(balancerstatsmem, ids);
+    for (i = 0; i < size; i++) {
+        if (copy_balancer(balancerstatsmem, &balancers[nbalancer], ids[i]) == APR_SUCCESS)
+            nbalancer++;
+    }
+
+    size = loc_get_max_size_node();
+    ids = apr_palloc(pool, sizeof(int) * (size + 1));
+    size = get_ids_used_node(nodestatsmem, ids);
+    for (i = 0; i < size; i++) {
+        nodeinfo_t node;
+        balancerinfo_t *balancer = NULL;
+        proxy_worker_shared *stat;
+        const char *route;
+
+        if (copy_node(nodestatsmem, &node, ids[i]) != APR_SUCCESS || node.mess.remove)
+            continue;
+        for (j = 0; j < nbalancer; j++) {
+            if (strcmp(balancers[j].balancer, node.mess.balancer) == 0) {
+                balancer = &balancers[j];
+                break;
+            }
+        }
+        *(char **) apr_array_push(lines) = peer_config(pool, &node, balancer);
+
+        /* the load of the worker, a node without one will send its STATUS */
+        route = peer_escape(pool, node.mess.JVMRoute);
+        stat = (proxy_worker_shared *) ((char *) &node + node.offset);
+        if (stat->status & PROXY_WORKER_IN_ERROR)
+            *(char **) apr_array_push(lines) = apr_psprintf(pool, "STATUS / JVMRoute=%s&Load=-1", route);
+        else if (stat->lbfactor > 0)
+            *(char **) apr_array_push(lines) = apr_psprintf(pool, "STATUS / JVMRoute=%s&Load=%d", route, stat->lbfactor);
+
+        for (j = 0; j < ncontext; j++) {
+            contextinfo_t *context = &contexts[j];
+            const char *method;
+            char *aliases = NULL;
+
+            if (context->node != node.mess.id)
+                continue;
+            if (context->status == ENABLED)
+                method = "ENABLE-APP";
+            else if (context->status == DISABLED)
+                method = "DISABLE-APP";
+            else
+                method = "STOP-APP";
+            for (k = 0; k < nhost; k++) {
+                if (hosts[k].node != node.mess.id || hosts[k].vhost != context->vhost)
+                    continue;
+                if (aliases)
+                    aliases = apr_pstrcat(pool, aliases, ",", peer_escape(pool, hosts[k].host), NULL);
+                else
+                    aliases = (char *) peer_escape(pool, hosts[k].host);
+            }
+            if (aliases == NULL)
+                continue;
+            *(char **) apr_array_push(lines) = apr_psprintf(pool, "%s / JVMRoute=%s&Alias=%s&Context=%s",
+                                                            method, route, aliases,
+                                                            peer_escape(pool, context->context));
+        }
+    }
+    return lines;
+}
+
+/* send the whole tables in as many BATCHs as needed */
+static apr_status_t send_peer_tables(server_rec *s, struct manager_peer *peer, apr_pool_t *pool)
+{
+    apr_array_header_t *lines = peer_tables(pool);
+    char *buf = apr_palloc(pool, PEER_BATCHSZ);
+    apr_size_t len = 0;
+    int n = 0;
+    int i;
+    int errors;
+    apr_status_t rv;
+
+    for (i = 0; i < lines->nelts; i++) {
+        const char *line = ((char **) lines->elts)[i];
+        apr_size_t l = strlen(line);
+
+        if (l + 1 > PEER_BATCHSZ)
+            continue; /* the peer can't read it */
+        if (n == BATCH_MAX_ITEMS || len + l + 1 > PEER_BATCHSZ) {
+            rv = send_peer(s, peer, buf, len, &errors, pool);
+            if (rv != APR_SUCCESS)
+                return rv;
+            len = 0;
+            n = 0;
+        }
+        memcpy(buf + len, line, l);
+        len += l;
+        buf[len++] = '\n';
+        n++;
+    }
+    if (n == 0)
+        return APR_SUCCESS;
+    return send_peer(s, peer, buf, len, &errors, pool);
+}
+
+/*
+ * Send to the peer i what it hasn't got yet: the changes recorded since the
+ * last BATCH or the whole tables if it has missed some.
+ */
+static void sync_peer(server_rec *s, struct manager_peer *peer, int i, apr_pool_t *pool)
+{
+    unsigned int sent;
+    unsigned int last;
+    int resync;
+    int errors = 0;
+    int n;
+    char *buf;
+    apr_size_t len;
+    apr_status_t rv;
+
+    if (peer_retry[i] && apr_time_now() < peer_retry[i])
+        return;
+    get_mem_peer_state(peer_changes, i, &sent, &resync);
+    if (resync) {
+        /* what is recorded after that will be sent again: the commands can be applied twice */
+        last = head_mem_peer(peer_changes);
+        rv = send_peer_tables(s, peer, pool);
+        if (rv == APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "PeerSync: %s has now the whole tables", peer->name);
+            set_mem_peer_state(peer_changes, i, last, 0);
+        }
+    } else {
+        if (head_mem_peer(peer_changes) == sent)
+            return;
+        buf = apr_palloc(pool, PEER_BATCHSZ);
+        last = sent;
+        n = read_mem_peer(peer_changes, &last, buf, PEER_BATCHSZ, &len, BATCH_MAX_ITEMS);
+        if (n < 0) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "PeerSync: %s needs the whole tables", peer->name);
+            set_mem_peer_state(peer_changes, i, last, 1);
+            return;
+        }
+        if (n == 0)
+            return;
+        rv = send_peer(s, peer, buf, len, &errors, pool);
+        if (rv == APR_SUCCESS)
+            set_mem_peer_state(peer_changes, i, last, errors != 0);
+    }
+    if (rv != APR_SUCCESS) {
+        /* it may have been restarted: it needs the whole tables when it is back */
+        if (!peer_retry[i])
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "PeerSync: can't send to %s", peer->name);
+        set_mem_peer_state(peer_changes, i, sent, 1);
+        peer_retry[i] = apr_time_now() + PEER_RETRY;
+    } else
+        peer_retry[i] = 0;
+}
+
+static void * APR_THREAD_FUNC peer_sync(apr_thread_t *thd, void *data)
+{
+    server_rec *s = (server_rec *) data;
+    mod_manager_config *mconf = ap_get_module_config(s->module_config, &manager_module);
+    apr_pool_t *pool;
+    int i;
+
+    apr_pool_create(&pool, apr_thread_pool_get(thd));
+    while (!peer_stop) {
+        apr_sleep(PEER_WAIT);
+        for (i = 0; i < mconf->peers->nelts && !peer_stop; i++) {
+            /* heartbeat before each peer: another child takes over if we hang */
+            if (!lock_mem_peer(peer_changes, peer_owner, (apr_uint32_t) apr_time_sec(apr_time_now())))
+                break;
+            sync_peer(s, &((struct manager_peer *) mconf->peers->elts)[i], i, pool);
+            apr_pool_clear(pool);
+        }
+    }
+    unlock_mem_peer(peer_changes, peer_owner);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stop_peer_thread(void *data)
+{
+    apr_status_t rv;
+    if (peer_thread) {
+        peer_stop = 1;
+        apr_thread_join(&rv, peer_thread);
+        peer_thread = NULL;
+    }
+    return APR_SUCCESS;
+}
+#endif
+
 /*
  *  Attach to the shared memory when the child is created.
  */
@@ -3164,6 +4721,12 @@ static void  manager_child_init(apr_pool_t *p, server_rec *s)
                     "manager_child_init: apr_thread_mutex_create failed");
         return;
     }
+    if (apr_thread_mutex_create(&snapshot_mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "manager_child_init: apr_thread_mutex_create failed");
+        return;
+    }
+    snapshot_pool = p;
 
     mconf->tableversion = 0;
 
@@ -3204,6 +4767,11 @@ static void  manager_child_init(apr_pool_t *p, server_rec *s)
         ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_EMERG, 0, s, "get_mem_host failed");
         return;
     }
+    set_mem_journal(nodestatsmem, journal, TABLE_NODE);
+    set_mem_journal(hoststatsmem, journal, TABLE_HOST);
+    set_mem_journal(contextstatsmem, journal, TABLE_CONTEXT);
+    nodestatsmem->inserted = node_inserted;
+    contextstatsmem->inserted = context_inserted;
 
     balancerstatsmem = get_mem_balancer(balancer, &mconf->maxhost, p, storage);
     if (balancerstatsmem == NULL) {
@@ -3219,6 +4787,24 @@ static void  manager_child_init(apr_pool_t *p, server_rec *s)
             return;
         }
     }
+
+#if APR_HAS_THREADS
+    if (peer_changes && mconf->peers) {
+        /* the children compete for the sending, each needs its own id */
+        while (apr_generate_random_bytes((unsigned char *) &peer_owner, sizeof(peer_owner)) == APR_SUCCESS &&
+               peer_owner == 0)
+            ;
+        if (peer_owner == 0)
+            peer_owner = (apr_uint32_t) getpid();
+        peer_stop = 0;
+        if (apr_thread_create(&peer_thread, NULL, peer_sync, s, p) != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                        "manager_child_init: can't create the PeerSync thread");
+            peer_thread = NULL;
+        } else
+            apr_pool_cleanup_register(p, NULL, stop_peer_thread, apr_pool_cleanup_null);
+    }
+#endif
 }
 
 /*
@@ -3294,9 +4880,11 @@ static const char*cmd_manager_pers(cmd_parms *cmd, void *dummy, const char *arg)
        mconf->persistent = 0;
     else if (strcasecmp(arg, "On") == 0)
        mconf->persistent = CREPER_SLOTMEM;
+    else if (strcasecmp(arg, "Mmap") == 0)
+       mconf->persistent = CREPER_SLOTMEM | CREMAP_SLOTMEM;
     else {
        return "PersistSlots must be one of: "
-              "off | on";
+              "off | on | mmap";
     }
     return NULL;
 }
@@ -3426,6 +5014,33 @@ static const char*cmd_manager_ajp_secret(cmd_parms *cmd, void *mconfig, const ch
         return "AJPsecret requires mod_proxy_ajp.c";
     }
 }
+static const char*cmd_manager_peer_sync(cmd_parms *cmd, void *mconfig, const char *word)
+{
+    mod_manager_config *mconf = ap_get_module_config(cmd->server->module_config, &manager_module);
+    struct manager_peer *peer;
+    char *scope_id;
+    apr_status_t rv;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+    if (mconf->peers == NULL)
+        mconf->peers = apr_array_make(cmd->pool, 4, sizeof(struct manager_peer));
+    if (mconf->peers->nelts >= PEER_MAX)
+        return apr_psprintf(cmd->temp_pool, "PeerSync supports at most %d proxies", PEER_MAX);
+    peer = apr_array_push(mconf->peers);
+    rv = apr_parse_addr_port(&peer->host, &scope_id, &peer->port, word, cmd->pool);
+    if (rv != APR_SUCCESS || peer->host == NULL || peer->port == 0)
+        return apr_psprintf(cmd->temp_pool, "PeerSync %s must be host:port", word);
+    peer->name = apr_pstrdup(cmd->pool, word);
+    rv = apr_sockaddr_info_get(&peer->addr, peer->host, APR_UNSPEC, peer->port, 0, cmd->pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, cmd->server,
+                     "PeerSync: can't resolve %s, its BATCHs will be handled like the ones of a node", word);
+        peer->addr = NULL;
+    }
+    return NULL;
+}
 
 
 static const command_rec  manager_cmds[] =
@@ -3477,7 +5092,7 @@ static const command_rec  manager_cmds[] =
         cmd_manager_pers,
         NULL,
         OR_ALL,
-        "PersistSlots - Persist the slot mem elements on | off (Default: off No persistence)"
+        "PersistSlots - Persist the slot mem elements on | mmap | off (Default: off No persistence)"
     ),
     AP_INIT_TAKE1(
         "CheckNonce",
@@ -3542,6 +5157,13 @@ static const command_rec  manager_cmds[] =
          OR_ALL,
          "AJPSecret - secret for all mod_cluster node, not configued no secret."
     ),
+    AP_INIT_ITERATE(
+        "PeerSync",
+         cmd_manager_peer_sync,
+         NULL,
+         OR_ALL,
+         "PeerSync - host:port of the MCMP VirtualHost of the other proxies, the commands received from the nodes are replicated to them (Default: none)."
+    ),
     {NULL}
 };
 
@@ -3596,6 +5218,7 @@ static void *create_manager_config(apr_pool_t *p)
     mconf->enable_ws_tunnel = 0;
     mconf->ws_upgrade_header = NULL;
     mconf->ajp_secret = NULL;
+    mconf->peers = NULL;
     return mconf;
 }
 
@@ -3696,6 +5319,11 @@ static void *merge_manager_server_config(apr_pool_t *p, void *server1_conf,
     else if (mconf1->ajp_secret)
         mconf->ajp_secret = apr_pstrdup(p, mconf1->ajp_secret);
 
+    if (mconf2->peers)
+        mconf->peers = mconf2->peers;
+    else if (mconf1->peers)
+        mconf->peers = mconf1->peers;
+
     return mconf;
 }
 
@@ -25,10 +25,184 @@
  * @version $Revision$
  */
 
+#ifndef MEM_T
+typedef struct mem mem_t; 
+#define MEM_T
+#endif
+
+/* hash index of a table (see index.c) */
+typedef struct mem_index mem_index_t;
+
+/* change journal of the tables (see journal.c) */
+typedef struct mem_journal mem_journal_t;
+struct table_change;
+
+/* changes replicated to the PeerSync proxies (see peer.c) */
+typedef struct mem_peer mem_peer_t;
+#define PEER_MAX    16   /* PeerSync proxies */
+#define PEER_LINESZ 2048 /* longest command recorded, a longer one resyncs the peers */
+
+/* returns the key of a slot of the table */
+typedef const char *mem_index_key_fn(void *slot);
+/* returns 1 if the slot is the one we are looking for */
+typedef int mem_index_match_fn(void *slot, void *data);
+/* returns the last update time of a slot of the table */
+typedef apr_time_t mem_index_time_fn(void *slot);
+
 struct mem {
     ap_slotmem_t *slotmem;
     const slotmem_storage_method *storage;
     int num;
     apr_pool_t *p;
     apr_status_t laststatus;
+    mem_index_t *index;      /* optional hash index (in shared memory) */
+    mem_index_key_fn *key;   /* key of the slots for the index */
+    mem_journal_t *journal;  /* optional change journal (in shared memory) */
+    int table;               /* table id in the journal */
+    void (*inserted)(int ident); /* optional: resets what is kept per id out of the table */
 };
+
+/**
+ * create or attach the hash index of a table.
+ * The index is kept in a slotmem of its own (name.index) and is rebuilt from
+ * the used slots of the table when it is created.
+ * @param s the table.
+ * @param name name of the slotmem of the table.
+ * @param type 0: attach, otherwise create.
+ * @param key routine returning the key of a slot.
+ * @param time routine returning the update time of a slot, used to order
+ *        the slots when rebuilding (NULL: order of the ids).
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t create_mem_index(mem_t *s, const char *name, int type, mem_index_key_fn *key, mem_index_time_fn *time);
+
+/**
+ * find a slot using the index.
+ * @param s the table.
+ * @param key the key to search.
+ * @param match routine to select the slot (NULL: compare the key).
+ * @param data parameter for match.
+ * @return the id of the slot or 0 if not found.
+ */
+int find_mem_index(mem_t *s, const char *key, mem_index_match_fn *match, void *data);
+
+/**
+ * add a slot to the index (the slot must be filled).
+ * The slot is the most recently updated of the table.
+ * The table must be locked.
+ */
+void insert_mem_index(mem_t *s, int id);
+
+/**
+ * remove a slot from the index. The table must be locked.
+ */
+void remove_mem_index(mem_t *s, int id);
+
+/**
+ * mark a slot as the most recently updated. The table must be locked.
+ */
+void touch_mem_index(mem_t *s, int id);
+
+/**
+ * get the least recently updated slot.
+ * @return the id of the slot or 0 if the index is empty.
+ */
+int oldest_mem_index(mem_t *s);
+
+/**
+ * size of the change journal in shared memory.
+ */
+apr_size_t size_mem_journal(void);
+
+/**
+ * initialize a change journal (once, by the process that created the shared memory).
+ * @param base address of the shared memory.
+ * @return the journal.
+ */
+mem_journal_t *init_mem_journal(void *base);
+
+/**
+ * record the changes of a table in a journal.
+ * @param s the table.
+ * @param journal the journal (NULL: the changes are not recorded).
+ * @param table TABLE_ id of the table.
+ */
+void set_mem_journal(mem_t *s, mem_journal_t *journal, int table);
+
+/**
+ * record a change of a slot of the table (nothing if the table has no journal).
+ * @param s the table.
+ * @param id the slot.
+ * @param op CHANGE_ operation.
+ */
+void add_mem_journal(mem_t *s, int id, int op);
+
+/**
+ * read the changes recorded after the sequence last.
+ * @param journal the journal.
+ * @param last the sequence of the last change already read, updated.
+ * @param changes array to store the changes.
+ * @param max size of changes (0: just set last to the actual sequence).
+ * @return the number of changes or -1 if some were lost (last then is the
+ *         actual sequence of the journal).
+ */
+int read_mem_journal(mem_journal_t *journal, unsigned int *last, struct table_change *changes, int max);
+
+/**
+ * size of the PeerSync changes in shared memory.
+ */
+apr_size_t size_mem_peer(void);
+
+/**
+ * initialize the PeerSync changes (once, by the process that created the shared memory).
+ * @param base address of the shared memory.
+ * @return the changes, all the peers need the whole tables.
+ */
+mem_peer_t *init_mem_peer(void *base);
+
+/**
+ * record a command applied by the proxy.
+ * @param peer the changes.
+ * @param line the command as a BATCH line ("METHOD PATH PARAMETERS").
+ * @param len length of line (PEER_LINESZ or more: the peers will need the whole tables).
+ */
+void add_mem_peer(mem_peer_t *peer, const char *line, apr_size_t len);
+
+/**
+ * get the sequence of the last change recorded.
+ */
+unsigned int head_mem_peer(mem_peer_t *peer);
+
+/**
+ * read the commands recorded after the sequence last, a line each.
+ * @param peer the changes.
+ * @param last the sequence of the last change already read, updated.
+ * @param buf buffer to store the lines.
+ * @param size size of buf.
+ * @param len length of the lines stored.
+ * @param max maximum number of lines.
+ * @return the number of lines or -1 if some were lost or not recorded
+ *         (last then is the actual sequence).
+ */
+int read_mem_peer(mem_peer_t *peer, unsigned int *last, char *buf, apr_size_t size, apr_size_t *len, int max);
+
+/**
+ * become (or stay) the child that sends the changes, unless another one does.
+ * @param peer the changes.
+ * @param owner the ident of the child (not 0).
+ * @param now apr_time_sec() of now.
+ * @return 1 if the child is the one that sends.
+ */
+int lock_mem_peer(mem_peer_t *peer, apr_uint32_t owner, apr_uint32_t now);
+
+/**
+ * stop sending the changes (the child exits).
+ */
+void unlock_mem_peer(mem_peer_t *peer, apr_uint32_t owner);
+
+/**
+ * get/set the last change sent to the peer i and whether it needs the whole
+ * tables, only by the child that sends.
+ */
+void get_mem_peer_state(mem_peer_t *peer, int i, unsigned int *sent, int *resync);
+void set_mem_peer_state(mem_peer_t *peer, int i, unsigned int sent, int resync);
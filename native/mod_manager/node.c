@@ -44,6 +44,15 @@
 
 #include "mod_manager.h"
 
+static const char *node_key(void *slot)
+{
+    return ((nodeinfo_t *) slot)->mess.JVMRoute;
+}
+static apr_time_t node_time(void *slot)
+{
+    return ((nodeinfo_t *) slot)->updatetime;
+}
+
 static mem_t * create_attach_mem_node(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
@@ -65,9 +74,10 @@ static mem_t * create_attach_mem_node(char *string, int *num, int type, apr_pool
         ptr->laststatus = rv;
         return ptr;
     }
-    ptr->laststatus = APR_SUCCESS;
     ptr->num = *num;
     ptr->p = p;
+    /* the nodes are searched by JVMRoute, index them */
+    ptr->laststatus = create_mem_index(ptr, storename, type, node_key, node_time);
     return ptr;
 }
 
@@ -89,11 +99,17 @@ apr_status_t get_last_mem_error(mem_t *mem) {
  * @return APR_SUCCESS if all went well
  *
  */
-static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *pool)
+apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
 {
-    nodeinfo_t *in = (nodeinfo_t *)*data;
-    nodeinfo_t *ou = (nodeinfo_t *)mem;
-    if (strcmp(in->mess.JVMRoute, ou->mess.JVMRoute) == 0) {
+    apr_status_t rv;
+    nodeinfo_t *ou;
+    int ident;
+    apr_time_t now;
+
+    now = apr_time_now();
+    s->storage->ap_slotmem_lock(s->slotmem);
+    ident = find_mem_index(s, node->mess.JVMRoute, NULL, NULL);
+    if (ident != 0 && s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou) == APR_SUCCESS) {
         /*
          * The node information is made of several pieces:
          * Information from the cluster (nodemess_t).
@@ -101,30 +117,21 @@ static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *po
          * offset (of the area shared with the proxy logic).
          * stat (shared area with the proxy logic we shouldn't modify it here).
          */
-        memcpy(ou, in, sizeof(nodemess_t));
-        ou->mess.id = id;
-        ou->updatetime = apr_time_now();
+        rv = s->storage->ap_slotmem_lock_slot(s->slotmem, ident);
+        s->storage->ap_slotmem_write_begin(s->slotmem, ident);
+        memcpy(ou, node, sizeof(nodemess_t));
+        ou->mess.id = ident;
+        ou->updatetime = now;
         ou->offset = sizeof(nodemess_t) + sizeof(apr_time_t) + sizeof(int);
         ou->offset = APR_ALIGN_DEFAULT(ou->offset);
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
-apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
-{
-    apr_status_t rv;
-    nodeinfo_t *ou;
-    int ident;
-    apr_time_t now;
-
-    node->mess.id = 0;
-    now = apr_time_now();
-    s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &node, s->p);
-    if (node->mess.id != 0 && rv == APR_SUCCESS) {
+        s->storage->ap_slotmem_write_end(s->slotmem, ident);
+        if (rv == APR_SUCCESS)
+            s->storage->ap_slotmem_unlock_slot(s->slotmem, ident);
+        touch_mem_index(s, ident);
+        add_mem_journal(s, ident, CHANGE_UPDATE);
+        s->storage->ap_slotmem_touch(s->slotmem);
         s->storage->ap_slotmem_unlock(s->slotmem);
-        *id = node->mess.id;
+        *id = ident;
         return APR_SUCCESS; /* updated */
     }
 
@@ -134,6 +141,9 @@ apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
         s->storage->ap_slotmem_unlock(s->slotmem);
         return rv;
     }
+    /* a writer of the node that used the slot before may still hold its stripe */
+    rv = s->storage->ap_slotmem_lock_slot(s->slotmem, ident);
+    s->storage->ap_slotmem_write_begin(s->slotmem, ident);
     memcpy(ou, node, sizeof(nodeinfo_t));
     ou->mess.id = ident;
     *id = ident;
@@ -145,37 +155,76 @@ apr_status_t insert_update_node(mem_t *s, nodeinfo_t *node, int *id)
 
     /* blank the proxy status information */
     memset(&(ou->stat), '\0', SIZEOFSCORE);
+    s->storage->ap_slotmem_write_end(s->slotmem, ident);
+    if (rv == APR_SUCCESS)
+        s->storage->ap_slotmem_unlock_slot(s->slotmem, ident);
 
+    insert_mem_index(s, ident);
+    if (s->inserted)
+        s->inserted(ident);
+    add_mem_journal(s, ident, CHANGE_UPDATE);
+    s->storage->ap_slotmem_touch(s->slotmem);
     s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
 
+/**
+ * mark a node record as removed (the slot is freed later by the watchdog).
+ * @param pointer to the shared table.
+ * @param ids  in the node table.
+ * @param rename 1: the JVMRoute becomes "REMOVED" so that a new node can use it.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t mark_removed_node(mem_t *s, int ids, int rename)
+{
+    apr_status_t rv;
+    nodeinfo_t *ou;
+
+    s->storage->ap_slotmem_lock(s->slotmem);
+    if (s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) &ou) != APR_SUCCESS) {
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        return APR_NOTFOUND;
+    }
+    /* the index is keyed by the JVMRoute: take the slot out before renaming it */
+    if (rename)
+        remove_mem_index(s, ids);
+    rv = s->storage->ap_slotmem_lock_slot(s->slotmem, ids);
+    s->storage->ap_slotmem_write_begin(s->slotmem, ids);
+    if (rename)
+        strcpy(ou->mess.JVMRoute, "REMOVED");
+    ou->mess.remove = 1;
+    ou->updatetime = apr_time_now();
+    s->storage->ap_slotmem_write_end(s->slotmem, ids);
+    if (rv == APR_SUCCESS)
+        s->storage->ap_slotmem_unlock_slot(s->slotmem, ids);
+    if (rename)
+        insert_mem_index(s, ids);
+    else
+        touch_mem_index(s, ids);
+    add_mem_journal(s, ids, CHANGE_UPDATE);
+    s->storage->ap_slotmem_touch(s->slotmem);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+    return APR_SUCCESS;
+}
+
 /**
  * read a node record from the shared table
  * @param pointer to the shared table.
  * @param node node to read from the shared table.
  * @return address of the read node or NULL if error.
  */
-static apr_status_t loc_read_node(void* mem, void **data, int id, apr_pool_t *pool) {
-    nodeinfo_t *in = (nodeinfo_t *)*data;
-    nodeinfo_t *ou = (nodeinfo_t *)mem;
-    if (strcmp(in->mess.JVMRoute, ou->mess.JVMRoute) == 0) {
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
 nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node)
 {
     apr_status_t rv;
     nodeinfo_t *ou = node;
+    int ident = node->mess.id;
 
-    if (node->mess.id)
-        rv = s->storage->ap_slotmem_mem(s->slotmem, node->mess.id, (void **) &ou);
-    else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, &ou, s->p);
-    }
+    if (!ident)
+        ident = find_mem_index(s, node->mess.JVMRoute, NULL, NULL);
+    if (!ident)
+        return NULL;
+    rv = s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou);
     if (rv == APR_SUCCESS)
         return ou;
     return NULL;
@@ -189,11 +238,20 @@ nodeinfo_t * read_node(mem_t *s, nodeinfo_t *node)
  */
 apr_status_t get_node(mem_t *s, nodeinfo_t **node, int ids)
 {
-  apr_status_t status;
-  s->storage->ap_slotmem_lock(s->slotmem);
-  status = s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) node);
-  s->storage->ap_slotmem_unlock(s->slotmem);
-  return(status);
+  /* no lock: the readers of the request path mustn't wait for the writers */
+  return(s->storage->ap_slotmem_mem(s->slotmem, ids, (void **) node));
+}
+
+/**
+ * copy a node record from the shared table (retries while a writer changes it).
+ * @param pointer to the shared table.
+ * @param node address where to copy the node.
+ * @param ids  in the node table.
+ * @return APR_SUCCESS if all went well
+ */
+apr_status_t copy_node(mem_t *s, nodeinfo_t *node, int ids)
+{
+  return(s->storage->ap_slotmem_read(s->slotmem, ids, node, sizeof(nodeinfo_t)));
 }
 
 /**
@@ -204,16 +262,24 @@ apr_status_t get_node(mem_t *s, nodeinfo_t **node, int ids)
  */
 apr_status_t remove_node(mem_t *s, nodeinfo_t *node)
 {
+    int ident;
     apr_status_t rv;
-    nodeinfo_t *ou = node;
-    if (node->mess.id)
-        rv = s->storage->ap_slotmem_free(s->slotmem, node->mess.id, node);
-    else {
-        /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, &ou, s->p);
-        if (rv == APR_SUCCESS)
-            rv = s->storage->ap_slotmem_free(s->slotmem, ou->mess.id, node);
+
+    s->storage->ap_slotmem_lock(s->slotmem);
+    ident = node->mess.id;
+    if (!ident)
+        ident = find_mem_index(s, node->mess.JVMRoute, NULL, NULL);
+    if (!ident) {
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        return APR_NOTFOUND;
     }
+    remove_mem_index(s, ident);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+    /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
+    /* it takes the stripe of the slot under the table lock like insert_update_node() */
+    rv = s->storage->ap_slotmem_free(s->slotmem, ident, node);
+    if (rv == APR_SUCCESS)
+        add_mem_journal(s, ident, CHANGE_REMOVE);
     return rv;
 }
 
@@ -226,14 +292,15 @@ apr_status_t remove_node(mem_t *s, nodeinfo_t *node)
  */
 apr_status_t find_node(mem_t *s, nodeinfo_t **node, const char *route)
 {
-    nodeinfo_t ou;
-    apr_status_t rv;
+    char JVMRoute[sizeof((*node)->mess.JVMRoute)];
+    int ident;
 
-    strncpy(ou.mess.JVMRoute, route, sizeof(ou.mess.JVMRoute));
-    ou.mess.JVMRoute[sizeof(ou.mess.JVMRoute) - 1] = '\0';
-    *node = &ou;
-    rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_node, node, s->p);
-    return rv;
+    strncpy(JVMRoute, route, sizeof(JVMRoute));
+    JVMRoute[sizeof(JVMRoute) - 1] = '\0';
+    ident = find_mem_index(s, JVMRoute, NULL, NULL);
+    if (!ident)
+        return APR_NOTFOUND;
+    return s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) node);
 }
 
 /*
@@ -260,6 +327,18 @@ int get_max_size_node(mem_t *s)
         return (s->storage->ap_slotmem_get_max_size(s->slotmem));
 }
 
+/*
+ * read the version of the table.
+ * @param pointer to the shared table.
+ * @return the version of the table or 0 if error.
+ */
+unsigned int get_version_node(mem_t *s)
+{
+    if (s == NULL || s->storage == NULL)
+        return 0;
+    return (s->storage->ap_slotmem_get_version(s->slotmem));
+}
+
 /**
  * attach to the shared node table
  * @param name of an existing shared table.
@@ -0,0 +1,200 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2009 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+/**
+ * @file  peer.c
+ * @brief changes replicated to the PeerSync proxies
+ *
+ * A ring of the last PEER_SIZE MCMP commands applied by the proxy, as the
+ * BATCH lines the sender sends to the peers. Like the journal the commands
+ * are processed by the children concurrently: a writer claims its sequence
+ * with an atomic increment and publishes the entry by storing the sequence
+ * in it last. Only one child sends (the owner), it keeps the sequence sent
+ * to each peer and whether the peer needs the whole tables: the peer was
+ * unreachable, it is more than PEER_SIZE changes late or a command was too
+ * long for an entry.
+ *
+ * @defgroup MEM peer
+ * @ingroup  APACHE_MODS
+ * @{
+ */
+
+#include <string.h>
+
+#include "apr.h"
+#include "apr_pools.h"
+#include "apr_time.h"
+#include "apr_atomic.h"
+
+#include "slotmem.h"
+#include "node.h"
+
+#include "mod_manager.h"
+
+#define PEER_SIZE 1024 /* power of 2 */
+#define PEER_MASK (PEER_SIZE - 1)
+
+/* seconds without a pass of the owner before another child takes over */
+#define PEER_STALE 30
+
+struct peer_change {
+    apr_uint32_t seq;        /* sequence of the change (0: being written) */
+    apr_uint32_t len;        /* length of the line (0: too long to be recorded) */
+    char line[PEER_LINESZ];
+};
+
+struct mem_peer {
+    apr_uint32_t seq;        /* sequence of the last change claimed */
+    apr_uint32_t owner;      /* child that sends (0: none) */
+    apr_uint32_t beat;       /* apr_time_sec() of the last pass of the owner */
+    apr_uint32_t sent[PEER_MAX];   /* last change sent to each peer */
+    int resync[PEER_MAX];          /* the peer needs the whole tables */
+    struct peer_change changes[PEER_SIZE];
+};
+
+apr_size_t size_mem_peer(void)
+{
+    return sizeof(mem_peer_t);
+}
+
+mem_peer_t *init_mem_peer(void *base)
+{
+    mem_peer_t *peer = (mem_peer_t *) base;
+    int i;
+
+    memset(peer, 0, sizeof(mem_peer_t));
+    /* we don't know what the peers have */
+    for (i = 0; i < PEER_MAX; i++)
+        peer->resync[i] = 1;
+    return peer;
+}
+
+void add_mem_peer(mem_peer_t *peer, const char *line, apr_size_t len)
+{
+    struct peer_change *change;
+    apr_uint32_t seq;
+
+    seq = apr_atomic_inc32(&peer->seq) + 1;
+    if (seq == 0)
+        seq = apr_atomic_inc32(&peer->seq) + 1; /* 0 marks the entries being written */
+    change = &peer->changes[seq & PEER_MASK];
+    apr_atomic_xchg32(&change->seq, 0);
+    if (len >= PEER_LINESZ)
+        len = 0;
+    memcpy(change->line, line, len);
+    change->len = (apr_uint32_t) len;
+    apr_atomic_xchg32(&change->seq, seq);
+}
+
+unsigned int head_mem_peer(mem_peer_t *peer)
+{
+    return apr_atomic_read32(&peer->seq);
+}
+
+int read_mem_peer(mem_peer_t *peer, unsigned int *last, char *buf, apr_size_t size, apr_size_t *len, int max)
+{
+    apr_uint32_t head = apr_atomic_read32(&peer->seq);
+    apr_uint32_t seq = *last;
+    int n = 0;
+    int lost = 0;
+
+    *len = 0;
+    if (head - seq > PEER_SIZE) {
+        *last = head;
+        return -1;
+    }
+    while (seq != head && n < max) {
+        struct peer_change *change;
+        apr_uint32_t got, l;
+
+        if (seq + 1 == 0) {
+            seq++; /* never used */
+            continue;
+        }
+        change = &peer->changes[(seq + 1) & PEER_MASK];
+        got = apr_atomic_read32(&change->seq);
+        if (got != seq + 1) {
+            /* overwritten or not yet published (the next call will read it) */
+            lost = (got != 0 && (apr_int32_t) (got - (seq + 1)) > 0);
+            break;
+        }
+        l = change->len;
+        if (l == 0 || l >= PEER_LINESZ) {
+            lost = 1; /* too long to be recorded */
+            break;
+        }
+        if (*len + l + 1 > size)
+            break; /* the next call will read it */
+        memcpy(buf + *len, change->line, l);
+        if (apr_atomic_read32(&change->seq) != got) {
+            lost = 1; /* overwritten while copying */
+            break;
+        }
+        *len += l;
+        buf[(*len)++] = '\n';
+        seq++;
+        n++;
+    }
+    if (lost) {
+        *len = 0;
+        *last = apr_atomic_read32(&peer->seq);
+        return -1;
+    }
+    *last = seq;
+    return n;
+}
+
+int lock_mem_peer(mem_peer_t *peer, apr_uint32_t owner, apr_uint32_t now)
+{
+    apr_uint32_t cur = apr_atomic_read32(&peer->owner);
+
+    if (cur != owner) {
+        if (cur != 0 && now - apr_atomic_read32(&peer->beat) < PEER_STALE)
+            return 0;
+        if (apr_atomic_cas32(&peer->owner, owner, cur) != cur)
+            return 0;
+    }
+    apr_atomic_set32(&peer->beat, now);
+    return 1;
+}
+
+void unlock_mem_peer(mem_peer_t *peer, apr_uint32_t owner)
+{
+    apr_atomic_cas32(&peer->owner, 0, owner);
+}
+
+void get_mem_peer_state(mem_peer_t *peer, int i, unsigned int *sent, int *resync)
+{
+    *sent = peer->sent[i];
+    *resync = peer->resync[i];
+}
+
+void set_mem_peer_state(mem_peer_t *peer, int i, unsigned int sent, int resync)
+{
+    peer->sent[i] = sent;
+    peer->resync[i] = resync;
+}
@@ -44,6 +44,15 @@
 
 #include "mod_manager.h"
 
+static const char *sessionid_key(void *slot)
+{
+    return ((sessionidinfo_t *) slot)->sessionid;
+}
+static apr_time_t sessionid_time(void *slot)
+{
+    return ((sessionidinfo_t *) slot)->updatetime;
+}
+
 static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr_pool_t *p, slotmem_storage_method *storage) {
     mem_t *ptr;
     const char *storename;
@@ -66,6 +75,11 @@ static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr
     }
     ptr->num = *num;
     ptr->p = p;
+    /* the sessionids are searched by value, index them */
+    rv = create_mem_index(ptr, storename, type, sessionid_key, sessionid_time);
+    if (rv != APR_SUCCESS) {
+        return NULL;
+    }
     return ptr;
 }
 /**
@@ -75,19 +89,6 @@ static mem_t * create_attach_mem_sessionid(char *string, int *num, int type, apr
  * @return APR_SUCCESS if all went well
  *
  */
-static apr_status_t insert_update(void* mem, void **data, int id, apr_pool_t *pool)
-{
-    sessionidinfo_t *in = (sessionidinfo_t *)*data;
-    sessionidinfo_t *ou = (sessionidinfo_t *)mem;
-    if (strcmp(in->sessionid, ou->sessionid) == 0) {
-        memcpy(ou, in, sizeof(sessionidinfo_t));
-        ou->id = id;
-        ou->updatetime = apr_time_sec(apr_time_now());
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
 apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
 {
     apr_status_t rv;
@@ -96,8 +97,12 @@ apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
 
     sessionid->id = 0;
     s->storage->ap_slotmem_lock(s->slotmem);
-    rv = s->storage->ap_slotmem_do(s->slotmem, insert_update, &sessionid, s->p);
-    if (sessionid->id != 0 && rv == APR_SUCCESS) {
+    ident = find_mem_index(s, sessionid->sessionid, NULL, NULL);
+    if (ident != 0 && s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou) == APR_SUCCESS) {
+        memcpy(ou, sessionid, sizeof(sessionidinfo_t));
+        ou->id = ident;
+        ou->updatetime = apr_time_sec(apr_time_now());
+        touch_mem_index(s, ident);
         s->storage->ap_slotmem_unlock(s->slotmem);
         return APR_SUCCESS; /* updated */
     }
@@ -110,8 +115,9 @@ apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
     }
     memcpy(ou, sessionid, sizeof(sessionidinfo_t));
     ou->id = ident;
-    s->storage->ap_slotmem_unlock(s->slotmem);
     ou->updatetime = apr_time_sec(apr_time_now());
+    insert_mem_index(s, ident);
+    s->storage->ap_slotmem_unlock(s->slotmem);
 
     return APR_SUCCESS;
 }
@@ -122,26 +128,17 @@ apr_status_t insert_update_sessionid(mem_t *s, sessionidinfo_t *sessionid)
  * @param sessionid sessionid to read from the shared table.
  * @return address of the read sessionid or NULL if error.
  */
-static apr_status_t loc_read_sessionid(void* mem, void **data, int id, apr_pool_t *pool) {
-    sessionidinfo_t *in = (sessionidinfo_t *)*data;
-    sessionidinfo_t *ou = (sessionidinfo_t *)mem;
-
-    if (strcmp(in->sessionid, ou->sessionid) == 0) {
-        *data = ou;
-        return APR_SUCCESS;
-    }
-    return APR_NOTFOUND;
-}
 sessionidinfo_t * read_sessionid(mem_t *s, sessionidinfo_t *sessionid)
 {
     apr_status_t rv;
     sessionidinfo_t *ou = sessionid;
+    int ident = sessionid->id;
 
-    if (sessionid->id)
-        rv = s->storage->ap_slotmem_mem(s->slotmem, sessionid->id, (void **) &ou);
-    else {
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_sessionid, &ou, s->p);
-    }
+    if (!ident)
+        ident = find_mem_index(s, sessionid->sessionid, NULL, NULL);
+    if (!ident)
+        return NULL;
+    rv = s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou);
     if (rv == APR_SUCCESS)
         return ou;
     return NULL;
@@ -166,17 +163,49 @@ apr_status_t get_sessionid(mem_t *s, sessionidinfo_t **sessionid, int ids)
  */
 apr_status_t remove_sessionid(mem_t *s, sessionidinfo_t *sessionid)
 {
-    apr_status_t rv;
-    sessionidinfo_t *ou = sessionid;
-    if (sessionid->id) {
-        rv = s->storage->ap_slotmem_free(s->slotmem, sessionid->id, sessionid);
-    } else {
-        /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
-        rv = s->storage->ap_slotmem_do(s->slotmem, loc_read_sessionid, &ou, s->p);
-        if (rv == APR_SUCCESS)
-            rv = s->storage->ap_slotmem_free(s->slotmem, ou->id, sessionid);
+    int ident;
+
+    s->storage->ap_slotmem_lock(s->slotmem);
+    ident = sessionid->id;
+    if (!ident)
+        ident = find_mem_index(s, sessionid->sessionid, NULL, NULL);
+    if (!ident) {
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        return APR_NOTFOUND;
+    }
+    remove_mem_index(s, ident);
+    s->storage->ap_slotmem_unlock(s->slotmem);
+    /* XXX: for the moment January 2007 ap_slotmem_free only uses ident to remove */
+    return s->storage->ap_slotmem_free(s->slotmem, ident, sessionid);
+}
+
+/**
+ * remove(free) the sessionid records not updated since a given time
+ * @param pointer to the shared table.
+ * @param before time (in seconds) of the oldest update to keep.
+ * @return number of sessionids removed.
+ */
+int remove_expired_sessionid(mem_t *s, apr_time_t before)
+{
+    int removed = 0;
+
+    for (;;) {
+        sessionidinfo_t *ou;
+        int ident;
+
+        s->storage->ap_slotmem_lock(s->slotmem);
+        ident = oldest_mem_index(s);
+        if (!ident || s->storage->ap_slotmem_mem(s->slotmem, ident, (void **) &ou) != APR_SUCCESS ||
+            ou->updatetime >= before) {
+            s->storage->ap_slotmem_unlock(s->slotmem);
+            break;
+        }
+        remove_mem_index(s, ident);
+        s->storage->ap_slotmem_unlock(s->slotmem);
+        s->storage->ap_slotmem_free(s->slotmem, ident, ou);
+        removed++;
     }
-    return rv;
+    return removed;
 }
 
 /*
@@ -37,6 +37,9 @@
 #include "mod_proxy.h"
 #include "mod_watchdog.h"
 
+#include "apr_atomic.h"
+#include "apr_hash.h"
+
 #include "slotmem.h"
 
 #include "node.h"
@@ -47,6 +50,10 @@
 #include "domain.h"
 
 #include "mod_proxy_cluster.h"
+#include "metrics.h"
+#include "latency.h"
+
+#include <math.h>
 
 #if APR_HAVE_UNISTD_H
 /* for getpid() */
@@ -68,12 +75,46 @@
 
 
 struct proxy_cluster_helper {
-    int count_active; /* currently active request using the worker */
+    apr_uint32_t count_active; /* currently active request using the worker (atomic) */
     proxy_worker_shared *shared;
     int index; /* like the worker->id */
+    node_hot_t *hot; /* hot runtime state of the node (mirror of worker->s) */
+    int warm; /* connections to open once the node is usable (0: none, protected by lock) */
 };
 typedef struct  proxy_cluster_helper proxy_cluster_helper;
 
+/* like PROXY_WORKER_IS_USABLE() but using the hot state */
+#define NODE_HOT_IS_USABLE(h) (!((h)->s.status & PROXY_WORKER_NOT_USABLE_BITMAP) && \
+                               ((h)->s.status & PROXY_WORKER_INITIALIZED))
+
+/* a worker of a balancer that can be elected and its node */
+struct proxy_cluster_candidate {
+    proxy_worker *worker;
+    proxy_cluster_helper *helper;
+    node_hot_t *hot;          /* what the election reads */
+    int id;                   /* id of the node in the node table */
+    nodeinfo_t *node;         /* the node in shared memory */
+    apr_uint64_t hash;        /* hash of the route (deterministic failover) */
+};
+typedef struct proxy_cluster_candidate proxy_cluster_candidate;
+
+/*
+ * The candidates of a balancer, published in balancer->context.
+ * The array is never modified once published: when the nodes or the workers
+ * change a new one is built and the old one is destroyed by the last
+ * election that used it.
+ */
+struct proxy_cluster_candidates {
+    cluster_shared shared;    /* first: the pool and the references */
+    unsigned int version;     /* version of the node table */
+    unsigned int generation;  /* get_workers_generation() of the conf */
+    int nworkers;             /* balancer->workers->nelts */
+    int ncandidates;
+    int method;               /* ELECTION_* of the balancer */
+    proxy_cluster_candidate *candidates;
+};
+typedef struct proxy_cluster_candidates proxy_cluster_candidates;
+
 static struct node_storage_method *node_storage = NULL; 
 static struct host_storage_method *host_storage = NULL; 
 static struct context_storage_method *context_storage = NULL; 
@@ -81,35 +122,111 @@ static struct balancer_storage_method *balancer_storage = NULL;
 static struct sessionid_storage_method *sessionid_storage = NULL; 
 static struct domain_storage_method *domain_storage = NULL; 
 
+/* latency histograms in the shared memory of mod_manager (NULL: not recorded) */
+static cluster_metrics_t *metrics = NULL;
+
+module AP_MODULE_DECLARE_DATA proxy_cluster_module;
+
 #define LB_CLUSTER_WATHCHDOG_NAME ("_mod_cluster_")
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *mc_watchdog_set_interval;
 static ap_watchdog_t *watchdog;
 
 static apr_thread_mutex_t *lock = NULL;
 
+/*
+ * The watchdog sweep runs every SWEEP_MIN_INTERVAL, the lbstatus and the
+ * ping/pong of the nodes run that often when the nodes change and back off
+ * to LBstatusRecalTime when they don't (decided in the sweep of the main
+ * server, the watchdog thread calls the servers one after the other).
+ * The new nodes are picked up by the reconcile thread of each child as soon
+ * as mod_manager changes the version.
+ */
+#define SWEEP_MIN_INTERVAL apr_time_from_sec(1)
+static apr_interval_time_t lbstatus_interval = SWEEP_MIN_INTERVAL;
+static apr_time_t lbstatus_next = 0;
+static int lbstatus_due = 1;
+static unsigned int sweep_version = 0;
+#define RECONCILE_WAIT apr_time_from_sec(1)
+#if APR_HAS_THREADS
+static volatile int reconcile_stop = 0;
+static apr_thread_t *reconcile_thread = NULL;
+#endif
+
 static server_rec *main_server = NULL;
+
+/*
+ * The nodes marked removed found in the change journal that still have to
+ * be processed (their workers are busy or they are not removed long enough).
+ */
+struct proxy_cluster_removed {
+    unsigned int seq;         /* last change processed */
+    int synced;               /* 0: the journal was never read */
+    apr_array_header_t *ids;  /* ids of the nodes */
+};
+typedef struct proxy_cluster_removed proxy_cluster_removed;
+
+/* where a server is in the change journal of mod_manager (protected by lock) */
+struct proxy_cluster_journal {
+    server_rec *server;
+    unsigned int seq;         /* last change processed */
+    int synced;               /* 0: the nodes were never read */
+    proxy_cluster_removed removed; /* for remove_workers_nodes() */
+};
+typedef struct proxy_cluster_journal proxy_cluster_journal;
+static apr_hash_t *journals = NULL;
+static proxy_cluster_removed removed_nodes; /* for remove_removed_node() (watchdog thread) */
+#define JOURNAL_CHANGES 64
 #define CREAT_ALL  0 /* create balancers/workers in all VirtualHost */
 #define CREAT_NONE 1 /* don't create balancers (but add workers) */
 #define CREAT_ROOT 2 /* Only create balancers/workers in the main server */
 static int creat_bal = CREAT_ROOT;
 
+/*
+ * ShareWorkers On: the workers of a balancer are created once per process in
+ * a balancer that isn't in any proxy_server_conf, the balancers of the
+ * VirtualHosts with the same name use its workers array (and the connection
+ * pools of its workers).
+ */
+static int share_workers = 0;
+static apr_hash_t *shared_balancers = NULL; /* name -> proxy_balancer (protected by lock) */
+
 static int use_alias = 0; /* 1 : Compare Alias with server_name */
 static int deterministic_failover = 0;
 
+/*
+ * A node that joins (or comes back) starts with cold connection pools: each
+ * child opens WarmConnections connections to it in the reconcile thread and
+ * its lbfactor ramps up from 1 during SlowStart seconds. The CONFIG message
+ * can change both for a balancer.
+ */
+static int warm_connections = 0;
+static int slow_start = 0;
+static int warm_pending = 0; /* some helpers have warm != 0 (protected by lock) */
+
+/* election methods of the balancers (ElectionMethod, ELECTION_ are in balancer.h) */
+#define P2C_TRIES                 8 /* random picks before checking all the workers */
+
+static int election_method = ELECTION_BYREQUESTS;
+static apr_table_t *election_methods = NULL; /* balancer name -> method */
+
 static apr_time_t lbstatus_recalc_time = apr_time_from_sec(5); /* recalcul the lbstatus based on number of request in the time interval */
 
 static apr_time_t wait_for_remove =  apr_time_from_sec(10); /* wait until that before removing a removed node */
 
 static int enable_options = -1; /* Use OPTIONS * for CPING/CPONG */
 
-#define TIMESESSIONID 300                    /* after 5 minutes the sessionid have probably timeout */
+static int sessionid_timeout = 0; /* seconds before a sessionid not seen is removed, 0: never */
 #define TIMEDOMAIN    300                    /* after 5 minutes the sessionid have probably timeout */
 
-static int proxy_worker_cmp(const void *a, const void *b)
+/* FNV-1a 64 bits */
+static apr_uint64_t cluster_hash(const char *str)
 {
-    const char *route1 = (*(proxy_worker **) a)->s->route;
-    const char *route2 = (*(proxy_worker **) b)->s->route;
-    return strcmp(route1, route2);
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    for (; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= APR_UINT64_C(1099511628211);
+    }
+    return hash;
 }
 
 /* compare proxy host with node host */
@@ -138,6 +255,190 @@ static char * normalize_hostname(apr_pool_t *p, char *hostname)
 static int (*ap_proxy_retry_worker_fn)(const char *proxy_function,
         proxy_worker *worker, server_rec *s) = NULL;
 
+static balancerinfo_t *read_balancer_name(const char *name, apr_pool_t *pool)
+{
+    int sizebal, i;
+    int *bal;
+    sizebal =  balancer_storage->get_max_size_balancer();
+    if (sizebal == 0)
+        return NULL; /* Done broken. */
+    bal = apr_pcalloc(pool, sizeof(int) * sizebal);
+    sizebal = balancer_storage->get_ids_used_balancer(bal);
+    for (i=0; i<sizebal; i++) {
+        balancerinfo_t *balan;
+        balancer_storage->read_balancer(bal[i], &balan);
+        /* Something like balancer://cluster1 and cluster1 */
+        if (strcmp(balan->balancer, name) == 0) {
+            return balan;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The lbfactor of a node during its slow start: it grows linearly from 1
+ * to the lbfactor of the STATUS in ramp seconds, the election reads it in
+ * the hot state so the sweep updates it there too.
+ */
+static int slow_start_lbfactor(node_hot_t *hot, int lbfactor)
+{
+    apr_uint32_t elapsed;
+
+    if (lbfactor <= 0 || hot->s.rampstart == 0)
+        return lbfactor;
+    elapsed = (apr_uint32_t) apr_time_sec(apr_time_now()) - hot->s.rampstart;
+    if (elapsed >= hot->s.ramp) {
+        hot->s.rampstart = 0; /* done */
+        return lbfactor;
+    }
+    lbfactor = (int) (((apr_uint64_t) lbfactor * elapsed) / hot->s.ramp);
+    return lbfactor > 0 ? lbfactor : 1;
+}
+
+/* the node of the worker becomes usable: start its slow start */
+static void start_slow_start(proxy_worker *worker, nodeinfo_t *node, apr_pool_t *pool)
+{
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+    balancerinfo_t *balan;
+    int ramp = slow_start;
+
+    if (helper == NULL || helper->hot == NULL)
+        return;
+    balan = read_balancer_name(node->mess.balancer, pool);
+    if (balan && balan->SlowStart >= 0)
+        ramp = balan->SlowStart;
+    if (ramp > 0) {
+        helper->hot->s.ramp = ramp;
+        helper->hot->s.rampstart = (apr_uint32_t) apr_time_sec(apr_time_now());
+    } else
+        helper->hot->s.rampstart = 0;
+}
+
+/* the worker gets a new node: open its connections once it is usable (called with lock held) */
+static void warm_worker_later(proxy_cluster_helper *helper, nodeinfo_t *node, apr_pool_t *pool)
+{
+    balancerinfo_t *balan = read_balancer_name(node->mess.balancer, pool);
+
+    helper->warm = warm_connections;
+    if (balan && balan->WarmConnections >= 0)
+        helper->warm = balan->WarmConnections;
+    if (helper->warm)
+        warm_pending = 1;
+}
+
+/*
+ * Copy the balancing fields of the worker shared memory (mod_proxy changes
+ * some of them) to the hot state of its node. elected and busy aren't
+ * copied: the children update them atomically in both places (a store
+ * here would lose their updates), the line starts at 0 with the node.
+ * @param node the node of the worker or NULL (id and oldelected unchanged).
+ */
+static void sync_node_hot(proxy_worker *worker, nodeinfo_t *node)
+{
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+    node_hot_t *hot;
+
+    if (helper == NULL || (hot = helper->hot) == NULL)
+        return;
+    hot->s.status = worker->s->status;
+    hot->s.lbfactor = slow_start_lbfactor(hot, worker->s->lbfactor);
+    hot->s.lbstatus = worker->s->lbstatus;
+    hot->s.read = worker->s->read;
+    if (node) {
+        hot->s.oldelected = (apr_uint32_t) node->mess.oldelected;
+        hot->s.id = node->mess.id;
+    }
+}
+
+static node_hot_t *worker_hot(proxy_worker *worker)
+{
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+    return helper ? helper->hot : NULL;
+}
+
+/* count an election of the worker */
+static void inc_elected(proxy_worker *worker)
+{
+    node_hot_t *hot = worker_hot(worker);
+    CLUSTER_ATOMIC_INC(&worker->s->elected);
+    if (hot)
+        apr_atomic_inc32(&hot->s.elected);
+}
+
+/* add a response of the worker to the averages of its node */
+static void record_response(proxy_worker *worker, apr_interval_time_t elapsed, int failed)
+{
+    node_hot_t *hot = worker_hot(worker);
+
+    if (hot == NULL)
+        return;
+    cluster_latency_record(&hot->s.rt, &hot->s.errors, elapsed, failed);
+}
+
+/* decrement the busy counter of the worker shared memory, it must not go under 0 */
+static void decrement_busy(volatile apr_size_t *counter)
+{
+    apr_size_t busy;
+    do {
+        busy = *counter;
+        if (busy == 0)
+            break;
+    } while (CLUSTER_ATOMIC_CAS(counter, busy - 1, busy) != busy);
+}
+
+/* the same for a counter of mod_cluster (the hot state) */
+static void decrement_busy32(volatile apr_uint32_t *counter)
+{
+    apr_uint32_t busy;
+    do {
+        busy = apr_atomic_read32(counter);
+        if (busy == 0)
+            break;
+    } while (apr_atomic_cas32(counter, busy - 1, busy) != busy);
+}
+
+/* the workers of conf changed, with ShareWorkers they are the workers of all the VirtualHosts */
+static void workers_changed(proxy_server_conf *conf)
+{
+    server_rec *s = main_server;
+
+    if (!share_workers) {
+        cluster_maps_changed(conf);
+        return;
+    }
+    while (s) {
+        cluster_maps_changed((proxy_server_conf *) ap_get_module_config(s->module_config, &proxy_module));
+        s = s->next;
+    }
+}
+
+/* attach the worker to the hot state of its node */
+static void attach_node_hot(proxy_server_conf *conf, proxy_worker *worker, nodeinfo_t *node)
+{
+    proxy_cluster_helper *helper = (proxy_cluster_helper *) worker->context;
+    node_hot_t *hot = node_storage->get_node_hot(node->mess.id);
+    if (helper->hot != hot) {
+        helper->hot = hot;
+        workers_changed(conf); /* the candidates skip the workers without hot state */
+    }
+    sync_node_hot(worker, node);
+}
+
+/* rebuild the maps that need it after changing the workers of conf, called with lock held */
+static void update_maps(proxy_server_conf *conf)
+{
+    server_rec *s = main_server;
+
+    if (!share_workers) {
+        update_cluster_maps(conf);
+        return;
+    }
+    while (s) {
+        update_cluster_maps((proxy_server_conf *) ap_get_module_config(s->module_config, &proxy_module));
+        s = s->next;
+    }
+}
+
 /**
  * Add a node to the worker conf
  * XXX: Contains code of ap_proxy_initialize_worker (proxy_util.c)
@@ -190,12 +491,14 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
             return APR_EGENERAL;
         }
 
-        worker->context = (proxy_cluster_helper *) apr_pcalloc(conf->pool,  sizeof(proxy_cluster_helper));
+        /* at least a cache line so the counters of 2 workers never share one */
+        worker->context = (proxy_cluster_helper *) apr_pcalloc(conf->pool,  APR_ALIGN(sizeof(proxy_cluster_helper), CLUSTER_CACHE_LINE));
         if (!worker->context)
             return APR_EGENERAL;
         helper = (proxy_cluster_helper *) worker->context;
         helper->count_active = 0;
         helper->shared = worker->s;
+        workers_changed(conf);
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
                      "Created: worker for %s", url);
     } else {
@@ -203,7 +506,7 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
             /* That is BalancerMember */
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
                          "Created: reusing BalancerMember worker for %s", url);
-            worker->context = (proxy_cluster_helper *) apr_pcalloc(conf->pool,  sizeof(proxy_cluster_helper));
+            worker->context = (proxy_cluster_helper *) apr_pcalloc(conf->pool,  APR_ALIGN(sizeof(proxy_cluster_helper), CLUSTER_CACHE_LINE));
             if (!worker->context)
                 return APR_EGENERAL;
             helper = (proxy_cluster_helper *) worker->context;
@@ -234,7 +537,9 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
                     worker->s->redirect[0] = '\0';
                     worker->s->lbstatus = 0;
                     worker->s->lbfactor = -1; /* prevent using the node using status message */
+                    workers_changed(conf); /* new route */
                 }
+                attach_node_hot(conf, worker, node);
                 return APR_SUCCESS; /* Done Already existing */
             } else {
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
@@ -245,12 +550,15 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
                 worker->s = (proxy_worker_shared *) ptr;
                 worker->s->was_malloced = 0; /* Prevent mod_proxy to free it */
                 helper->index = node->mess.id;
+                warm_worker_later(helper, node, pool);
+                workers_changed(conf);
 
                 if ((rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
                     ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
                                  "ap_proxy_initialize_worker failed %d for %s", rv, url);
                     return rv;
                 }
+                attach_node_hot(conf, worker, node);
                 return APR_SUCCESS;
             }
         }
@@ -262,13 +570,16 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
      * 1 - the worker was created.
      * 2 - it is the BalancerMember and we try to change the shared status.
      * 3 - we are reusing a removed worker.
+     * Only the record of the node is changed: lock it, not the nodes.
      */
-    node_storage->lock_nodes();
+    node_storage->lock_node(node->mess.id);
     ptr = (char *) node;
     ptr = ptr + node->offset;
     shared = worker->s;
     worker->s = (proxy_worker_shared *) ptr;
     helper->index = node->mess.id;
+    warm_worker_later(helper, node, pool);
+    workers_changed(conf);
 
     /* Changing the shared memory requires looking it... */
     if (strncmp(worker->s->name, shared->name, sizeof(worker->s->name))) {
@@ -311,7 +622,7 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
     if ((rv = ap_proxy_initialize_worker(worker, server, conf->pool)) != APR_SUCCESS) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, server,
                      "ap_proxy_initialize_worker failed %d for %s", rv, url);
-        node_storage->unlock_nodes();
+        node_storage->unlock_node(node->mess.id);
         return rv;
     }
 
@@ -325,29 +636,48 @@ static apr_status_t create_worker(proxy_server_conf *conf, proxy_balancer *balan
         worker->s->lbstatus = 0;
         worker->s->lbfactor = -1; /* prevent using the node using status message */
     }
+    attach_node_hot(conf, worker, node);
 
-    node_storage->unlock_nodes();
+    node_storage->unlock_node(node->mess.id);
     return rv;
 }
 
-static balancerinfo_t *read_balancer_name(const char *name, apr_pool_t *pool)
+/*
+ * Initialize a new (zeroed) balancer.
+ * @param balancer the balancer.
+ * @param name the name of the balancer (balancer://name).
+ * @param conf the proxy_server_conf (its pool is used).
+ * @server the server rec for logging purposes.
+ */
+static apr_status_t init_balancer(proxy_balancer *balancer, const char *name, proxy_server_conf *conf,
+                                  server_rec *server)
 {
-    int sizebal, i;
-    int *bal;
-    sizebal =  balancer_storage->get_max_size_balancer();
-    if (sizebal == 0)
-        return NULL; /* Done broken. */
-    bal = apr_pcalloc(pool, sizeof(int) * sizebal);
-    sizebal = balancer_storage->get_ids_used_balancer(bal);
-    for (i=0; i<sizebal; i++) {
-        balancerinfo_t *balan;
-        balancer_storage->read_balancer(bal[i], &balan);
-        /* Something like balancer://cluster1 and cluster1 */
-        if (strcmp(balan->balancer, name) == 0) {
-            return balan;
-        }
+    proxy_balancer_shared *bshared;
+
+    balancer->gmutex = NULL;
+    bshared = apr_palloc(conf->pool, sizeof(proxy_balancer_shared));
+    memset(bshared, 0, sizeof(proxy_balancer_shared));
+    if (PROXY_STRNCPY(bshared->sname, name) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE|APLOG_NOERRNO, 0, server,
+                      "add_balancer_node: balancer safe-name (%s) too long", name);
+        return APR_EGENERAL;
     }
-    return NULL;
+    bshared->hash.def = ap_proxy_hashfunc(name, PROXY_HASHFUNC_DEFAULT);
+    bshared->hash.fnv = ap_proxy_hashfunc(name, PROXY_HASHFUNC_FNV);
+    balancer->s = bshared;
+    balancer->hash = bshared->hash;
+    balancer->sconf = conf;
+    if (apr_thread_mutex_create(&(balancer->tmutex),
+                APR_THREAD_MUTEX_DEFAULT, conf->pool) != APR_SUCCESS) {
+        /* XXX: Do we need to log something here? */
+        ap_log_error(APLOG_MARK, APLOG_NOTICE|APLOG_NOERRNO, 0, server,
+                      "add_balancer_node: Can't create lock for balancer");
+    }
+    balancer->workers = apr_array_make(conf->pool, 5, sizeof(proxy_worker *));
+    strncpy(balancer->s->name, name, PROXY_BALANCER_MAX_NAME_SIZE-1);
+    /* XXX: TODO we should have our own lbmethod(s), this one is the mod_proxy_balancer default one! */
+    balancer->lbmethod = ap_lookup_provider(PROXY_LBMETHOD, "byrequests", "0");
+    return APR_SUCCESS;
 }
 
 /**
@@ -370,36 +700,15 @@ static proxy_balancer *add_balancer_node(nodeinfo_t *node, proxy_server_conf *co
     balancer = ap_proxy_get_balancer(pool, conf, name, 0);
     if (!balancer) {
        int sizeb = conf->balancers->elt_size;
-       proxy_balancer_shared *bshared;
        ap_log_error(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, server,
                     "add_balancer_node: Create balancer %s", name);
 
        balancer = apr_array_push(conf->balancers);
        memset(balancer, 0, sizeb);
+       cluster_maps_changed(conf); /* the array may have moved too */
 
-        balancer->gmutex = NULL;
-        bshared = apr_palloc(conf->pool, sizeof(proxy_balancer_shared));
-        memset(bshared, 0, sizeof(proxy_balancer_shared));
-        if (PROXY_STRNCPY(bshared->sname, name) != APR_SUCCESS) {
-            ap_log_error(APLOG_MARK, APLOG_NOTICE|APLOG_NOERRNO, 0, server,
-                          "add_balancer_node: balancer safe-name (%s) too long", name);
+        if (init_balancer(balancer, name, conf, server) != APR_SUCCESS)
             return NULL;
-        }
-        bshared->hash.def = ap_proxy_hashfunc(name, PROXY_HASHFUNC_DEFAULT);
-        bshared->hash.fnv = ap_proxy_hashfunc(name, PROXY_HASHFUNC_FNV);
-        balancer->s = bshared;
-        balancer->hash = bshared->hash;
-        balancer->sconf = conf;
-        if (apr_thread_mutex_create(&(balancer->tmutex),
-                    APR_THREAD_MUTEX_DEFAULT, conf->pool) != APR_SUCCESS) {
-            /* XXX: Do we need to log something here? */
-            ap_log_error(APLOG_MARK, APLOG_NOTICE|APLOG_NOERRNO, 0, server,
-                          "add_balancer_node: Can't create lock for balancer");
-        }
-        balancer->workers = apr_array_make(conf->pool, 5, sizeof(proxy_worker *));
-        strncpy(balancer->s->name, name, PROXY_BALANCER_MAX_NAME_SIZE-1);
-        /* XXX: TODO we should have our own lbmethod(s), this one is the mod_proxy_balancer default one! */
-        balancer->lbmethod = ap_lookup_provider(PROXY_LBMETHOD, "byrequests", "0");
     } else {
         ap_log_error(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, server,
                       "add_balancer_node: Using balancer %s", name);
@@ -487,6 +796,54 @@ static void reuse_balancer(proxy_balancer *balancer, char *name, apr_pool_t *poo
         }
     }
 }
+/*
+ * The process-wide balancer holding the shared workers of the balancer of
+ * the node (ShareWorkers On), called with lock held.
+ */
+static proxy_balancer *get_shared_balancer(nodeinfo_t *node, apr_pool_t *pool)
+{
+    proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(main_server->module_config, &proxy_module);
+    proxy_balancer *balancer;
+    char *name;
+
+    balancer = apr_hash_get(shared_balancers, node->mess.balancer, APR_HASH_KEY_STRING);
+    if (balancer)
+        return balancer;
+    name = apr_pstrcat(pool, "balancer://", node->mess.balancer, NULL);
+    ap_log_error(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, main_server,
+                 "get_shared_balancer: Create shared workers for %s", name);
+    balancer = apr_pcalloc(conf->pool, sizeof(proxy_balancer));
+    if (init_balancer(balancer, name, conf, main_server) != APR_SUCCESS)
+        return NULL;
+    apr_hash_set(shared_balancers, apr_pstrdup(conf->pool, node->mess.balancer), APR_HASH_KEY_STRING, balancer);
+    return balancer;
+}
+
+/*
+ * Create the worker of the node in the balancer of the VirtualHost.
+ * With ShareWorkers the balancer uses the shared workers instead, unless
+ * it already has its own workers (BalancerMember).
+ */
+static void add_balancer_worker(proxy_server_conf *conf, proxy_balancer *balancer, server_rec *s,
+                                nodeinfo_t *node, apr_pool_t *pool)
+{
+    if (share_workers) {
+        proxy_balancer *shared = get_shared_balancer(node, pool);
+        if (shared && (balancer->workers == shared->workers || balancer->workers->nelts == 0)) {
+            if (balancer->workers != shared->workers) {
+                balancer->workers = shared->workers;
+                cluster_maps_changed(conf);
+            }
+            create_worker((proxy_server_conf *) ap_get_module_config(main_server->module_config, &proxy_module),
+                          shared, main_server, node, pool);
+            return;
+        }
+        ap_log_error(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, s,
+                     "add_balancer_worker: %s has its own workers", balancer->s->name);
+    }
+    create_worker(conf, balancer, s, node, pool);
+}
+
 /*
  * Adds the balancers and the workers to the VirtualHosts corresponding to node
  * Note that the calling routine should lock before calling us.
@@ -515,7 +872,8 @@ static void add_balancers_workers(nodeinfo_t *node, apr_pool_t *pool)
             reuse_balancer(balancer, &balancer->s->name[11], pool, s);
         }
         if (balancer)
-            create_worker(conf, balancer, s, node, pool);
+            add_balancer_worker(conf, balancer, s, node, pool);
+        update_cluster_maps(conf); /* we go through all the VirtualHosts */
         s = s->next;
     }
 }
@@ -546,7 +904,7 @@ static void add_balancers_workers_for_server(nodeinfo_t *node, apr_pool_t *pool,
         reuse_balancer(balancer, &balancer->s->name[11], pool, s);
     }
     if (balancer)
-        create_worker(conf, balancer, s, node, pool);
+        add_balancer_worker(conf, balancer, s, node, pool);
 }
 
 
@@ -575,6 +933,8 @@ static proxy_worker *get_worker_from_id_stat(proxy_server_conf *conf, int id, pr
                     compare_hostname((*worker)->s->hostname, node->mess.Host) ||
                     strcmp(sport, node->mess.Port)) {
                     (*worker)->s->index = 0;
+                    if (helper->hot)
+                        helper->hot->s.id = 0; /* don't elect it */
                     /* XXX: broken  ap_my_generation--; mark old generation that will recreate the process */
                     continue; /* skip it */
                 }
@@ -606,13 +966,14 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
 
     /* prevent other threads using it */
     worker->s->status = worker->s->status | PROXY_WORKER_IN_ERROR;
+    sync_node_hot(worker, NULL);
 
     /* apr_reslist_acquired_count */
     i = 0;
 
     helper = (proxy_cluster_helper *) worker->context;
     if (helper) {
-        i = helper->count_active;
+        i = apr_atomic_read32(&helper->count_active);
     }
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
              "remove_workers_node (helper) count_active: %d JVMRoute: %s", i, node->mess.JVMRoute);
@@ -624,15 +985,73 @@ static int remove_workers_node(nodeinfo_t *node, proxy_server_conf *conf, apr_po
 
         /* Here that is tricky the worker needs shared memory but we don't and CONFIG will reset it */
         helper->index = 0; /* mark it removed */
+        helper->hot = NULL;
+        helper->warm = 0;
         worker->s = helper->shared;
         memcpy(worker->s, stat, sizeof(proxy_worker_shared));
+        workers_changed(conf);
 
         return (0);
     } else {
+        node_storage->lock_node(node->mess.id);
         node->mess.lastcleantry = apr_time_now();
+        node_storage->unlock_node(node->mess.id);
         return (1); /* We should retry later */
     }
 }
+/* the position of the server in the change journal, called with lock held */
+static proxy_cluster_journal *get_journal(server_rec *server)
+{
+    proxy_cluster_journal *pos = apr_hash_get(journals, &server, sizeof(server_rec *));
+    if (pos == NULL) {
+        pos = apr_pcalloc(apr_hash_pool_get(journals), sizeof(proxy_cluster_journal));
+        pos->server = server;
+        pos->removed.ids = apr_array_make(apr_hash_pool_get(journals), 16, sizeof(int));
+        apr_hash_set(journals, &pos->server, sizeof(server_rec *), pos);
+    }
+    return pos;
+}
+/*
+ * Create the workers of the nodes changed since the last call for the server
+ * using the change journal, called with lock held.
+ * @return 0 if the whole node table has to be read instead.
+ */
+static int apply_node_changes(apr_pool_t *pool, server_rec *server)
+{
+    proxy_cluster_journal *pos;
+    table_change_t changes[JOURNAL_CHANGES];
+    int n, i;
+
+    if (journals == NULL || node_storage->get_changes == NULL)
+        return 0;
+    pos = get_journal(server);
+    if (!pos->synced) {
+        /* the changes after that will be processed next time */
+        node_storage->get_changes(&pos->seq, changes, 0);
+        pos->synced = 1;
+        return 0;
+    }
+    do {
+        n = node_storage->get_changes(&pos->seq, changes, JOURNAL_CHANGES);
+        if (n < 0) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "update_workers_node: changes lost reading all the nodes");
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            nodeinfo_t *ou;
+            if (changes[i].table != TABLE_NODE || changes[i].op != CHANGE_UPDATE)
+                continue; /* removed nodes are processed by remove_workers_nodes() */
+            if (node_storage->read_node(changes[i].id, &ou) != APR_SUCCESS)
+                continue;
+            if (ou->mess.remove)
+                continue;
+            add_balancers_workers_for_server(ou, pool, server);
+        }
+    } while (n == JOURNAL_CHANGES);
+    return 1;
+}
+
 /*
  * Create/Remove workers corresponding to updated nodes.
  * NOTE: It is called from proxy_cluster_watchdog_func and other locations
@@ -643,7 +1062,9 @@ static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, serve
     int *id, size, i;
     unsigned int last;
 
-    /* Check if we have to do something */
+    /* Check if we have to do something (without the lock, the check only reads the version) */
+    if (check && node_storage->worker_nodes_need_update(main_server, pool) == 0)
+        return;
     apr_thread_mutex_lock(lock);
     if (check) { 
         last = node_storage->worker_nodes_need_update(main_server, pool);
@@ -654,6 +1075,15 @@ static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, serve
         }
     }
 
+    /* Only process the nodes that have been updated since our last update */
+    if (apply_node_changes(pool, server)) {
+        update_maps(conf);
+        apr_thread_mutex_unlock(lock);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                 "update_workers_node done (changes)");
+        return;
+    }
+
     /* read the ident of the nodes */
     size = node_storage->get_max_size_node();
     if (size == 0) {
@@ -668,7 +1098,6 @@ static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, serve
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
              "update_workers_node starting");
 
-    /* Only process the nodes that have been updated since our last update */
     for (i=0; i<size; i++) {
         nodeinfo_t *ou;
         if (node_storage->read_node(id[i], &ou) != APR_SUCCESS)
@@ -677,6 +1106,7 @@ static void update_workers_node(proxy_server_conf *conf, apr_pool_t *pool, serve
             continue;
         add_balancers_workers_for_server(ou, pool, server);
     } 
+    update_maps(conf);
 
     apr_thread_mutex_unlock(lock);
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
@@ -884,6 +1314,7 @@ static apr_status_t proxy_cluster_try_pingpong(request_rec *r, proxy_worker *wor
 {
     apr_status_t status;
     apr_interval_time_t timeout;
+    apr_time_t start;
     proxy_conn_rec *backend = NULL;
     char server_portstr[32];
     char *locurl = url;
@@ -965,7 +1396,10 @@ static apr_status_t proxy_cluster_try_pingpong(request_rec *r, proxy_worker *wor
     }
 
     if (strcasecmp(scheme, "AJP") == 0) {
+        start = apr_time_now();
         status = ajp_handle_cping_cpong(backend->sock, r, timeout);
+        if (status == APR_SUCCESS && metrics)
+            cluster_hist_observe(&metrics->cping, apr_time_now() - start);
         if (status != APR_SUCCESS) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy_cluster_try_pingpong: cping_cpong failed");
@@ -989,7 +1423,10 @@ static apr_status_t proxy_cluster_try_pingpong(request_rec *r, proxy_worker *wor
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                 "proxy_cluster_try_pingpong: trying %s"
                 , backend->connection->client_ip);
+        start = apr_time_now();
         status = http_handle_cping_cpong(backend, r, timeout);
+        if (status == APR_SUCCESS && metrics)
+            cluster_hist_observe(&metrics->cping, apr_time_now() - start);
         if (status != APR_SUCCESS) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy_cluster_try_pingpong: cping_cpong failed");
@@ -1000,23 +1437,272 @@ static apr_status_t proxy_cluster_try_pingpong(request_rec *r, proxy_worker *wor
     return status;
 }
 
-/* read the node and check that it corresponds to the worker */
+/* read the node and check that it corresponds to the worker (using a consistent copy) */
 static apr_status_t read_node_worker(int id, nodeinfo_t **node, proxy_worker *worker)
 {
     char sport[7];
+    nodeinfo_t copy;
     apr_status_t status = node_storage->read_node(id, node);
+    if (status != APR_SUCCESS)
+        return status;
+    status = node_storage->copy_node(id, &copy);
     if (status != APR_SUCCESS)
         return status;
     apr_snprintf(sport, sizeof(sport), "%d", worker->s->port);
-    if (strcmp(worker->s->scheme, (* node)->mess.Type) ||
-        compare_hostname(worker->s->hostname, (* node)->mess.Host) ||
-        strcmp(sport, (* node)->mess.Port)) {
+    if (strcmp(worker->s->scheme, copy.mess.Type) ||
+        compare_hostname(worker->s->hostname, copy.mess.Host) ||
+        strcmp(sport, copy.mess.Port)) {
         /* for some reasons it is not the right node */
         return APR_NOTFOUND;
     }
     return APR_SUCCESS;
 }
 
+/* election method of the balancer: the one of its CONFIG messages, of ElectionMethod name or of ElectionMethod */
+static int get_election_method(proxy_balancer *balancer, apr_pool_t *pool)
+{
+    const char *method;
+    /* balancer://name */
+    balancerinfo_t *balan = read_balancer_name(&balancer->s->name[11], pool);
+
+    if (balan && balan->ElectionMethod >= 0)
+        return balan->ElectionMethod;
+    if (election_methods == NULL)
+        return election_method;
+    method = apr_table_get(election_methods, &balancer->s->name[11]);
+    if (method)
+        return atoi(method);
+    return election_method;
+}
+
+/* the candidates were built with the current nodes and workers of the balancer */
+static int candidates_are_current(proxy_cluster_candidates *cands, proxy_balancer *balancer,
+                                  unsigned int version, unsigned int generation)
+{
+    return (cands->version == version && cands->generation == generation &&
+            cands->nworkers == balancer->workers->nelts);
+}
+
+/*
+ * Get a reference to the candidates of the balancer, rebuilt them if the
+ * node table or the workers of the balancer (added, removed or attached to
+ * the hot state of a node) have changed since they were built.
+ * The checks that don't change while the node is not updated (the node
+ * corresponds to the worker and its shared memory) are done here once.
+ * The caller releases the reference with cluster_shared_release().
+ */
+static proxy_cluster_candidates *get_balancer_candidates(proxy_balancer *balancer, server_rec *server)
+{
+    proxy_cluster_candidates *cands, *old;
+    proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(server->module_config, &proxy_module);
+    cluster_shared **where = (cluster_shared **) &balancer->context;
+    apr_pool_t *pool;
+    unsigned int version, generation;
+    char *ptr;
+    int sizew, i;
+
+    version = node_storage->get_version_node();
+    generation = get_workers_generation(conf);
+    old = (proxy_cluster_candidates *) cluster_shared_acquire(where);
+    if (old && candidates_are_current(old, balancer, version, generation))
+        return old;
+
+    apr_thread_mutex_lock(lock);
+    /* the workers can't change while we hold the lock */
+    generation = get_workers_generation(conf);
+    if (old)
+        cluster_shared_release(&old->shared);
+    old = (proxy_cluster_candidates *) cluster_shared_acquire(where);
+    if (old && candidates_are_current(old, balancer, version, generation)) {
+        apr_thread_mutex_unlock(lock);
+        return old; /* another thread did it */
+    }
+    cands = cluster_shared_create(sizeof(proxy_cluster_candidates));
+    if (cands == NULL) {
+        apr_thread_mutex_unlock(lock);
+        return old;
+    }
+    pool = cands->shared.pool;
+    cands->version = version;
+    cands->generation = generation;
+    cands->nworkers = balancer->workers->nelts;
+    cands->method = get_election_method(balancer, pool);
+    cands->candidates = apr_pcalloc(pool, sizeof(proxy_cluster_candidate) * (cands->nworkers + 1));
+
+    ptr = balancer->workers->elts;
+    sizew = balancer->workers->elt_size;
+    for (i = 0; i < cands->nworkers; i++, ptr=ptr+sizew) {
+        proxy_worker *worker = *(proxy_worker **) ptr;
+        proxy_cluster_candidate *cand;
+        nodeinfo_t *node;
+        char *pptr;
+
+        if (!worker->s || !worker->context) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                         "proxy: byrequests balancer %s skipping BAD worker %s", balancer->s->name, worker->s ? worker->s->name : "NULL");
+            continue;
+        }
+        if (read_node_worker(worker->s->index, &node, worker) != APR_SUCCESS)
+            continue; /* Can't read node */
+        pptr = (char *) node;
+        pptr = pptr + node->offset;
+        if (worker->s != (proxy_worker_shared *) pptr)
+            continue; /* wrong shared memory address */
+
+        if (((proxy_cluster_helper *) worker->context)->hot == NULL)
+            continue; /* not attached to a node */
+
+        cand = &cands->candidates[cands->ncandidates++];
+        cand->worker = worker;
+        cand->helper = (proxy_cluster_helper *) worker->context;
+        cand->hot = cand->helper->hot;
+        cand->id = worker->s->index;
+        cand->node = node;
+        cand->hash = cluster_hash(worker->s->route);
+    }
+
+    /* the elections still using the old ones destroy them */
+    cluster_shared_publish(where, &cands->shared);
+    apr_thread_mutex_unlock(lock);
+    if (old)
+        cluster_shared_release(&old->shared);
+    return cands;
+}
+
+/* a ping/pong to do for update_workers_lbstatus() */
+struct proxy_cluster_probe {
+    int id;                    /* id of the node */
+    proxy_worker *worker;
+    request_rec *r;            /* dummy request for the ping */
+    char *url;
+    proxy_server_conf *conf;
+    apr_interval_time_t ping;
+    apr_interval_time_t timeout;
+    apr_status_t rv;           /* result */
+};
+typedef struct proxy_cluster_probe proxy_cluster_probe;
+
+struct proxy_cluster_probes {
+    proxy_cluster_probe *probes;
+    int nprobes;
+    apr_uint32_t next;         /* next probe to run (atomic) */
+};
+typedef struct proxy_cluster_probes proxy_cluster_probes;
+
+/* max number of threads doing the ping/pong at the same time */
+#define MAX_PROBE_THREADS 32
+
+/*
+ * A child pool with an allocator of its own (the allocator of the watchdog
+ * pool has no mutex): created by the parent thread, used by one thread.
+ * It is destroyed with its parent.
+ */
+static apr_pool_t *create_private_pool(apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *p;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        return NULL;
+    if (apr_pool_create_ex(&p, parent, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return NULL;
+    }
+    apr_allocator_owner_set(allocator, p);
+    return p;
+}
+
+static void run_probes(proxy_cluster_probes *probes)
+{
+    for (;;) {
+        proxy_cluster_probe *probe;
+        apr_uint32_t i = apr_atomic_inc32(&probes->next);
+        if (i >= (apr_uint32_t) probes->nprobes)
+            break;
+        probe = &probes->probes[i];
+        probe->rv = proxy_cluster_try_pingpong(probe->r, probe->worker, probe->url, probe->conf,
+                                               probe->ping, probe->timeout);
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC probe_thread(apr_thread_t *thd, void *data)
+{
+    run_probes((proxy_cluster_probes *) data);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+/*
+ * Do the ping/pong of the probes in parallel, each of them is bounded by the
+ * ping timeout of its node so all of them are done in about the biggest one.
+ */
+static void do_probes(proxy_cluster_probes *probes, apr_pool_t *pool, server_rec *server)
+{
+#if APR_HAS_THREADS
+    apr_thread_t **threads;
+    apr_pool_t *tpool;
+    int nthreads, i, created = 0;
+
+    nthreads = probes->nprobes;
+    if (nthreads > MAX_PROBE_THREADS)
+        nthreads = MAX_PROBE_THREADS;
+    if (nthreads > 1) {
+        threads = apr_pcalloc(pool, sizeof(apr_thread_t *) * nthreads);
+        for (i = 0; i < nthreads - 1; i++) {
+            apr_status_t rv = APR_ENOMEM;
+            /* the pool of the thread is created from it and destroyed by the thread */
+            tpool = create_private_pool(pool);
+            if (tpool)
+                rv = apr_thread_create(&threads[i], NULL, probe_thread, probes, tpool);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, server,
+                             "update_workers_lbstatus: can't create probe thread");
+                break;
+            }
+            created++;
+        }
+        /* this thread does its share too */
+        run_probes(probes);
+        for (i = 0; i < created; i++) {
+            apr_status_t rv;
+            apr_thread_join(&rv, threads[i]);
+        }
+        return;
+    }
+#endif
+    run_probes(probes);
+}
+
+/* a request for the mod_proxy functions that need one (the ping/pong, the warm up) */
+static request_rec *create_dummy_request(apr_pool_t *pool, server_rec *server, const char *method)
+{
+    apr_pool_t *rrp;
+    request_rec *rnew;
+
+    /* the probes use their request in parallel */
+    rrp = create_private_pool(pool);
+    if (rrp == NULL)
+        return NULL;
+    apr_pool_tag(rrp, "subrequest");
+    rnew = apr_pcalloc(rrp, sizeof(request_rec));
+    rnew->pool = rrp;
+    /* we need only those ones */
+    rnew->server = server;
+    rnew->connection = apr_pcalloc(rrp, sizeof(conn_rec));
+    rnew->connection->log_id = "-";
+    rnew->connection->conn_config = ap_create_conn_config(rrp);
+    rnew->log_id = "-";
+    rnew->useragent_addr = apr_pcalloc(rrp, sizeof(apr_sockaddr_t));
+    rnew->per_dir_config = server->lookup_defaults;
+    rnew->notes = apr_table_make(rnew->pool, 1);
+    rnew->method = method;
+    rnew->uri = "/";
+    rnew->headers_in = apr_table_make(rnew->pool, 1);
+    return rnew;
+}
+
 /*
  * update the lbfactor of each node if needed,
  */
@@ -1024,6 +1710,7 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
 {
     int *id, size, i;
     apr_time_t now;
+    proxy_cluster_probes probes;
 
     now = apr_time_now();
 
@@ -1033,6 +1720,9 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
         return;
     id = apr_pcalloc(pool, sizeof(int) * size);
     size = node_storage->get_ids_used_node(id);
+    probes.probes = apr_pcalloc(pool, sizeof(proxy_cluster_probe) * (size + 1));
+    probes.nprobes = 0;
+    probes.next = 0;
 
     /* update lbstatus if needed */
     for (i=0; i<size; i++) {
@@ -1046,19 +1736,43 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
             int elected, oldelected;
             apr_off_t read, oldread;
             proxy_worker_shared *stat;
+            node_hot_t *hot = node_storage->get_node_hot(id[i]);
             char *ptr = (char *) ou;
 
             ptr = ptr + ou->offset;
             stat = (proxy_worker_shared *) ptr;
-            elected = stat->elected;
-            read = stat->read;
-            oldelected = ou->mess.oldelected;
+            if (hot && hot->s.id == id[i]) {
+                /* the counters are in the hot state */
+                elected = apr_atomic_read32(&hot->s.elected);
+                read = hot->s.read;
+                oldelected = hot->s.oldelected;
+            } else {
+                hot = NULL;
+                elected = stat->elected;
+                read = stat->read;
+                oldelected = ou->mess.oldelected;
+            }
+            node_storage->lock_node(id[i]);
             oldread = ou->mess.oldread;
             ou->mess.updatetimelb = now;
             ou->mess.oldelected = elected;
             ou->mess.oldread = read;
-            if (stat->lbfactor > 0)
+            if (read != oldread)
+                ou->mess.num_failure_idle = 0;
+            if (hot) {
+                if (elected == oldelected) {
+                    cluster_ewma_decay(&hot->s.rt);
+                    cluster_ewma_decay(&hot->s.errors);
+                }
+                hot->s.oldelected = elected;
+                if (hot->s.rampstart)
+                    hot->s.lbfactor = slow_start_lbfactor(hot, stat->lbfactor);
+                if (hot->s.lbfactor > 0)
+                    hot->s.lbstatus = ((elected - oldelected) * 1000) / hot->s.lbfactor;
+                stat->lbstatus = hot->s.lbstatus;
+            } else if (stat->lbfactor > 0)
                 stat->lbstatus = ((elected - oldelected) * 1000) / stat->lbfactor;
+            node_storage->unlock_node(id[i]);
             if (read == oldread) {
                 /* lbstatus_recalc_time without changes: test for broken nodes   */
                 /* first get the worker, create a dummy request and do a ping    */
@@ -1068,10 +1782,9 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
                 /* establish so we use read to check for changes                 */ 
                 char sport[7];
                 char *url;
-                apr_status_t rv;
-                apr_pool_t *rrp;
                 request_rec *rnew;
                 proxy_worker *worker;
+                proxy_cluster_probe *probe;
                 apr_thread_mutex_lock(lock);
                 worker = get_worker_from_id_stat(conf, id[i], stat, ou);
                 apr_thread_mutex_unlock(lock);
@@ -1085,6 +1798,8 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
                     strcmp(sport, ou->mess.Port)) {
                     /* the worker doesn't correspond to the node */
                     worker->s->index = 0;
+                    if (worker_hot(worker))
+                        worker_hot(worker)->s.id = 0; /* don't elect it */
                     /* XXX: broken ap_my_generation--; mark old generation that will recreate the process */ 
                     continue; /* skip it */
                 }
@@ -1094,42 +1809,58 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
                 else
                     url = apr_pstrcat(pool, worker->s->scheme, "://", worker->s->hostname,  ":", sport, "/", NULL);
 
-                apr_pool_create(&rrp, pool);
-                apr_pool_tag(rrp, "subrequest");
-                rnew = apr_pcalloc(rrp, sizeof(request_rec));
-                rnew->pool = rrp;
-                /* we need only those ones */
-                rnew->server = server;
-                rnew->connection = apr_pcalloc(rrp, sizeof(conn_rec));
-                rnew->connection->log_id = "-";
-                rnew->connection->conn_config = ap_create_conn_config(rrp);
-                rnew->log_id = "-";
-                rnew->useragent_addr = apr_pcalloc(rrp, sizeof(apr_sockaddr_t));
-                rnew->per_dir_config = server->lookup_defaults;
-                rnew->notes = apr_table_make(rnew->pool, 1);
-                rnew->method = "PING";
-                rnew->uri = "/";
-                rnew->headers_in = apr_table_make(rnew->pool, 1);
-                rv = proxy_cluster_try_pingpong(rnew, worker, url, conf, ou->mess.ping, ou->mess.timeout);
-
-                if (read_node_worker(id[i], &ou, worker) != APR_SUCCESS)
+                rnew = create_dummy_request(pool, server, "PING");
+                if (rnew == NULL)
                     continue;
 
-                if (rv != APR_SUCCESS) {
-                    /* We can't reach the node: XXX changing ou->mess.updatetimelb here ??? */
-                    worker->s->status |= PROXY_WORKER_IN_ERROR;
-                    ou->mess.num_failure_idle++;
-                    if (ou->mess.num_failure_idle > 60) {
-                        /* Failing for 5 minutes: time to mark it removed */
-                        ou->mess.remove = 1;
-                        ou->updatetime = now;
-                    } 
-                } else
-                    ou->mess.num_failure_idle = 0;
-            } else
-                ou->mess.num_failure_idle = 0;
+                /* the ping/pong is done later with the other ones */
+                probe = &probes.probes[probes.nprobes++];
+                probe->id = id[i];
+                probe->worker = worker;
+                probe->r = rnew;
+                probe->url = url;
+                probe->conf = conf;
+                probe->ping = ou->mess.ping;
+                probe->timeout = ou->mess.timeout;
+            }
         } 
     } 
+
+    if (probes.nprobes == 0)
+        return;
+    do_probes(&probes, pool, server);
+
+    /* publish the results in the nodes */
+    for (i=0; i<probes.nprobes; i++) {
+        proxy_cluster_probe *probe = &probes.probes[i];
+        proxy_worker *worker = probe->worker;
+        nodeinfo_t *ou;
+        int removed = 0;
+
+        if (read_node_worker(probe->id, &ou, worker) != APR_SUCCESS)
+            continue;
+
+        if (probe->rv != APR_SUCCESS) {
+            /* We can't reach the node: XXX changing ou->mess.updatetimelb here ??? */
+            worker->s->status |= PROXY_WORKER_IN_ERROR;
+            sync_node_hot(worker, NULL);
+            node_storage->lock_node(probe->id);
+            ou->mess.num_failure_idle++;
+            if (ou->mess.num_failure_idle > 60) {
+                /* Failing for 5 minutes: time to mark it removed */
+                ou->mess.remove = 1;
+                ou->updatetime = now;
+                removed = 1;
+            } 
+            node_storage->unlock_node(probe->id);
+            if (removed)
+                node_storage->journal_node(probe->id);
+        } else {
+            node_storage->lock_node(probe->id);
+            ou->mess.num_failure_idle = 0;
+            node_storage->unlock_node(probe->id);
+        }
+    }
 }
 
 /*
@@ -1137,30 +1868,15 @@ static void update_workers_lbstatus(proxy_server_conf *conf, apr_pool_t *pool, s
  */
 static void remove_timeout_sessionid(proxy_server_conf *conf, apr_pool_t *pool, server_rec *server)
 {
-    int *id, size, i;
     apr_time_t now;
 
     now = apr_time_sec(apr_time_now());
 
-    /* read the ident of the sessionid */
-    size = sessionid_storage->get_max_size_sessionid();
-    if (size == 0)
-        return;
-    else
+    if (!sessionid_timeout || sessionid_storage->get_max_size_sessionid() == 0)
         return;
-    id = apr_pcalloc(pool, sizeof(int) * size);
-    size = sessionid_storage->get_ids_used_sessionid(id);
 
-    /* update lbstatus if needed */
-    for (i=0; i<size; i++) {
-        sessionidinfo_t *ou;
-        if (sessionid_storage->read_sessionid(id[i], &ou) != APR_SUCCESS)
-            continue;
-        if (ou->updatetime < (now - TIMESESSIONID)) {
-            /* Remove it */
-            sessionid_storage->remove_sessionid(ou);
-        } 
-    } 
+    /* the table is ordered by update time: only the expired ones are read */
+    sessionid_storage->remove_expired_sessionid(now - sessionid_timeout);
 }
 
 /*
@@ -1208,6 +1924,177 @@ static int isnode_domain_ok(request_rec *r, nodeinfo_t *node,
     return 0;
 }
 
+/*
+ * Check that the candidate can be elected for the request.
+ * return the node/context to use or NULL.
+ */
+static node_context *candidate_context_ok(request_rec *r, proxy_balancer *balancer, proxy_cluster_candidate *cand,
+                                          int checking_standby, int checked_domain, const char *domain,
+                                          proxy_vhost_table *vhost_table,
+                                          proxy_context_table *context_table, proxy_node_table *node_table)
+{
+    node_context *nodecontext;
+    nodeinfo_t *node = cand->node;
+    proxy_cluster_helper *helper = cand->helper;
+    node_hot_t *hot = cand->hot;
+
+    if (helper->index == 0)
+        return NULL; /* marked removed */
+    if (hot->s.id != cand->id) {
+        /* something is very bad */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
+                     "proxy: byrequests balancer skipping BAD worker");
+        return NULL; /* probably used by different worker */
+    }
+
+    /* standby logic
+     * lbfactor: -1 broken node.
+     *            0 standby.
+     *           >0 factor to use.
+     */
+    if (hot->s.lbfactor < 0 || (hot->s.lbfactor == 0 && !checking_standby))
+        return NULL;
+
+    /* If the worker is in error state the STATUS logic will retry it */
+    if (!NODE_HOT_IS_USABLE(hot)) {
+        return NULL;
+    }
+
+    /* Take into calculation only the workers that are
+     * not in error state or not disabled.
+     * and that can map the context.
+     * (the shared memory of the worker was checked when building the candidates)
+     */
+    if ((nodecontext = context_host_ok(r, balancer, cand->id, use_alias, vhost_table, context_table, node_table)) != NULL) {
+        if (!checked_domain) {
+            /* First try only nodes in the domain */
+            if (!isnode_domain_ok(r, node, domain)) {
+                return NULL;
+            }
+        }
+        return nodecontext;
+    }
+    return NULL;
+}
+
+/* the lbfactor/lbstatus/elected formula: 1 if cand is better than best */
+static int candidate_byrequests_better(proxy_cluster_candidate *cand, proxy_cluster_candidate *best)
+{
+    int lbstatus, lbstatus1;
+
+    lbstatus1 = ((apr_atomic_read32(&best->hot->s.elected) - best->hot->s.oldelected) * 1000)/best->hot->s.lbfactor;
+    lbstatus  = ((apr_atomic_read32(&cand->hot->s.elected) - cand->hot->s.oldelected) * 1000)/cand->hot->s.lbfactor;
+    lbstatus1 = lbstatus1 + best->hot->s.lbstatus;
+    lbstatus = lbstatus + cand->hot->s.lbstatus;
+    return (lbstatus1> lbstatus);
+}
+
+/*
+ * The outstanding requests of the candidate: the busy counter of its node
+ * (the requests of all the children) but never less than the count_active
+ * of the worker in this child (the hot line restarts at 0 when the node is
+ * inserted again while requests are still running).
+ */
+static apr_size_t candidate_outstanding(proxy_cluster_candidate *cand)
+{
+    apr_uint32_t busy = apr_atomic_read32(&cand->hot->s.busy);
+    apr_uint32_t active = apr_atomic_read32(&cand->helper->count_active);
+    return busy > active ? busy : active;
+}
+
+/*
+ * 1 if cand is better than best according to the election method.
+ * The outstanding requests are weighted by the lbfactor of the workers,
+ * ElectionMethod latency weights them by the averages of the response time
+ * and errors too.
+ */
+static int candidate_better(int method, proxy_cluster_candidate *cand, proxy_cluster_candidate *best)
+{
+    if (method == ELECTION_LATENCY) {
+        int cmp = cluster_latency_compare(candidate_outstanding(cand), cand->hot->s.rt, cand->hot->s.errors, cand->hot->s.lbfactor,
+                                          candidate_outstanding(best), best->hot->s.rt, best->hot->s.errors, best->hot->s.lbfactor);
+        if (cmp)
+            return (cmp < 0);
+    } else if (method != ELECTION_BYREQUESTS) {
+        apr_uint64_t load = (apr_uint64_t) candidate_outstanding(cand) * best->hot->s.lbfactor;
+        apr_uint64_t load1 = (apr_uint64_t) candidate_outstanding(best) * cand->hot->s.lbfactor;
+        if (load != load1)
+            return (load < load1);
+    }
+    return candidate_byrequests_better(cand, best);
+}
+
+/*
+ * Power of two choices: take 2 random candidates (weighted by their
+ * lbfactor) and elect the less loaded one.
+ * return NULL if we didn't find 2 candidates (the caller checks all of them).
+ */
+static proxy_cluster_candidate *p2c_candidate(request_rec *r, proxy_balancer *balancer, proxy_cluster_candidates *cands,
+                                              int checked_domain, const char *domain, node_context **mynodecontext,
+                                              proxy_vhost_table *vhost_table,
+                                              proxy_context_table *context_table, proxy_node_table *node_table)
+{
+    proxy_cluster_candidate *choices[2];
+    node_context *nodecontexts[2];
+    int n, picked = 0;
+
+    for (n = 0; n < P2C_TRIES && picked < 2; n++) {
+        proxy_cluster_candidate *cand = &cands->candidates[ap_random_pick(0, cands->ncandidates - 1)];
+        node_context *nodecontext;
+
+        if (picked && cand == choices[0])
+            continue;
+        /* keep the choice with a probability of lbfactor/100 */
+        if (cand->hot->s.lbfactor < 100 && (int) ap_random_pick(1, 100) > cand->hot->s.lbfactor)
+            continue;
+        nodecontext = candidate_context_ok(r, balancer, cand, 0, checked_domain, domain, vhost_table, context_table, node_table);
+        if (nodecontext == NULL)
+            continue;
+        choices[picked] = cand;
+        nodecontexts[picked] = nodecontext;
+        picked++;
+    }
+    if (picked < 2)
+        return NULL;
+    n = candidate_better(ELECTION_P2C, choices[1], choices[0]);
+    *mynodecontext = nodecontexts[n];
+    return choices[n];
+}
+
+/*
+ * Deterministic failover: weighted rendezvous hashing of the session over
+ * the routes of the candidates. Each candidate gets a score from the hash of
+ * the (session, route) pair and its lbfactor and the highest score wins, so
+ * adding or removing a node only moves the sessions that go to/come from it.
+ */
+static int rendezvous_candidate(const char *session_id, proxy_cluster_candidate **cands, int ncands)
+{
+    apr_uint64_t shash = cluster_hash(session_id);
+    double best = 0;
+    int i, elected = 0;
+
+    for (i = 0; i < ncands; i++) {
+        /* mix the hashes (splitmix64 finalizer) */
+        apr_uint64_t h = shash ^ cands[i]->hash;
+        double u, score;
+        int lbfactor = cands[i]->hot->s.lbfactor;
+
+        h ^= h >> 30;
+        h *= APR_UINT64_C(0xbf58476d1ce4e5b9);
+        h ^= h >> 27;
+        h *= APR_UINT64_C(0x94d049bb133111eb);
+        h ^= h >> 31;
+        /* u in ]0, 1[ */
+        u = ((double) (h >> 11) + 0.5) / 9007199254740992.0;
+        score = (lbfactor > 0 ? lbfactor : 1) / -log(u);
+        if (i == 0 || score > best) {
+            best = score;
+            elected = i;
+        }
+    }
+    return elected;
+}
+
 /*
  * The ModClusterService from the cluster fills the lbfactor values.
  * Our logic is a bit different the mod_balancer one. We check the
@@ -1220,21 +2107,25 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
                                          proxy_vhost_table *vhost_table,
                                          proxy_context_table *context_table, proxy_node_table *node_table)
 {
-    int i, hash = 0;
+    int i, n;
+    int first = 0;
+    int stop_idle = 0;
     proxy_worker *mycandidate = NULL;
     node_context *mynodecontext = NULL;
     proxy_worker *worker;
     int checking_standby = 0;
     int checked_standby = 0;
     int checked_domain = 1;
-    /* Create a separate array of available workers, to be sorted later */
-    proxy_worker **workers = NULL;
+    /* Create a separate array of available workers, for the deterministic failover */
+    proxy_cluster_candidate **workers = NULL;
+    node_context **workers_context = NULL;
     int workers_length = 0;
     const char *session_id_with_route;
     char *tokenizer;
+    apr_time_t start = metrics ? apr_time_now() : 0;
     const char *session_id;
+    proxy_cluster_candidates *cands;
 
-    workers = apr_pcalloc(r->pool, sizeof(proxy_worker *) * balancer->workers->nelts);
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                  "proxy: Entering byrequests for CLUSTER (%s) failoverdomain:%d",
@@ -1248,104 +2139,70 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
     /* First try to see if we have available candidate */
     if (domain && strlen(domain)>0)
         checked_domain = 0;
+    cands = get_balancer_candidates(balancer, r->server);
+    if (cands == NULL)
+        checked_standby = 1; /* no worker to elect */
+    workers = apr_pcalloc(r->pool, sizeof(proxy_cluster_candidate *) * ((cands ? cands->ncandidates : 0) + 1));
+    workers_context = apr_pcalloc(r->pool, sizeof(node_context *) * ((cands ? cands->ncandidates : 0) + 1));
+
+    /* The deterministic failover needs all the candidates */
+    session_id_with_route = get_cluster_session(r)->sessionid;
+    if (cands && cands->method == ELECTION_P2C && cands->ncandidates > 2 &&
+        !(deterministic_failover && session_id_with_route && strchr(session_id_with_route, '.'))) {
+        proxy_cluster_candidate *cand = p2c_candidate(r, balancer, cands, checked_domain, domain, &mynodecontext,
+                                                      vhost_table, context_table, node_table);
+        if (cand) {
+            mycandidate = cand->worker;
+            checked_standby = 1;
+        }
+    }
+
+    /*
+     * leastoutstanding: nothing is better than a candidate without outstanding
+     * requests, start at a random one and stop at the first idle one.
+     */
+    if (cands && cands->method == ELECTION_LEASTOUTSTANDING && cands->ncandidates > 1 &&
+        !(deterministic_failover && session_id_with_route && strchr(session_id_with_route, '.'))) {
+        first = ap_random_pick(0, cands->ncandidates - 1);
+        stop_idle = 1;
+    }
+
     while (!checked_standby) {
-        char *ptr = balancer->workers->elts;
-        int sizew = balancer->workers->elt_size;
-        for (i = 0; i < balancer->workers->nelts; i++, ptr=ptr+sizew) {
+        proxy_cluster_candidate *mycand = NULL;
+        for (n = 0; n < cands->ncandidates; n++) {
+            proxy_cluster_candidate *cand;
             node_context *nodecontext;
-            nodeinfo_t *node;
-            proxy_cluster_helper *helper;
-            proxy_worker **run = (proxy_worker **) ptr;
-            char *pptr;
 
-            worker = *run;
-            helper = (proxy_cluster_helper *) worker->context;
-            if (!worker->s || !worker->context) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                             "proxy: byrequests balancer %s skipping BAD worker %s", balancer->s->name, worker->s ? worker->s->name : "NULL");
-                continue;
-            }
-            if (helper->index == 0)
-                continue; /* marked removed */
-            if (helper->index != worker->s->index) {
-                /* something is very bad */
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
-                             "proxy: byrequests balancer skipping BAD worker");
-                continue; /* probably used by different worker */
-            }
+            i = (first + n) % cands->ncandidates;
+            cand = &cands->candidates[i];
 
-            /* standby logic
-             * lbfactor: -1 broken node.
-             *            0 standby.
-             *           >0 factor to use.
-             */
-            if (worker->s->lbfactor < 0 || (worker->s->lbfactor == 0 && !checking_standby))
-                continue;
-
-            /* If the worker is in error state the STATUS logic will retry it */
-            if (!PROXY_WORKER_IS_USABLE(worker)) {
+            nodecontext = candidate_context_ok(r, balancer, cand, checking_standby, checked_domain, domain,
+                                               vhost_table, context_table, node_table);
+            if (nodecontext == NULL)
                 continue;
-            }
-
-            /* Take into calculation only the workers that are
-             * not in error state or not disabled.
-             * and that can map the context.
-             */
-            if (read_node_worker(worker->s->index, &node, worker) != APR_SUCCESS)
-                continue; /* Can't read node */
-            pptr = (char *) node;
-            pptr = pptr + node->offset;
-            if (worker->s != (proxy_worker_shared *) pptr)
-                continue; /* wrong shared memory address */
-
-            if (PROXY_WORKER_IS_USABLE(worker) && (nodecontext = context_host_ok(r, balancer, worker->s->index, use_alias, vhost_table, context_table, node_table)) != NULL) {
-                if (!checked_domain) {
-                    /* First try only nodes in the domain */
-                    if (!isnode_domain_ok(r, node, domain)) {
-                        continue;
-
-                    }
-                }
-                workers[workers_length++] = worker;
-                if (worker->s->lbfactor == 0 && checking_standby) {
-                    mycandidate = worker;
-                    mynodecontext = nodecontext;
+            worker = cand->worker;
+            workers_context[workers_length] = nodecontext;
+            workers[workers_length++] = cand;
+            if (cand->hot->s.lbfactor == 0 && checking_standby) {
+                mycandidate = worker;
+                mynodecontext = nodecontext;
+                break; /* Done */
+            } else if (!mycandidate || candidate_better(cands->method, cand, mycand)) {
+                mycandidate = worker;
+                mycand = cand;
+                mynodecontext = nodecontext;
+                if (stop_idle && !checking_standby && candidate_outstanding(cand) == 0)
                     break; /* Done */
-                } else {
-                    if (!mycandidate) {
-                        mycandidate = worker;
-                        mynodecontext = nodecontext;
-                    } else {
-                        nodeinfo_t *node1;
-                        int lbstatus, lbstatus1;
-
-                        if (read_node_worker(mycandidate->s->index, &node1, mycandidate) != APR_SUCCESS)
-                            continue;
-                        lbstatus1 = ((mycandidate->s->elected - node1->mess.oldelected) * 1000)/mycandidate->s->lbfactor;
-                        lbstatus  = ((worker->s->elected - node->mess.oldelected) * 1000)/worker->s->lbfactor;
-                        lbstatus1 = lbstatus1 + mycandidate->s->lbstatus;
-                        lbstatus = lbstatus + worker->s->lbstatus;
-                        if (lbstatus1> lbstatus) {
-                            mycandidate = worker;
-                            mynodecontext = nodecontext;
-                        }
-                    }
-                }
             }
         }
-        session_id_with_route = apr_table_get(r->notes, "session-id");
-        session_id = session_id_with_route ? apr_strtok(strdup(session_id_with_route), ".", &tokenizer) : NULL;
+        session_id_with_route = get_cluster_session(r)->sessionid;
+        session_id = session_id_with_route ? apr_strtok(apr_pstrdup(r->pool, session_id_with_route), ".", &tokenizer) : NULL;
         /* Determine deterministic route, if session is associated with a route, but that route wasn't used */
         if (deterministic_failover && session_id && strchr((char *)session_id_with_route, '.') && workers_length > 0) {
             /* Deterministic selection of target route */
-            if (workers_length > 1) {
-	            qsort(workers, workers_length, sizeof(*workers), &proxy_worker_cmp);
-	        }
-            /* Compute consistent int from session id */
-            for (i = 0; session_id[i] != 0; ++i) {
-                hash += session_id[i];
-            }
-            mycandidate = workers[hash % workers_length];
+            i = rendezvous_candidate(session_id, workers, workers_length);
+            mycandidate = workers[i]->worker;
+            mynodecontext = workers_context[i];
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "Using deterministic failover target: %s", mycandidate->s->route);
         }
         if (mycandidate)
@@ -1360,9 +2217,11 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
 
     if (mycandidate) {
         /* Failover in domain */
-        if (!checked_domain)
+        if (!checked_domain) {
+            get_cluster_session(r)->domain_ok = 1;
             apr_table_setn(r->notes, "session-domain-ok", "1");
-        mycandidate->s->elected++;
+        }
+        inc_elected(mycandidate);
         apr_table_setn(r->subprocess_env, "BALANCER_CONTEXT_ID", apr_psprintf(r->pool, "%d", (*mynodecontext).context));
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                              "proxy: byrequests balancer DONE (%s)",
@@ -1372,6 +2231,10 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                              "proxy: byrequests balancer FAILED");
     }
+    if (cands)
+        cluster_shared_release(&cands->shared);
+    if (metrics)
+        cluster_hist_observe(&metrics->election, apr_time_now() - start);
     return mycandidate;
 }
 
@@ -1383,8 +2246,9 @@ static proxy_worker *internal_find_best_byrequests(proxy_balancer *balancer, pro
  * load = 0  : standby worker.
  * load = -1 : errored worker.
  * load = -2 : just do a cping/cpong. 
+ * ping : 0 when a PeerSync proxy has already done the cping/cpong.
  */
-static int proxy_node_isup(request_rec *r, int id, int load)
+static int node_isup(request_rec *r, int id, int load, int ping)
 {
     apr_status_t rv;
     proxy_worker *worker = NULL;
@@ -1426,7 +2290,7 @@ static int proxy_node_isup(request_rec *r, int id, int load)
     }
 
     /* Try a  ping/pong to check the node */
-    if (load >= 0 || load == -2) {
+    if (ping && (load >= 0 || load == -2)) {
         /* Only try usuable nodes */
         char sport[7];
         char *url;
@@ -1439,6 +2303,7 @@ static int proxy_node_isup(request_rec *r, int id, int load)
         rv = proxy_cluster_try_pingpong(r, worker, url, conf, node->mess.ping, node->mess.timeout);
         if (rv != APR_SUCCESS) {
             worker->s->status |= PROXY_WORKER_IN_ERROR;
+            sync_node_hot(worker, NULL);
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy_cluster_isup: pingpong %s failed", url);
             return 500;
@@ -1460,10 +2325,22 @@ static int proxy_node_isup(request_rec *r, int id, int load)
         worker->s->status &= ~PROXY_WORKER_STOPPED;
         worker->s->status &= ~PROXY_WORKER_DISABLED;
         worker->s->status &= ~PROXY_WORKER_HOT_STANDBY;
+        if (worker->s->lbfactor <= 0)
+            start_slow_start(worker, node, r->pool);
         worker->s->lbfactor = load;
     }
+    sync_node_hot(worker, NULL);
     return 0;
 }
+static int proxy_node_isup(request_rec *r, int id, int load)
+{
+    return node_isup(r, id, load, 1);
+}
+/* the proxy that got the STATUS has done the ping/pong */
+static int proxy_node_setload(request_rec *r, int id, int load)
+{
+    return node_isup(r, id, load, 0);
+}
 static int proxy_host_isup(request_rec *r, char *scheme, char *host, char *port)
 {
     apr_socket_t *sock;
@@ -1513,28 +2390,83 @@ static int proxy_host_isup(request_rec *r, char *scheme, char *host, char *port)
 static const struct balancer_method balancerhandler =
 {
     proxy_node_isup,
-    proxy_host_isup
+    proxy_host_isup,
+    proxy_node_setload
 };
 
+static void add_removed_node(proxy_cluster_removed *removed, int id)
+{
+    int i;
+    int *ids = (int *) removed->ids->elts;
+
+    for (i = 0; i < removed->ids->nelts; i++) {
+        if (ids[i] == id)
+            return;
+    }
+    *(int *) apr_array_push(removed->ids) = id;
+}
 /*
- * Remove node that have beeen marked removed for more than 10 seconds.
+ * Add the nodes marked removed since the last call to the removed ones,
+ * from the change journal (or from the whole node table when the changes
+ * were lost or the first time).
  */
-static void remove_removed_node(apr_pool_t *pool, server_rec *server)
+static void collect_removed_nodes(proxy_cluster_removed *removed, apr_pool_t *pool)
 {
-    int *id, size, i;
-    apr_time_t now = apr_time_now();
-
-    /* read the ident of the nodes */
+    table_change_t changes[JOURNAL_CHANGES];
+    int *id, size, n, i;
+
+    if (removed->synced && node_storage->get_changes != NULL) {
+        do {
+            n = node_storage->get_changes(&removed->seq, changes, JOURNAL_CHANGES);
+            for (i = 0; i < n; i++) {
+                nodeinfo_t *ou;
+                if (changes[i].table != TABLE_NODE || changes[i].op != CHANGE_UPDATE)
+                    continue;
+                if (node_storage->read_node(changes[i].id, &ou) == APR_SUCCESS && ou->mess.remove)
+                    add_removed_node(removed, changes[i].id);
+            }
+        } while (n == JOURNAL_CHANGES);
+        if (n >= 0)
+            return;
+    }
+    /* the changes after that will be read next time */
+    if (node_storage->get_changes != NULL) {
+        node_storage->get_changes(&removed->seq, changes, 0);
+        removed->synced = 1;
+    }
+    apr_array_clear(removed->ids);
     size = node_storage->get_max_size_node();
     if (size == 0)
         return;
     id = apr_pcalloc(pool, sizeof(int) * size);
     size = node_storage->get_ids_used_node(id);
-    for (i=0; i<size; i++) {
+    for (i = 0; i < size; i++) {
         nodeinfo_t *ou;
-        if (node_storage->read_node(id[i], &ou) != APR_SUCCESS)
+        if (node_storage->read_node(id[i], &ou) == APR_SUCCESS && ou->mess.remove)
+            *(int *) apr_array_push(removed->ids) = id[i];
+    }
+}
+
+/*
+ * Remove node that have beeen marked removed for more than 10 seconds.
+ */
+static void remove_removed_node(apr_pool_t *pool, server_rec *server)
+{
+    int *ids, i;
+    apr_time_t now = apr_time_now();
+
+    if (removed_nodes.ids == NULL)
+        return;
+    collect_removed_nodes(&removed_nodes, pool);
+    ids = (int *) removed_nodes.ids->elts;
+    for (i = removed_nodes.ids->nelts - 1; i >= 0; i--) {
+        nodeinfo_t *ou;
+        if (node_storage->read_node(ids[i], &ou) != APR_SUCCESS || !ou->mess.remove) {
+            /* already removed (and maybe reused) */
+            ids[i] = ids[--removed_nodes.ids->nelts];
             continue;
-        if (ou->mess.remove && (now - ou->updatetime) >= wait_for_remove &&
+        }
+        if ((now - ou->updatetime) >= wait_for_remove &&
             (now - ou->mess.lastcleantry) >= wait_for_remove) {
             /* if it has a domain store it in the domain */
             if (ou->mess.Domain[0] != '\0') {
@@ -1553,43 +2485,43 @@ static void remove_removed_node(apr_pool_t *pool, server_rec *server)
             /* remove the node from the shared memory */
             node_storage->remove_host_context(ou->mess.id, pool);
             node_storage->remove_node(ou);
+            ids[i] = ids[--removed_nodes.ids->nelts];
         }
     }
 }
+/* remove the workers of the removed nodes, the ones still busy are retried next time */
 static void remove_workers_nodes(proxy_server_conf *conf, apr_pool_t *pool, server_rec *server)
 {
-    int *id, size, i;
-    apr_thread_mutex_lock(lock);
+    proxy_cluster_removed *removed;
+    int *ids, i;
 
-    /* read the ident of the nodes */
-    size = node_storage->get_max_size_node();
-    if (size == 0) {
-        apr_thread_mutex_unlock(lock);
-        return;
-    }
-    id = apr_pcalloc(pool, sizeof(int) * size);
-    size = node_storage->get_ids_used_node(id);
-    for (i=0; i<size; i++) {
+    apr_thread_mutex_lock(lock);
+    removed = &get_journal(server)->removed;
+    collect_removed_nodes(removed, pool);
+    ids = (int *) removed->ids->elts;
+    for (i = removed->ids->nelts - 1; i >= 0; i--) {
         nodeinfo_t *ou;
-        if (node_storage->read_node(id[i], &ou) != APR_SUCCESS)
+        if (node_storage->read_node(ids[i], &ou) == APR_SUCCESS && ou->mess.remove &&
+            remove_workers_node(ou, conf, pool, server))
             continue;
-        if (ou->mess.remove) {
-            remove_workers_node(ou, conf, pool, server);
-        }
+        ids[i] = ids[--removed->ids->nelts];
     }
+    update_maps(conf);
     apr_thread_mutex_unlock(lock);
 }
-/* Called by mc_watchdog_callback every seconds and for each server and from one child only */
+/* Called by mc_watchdog_callback every SWEEP_MIN_INTERVAL and for each server and from one child only */
 static void proxy_cluster_watchdog_func(server_rec *s, apr_pool_t *pool)
 {
     void *sconf = s->module_config;
     proxy_server_conf *conf = (proxy_server_conf *)
         ap_get_module_config(sconf, &proxy_module);
     unsigned int last;
+    apr_time_t start;
 
     if (!conf)
        return;
 
+    start = apr_time_now();
     last = node_storage->worker_nodes_need_update(s, pool);
 
     /* Create new workers if the shared memory changes */
@@ -1597,8 +2529,9 @@ static void proxy_cluster_watchdog_func(server_rec *s, apr_pool_t *pool)
         update_workers_node(conf, pool, s, 0);
     /* removed nodes: check for workers */
     remove_workers_nodes(conf, pool, s);
-    /* Calculate the lbstatus for each node */
-    update_workers_lbstatus(conf, pool, s);
+    /* Calculate the lbstatus for each node (backed off while nothing changes) */
+    if (lbstatus_due)
+        update_workers_lbstatus(conf, pool, s);
     /* Free sessionid slots */
     if (sessionid_storage)
         remove_timeout_sessionid(conf, pool, s);
@@ -1607,6 +2540,8 @@ static void proxy_cluster_watchdog_func(server_rec *s, apr_pool_t *pool)
     if (last) {
         node_storage->worker_nodes_are_updated(s, last);
     }
+    if (metrics)
+        cluster_hist_observe(&metrics->sweep, apr_time_now() - start);
 }
 
 
@@ -1621,10 +2556,29 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
 
         case AP_WATCHDOG_STATE_RUNNING:
             if (s) {
+               if (s == main_server) {
+                   /* back off the lbstatus while the nodes don't change */
+                   unsigned int version = node_storage->get_version_node();
+                   apr_time_t now = apr_time_now();
+                   if (version != sweep_version) {
+                       sweep_version = version;
+                       lbstatus_interval = SWEEP_MIN_INTERVAL;
+                       lbstatus_due = 1;
+                   } else {
+                       lbstatus_due = (now >= lbstatus_next);
+                       if (lbstatus_due && lbstatus_interval < lbstatus_recalc_time) {
+                           lbstatus_interval = lbstatus_interval * 2;
+                           if (lbstatus_interval > lbstatus_recalc_time)
+                               lbstatus_interval = lbstatus_recalc_time;
+                       }
+                   }
+                   if (lbstatus_due)
+                       lbstatus_next = now + lbstatus_interval;
+               }
                /* It is called for every server defined in httpd */
                proxy_cluster_watchdog_func(s, pool);
-               /* set the next call back XXX = 1 s can't it be better? */
-               mc_watchdog_set_interval(watchdog, apr_time_make(1, 0), s, mc_watchdog_callback);
+               /* set the next call back: the cleanups keep their interval */
+               mc_watchdog_set_interval(watchdog, SWEEP_MIN_INTERVAL, s, mc_watchdog_callback);
             }
             break;
 
@@ -1635,6 +2589,187 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
     return APR_SUCCESS;
 }
 
+#if APR_HAS_THREADS
+/* a worker whose connections the reconcile thread opens */
+struct proxy_cluster_warm {
+    proxy_worker *worker;
+    proxy_server_conf *conf;
+    server_rec *server;
+    int count;
+};
+typedef struct proxy_cluster_warm proxy_cluster_warm;
+
+/*
+ * Open count connections to the worker and put them back in its connection
+ * pool (all acquired before releasing them so they are different ones).
+ * Only the TCP connection is opened, mod_proxy does the rest on first use.
+ */
+static void warm_worker(proxy_cluster_warm *warm, apr_pool_t *pool)
+{
+    proxy_worker *worker = warm->worker;
+    char *scheme = worker->s->scheme;
+    proxy_conn_rec **backends;
+    request_rec *r;
+    char sport[7];
+    char *url;
+    int count = warm->count;
+    int acquired, opened = 0;
+
+    /* more than the pool holds would wait for the requests to release some */
+    if (worker->s->hmax > 0 && count > worker->s->hmax)
+        count = worker->s->hmax;
+    apr_snprintf(sport, sizeof(sport), "%d", worker->s->port);
+    if (strchr(worker->s->hostname, ':') != NULL)
+        url = apr_pstrcat(pool, scheme, "://[", worker->s->hostname, "]:", sport, "/", NULL);
+    else
+        url = apr_pstrcat(pool, scheme, "://", worker->s->hostname, ":", sport, "/", NULL);
+    r = create_dummy_request(pool, warm->server, "WARM");
+    if (r == NULL)
+        return;
+    backends = apr_pcalloc(pool, sizeof(proxy_conn_rec *) * count);
+
+    for (acquired = 0; acquired < count; acquired++) {
+        char server_portstr[32];
+        char *locurl = url;
+        apr_uri_t uri;
+
+        if (ap_proxy_acquire_connection(scheme, &backends[acquired], worker, warm->server) != OK) {
+            if (backends[acquired]) {
+                backends[acquired]->close = 1;
+                acquired++;
+            }
+            break;
+        }
+        if (ap_proxy_determine_connection(r->pool, r, warm->conf, worker, backends[acquired], &uri, &locurl,
+                                          NULL, 0, server_portstr, sizeof(server_portstr)) != OK ||
+            ap_proxy_connect_backend(scheme, backends[acquired], worker, warm->server) != OK) {
+            backends[acquired]->close = 1;
+            acquired++;
+            break;
+        }
+        opened++;
+    }
+    while (acquired--) {
+        if (backends[acquired])
+            ap_proxy_release_connection(scheme, backends[acquired], warm->server);
+    }
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, warm->server,
+                 "warm_worker: opened %d of %d connections to %s", opened, warm->count, url);
+}
+
+/*
+ * Open the connections of the workers whose node became usable, the ones
+ * still waiting for their first STATUS are kept for the next time.
+ */
+static void warm_workers(server_rec *server, apr_pool_t *pool)
+{
+    apr_array_header_t *warms;
+    server_rec *s;
+    int i;
+
+    if (!warm_pending)
+        return;
+    warms = apr_array_make(pool, 4, sizeof(proxy_cluster_warm));
+    apr_thread_mutex_lock(lock);
+    warm_pending = 0;
+    for (s = server; s; s = s->next) {
+        proxy_server_conf *conf = (proxy_server_conf *)
+            ap_get_module_config(s->module_config, &proxy_module);
+        char *ptr;
+        int sizeb;
+
+        if (!conf)
+            continue;
+        ptr = conf->balancers->elts;
+        sizeb = conf->balancers->elt_size;
+        for (i = 0; i < conf->balancers->nelts; i++, ptr = ptr + sizeb) {
+            proxy_balancer *balancer = (proxy_balancer *) ptr;
+            proxy_worker **workers = (proxy_worker **) balancer->workers->elts;
+            int j;
+
+            for (j = 0; j < balancer->workers->nelts; j++) {
+                proxy_cluster_helper *helper = (proxy_cluster_helper *) workers[j]->context;
+                node_hot_t *hot;
+                proxy_cluster_warm *warm;
+
+                if (helper == NULL || helper->warm == 0)
+                    continue;
+                if (helper->index <= 0) {
+                    helper->warm = 0;
+                    continue;
+                }
+                hot = helper->hot;
+                if (hot == NULL || hot->s.id != helper->index || hot->s.lbfactor <= 0 || !NODE_HOT_IS_USABLE(hot)) {
+                    warm_pending = 1; /* not yet */
+                    continue;
+                }
+                warm = (proxy_cluster_warm *) apr_array_push(warms);
+                warm->worker = workers[j];
+                warm->conf = conf;
+                warm->server = s;
+                warm->count = helper->warm;
+                helper->warm = 0;
+            }
+        }
+    }
+    apr_thread_mutex_unlock(lock);
+
+    /* the workers are never freed, the connections are opened without the lock */
+    for (i = 0; i < warms->nelts; i++)
+        warm_worker(&((proxy_cluster_warm *) warms->elts)[i], pool);
+}
+
+/*
+ * Create the workers of the new nodes in all the servers as soon the
+ * version of the nodes changes (every child, not only the watchdog one)
+ * and open the connections of the ones that became usable.
+ */
+static void * APR_THREAD_FUNC proxy_cluster_reconcile(apr_thread_t *thd, void *data)
+{
+    server_rec *server = (server_rec *) data;
+    apr_pool_t *pool;
+    unsigned int last;
+
+    apr_pool_create(&pool, apr_thread_pool_get(thd));
+    last = node_storage->wait_nodes_update(0, 0);
+    while (!reconcile_stop) {
+        server_rec *s;
+        unsigned int version = node_storage->wait_nodes_update(last, RECONCILE_WAIT);
+        if (reconcile_stop)
+            break;
+        if (warm_pending) {
+            warm_workers(server, pool);
+            apr_pool_clear(pool);
+        }
+        if (version == last)
+            continue;
+        for (s = server; s; s = s->next) {
+            proxy_server_conf *conf = (proxy_server_conf *)
+                ap_get_module_config(s->module_config, &proxy_module);
+            if (conf)
+                update_workers_node(conf, pool, s, 0);
+        }
+        /* the requests don't need to check the nodes anymore */
+        node_storage->worker_nodes_are_updated(server, version);
+        last = version;
+        apr_pool_clear(pool);
+    }
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t stop_reconcile_thread(void *data)
+{
+    apr_status_t rv;
+    if (reconcile_thread) {
+        reconcile_stop = 1;
+        apr_thread_join(&rv, reconcile_thread);
+        reconcile_thread = NULL;
+    }
+    return APR_SUCCESS;
+}
+#endif
+
 /*
  * Create a thread per process to make maintenance task.
  * and the mutex of the node creation.
@@ -1642,6 +2777,7 @@ static apr_status_t mc_watchdog_callback(int state, void *data,
 static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
 {
     apr_status_t rv;
+    apr_pool_t *removed_pool;
     void *sconf = s->module_config;
     proxy_server_conf *conf = (proxy_server_conf *) ap_get_module_config(sconf, &proxy_module);
 
@@ -1652,6 +2788,27 @@ static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
         ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
                     "proxy_cluster_child_init: apr_thread_mutex_create failed");
     }
+    journals = apr_hash_make(p);
+    rv = apr_pool_create(&removed_pool, p);
+    if (rv == APR_SUCCESS)
+        removed_nodes.ids = apr_array_make(removed_pool, 16, sizeof(int)); /* only used by the watchdog thread */
+    shared_balancers = apr_hash_make(p);
+    metrics = node_storage->get_metrics();
+    rv = cluster_shared_child_init(p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "proxy_cluster_child_init: cluster_shared_child_init failed");
+    }
+    rv = table_snapshot_child_init(p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "proxy_cluster_child_init: table_snapshot_child_init failed");
+    }
+    rv = cluster_maps_child_init(p, s);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR|APLOG_NOERRNO, 0, s,
+                    "proxy_cluster_child_init: cluster_maps_child_init failed");
+    }
 
     if (conf) {
         apr_pool_t *pool;
@@ -1662,11 +2819,41 @@ static void  proxy_cluster_child_init(apr_pool_t *p, server_rec *s)
                 ap_get_module_config(sconf, &proxy_module);
 
             update_workers_node(conf, pool, s, 0);
+            /* the VirtualHosts without nodes have maps too */
+            apr_thread_mutex_lock(lock);
+            update_cluster_maps(conf);
+            apr_thread_mutex_unlock(lock);
 
             s = s->next;
         }
         apr_pool_destroy(pool);
     }
+
+#if APR_HAS_THREADS
+    rv = apr_thread_create(&reconcile_thread, NULL, proxy_cluster_reconcile, main_server, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, main_server,
+                    "proxy_cluster_child_init: can't create the reconcile thread");
+        reconcile_thread = NULL;
+    } else
+        apr_pool_cleanup_register(p, NULL, stop_reconcile_thread, apr_pool_cleanup_null);
+#endif
+}
+
+/*
+ * The directives only set the values they are given: back to the defaults
+ * before reading the configuration, a graceful restart of a statically
+ * linked httpd keeps the globals of the previous one.
+ */
+static int proxy_cluster_pre_config(apr_pool_t *p, apr_pool_t *plog,
+                                    apr_pool_t *ptemp)
+{
+    election_method = ELECTION_BYREQUESTS;
+    warm_connections = 0;
+    slow_start = 0;
+    share_workers = 0;
+    sessionid_timeout = 0;
+    return OK;
 }
 
 static int proxy_cluster_post_config(apr_pool_t *p, apr_pool_t *plog,
@@ -1895,16 +3082,7 @@ static int proxy_cluster_trans(request_rec *r)
     void *sconf = r->server->module_config;
     proxy_server_conf *conf = (proxy_server_conf *)
         ap_get_module_config(sconf, &proxy_module);
-
-    proxy_vhost_table *vhost_table = read_vhost_table(r->pool, host_storage);
-    proxy_context_table *context_table = read_context_table(r->pool, context_storage);
-    proxy_balancer_table *balancer_table = read_balancer_table(r->pool, balancer_storage);
-    proxy_node_table *node_table = read_node_table(r->pool, node_storage);
-
-    apr_table_setn(r->notes, "vhost-table",  (char *) vhost_table);
-    apr_table_setn(r->notes, "context-table",  (char *) context_table);
-    apr_table_setn(r->notes, "balancer-table",  (char *) balancer_table);
-    apr_table_setn(r->notes, "node-table",  (char *) node_table);
+    proxy_table_snapshot *snapshot;
 
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_NOERRNO|APLOG_DEBUG, 0, r->server,
@@ -1914,9 +3092,12 @@ static int proxy_cluster_trans(request_rec *r)
 
     /* make sure we have a up to date workers and balancers in our process */
     update_workers_node(conf, r->pool, r->server, 1);
-    balancer = get_route_balancer(r, conf, vhost_table, context_table, balancer_table, node_table, use_alias);
+    snapshot = get_table_snapshot(r, host_storage, context_storage, balancer_storage, node_storage);
+    balancer = get_route_balancer(r, conf, snapshot->vhost_table, snapshot->context_table,
+                                  snapshot->balancer_table, snapshot->node_table, use_alias);
     if (!balancer) {
-        balancer = get_context_host_balancer(r, vhost_table, context_table, node_table, use_alias);
+        balancer = get_context_host_balancer(r, snapshot->vhost_table, snapshot->context_table,
+                                             snapshot->node_table, use_alias);
     }
     
 
@@ -2040,30 +3221,16 @@ static int proxy_cluster_canon(request_rec *r, char *url)
     /*
      * Check sticky sessions again in case of ProxyPass
      */
-    route = apr_table_get(r->notes, "session-route");
+    route = get_cluster_session(r)->route;
     if (!route) {
         void *sconf = r->server->module_config;
         proxy_server_conf *conf = (proxy_server_conf *)
             ap_get_module_config(sconf, &proxy_module);
+        proxy_table_snapshot *snapshot = get_table_snapshot(r, host_storage, context_storage,
+                                                            balancer_storage, node_storage);
 
-        proxy_vhost_table *vhost_table = (proxy_vhost_table *) apr_table_get(r->notes, "vhost-table");
-        proxy_context_table *context_table  = (proxy_context_table *) apr_table_get(r->notes, "context-table");
-        proxy_balancer_table *balancer_table  = (proxy_balancer_table *) apr_table_get(r->notes, "balancer-table");
-        proxy_node_table *node_table  = (proxy_node_table *) apr_table_get(r->notes, "node-table");
-
-        if (!vhost_table)
-            vhost_table = read_vhost_table(r->pool, host_storage);
-
-        if (!context_table)
-            context_table = read_context_table(r->pool, context_storage);
-
-        if (!balancer_table)
-            balancer_table = read_balancer_table(r->pool, balancer_storage);
-
-        if (!node_table)
-            node_table = read_node_table(r->pool, node_storage);
-
-        get_route_balancer(r, conf, vhost_table, context_table, balancer_table, node_table, use_alias);
+        get_route_balancer(r, conf, snapshot->vhost_table, snapshot->context_table,
+                           snapshot->balancer_table, snapshot->node_table, use_alias);
     }
 
     return OK;
@@ -2082,15 +3249,27 @@ static proxy_worker *find_route_worker(request_rec *r,
     int i;
     int checking_standby;
     int checked_standby;
-    int sizew = balancer->workers->elt_size;
+    apr_array_header_t *workers = balancer->workers;
+    int sizew;
+    proxy_balancer_map *map;
     
     proxy_worker *worker;
     node_context *nodecontext;
 
+    /* only the workers with that route when we have the maps */
+    map = get_balancer_map(r, (proxy_server_conf *) ap_get_module_config(r->server->module_config, &proxy_module),
+                           balancer);
+    if (map) {
+        workers = apr_hash_get(map->routes, route, APR_HASH_KEY_STRING);
+        if (workers == NULL)
+            return NULL;
+    }
+    sizew = workers->elt_size;
+
     checking_standby = checked_standby = 0;
     while (!checked_standby) {
-        char *ptr = balancer->workers->elts;
-        for (i = 0; i < balancer->workers->nelts; i++, ptr=ptr+sizew) {
+        char *ptr = workers->elts;
+        for (i = 0; i < workers->nelts; i++, ptr=ptr+sizew) {
             proxy_worker **run = (proxy_worker **) ptr;
             int index = (*run)->s->index;
             proxy_cluster_helper *helper = (*run)->context;
@@ -2198,6 +3377,7 @@ static proxy_worker *find_session_route(proxy_balancer *balancer,
                                         proxy_node_table *node_table)
 {
     proxy_worker *worker = NULL;
+    proxy_cluster_session *session;
 
 #if HAVE_CLUSTER_EX_DEBUG
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -2209,8 +3389,9 @@ static proxy_worker *find_session_route(proxy_balancer *balancer,
     if (strcmp(balancer->s->lbpname, MC_NOT_STICKY) == 0)
         return NULL;
 
-    /* We already should have the route in the notes for the trans() */
-    *route = apr_table_get(r->notes, "session-route");
+    /* We already should have the route in the session for the trans() */
+    session = get_cluster_session(r);
+    *route = session->route;
     if (*route && (**route)) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                      "cluster: Using route %s", *route);
@@ -2222,10 +3403,10 @@ static proxy_worker *find_session_route(proxy_balancer *balancer,
         return NULL;
     }
 
-    *sticky_used = apr_table_get(r->notes, "session-sticky");
+    *sticky_used = session->sticky_used;
 
     if (domain)
-        *domain = apr_table_get(r->notes, "CLUSTER_DOMAIN");
+        *domain = session->domain;
 
     /* We have a route in path or in cookie
      * Find the worker that has this route defined.
@@ -2252,25 +3433,10 @@ static proxy_worker *find_best_worker(proxy_balancer *balancer, proxy_server_con
                                       int recurse)
 {
     proxy_worker *candidate = NULL;
-    apr_status_t rv;
-
-    if ((rv = PROXY_THREAD_LOCK(balancer)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, r->server,
-        "proxy: CLUSTER: (%s). Lock failed for find_best_worker()",
-         balancer->s->name
-         );
-        return NULL;
-    }
 
+    /* The election only reads the candidates of the balancer: no lock */
     candidate = internal_find_best_byrequests(balancer, conf, r, domain, failoverdomain, vhost_table, context_table, node_table);
 
-    if ((rv = PROXY_THREAD_UNLOCK(balancer)) != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_ERR, rv, r->server,
-        "proxy: CLUSTER: (%s). Unlock failed for find_best_worker()",
-         balancer->s->name
-         );
-    }
-
     if (candidate == NULL) {
         /* All the workers are in error state or disabled.
          * If the balancer has a timeout sleep for a while
@@ -2397,30 +3563,59 @@ static void remove_session_route(request_rec *r, const char *name)
 
 /*
  * Update the context active request counter
- * Note: it need to lock the whole context table
+ * Note: the counter is updated atomically, the table isn't locked
  */
 static void upd_context_count(const char *id, int val, server_rec *s)
 {
     int ident = atoi(id);
     contextinfo_t *context;
-    context_storage->lock_contexts();
     if (context_storage->read_context(ident, &context) == APR_SUCCESS) {
-        context->nbrequests = context->nbrequests + val;
+        apr_atomic_add32((volatile apr_uint32_t *) &context->nbrequests, (apr_uint32_t) val);
     }
-    context_storage->unlock_contexts();
+}
+
+/* decrement a counter that must not go under 0 */
+static void decrement_count_active(proxy_cluster_helper *helper)
+{
+    apr_uint32_t count;
+    do {
+        count = apr_atomic_read32(&helper->count_active);
+        if (count == 0)
+            return;
+    } while (apr_atomic_cas32(&helper->count_active, count - 1, count) != count);
 }
 
 static apr_status_t decrement_busy_count(void *worker_)
 {
     proxy_worker *worker = worker_;
-    
-    if (worker->s->busy) {
-        worker->s->busy--;
-    }
+    node_hot_t *hot = worker_hot(worker);
+
+    decrement_busy(&worker->s->busy);
+    if (hot)
+        decrement_busy32(&hot->s.busy);
 
     return APR_SUCCESS;
 }
 
+/* ap_proxy_get_balancer() using the maps: url is balancer://name/... */
+static proxy_balancer *get_balancer_url(request_rec *r, proxy_server_conf *conf, const char *url)
+{
+    char name[PROXY_BALANCER_MAX_NAME_SIZE];
+    const char *end;
+
+    if (strncasecmp(url, "balancer://", 11) != 0)
+        return ap_proxy_get_balancer(r->pool, conf, url, 0);
+    url += 11;
+    end = ap_strchr_c(url, '/');
+    if (end == NULL)
+        end = url + strlen(url);
+    if (end - url >= (int) sizeof(name))
+        return ap_proxy_get_balancer(r->pool, conf, url - 11, 0);
+    memcpy(name, url, end - url);
+    name[end - url] = '\0';
+    return find_cluster_balancer(conf, name);
+}
+
 /*
  * Find a worker for mod_proxy logic
  */
@@ -2438,10 +3633,16 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     apr_status_t rv;
     proxy_cluster_helper *helper;
     const char *context_id;
+    proxy_table_snapshot *snapshot;
+    proxy_vhost_table *vhost_table;
+    proxy_context_table *context_table;
+    proxy_node_table *node_table;
+    apr_time_t *start;
 
-    proxy_vhost_table *vhost_table = read_vhost_table(r->pool, host_storage);
-    proxy_context_table *context_table = read_context_table(r->pool, context_storage);
-    proxy_node_table *node_table = read_node_table(r->pool, node_storage);
+    snapshot = get_table_snapshot(r, host_storage, context_storage, balancer_storage, node_storage);
+    vhost_table = snapshot->vhost_table;
+    context_table = snapshot->context_table;
+    node_table = snapshot->node_table;
 
     *worker = NULL;
 #if HAVE_CLUSTER_EX_DEBUG
@@ -2469,6 +3670,7 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
             char *ptr = (*balancer)->workers->elts;
             int def = ap_proxy_hashfunc(worker_name, PROXY_HASHFUNC_DEFAULT);
             int fnv = ap_proxy_hashfunc(worker_name, PROXY_HASHFUNC_FNV);
+            proxy_balancer_map *map;
 #if HAVE_CLUSTER_EX_DEBUG
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy_cluster_pre_request: worker %s", worker_name);
@@ -2479,13 +3681,25 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
                upd_context_count(context_id, -1, r->server);
             }
             apr_thread_mutex_lock(lock);
-            for (i = 0; i < (*balancer)->workers->nelts; i++, ptr=ptr+sizew) {
-                proxy_worker **run = (proxy_worker **) ptr;
-                if ((*run)->hash.def == def && (*run)->hash.fnv == fnv) {
-                    helper = (proxy_cluster_helper *) (*run)->context;
-                    if (helper->count_active>0)
-                        helper->count_active--;
-                    break;
+            map = get_balancer_map(r, conf, *balancer);
+            if (map) {
+                proxy_worker *run;
+                proxy_hashes hash;
+                hash.def = def;
+                hash.fnv = fnv;
+                run = apr_hash_get(map->workers, &hash, sizeof(proxy_hashes));
+                if (run) {
+                    helper = (proxy_cluster_helper *) run->context;
+                    decrement_count_active(helper);
+                }
+            } else {
+                for (i = 0; i < (*balancer)->workers->nelts; i++, ptr=ptr+sizew) {
+                    proxy_worker **run = (proxy_worker **) ptr;
+                    if ((*run)->hash.def == def && (*run)->hash.fnv == fnv) {
+                        helper = (proxy_cluster_helper *) (*run)->context;
+                        decrement_count_active(helper);
+                        break;
+                    }
                 }
             }
             apr_thread_mutex_unlock(lock);
@@ -2495,12 +3709,12 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     /* TODO if we don't have a balancer but a route we should use it directly */
     apr_thread_mutex_lock(lock);
     if (!*balancer &&
-        !(*balancer = ap_proxy_get_balancer(r->pool, conf, *url, 0))) {
+        !(*balancer = get_balancer_url(r, conf, *url))) {
         apr_thread_mutex_unlock(lock);
         /* May be the node has not been created yet */
         update_workers_node(conf, r->pool, r->server, 1);
         apr_thread_mutex_lock(lock);
-        if (!(*balancer = ap_proxy_get_balancer(r->pool, conf, *url, 0))) {
+        if (!(*balancer = get_balancer_url(r, conf, *url))) {
             apr_thread_mutex_unlock(lock);
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                          "proxy: CLUSTER no balancer for %s", *url);
@@ -2525,7 +3739,7 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
         return DECLINED;
     }
     if (runtime) {
-        runtime->s->elected++;
+        inc_elected(runtime);
         *worker = runtime;
     }
     else if (route && ((*balancer)->s->sticky_force)) {
@@ -2592,15 +3806,17 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
             /*
              * Failover to another domain. Remove sessionid information.
              */
-            const char *domain_ok =  apr_table_get(r->notes, "session-domain-ok");
-            if (!domain_ok) {
-                remove_session_route(r, sticky); 
+            if (!get_cluster_session(r)->domain_ok) {
+                remove_session_route(r, sticky);
+                clear_cluster_session_params(r);
             }
         }
         *worker = runtime;
     }
 
-    (*worker)->s->busy++;
+    CLUSTER_ATOMIC_INC(&(*worker)->s->busy);
+    if (worker_hot(*worker))
+        apr_atomic_inc32(&worker_hot(*worker)->s.busy);
     apr_pool_cleanup_register(r->pool, *worker, decrement_busy_count,
                               apr_pool_cleanup_null);
 
@@ -2611,10 +3827,13 @@ static int proxy_cluster_pre_request(proxy_worker **worker,
     }
 
     /* Mark the worker used for the cleanup logic */
-    apr_thread_mutex_lock(lock);
     helper = (proxy_cluster_helper *) (*worker)->context;
-    helper->count_active++;
-    apr_thread_mutex_unlock(lock);
+    apr_atomic_inc32(&helper->count_active);
+
+    /* start of the response time (see proxy_cluster_post_request()) */
+    start = apr_palloc(r->pool, sizeof(apr_time_t));
+    *start = apr_time_now();
+    ap_set_module_config(r->request_config, &proxy_cluster_module, start);
 
     /*
      * get_route_balancer already fills all of the notes and some subprocess_env
@@ -2656,6 +3875,7 @@ static int proxy_cluster_post_request(proxy_worker *worker,
     const char *sticky;
     char *oroute;
     const char *context_id = apr_table_get(r->subprocess_env, "BALANCER_CONTEXT_ID");
+    apr_time_t *start;
     apr_status_t rv;
 
     /* Ajust the context counter here too */
@@ -2664,11 +3884,21 @@ static int proxy_cluster_post_request(proxy_worker *worker,
     }
 
     /* mark the worker as not in use */
-    apr_thread_mutex_lock(lock);
     helper = (proxy_cluster_helper *) worker->context;
-    helper->count_active--;
-
-    apr_thread_mutex_unlock(lock);
+    decrement_count_active(helper);
+
+    /* record the response time of the node and the context */
+    start = ap_get_module_config(r->request_config, &proxy_cluster_module);
+    if (start) {
+        apr_interval_time_t elapsed = apr_time_now() - *start;
+        record_response(worker, elapsed, r->status >= HTTP_INTERNAL_SERVER_ERROR ||
+                                         (worker->s->status & PROXY_WORKER_IN_ERROR));
+        if (metrics) {
+            cluster_hist_observe(cluster_metrics_node(metrics, helper->index), elapsed);
+            if (context_id && *context_id)
+                cluster_hist_observe(cluster_metrics_context(metrics, atoi(context_id)), elapsed);
+        }
+    }
 
 #if HAVE_CLUSTER_EX_DEBUG
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
@@ -2680,14 +3910,15 @@ static int proxy_cluster_post_request(proxy_worker *worker,
     if (sessionid_storage) {
 
         /* Add information about sessions corresponding to a node */
-        sticky = apr_table_get(r->notes, "session-sticky");
+        proxy_cluster_session *session = get_cluster_session(r);
+        sticky = session->sticky_used;
         if (sticky == NULL && balancer->s->sticky[0] != '\0') {
             sticky = apr_pstrdup(r->pool, balancer->s->sticky);
         }
         if (sticky != NULL) {
             cookie = get_cookie_param(r, sticky, 0);
-            sessionid =  apr_table_get(r->notes, "session-id");
-            route =  apr_table_get(r->notes, "session-route");
+            sessionid = session->sessionid;
+            route = session->route;
             if (cookie) {
                 if (sessionid && strcmp(cookie, sessionid)) {
                     /* The cookie has changed, remove the old one and store the next one */
@@ -2750,6 +3981,9 @@ static int proxy_cluster_post_request(proxy_worker *worker,
             );
     }
 
+    /* mod_proxy may have changed the status of the worker or what was read */
+    sync_node_hot(worker, NULL);
+
     ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server,
                  "proxy_cluster_post_request %d for (%s)", r->status,
                  balancer->s->name
@@ -2766,6 +4000,7 @@ static void proxy_cluster_hooks(apr_pool_t *p)
     static const char * const aszPre[]={ "mod_manager.c", "mod_rewrite.c", NULL };
     static const char * const aszSucc[]={ "mod_proxy.c", NULL };
 
+    ap_hook_pre_config(proxy_cluster_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(proxy_cluster_post_config, NULL, NULL, APR_HOOK_MIDDLE);
 
     /* create the "maintenance" thread */
@@ -2870,6 +4105,78 @@ static const char *cmd_proxy_cluster_deterministic_failover(cmd_parms *parms, vo
     return NULL;
 }
 
+static const char*cmd_proxy_cluster_warm_connections(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "WarmConnections must be greater than 0";
+    } else {
+        warm_connections = val;
+    }
+    return NULL;
+}
+
+static const char*cmd_proxy_cluster_slow_start(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "SlowStart must be greater than 0";
+    } else {
+        slow_start = val;
+    }
+    return NULL;
+}
+
+static const char*cmd_proxy_cluster_sessionid_timeout(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    int val = atoi(arg);
+    if (val<0) {
+        return "SessionIdTimeout must be greater than 0";
+    } else {
+        sessionid_timeout = val;
+    }
+    return NULL;
+}
+
+static const char *cmd_proxy_cluster_share_workers(cmd_parms *parms, void *mconfig, int on)
+{
+    share_workers = on;
+
+    return NULL;
+}
+
+static apr_status_t reset_election_methods(void *data)
+{
+    election_methods = NULL;
+    return APR_SUCCESS;
+}
+
+static const char *cmd_proxy_cluster_election_method(cmd_parms *cmd, void *dummy, const char *arg, const char *name)
+{
+    static const char *names[] = ELECTION_NAMES;
+    int method;
+
+    for (method = 0; method < ELECTION_COUNT; method++) {
+        if (strcasecmp(arg, names[method]) == 0)
+            break;
+    }
+    if (method == ELECTION_COUNT)
+        return "ElectionMethod must be one of: byrequests, leastoutstanding, p2c or latency";
+
+    if (name == NULL) {
+        election_method = method;
+    } else {
+        if (strncasecmp(name, "balancer://", 11) == 0)
+            name = name + 11;
+        if (election_methods == NULL) {
+            election_methods = apr_table_make(cmd->pool, 4);
+            apr_pool_cleanup_register(cmd->pool, NULL, reset_election_methods, apr_pool_cleanup_null);
+        }
+        apr_table_set(election_methods, name, apr_itoa(cmd->pool, method));
+    }
+    return NULL;
+}
+
 static const command_rec  proxy_cluster_cmds[] =
 {
     AP_INIT_TAKE1(
@@ -2915,6 +4222,41 @@ static const command_rec  proxy_cluster_cmds[] =
         OR_ALL,
         "DeterministicFailover - controls whether a node upon failover is chosen deterministically (Default: Off)"
     ),
+    AP_INIT_FLAG(
+        "ShareWorkers",
+        cmd_proxy_cluster_share_workers,
+        NULL,
+        OR_ALL,
+        "ShareWorkers - Use one set of workers (and connection pools) per process for the balancers of all the VirtualHosts: (Default: Off)"
+    ),
+    AP_INIT_TAKE1(
+        "WarmConnections",
+        cmd_proxy_cluster_warm_connections,
+        NULL,
+        OR_ALL,
+        "WarmConnections - Number of connections each child opens to a node when it becomes usable (WarmConnections in the CONFIG message for a balancer): (Default: 0)"
+    ),
+    AP_INIT_TAKE1(
+        "SlowStart",
+        cmd_proxy_cluster_slow_start,
+        NULL,
+        OR_ALL,
+        "SlowStart - Time in seconds for the lbfactor of a node that becomes usable to ramp up to its value (SlowStart in the CONFIG message for a balancer): (Default: 0)"
+    ),
+    AP_INIT_TAKE1(
+        "SessionIdTimeout",
+        cmd_proxy_cluster_sessionid_timeout,
+        NULL,
+        OR_ALL,
+        "SessionIdTimeout - Time in seconds before a sessionid that isn't used any more is removed from the Maxsessionid table, 0: never (Default: 0)"
+    ),
+    AP_INIT_TAKE12(
+        "ElectionMethod",
+        cmd_proxy_cluster_election_method,
+        NULL,
+        OR_ALL,
+        "ElectionMethod - Method to elect the worker for the balancer (all if no name given, ElectionMethod in the CONFIG message for a balancer): byrequests, leastoutstanding, p2c or latency: (Default: byrequests)"
+    ),
     {NULL}
 };
 
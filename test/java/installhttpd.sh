@@ -391,6 +391,8 @@ MaxContext 150
 MaxHost 130
 Maxnode 40
 Maxjgroupsid 40
+Maxsessionid 100
+SessionIdTimeout 10
 EnableOptions
 EOF
 
@@ -143,6 +143,10 @@ public class  ManagerClient {
             String DURL = URL + "?nonce=" + nonce + "&Cmd=INFO&Range=ALL";
             return DoCmd(DURL);
         }
+        /* The mod_cluster_manager page (with the sessionids when Maxsessionid is set) */
+        public String getManagerPage() throws Exception {
+            return DoCmd(URL);
+        }
 	public boolean isApacheHttpd() throws Exception {
             GetMethod gm = new GetMethod(URL);
             try {
@@ -0,0 +1,153 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2008 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+package org.jboss.mod_cluster;
+
+import junit.framework.TestCase;
+
+import org.apache.commons.httpclient.HttpClient;
+import org.apache.commons.httpclient.methods.PostMethod;
+import org.apache.commons.httpclient.methods.StringRequestEntity;
+
+import org.jboss.modcluster.ModClusterService;
+import org.apache.catalina.core.StandardServer;
+
+public class TestReConfig extends TestCase {
+
+    /* MCMP command sent directly to httpd */
+    static class MCMPMethod extends PostMethod {
+        private String name;
+        public MCMPMethod(String name, String url) {
+            super(url);
+            this.name = name;
+        }
+        public String getName() {
+            return name;
+        }
+    }
+
+    private int mcmp(HttpClient httpClient, String proxy, String cmd, String path, String body) throws Exception {
+        MCMPMethod pm = new MCMPMethod(cmd, "http://" + proxy + path);
+        pm.setRequestEntity(new StringRequestEntity(body, "application/x-www-form-urlencoded", "UTF-8"));
+        int code = httpClient.executeMethod(pm);
+        pm.releaseConnection();
+        System.out.println(cmd + " " + body + ": " + code);
+        return code;
+    }
+
+    private int count(String info, String what) {
+        int n = 0;
+        String [] records = info.split("\n");
+        for (int i=0; i<records.length; i++) {
+            if (records[i].indexOf(what) >= 0)
+                n++;
+        }
+        return n;
+    }
+
+    /* A CONFIG with another Port for an existing JVMRoute marks the old node removed with its contexts */
+    public void testReConfig() {
+
+        StandardServer server = new StandardServer();
+        JBossWeb service = null;
+        ModClusterService cluster = null;
+
+        System.out.println("TestReConfig Started");
+        System.setProperty("org.apache.catalina.core.StandardService.DELAY_CONNECTOR_STARTUP", "false");
+        try {
+            service = new JBossWeb("node1",  "localhost");
+            service.addConnector(8011);
+            server.addService(service);
+
+            cluster = Maintest.createClusterListener(server, "224.0.1.105", 23364, false, null, true, false, true, "secret");
+
+        } catch(Exception ex) {
+            ex.printStackTrace();
+            fail("can't start service");
+        }
+
+        // start the server thread.
+        ServerThread wait = new ServerThread(3000, server);
+        wait.start();
+
+        // Wait until httpd as received the nodes information.
+        String [] nodes = new String[1];
+        nodes[0] = "node1";
+        if (!Maintest.WaitForNodes(cluster, nodes)) {
+            Maintest.stop(20, wait, server, service, cluster);
+            fail("can't start nodes");
+        }
+
+        String proxy = Maintest.getProxyAddress(cluster);
+        HttpClient httpClient = new HttpClient();
+        String info = null;
+        boolean error = false;
+        try {
+            if (mcmp(httpClient, proxy, "CONFIG", "/", "JVMRoute=reconfig&Host=localhost&Port=8012&Type=http") != 200)
+                error = true;
+            if (mcmp(httpClient, proxy, "ENABLE-APP", "/", "JVMRoute=reconfig&Alias=localhost&Context=/reconfig") != 200)
+                error = true;
+            info = Maintest.getProxyInfo(cluster);
+            if (count(info, "Context: /reconfig,") != 1) {
+                System.out.println("context /reconfig not found: " + info);
+                error = true;
+            }
+
+            // Same JVMRoute another Port: refused, the old node is removed.
+            if (mcmp(httpClient, proxy, "CONFIG", "/", "JVMRoute=reconfig&Host=localhost&Port=8013&Type=http") == 200)
+                error = true;
+            info = Maintest.getProxyInfo(cluster);
+            if (count(info, "Name: REMOVED,") != 1 || count(info, "Name: reconfig,") != 0) {
+                System.out.println("old node not marked removed: " + info);
+                error = true;
+            }
+            if (count(info, "Context: /reconfig,") != 0) {
+                System.out.println("contexts of the old node not removed: " + info);
+                error = true;
+            }
+
+            // Now the new one can be inserted.
+            if (mcmp(httpClient, proxy, "CONFIG", "/", "JVMRoute=reconfig&Host=localhost&Port=8013&Type=http") != 200)
+                error = true;
+            info = Maintest.getProxyInfo(cluster);
+            if (count(info, "Name: reconfig,") != 1 || count(info, "Port: 8013,") != 1) {
+                System.out.println("new node not inserted: " + info);
+                error = true;
+            }
+            mcmp(httpClient, proxy, "REMOVE-APP", "/*", "JVMRoute=reconfig");
+        } catch(Exception ex) {
+            ex.printStackTrace();
+            error = true;
+        }
+
+        // the removed nodes are freed by the watchdog of httpd.
+        Maintest.stop(40, wait, server, service, cluster);
+        if (error)
+            fail("TestReConfig failed");
+        System.out.println("TestReConfig Done");
+    }
+}
@@ -0,0 +1,129 @@
+/*
+ *  mod_cluster
+ *
+ *  Copyright(c) 2008 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ * @version $Revision$
+ */
+
+package org.jboss.mod_cluster;
+
+import junit.framework.TestCase;
+
+import org.jboss.modcluster.ModClusterService;
+import org.apache.catalina.core.StandardServer;
+
+public class TestSessionIdTimeout extends TestCase {
+
+    private int count(String page, String what) {
+        int n = 0;
+        String [] records = page.split("\n");
+        for (int i=0; i<records.length; i++) {
+            if (records[i].indexOf(what) >= 0)
+                n++;
+        }
+        return n;
+    }
+
+    /* The sessionids not used for SessionIdTimeout (10 seconds in installhttpd.sh) are removed */
+    public void testSessionIdTimeout() {
+
+        boolean clienterror = false;
+        StandardServer server = new StandardServer();
+        JBossWeb service = null;
+        ModClusterService cluster = null;
+
+        System.out.println("TestSessionIdTimeout Started");
+        System.setProperty("org.apache.catalina.core.StandardService.DELAY_CONNECTOR_STARTUP", "false");
+        try {
+            service = new JBossWeb("node1",  "localhost");
+            service.addConnector(8011);
+            server.addService(service);
+
+            cluster = Maintest.createClusterListener(server, "224.0.1.105", 23364, false, null, true, false, true, "secret");
+
+        } catch(Exception ex) {
+            ex.printStackTrace();
+            fail("can't start service");
+        }
+
+        // start the server thread.
+        ServerThread wait = new ServerThread(3000, server);
+        wait.start();
+
+        // Wait until httpd as received the nodes information.
+        String [] nodes = new String[1];
+        nodes[0] = "node1";
+        if (!Maintest.WaitForNodes(cluster, nodes)) {
+            Maintest.stop(20, wait, server, service, cluster);
+            fail("can't start nodes");
+        }
+
+        ManagerClient managerclient = null;
+        try {
+              managerclient = new ManagerClient(Maintest.getProxyAddress(cluster));
+        } catch (Exception ex) {
+            ex.printStackTrace();
+            clienterror = true;
+        }
+
+        // Create a session on node1.
+        Client client = new Client();
+        try {
+            if (client.runit("/MyCount", 20, true) != 0)
+                clienterror = true;
+        } catch (Exception ex) {
+            ex.printStackTrace();
+            clienterror = true;
+        }
+
+        if (!clienterror) {
+            try {
+                String page = managerclient.getManagerPage();
+                if (count(page, "route: node1") != 1) {
+                    System.out.println("sessionid not stored: " + page);
+                    clienterror = true;
+                }
+
+                // Not used any more: the watchdog removes it after SessionIdTimeout.
+                int countinfo = 0;
+                while (count(page, "route: node1") != 0 && countinfo < 20) {
+                    Thread.sleep(3000);
+                    page = managerclient.getManagerPage();
+                    countinfo++;
+                }
+                if (countinfo == 20) {
+                    System.out.println("sessionid not removed: " + page);
+                    clienterror = true;
+                }
+            } catch (Exception ex) {
+                ex.printStackTrace();
+                clienterror = true;
+            }
+        }
+
+        Maintest.stop(20, wait, server, service, cluster);
+        if (clienterror)
+            fail("TestSessionIdTimeout failed");
+        System.out.println("TestSessionIdTimeout Done");
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ *  Latency (test of the costs of ElectionMethod latency)
+ *
+ *  Copyright(c) 2009 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ *
+ * @author Jean-Frederic Clere
+ */
+
+#include <stdio.h>
+
+#include "apr.h"
+#include "apr_general.h"
+#include "apr_time.h"
+
+#include "node.h"
+#include "latency.h"
+
+/* a node sending 502 in 1 ms against a healthy one answering in 200 ms */
+static int fail_fast(int percent, apr_size_t busy)
+{
+    volatile apr_uint32_t rt = 0, errors = 0;
+    volatile apr_uint32_t rt1 = 0, errors1 = 0;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        cluster_latency_record(&rt, &errors, APR_TIME_C(1000), ((i * percent) % 100) < percent);
+        cluster_latency_record(&rt1, &errors1, APR_TIME_C(200000), 0);
+    }
+    if (cluster_latency_compare(0, rt, errors, 1, busy, rt1, errors1, 1) <= 0) {
+        printf("%d%% failing node (rt %u errors %u) preferred to the healthy one (rt %u busy %d)\n",
+               percent, rt, errors, rt1, (int) busy);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    volatile apr_uint32_t rt = 0, errors = 0;
+    int failed = 0;
+    int i;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    /* a mostly failing node costs more than any healthy one */
+    failed += fail_fast(100, 0);
+    failed += fail_fast(100, 1000);
+    failed += fail_fast(60, 0);
+    failed += fail_fast(60, 1000);
+
+    /* the failed responses don't make the response time shorter */
+    for (i = 0; i < 100; i++)
+        cluster_latency_record(&rt, &errors, APR_TIME_C(200000), 0);
+    for (i = 0; i < 100; i++)
+        cluster_latency_record(&rt, &errors, APR_TIME_C(1000), 1);
+    if (rt < 200000) {
+        printf("failed responses lowered the response time to %u\n", rt);
+        failed++;
+    }
+
+    /* between 2 failing nodes the cost still decides */
+    if (cluster_latency_compare(0, LATENCY_MAX, NODE_HOT_ERRORS_ALL, 1,
+                                10, LATENCY_MAX, NODE_HOT_ERRORS_ALL, 1) >= 0) {
+        printf("the less busy failing node is not preferred\n");
+        failed++;
+    }
+
+    if (failed) {
+        printf("Latency failed %d\n", failed);
+        return 1;
+    }
+    printf("Latency Done\n");
+    return 0;
+}
@@ -0,0 +1,1087 @@
+/*
+ *  MCMPLoad (load generator for mod_manager)
+ *
+ *  Copyright(c) 2009 Red Hat Middleware, LLC,
+ *  and individual contributors as indicated by the @authors tag.
+ *  See the copyright.txt in the distribution for a
+ *  full listing of individual contributors.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library in the file COPYING.LIB;
+ *  if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Simulates N Tomcat nodes with M contexts each: every node has a small
+ * HTTP server (the backend mod_proxy_cluster sends the requests to) and
+ * sends MCMP messages to mod_manager:
+ * - registration: CONFIG then ENABLE-APP for each context, all the nodes at once.
+ * - load: STATUS (8/10), PING (1/10) and ENABLE-APP again (1/10) at the given
+ *   rate, in bursts of the given size.
+ * - optional: REMOVE-APP of all the nodes (URI *) at the end.
+ * Instead of the generated messages a capture can be replayed (-R), a capture
+ * of the generated messages is written with -C. The format is one message
+ * per line: offset_in_ms METHOD URI [url-encoded body].
+ * HTTP requests sent through the proxy during the test (-w) show how much the
+ * MCMP messages slow down the user requests: the ones before the load phase
+ * (-q seconds) are the baseline.
+ * The latency percentiles of the messages and requests are reported, with
+ * -M the nodes lock hold/wait times of the cluster-metrics handler too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr.h"
+#include "apr_network_io.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_atomic.h"
+#include "apr_getopt.h"
+#include "apr_tables.h"
+#include "apr_file_io.h"
+
+#define CMD_CONFIG  0
+#define CMD_ENABLE  1
+#define CMD_STATUS  2
+#define CMD_PING    3
+#define CMD_REMOVE  4
+#define CMD_REPLAY  5
+#define CMD_HTTP_BASELINE 6
+#define CMD_HTTP_LOAD     7
+#define CMD_NUM     8
+
+static const char *cmd_names[CMD_NUM] = {
+    "CONFIG", "ENABLE-APP", "STATUS", "PING", "REMOVE-APP", "replay", "HTTP baseline", "HTTP under MCMP"
+};
+
+#define BUFSIZE 8192
+#define MAX_LOCK_COMMANDS 16
+#define MAX_BUCKETS 32
+
+/* configuration */
+static const char *mcmp_host = "127.0.0.1";
+static apr_port_t mcmp_port = 6666;
+static const char *mcmp_uri = "/";
+static const char *proxy_host = "127.0.0.1";
+static apr_port_t proxy_port = 8000;
+static const char *backend_host = "127.0.0.1";
+static apr_port_t backend_port = 9000;
+static int backends = 1;
+static int nodes = 10;
+static int contexts = 10;
+static int threads = 4;
+static int rate = 100;           /* MCMP messages/s in the load phase, 0: as fast as possible */
+static int burst = 1;
+static int duration = 10;        /* seconds of load phase */
+static int baseline = 2;         /* seconds of HTTP requests before the load phase */
+static int http_threads = 0;
+static int remove_nodes = 0;
+static const char *balancer = "mycluster";
+static const char *replay_file = NULL;
+static double replay_speed = 1.0;
+static const char *capture_file = NULL;
+static const char *metrics_uri = NULL;
+static apr_interval_time_t timeout;
+
+static apr_sockaddr_t *mcmp_sa;
+static apr_sockaddr_t *proxy_sa;
+
+/* the latencies of everybody */
+static apr_array_header_t *times[CMD_NUM];
+static int errors[CMD_NUM];
+static apr_thread_mutex_t *stats_mutex;
+
+static FILE *capture;
+static apr_thread_mutex_t *capture_mutex;
+static apr_time_t capture_start;
+
+static volatile apr_uint32_t stop_http = 0;
+static volatile apr_uint32_t in_load = 0;
+
+/*
+ * HTTP/1.1 client with keep-alive
+ */
+typedef struct {
+    apr_sockaddr_t *sa;
+    apr_socket_t *sock;
+    apr_pool_t *pool;       /* of the socket */
+    char buf[BUFSIZE];
+    apr_size_t pos;
+    apr_size_t len;
+} conn_t;
+
+typedef struct {
+    char *data;
+    apr_size_t len;
+    apr_size_t size;
+} body_t;
+
+static void conn_close(conn_t *c)
+{
+    if (c->sock) {
+        apr_socket_close(c->sock);
+        c->sock = NULL;
+    }
+    if (c->pool) {
+        apr_pool_destroy(c->pool);
+        c->pool = NULL;
+    }
+    c->pos = c->len = 0;
+}
+
+static apr_status_t conn_open(conn_t *c)
+{
+    apr_status_t rv;
+
+    conn_close(c);
+    apr_pool_create(&c->pool, NULL);
+    rv = apr_socket_create(&c->sock, c->sa->family, SOCK_STREAM, APR_PROTO_TCP, c->pool);
+    if (rv != APR_SUCCESS) {
+        conn_close(c);
+        return rv;
+    }
+    apr_socket_timeout_set(c->sock, timeout);
+    rv = apr_socket_connect(c->sock, c->sa);
+    if (rv != APR_SUCCESS) {
+        conn_close(c);
+        return rv;
+    }
+    apr_socket_opt_set(c->sock, APR_TCP_NODELAY, 1);
+    return APR_SUCCESS;
+}
+
+static apr_status_t send_all(apr_socket_t *sock, const char *buf, apr_size_t len)
+{
+    apr_status_t rv;
+    while (len > 0) {
+        apr_size_t n = len;
+        rv = apr_socket_send(sock, buf, &n);
+        if (rv != APR_SUCCESS)
+            return rv;
+        buf += n;
+        len -= n;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t conn_fill(conn_t *c)
+{
+    apr_size_t n = BUFSIZE;
+    apr_status_t rv = apr_socket_recv(c->sock, c->buf, &n);
+    c->pos = 0;
+    c->len = n;
+    if (rv == APR_SUCCESS && n == 0)
+        rv = APR_EOF;
+    if (rv == APR_EOF && n > 0)
+        rv = APR_SUCCESS;
+    return rv;
+}
+
+/* read a line without the CRLF */
+static apr_status_t conn_getline(conn_t *c, char *line, apr_size_t max)
+{
+    apr_size_t n = 0;
+    apr_status_t rv;
+
+    for (;;) {
+        char ch;
+        if (c->pos == c->len) {
+            rv = conn_fill(c);
+            if (rv != APR_SUCCESS)
+                return rv;
+        }
+        ch = c->buf[c->pos++];
+        if (ch == '\n')
+            break;
+        if (ch != '\r' && n < max - 1)
+            line[n++] = ch;
+    }
+    line[n] = '\0';
+    return APR_SUCCESS;
+}
+
+static void body_append(body_t *body, const char *data, apr_size_t len)
+{
+    if (body == NULL)
+        return;
+    if (body->len + len + 1 > body->size) {
+        apr_size_t size = body->size ? body->size : BUFSIZE;
+        while (size < body->len + len + 1)
+            size = size * 2;
+        body->data = realloc(body->data, size);
+        body->size = size;
+    }
+    memcpy(body->data + body->len, data, len);
+    body->len += len;
+    body->data[body->len] = '\0';
+}
+
+/* read len bytes of the body */
+static apr_status_t conn_read_body(conn_t *c, apr_off_t len, body_t *body)
+{
+    apr_status_t rv;
+    while (len > 0) {
+        apr_size_t n;
+        if (c->pos == c->len) {
+            rv = conn_fill(c);
+            if (rv != APR_SUCCESS)
+                return rv;
+        }
+        n = c->len - c->pos;
+        if ((apr_off_t) n > len)
+            n = (apr_size_t) len;
+        body_append(body, c->buf + c->pos, n);
+        c->pos += n;
+        len -= n;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Send a request and read the response, the connection is opened again if
+ * the server closed the kept alive one.
+ * @return the HTTP status or -1 if the request failed.
+ */
+static int http_request(conn_t *c, const char *method, const char *uri, const char *host, const char *data, body_t *body)
+{
+    char line[BUFSIZE];
+    char *req;
+    apr_size_t len = data ? strlen(data) : 0;
+    apr_off_t clen = -1;
+    int chunked = 0, closing = 0, status = -1;
+    int tries;
+    apr_status_t rv = APR_SUCCESS;
+    apr_pool_t *pool;
+
+    if (body) {
+        body->len = 0;
+        if (body->data)
+            body->data[0] = '\0';
+    }
+    apr_pool_create(&pool, NULL);
+    if (data)
+        req = apr_psprintf(pool, "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: MCMPLoad\r\n"
+                           "Content-Type: application/x-www-form-urlencoded\r\n"
+                           "Content-Length: %" APR_SIZE_T_FMT "\r\n\r\n%s", method, uri, host, len, data);
+    else
+        req = apr_psprintf(pool, "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: MCMPLoad\r\n\r\n", method, uri, host);
+
+    for (tries = 0; tries < 2; tries++) {
+        int reused = (c->sock != NULL);
+        if (!reused && conn_open(c) != APR_SUCCESS)
+            break;
+        rv = send_all(c->sock, req, strlen(req));
+        if (rv == APR_SUCCESS)
+            rv = conn_getline(c, line, sizeof(line));
+        if (rv == APR_SUCCESS)
+            break;
+        conn_close(c);
+        if (!reused)
+            break;
+    }
+    if (c->sock == NULL || rv != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return -1;
+    }
+    if (strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12) {
+        conn_close(c);
+        apr_pool_destroy(pool);
+        return -1;
+    }
+    status = atoi(line + 9);
+    if (line[7] == '0')
+        closing = 1;
+
+    /* headers */
+    while ((rv = conn_getline(c, line, sizeof(line))) == APR_SUCCESS && line[0] != '\0') {
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            clen = apr_atoi64(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked"))
+            chunked = 1;
+        else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close"))
+            closing = 1;
+    }
+    if (rv == APR_SUCCESS && strcmp(method, "HEAD") != 0 && status != 204 && status != 304) {
+        if (chunked) {
+            for (;;) {
+                apr_off_t size;
+                rv = conn_getline(c, line, sizeof(line));
+                if (rv != APR_SUCCESS)
+                    break;
+                size = apr_strtoi64(line, NULL, 16);
+                if (size == 0) {
+                    /* trailers */
+                    while ((rv = conn_getline(c, line, sizeof(line))) == APR_SUCCESS && line[0] != '\0')
+                        ;
+                    break;
+                }
+                rv = conn_read_body(c, size, body);
+                if (rv == APR_SUCCESS)
+                    rv = conn_getline(c, line, sizeof(line));
+                if (rv != APR_SUCCESS)
+                    break;
+            }
+        }
+        else if (clen >= 0)
+            rv = conn_read_body(c, clen, body);
+        else {
+            /* until the server closes the connection */
+            for (;;) {
+                if (c->pos == c->len && conn_fill(c) != APR_SUCCESS)
+                    break;
+                body_append(body, c->buf + c->pos, c->len - c->pos);
+                c->pos = c->len;
+            }
+            closing = 1;
+        }
+    }
+    if (rv != APR_SUCCESS)
+        status = -1;
+    if (rv != APR_SUCCESS || closing)
+        conn_close(c);
+    apr_pool_destroy(pool);
+    return status;
+}
+
+/*
+ * The statistics
+ */
+typedef struct {
+    apr_array_header_t *times[CMD_NUM];
+    int errors[CMD_NUM];
+} stats_t;
+
+static void stats_init(stats_t *stats, apr_pool_t *pool)
+{
+    int i;
+    for (i = 0; i < CMD_NUM; i++) {
+        stats->times[i] = apr_array_make(pool, 1024, sizeof(apr_interval_time_t));
+        stats->errors[i] = 0;
+    }
+}
+
+static void stats_add(stats_t *stats, int cmd, apr_interval_time_t t, int error)
+{
+    APR_ARRAY_PUSH(stats->times[cmd], apr_interval_time_t) = t;
+    if (error)
+        stats->errors[cmd]++;
+}
+
+/* add the statistics of a thread to the ones of everybody */
+static void stats_merge(stats_t *stats)
+{
+    int i;
+    apr_thread_mutex_lock(stats_mutex);
+    for (i = 0; i < CMD_NUM; i++) {
+        apr_array_cat(times[i], stats->times[i]);
+        errors[i] += stats->errors[i];
+    }
+    apr_thread_mutex_unlock(stats_mutex);
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+    apr_interval_time_t ta = *(const apr_interval_time_t *) a;
+    apr_interval_time_t tb = *(const apr_interval_time_t *) b;
+    return (ta > tb) - (ta < tb);
+}
+
+static double percentile(apr_array_header_t *arr, double p)
+{
+    int n = arr->nelts;
+    if (n == 0)
+        return 0;
+    return (double) ((apr_interval_time_t *) arr->elts)[(int) ((n - 1) * p)] / 1000;
+}
+
+static void print_stats(void)
+{
+    int i;
+    printf("%-16s %9s %7s %9s %9s %9s %9s %9s\n",
+           "command", "count", "errors", "p50(ms)", "p90(ms)", "p99(ms)", "p99.9(ms)", "max(ms)");
+    for (i = 0; i < CMD_NUM; i++) {
+        apr_array_header_t *arr = times[i];
+        if (arr->nelts == 0)
+            continue;
+        qsort(arr->elts, arr->nelts, sizeof(apr_interval_time_t), cmp_time);
+        printf("%-16s %9d %7d %9.3f %9.3f %9.3f %9.3f %9.3f\n", cmd_names[i], arr->nelts, errors[i],
+               percentile(arr, 0.50), percentile(arr, 0.90), percentile(arr, 0.99),
+               percentile(arr, 0.999), percentile(arr, 1.0));
+    }
+}
+
+/*
+ * The MCMP messages
+ */
+static void record(const char *method, const char *uri, const char *data)
+{
+    if (capture == NULL)
+        return;
+    apr_thread_mutex_lock(capture_mutex);
+    fprintf(capture, "%" APR_TIME_T_FMT " %s %s %s\n", (apr_time_now() - capture_start) / 1000,
+            method, uri, data ? data : "");
+    apr_thread_mutex_unlock(capture_mutex);
+}
+
+/* send a MCMP message, a STATUS-RSP with State=NOTOK is an error */
+static void mcmp_send(conn_t *c, stats_t *stats, int cmd, const char *method, const char *uri, const char *data, body_t *body)
+{
+    apr_time_t start;
+    int status;
+
+    record(method, uri, data);
+    start = apr_time_now();
+    status = http_request(c, method, uri, mcmp_host, data, body);
+    stats_add(stats, cmd, apr_time_now() - start,
+              status != 200 || (body->data && strstr(body->data, "State=NOTOK") != NULL));
+}
+
+static const char *node_config(apr_pool_t *pool, int node)
+{
+    if (backends)
+        return apr_psprintf(pool, "JVMRoute=node%d&Balancer=%s&Host=%s&Port=%d&Type=http"
+                            "&StickySession=yes&StickySessionCookie=JSESSIONID&StickySessionPath=jsessionid",
+                            node, balancer, backend_host, backend_port + node - 1);
+    return apr_psprintf(pool, "JVMRoute=node%d&Balancer=%s&Host=%s&Port=%d&Type=ajp"
+                        "&StickySession=yes&StickySessionCookie=JSESSIONID&StickySessionPath=jsessionid",
+                        node, balancer, backend_host, backend_port);
+}
+
+static const char *node_context(apr_pool_t *pool, int node, int context)
+{
+    return apr_psprintf(pool, "JVMRoute=node%d&Alias=localhost&Context=%%2Fapp%d", node, context);
+}
+
+struct mcmp_thread {
+    int first;        /* the nodes of the thread: first, first + threads... */
+    int phase;        /* 0: registration, 1: load, 2: remove */
+};
+
+static void * APR_THREAD_FUNC mcmp_thread(apr_thread_t *thd, void *data)
+{
+    struct mcmp_thread *me = data;
+    apr_pool_t *pool, *tpool;
+    conn_t *c;
+    body_t body;
+    stats_t stats;
+    int node, i;
+
+    apr_pool_create(&pool, NULL);
+    apr_pool_create(&tpool, pool);
+    c = apr_pcalloc(pool, sizeof(conn_t));
+    c->sa = mcmp_sa;
+    memset(&body, 0, sizeof(body));
+    stats_init(&stats, pool);
+
+    if (me->phase == 0) {
+        for (node = me->first; node <= nodes; node += threads) {
+            mcmp_send(c, &stats, CMD_CONFIG, "CONFIG", mcmp_uri, node_config(tpool, node), &body);
+            for (i = 0; i < contexts; i++)
+                mcmp_send(c, &stats, CMD_ENABLE, "ENABLE-APP", mcmp_uri, node_context(tpool, node, i), &body);
+            apr_pool_clear(tpool);
+        }
+    }
+    else if (me->phase == 2) {
+        for (node = me->first; node <= nodes; node += threads) {
+            char *uri = apr_pstrcat(tpool, mcmp_uri, mcmp_uri[strlen(mcmp_uri) - 1] == '/' ? "*" : "/*", NULL);
+            mcmp_send(c, &stats, CMD_REMOVE, "REMOVE-APP", uri, apr_psprintf(tpool, "JVMRoute=node%d", node), &body);
+            apr_pool_clear(tpool);
+        }
+    }
+    else if (me->first <= nodes) {
+        /* the load: each thread sends its part of the rate */
+        apr_time_t start = apr_time_now();
+        apr_time_t end = start + apr_time_from_sec(duration);
+        apr_time_t next = start;
+        int active = threads < nodes ? threads : nodes;
+        apr_interval_time_t interval = rate > 0 ? (apr_interval_time_t) APR_USEC_PER_SEC * active * burst / rate : 0;
+        apr_uint64_t k = 0;
+        node = me->first;
+        while (apr_time_now() < end) {
+            for (i = 0; i < burst; i++, k++) {
+                if (k % 10 == 9)
+                    mcmp_send(c, &stats, CMD_PING, "PING", mcmp_uri, apr_psprintf(tpool, "JVMRoute=node%d", node), &body);
+                else if (k % 10 == 4)
+                    mcmp_send(c, &stats, CMD_ENABLE, "ENABLE-APP", mcmp_uri,
+                              node_context(tpool, node, (int) (k / 10) % contexts), &body);
+                else
+                    mcmp_send(c, &stats, CMD_STATUS, "STATUS", mcmp_uri,
+                              apr_psprintf(tpool, "JVMRoute=node%d&Load=%d", node, (int) (k * 37 % 100) + 1), &body);
+                apr_pool_clear(tpool);
+                node += threads;
+                if (node > nodes)
+                    node = me->first;
+            }
+            if (interval) {
+                apr_time_t now = apr_time_now();
+                next += interval;
+                if (next > now)
+                    apr_sleep(next - now);
+            }
+        }
+    }
+
+    conn_close(c);
+    stats_merge(&stats);
+    free(body.data);
+    apr_pool_destroy(pool);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* replay a capture: the offsets are divided by the speed, 0: as fast as possible */
+static int replay(apr_pool_t *pool)
+{
+    apr_file_t *file;
+    char line[BUFSIZE];
+    conn_t *c = apr_pcalloc(pool, sizeof(conn_t));
+    body_t body;
+    stats_t stats;
+    apr_time_t start;
+    apr_pool_t *tpool;
+
+    if (apr_file_open(&file, replay_file, APR_READ, APR_OS_DEFAULT, pool) != APR_SUCCESS) {
+        fprintf(stderr, "Can't open %s\n", replay_file);
+        return 1;
+    }
+    c->sa = mcmp_sa;
+    memset(&body, 0, sizeof(body));
+    stats_init(&stats, pool);
+    apr_pool_create(&tpool, pool);
+    start = apr_time_now();
+    while (apr_file_gets(line, sizeof(line), file) == APR_SUCCESS) {
+        char *last;
+        char *offset, *method, *uri, *data;
+        apr_size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        offset = apr_strtok(line, " ", &last);
+        method = apr_strtok(NULL, " ", &last);
+        uri = apr_strtok(NULL, " ", &last);
+        data = apr_strtok(NULL, "", &last);
+        if (offset == NULL || method == NULL || uri == NULL)
+            continue;
+        if (replay_speed > 0) {
+            apr_time_t at = start + (apr_time_t) (apr_atoi64(offset) * 1000 / replay_speed);
+            apr_time_t now = apr_time_now();
+            if (at > now)
+                apr_sleep(at - now);
+        }
+        mcmp_send(c, &stats, CMD_REPLAY, method, uri, data, &body);
+        apr_pool_clear(tpool);
+    }
+    apr_file_close(file);
+    conn_close(c);
+    stats_merge(&stats);
+    free(body.data);
+    return 0;
+}
+
+static int run_mcmp(apr_pool_t *pool, int phase)
+{
+    apr_thread_t **thds = apr_palloc(pool, sizeof(apr_thread_t *) * threads);
+    struct mcmp_thread *args = apr_palloc(pool, sizeof(struct mcmp_thread) * threads);
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        args[i].first = i + 1;
+        args[i].phase = phase;
+        if (apr_thread_create(&thds[i], NULL, mcmp_thread, &args[i], pool) != APR_SUCCESS) {
+            fprintf(stderr, "apr_thread_create failed\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < threads; i++)
+        apr_thread_join(&rv, thds[i]);
+    return 0;
+}
+
+/*
+ * The HTTP requests through the proxy
+ */
+static void * APR_THREAD_FUNC http_thread(apr_thread_t *thd, void *data)
+{
+    int me = *(int *) data;
+    apr_pool_t *pool;
+    conn_t *c;
+    stats_t stats;
+    char *host;
+    int k;
+
+    apr_pool_create(&pool, NULL);
+    c = apr_pcalloc(pool, sizeof(conn_t));
+    c->sa = proxy_sa;
+    stats_init(&stats, pool);
+    host = apr_psprintf(pool, "localhost:%d", proxy_port);
+    for (k = me; !apr_atomic_read32(&stop_http); k += http_threads) {
+        char uri[64];
+        apr_time_t start;
+        int status;
+        int cmd = apr_atomic_read32(&in_load) ? CMD_HTTP_LOAD : CMD_HTTP_BASELINE;
+        apr_snprintf(uri, sizeof(uri), "/app%d/", k % contexts);
+        start = apr_time_now();
+        status = http_request(c, "GET", uri, host, NULL, NULL);
+        stats_add(&stats, cmd, apr_time_now() - start, status != 200);
+        if (status < 0)
+            apr_sleep(apr_time_from_msec(10)); /* don't spin on a refused connection */
+    }
+    conn_close(c);
+    stats_merge(&stats);
+    apr_pool_destroy(pool);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/*
+ * The fake Tomcat nodes: any request gets a 200 with the JVMRoute
+ */
+struct backend_conn {
+    apr_socket_t *sock;
+    apr_pool_t *pool;
+    int node;
+};
+
+static void * APR_THREAD_FUNC backend_conn_thread(apr_thread_t *thd, void *data)
+{
+    struct backend_conn *bc = data;
+    conn_t *c = apr_pcalloc(bc->pool, sizeof(conn_t));
+    char line[BUFSIZE];
+    char resp[256];
+    char route[32];
+    int rlen = apr_snprintf(route, sizeof(route), "node%d\n", bc->node);
+
+    c->sock = bc->sock;
+    apr_socket_timeout_set(c->sock, apr_time_from_sec(60));
+    for (;;) {
+        apr_off_t clen = 0;
+        int closing = 0;
+        apr_size_t len;
+        if (conn_getline(c, line, sizeof(line)) != APR_SUCCESS)
+            break;
+        if (line[0] == '\0')
+            continue;
+        if (strstr(line, "HTTP/1.0"))
+            closing = 1;
+        while (conn_getline(c, line, sizeof(line)) == APR_SUCCESS && line[0] != '\0') {
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+                clen = apr_atoi64(line + 15);
+            else if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close"))
+                closing = 1;
+        }
+        if (clen > 0 && conn_read_body(c, clen, NULL) != APR_SUCCESS)
+            break;
+        len = apr_snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                           "Content-Length: %d\r\n%s\r\n%s", rlen,
+                           closing ? "Connection: close\r\n" : "", route);
+        if (send_all(c->sock, resp, len) != APR_SUCCESS || closing)
+            break;
+    }
+    apr_socket_close(bc->sock);
+    apr_pool_destroy(bc->pool);
+    return NULL;
+}
+
+static void * APR_THREAD_FUNC backend_thread(apr_thread_t *thd, void *data)
+{
+    struct backend_conn *listener = data;
+    apr_threadattr_t *attr;
+    apr_pool_t *lpool;
+
+    apr_pool_create(&lpool, NULL);
+    apr_threadattr_create(&attr, lpool);
+    apr_threadattr_detach_set(attr, 1);
+    for (;;) {
+        apr_pool_t *pool;
+        struct backend_conn *bc;
+        apr_thread_t *t;
+
+        apr_pool_create(&pool, NULL);
+        bc = apr_pcalloc(pool, sizeof(struct backend_conn));
+        bc->pool = pool;
+        bc->node = listener->node;
+        if (apr_socket_accept(&bc->sock, listener->sock, pool) != APR_SUCCESS ||
+            apr_thread_create(&t, attr, backend_conn_thread, bc, pool) != APR_SUCCESS) {
+            apr_pool_destroy(pool);
+            apr_sleep(apr_time_from_msec(10));
+        }
+    }
+    return NULL;
+}
+
+static int start_backends(apr_pool_t *pool)
+{
+    apr_threadattr_t *attr;
+    int node;
+
+    apr_threadattr_create(&attr, pool);
+    apr_threadattr_detach_set(attr, 1);
+    for (node = 1; node <= nodes; node++) {
+        apr_sockaddr_t *sa;
+        struct backend_conn *listener = apr_pcalloc(pool, sizeof(struct backend_conn));
+        apr_thread_t *t;
+        apr_status_t rv;
+
+        listener->node = node;
+        listener->pool = pool;
+        rv = apr_sockaddr_info_get(&sa, backend_host, APR_UNSPEC, backend_port + node - 1, 0, pool);
+        if (rv == APR_SUCCESS)
+            rv = apr_socket_create(&listener->sock, sa->family, SOCK_STREAM, APR_PROTO_TCP, pool);
+        if (rv == APR_SUCCESS) {
+            apr_socket_opt_set(listener->sock, APR_SO_REUSEADDR, 1);
+            rv = apr_socket_bind(listener->sock, sa);
+        }
+        if (rv == APR_SUCCESS)
+            rv = apr_socket_listen(listener->sock, 128);
+        if (rv == APR_SUCCESS)
+            rv = apr_thread_create(&t, attr, backend_thread, listener, pool);
+        if (rv != APR_SUCCESS) {
+            char buf[120];
+            fprintf(stderr, "Can't listen on %s:%d for node%d: %s\n", backend_host, backend_port + node - 1, node,
+                    apr_strerror(rv, buf, sizeof(buf)));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The nodes lock times of the cluster-metrics handler
+ */
+typedef struct {
+    int ncommands;
+    char commands[MAX_LOCK_COMMANDS][32];
+    double hold_sum[MAX_LOCK_COMMANDS];
+    double hold_count[MAX_LOCK_COMMANDS];
+    double wait_sum;
+    double wait_count;
+    int nbuckets;
+    char le[MAX_BUCKETS][16];
+    double buckets[MAX_BUCKETS];
+} lock_metrics_t;
+
+static int lock_command(lock_metrics_t *m, const char *name)
+{
+    int i;
+    for (i = 0; i < m->ncommands; i++) {
+        if (strcmp(m->commands[i], name) == 0)
+            return i;
+    }
+    if (m->ncommands == MAX_LOCK_COMMANDS)
+        return -1;
+    apr_cpystrn(m->commands[m->ncommands], name, sizeof(m->commands[0]));
+    return m->ncommands++;
+}
+
+static int read_metrics(apr_pool_t *pool, lock_metrics_t *m)
+{
+    conn_t *c = apr_pcalloc(pool, sizeof(conn_t));
+    body_t body;
+    char *line, *last;
+    int status;
+
+    memset(m, 0, sizeof(lock_metrics_t));
+    memset(&body, 0, sizeof(body));
+    c->sa = mcmp_sa;
+    status = http_request(c, "GET", metrics_uri, mcmp_host, NULL, &body);
+    conn_close(c);
+    if (status != 200 || body.data == NULL) {
+        free(body.data);
+        return 0;
+    }
+    for (line = apr_strtok(body.data, "\n", &last); line; line = apr_strtok(NULL, "\n", &last)) {
+        char name[32];
+        double value;
+        int i;
+        if (sscanf(line, "mod_cluster_lock_hold_seconds_sum{command=\"%31[^\"]\"} %lf", name, &value) == 2) {
+            if ((i = lock_command(m, name)) >= 0)
+                m->hold_sum[i] = value;
+        }
+        else if (sscanf(line, "mod_cluster_lock_hold_seconds_count{command=\"%31[^\"]\"} %lf", name, &value) == 2) {
+            if ((i = lock_command(m, name)) >= 0)
+                m->hold_count[i] = value;
+        }
+        else if (sscanf(line, "mod_cluster_lock_wait_seconds_sum{} %lf", &value) == 1)
+            m->wait_sum = value;
+        else if (sscanf(line, "mod_cluster_lock_wait_seconds_count{} %lf", &value) == 1)
+            m->wait_count = value;
+        else if (sscanf(line, "mod_cluster_lock_wait_seconds_bucket{le=\"%15[^\"]\"} %lf", name, &value) == 2 &&
+                 m->nbuckets < MAX_BUCKETS) {
+            apr_cpystrn(m->le[m->nbuckets], name, sizeof(m->le[0]));
+            m->buckets[m->nbuckets++] = value;
+        }
+    }
+    free(body.data);
+    return 1;
+}
+
+static void print_lock_metrics(lock_metrics_t *before, lock_metrics_t *after)
+{
+    int i, j;
+    double count;
+
+    printf("nodes lock (%s)\n", metrics_uri);
+    printf("%-16s %9s %14s\n", "command", "count", "hold mean(ms)");
+    for (i = 0; i < after->ncommands; i++) {
+        double sum = after->hold_sum[i];
+        count = after->hold_count[i];
+        for (j = 0; j < before->ncommands; j++) {
+            if (strcmp(before->commands[j], after->commands[i]) == 0) {
+                sum -= before->hold_sum[j];
+                count -= before->hold_count[j];
+            }
+        }
+        if (count > 0)
+            printf("%-16s %9.0f %14.3f\n", after->commands[i], count, sum * 1000 / count);
+    }
+    count = after->wait_count - before->wait_count;
+    if (count > 0) {
+        const char *p99 = "+Inf";
+        for (i = 0; i < after->nbuckets; i++) {
+            double n = after->buckets[i] - (i < before->nbuckets ? before->buckets[i] : 0);
+            if (n >= count * 0.99) {
+                p99 = after->le[i];
+                break;
+            }
+        }
+        printf("%-16s %9.0f %14.3f (p99 <= %s s)\n", "wait", count,
+               (after->wait_sum - before->wait_sum) * 1000 / count, p99);
+    }
+}
+
+static int parse_hostport(const char *arg, const char **host, apr_port_t *port, apr_pool_t *pool)
+{
+    char *addr, *scope;
+    apr_port_t p;
+    if (apr_parse_addr_port(&addr, &scope, &p, arg, pool) != APR_SUCCESS || addr == NULL)
+        return 0;
+    *host = addr;
+    if (p)
+        *port = p;
+    return 1;
+}
+
+static const apr_getopt_option_t options[] = {
+    { "manager", 'm', 1, "host:port of the MCMP VirtualHost (127.0.0.1:6666)" },
+    { "uri", 'u', 1, "URI of the MCMP messages (/)" },
+    { "nodes", 'n', 1, "number of nodes (10)" },
+    { "contexts", 'c', 1, "contexts of each node (10)" },
+    { "threads", 't', 1, "MCMP connections (4)" },
+    { "rate", 'r', 1, "MCMP messages/s during the load, 0: as fast as possible (100)" },
+    { "burst", 'b', 1, "messages sent back to back at the rate (1)" },
+    { "duration", 'd', 1, "seconds of the load (10)" },
+    { "balancer", 'B', 1, "name of the balancer (mycluster)" },
+    { "backend", 'e', 1, "host:base_port of the nodes (127.0.0.1:9000)" },
+    { "no-backend", 'E', 0, "don't start the nodes: Type=ajp to backend" },
+    { "proxy", 'p', 1, "host:port of the proxy for the HTTP requests (127.0.0.1:8000)" },
+    { "http", 'w', 1, "HTTP threads sending requests through the proxy (0)" },
+    { "baseline", 'q', 1, "seconds of HTTP requests before the load (2)" },
+    { "remove", 'x', 0, "REMOVE-APP the nodes at the end" },
+    { "replay", 'R', 1, "replay the capture instead of the generated messages" },
+    { "speed", 's', 1, "speed of the replay, 0: as fast as possible (1.0)" },
+    { "capture", 'C', 1, "write a capture of the messages sent" },
+    { "metrics", 'M', 1, "URI of the cluster-metrics handler to get the lock times" },
+    { "timeout", 'T', 1, "socket timeout in seconds (10)" },
+    { "help", 'h', 0, "this help" },
+    { NULL, 0, 0, NULL }
+};
+
+static void usage(const char *name)
+{
+    int i;
+    fprintf(stderr, "Usage: %s [options]\n", name);
+    for (i = 0; options[i].name; i++)
+        fprintf(stderr, "  -%c, --%-11s %s\n", options[i].optch, options[i].name, options[i].description);
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    apr_thread_t **http_thds = NULL;
+    int *http_ids;
+    lock_metrics_t before, after;
+    int have_metrics = 0;
+    const char *arg;
+    apr_time_t start;
+    apr_interval_time_t elapsed;
+    apr_status_t rv;
+    int ch, i;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    /* no apr_terminate(): the backend threads are still running at the end */
+    apr_pool_create(&pool, NULL);
+    timeout = apr_time_from_sec(10);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((rv = apr_getopt_long(opt, options, &ch, &arg)) == APR_SUCCESS) {
+        switch (ch) {
+        case 'm':
+            if (!parse_hostport(arg, &mcmp_host, &mcmp_port, pool))
+                rv = APR_EINVAL;
+            break;
+        case 'u':
+            mcmp_uri = arg;
+            break;
+        case 'n':
+            nodes = atoi(arg);
+            break;
+        case 'c':
+            contexts = atoi(arg);
+            break;
+        case 't':
+            threads = atoi(arg);
+            break;
+        case 'r':
+            rate = atoi(arg);
+            break;
+        case 'b':
+            burst = atoi(arg);
+            break;
+        case 'd':
+            duration = atoi(arg);
+            break;
+        case 'B':
+            balancer = arg;
+            break;
+        case 'e':
+            if (!parse_hostport(arg, &backend_host, &backend_port, pool))
+                rv = APR_EINVAL;
+            break;
+        case 'E':
+            backends = 0;
+            break;
+        case 'p':
+            if (!parse_hostport(arg, &proxy_host, &proxy_port, pool))
+                rv = APR_EINVAL;
+            break;
+        case 'w':
+            http_threads = atoi(arg);
+            break;
+        case 'q':
+            baseline = atoi(arg);
+            break;
+        case 'x':
+            remove_nodes = 1;
+            break;
+        case 'R':
+            replay_file = arg;
+            break;
+        case 's':
+            replay_speed = atof(arg);
+            break;
+        case 'C':
+            capture_file = arg;
+            break;
+        case 'M':
+            metrics_uri = arg;
+            break;
+        case 'T':
+            timeout = apr_time_from_sec(atoi(arg));
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+        if (rv != APR_SUCCESS)
+            break;
+    }
+    if (rv != APR_EOF || nodes <= 0 || contexts <= 0 || threads <= 0 || rate < 0 || burst <= 0 ||
+        duration < 0 || http_threads < 0 || baseline < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (apr_sockaddr_info_get(&mcmp_sa, mcmp_host, APR_UNSPEC, mcmp_port, 0, pool) != APR_SUCCESS) {
+        fprintf(stderr, "Can't resolve %s\n", mcmp_host);
+        return 1;
+    }
+    if (http_threads && apr_sockaddr_info_get(&proxy_sa, proxy_host, APR_UNSPEC, proxy_port, 0, pool) != APR_SUCCESS) {
+        fprintf(stderr, "Can't resolve %s\n", proxy_host);
+        return 1;
+    }
+    apr_thread_mutex_create(&stats_mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    for (i = 0; i < CMD_NUM; i++)
+        times[i] = apr_array_make(pool, 1024, sizeof(apr_interval_time_t));
+    if (capture_file) {
+        capture = fopen(capture_file, "w");
+        if (capture == NULL) {
+            fprintf(stderr, "Can't create %s\n", capture_file);
+            return 1;
+        }
+        apr_thread_mutex_create(&capture_mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+        capture_start = apr_time_now();
+    }
+    if (backends && !replay_file && start_backends(pool))
+        return 1;
+    if (metrics_uri)
+        have_metrics = read_metrics(pool, &before);
+
+    /* registration of the nodes */
+    if (!replay_file && run_mcmp(pool, 0))
+        return 1;
+
+    /* user requests alone */
+    if (http_threads) {
+        apr_thread_t **thds = apr_palloc(pool, sizeof(apr_thread_t *) * http_threads);
+        http_ids = apr_palloc(pool, sizeof(int) * http_threads);
+        for (i = 0; i < http_threads; i++) {
+            http_ids[i] = i;
+            if (apr_thread_create(&thds[i], NULL, http_thread, &http_ids[i], pool) != APR_SUCCESS) {
+                fprintf(stderr, "apr_thread_create failed\n");
+                return 1;
+            }
+        }
+        http_thds = thds;
+        apr_sleep(apr_time_from_sec(baseline));
+    }
+
+    /* the load */
+    apr_atomic_set32(&in_load, 1);
+    start = apr_time_now();
+    if (replay_file) {
+        if (replay(pool))
+            return 1;
+    }
+    else if (run_mcmp(pool, 1))
+        return 1;
+    elapsed = apr_time_now() - start;
+    apr_atomic_set32(&stop_http, 1);
+    for (i = 0; i < http_threads; i++)
+        apr_thread_join(&rv, http_thds[i]);
+
+    if (remove_nodes && !replay_file && run_mcmp(pool, 2))
+        return 1;
+
+    printf("# MCMPLoad nodes %d contexts %d threads %d rate %d burst %d duration %d\n",
+           nodes, contexts, threads, rate, burst, duration);
+    print_stats();
+    if (elapsed > 0) {
+        int n = times[CMD_STATUS]->nelts + times[CMD_PING]->nelts + times[CMD_REPLAY]->nelts;
+        /* the ENABLE-APP of the load phase only */
+        n += times[CMD_ENABLE]->nelts - (replay_file ? 0 : nodes * contexts);
+        printf("load phase: %.1f MCMP messages/s\n", (double) n * APR_USEC_PER_SEC / elapsed);
+    }
+    if (have_metrics && read_metrics(pool, &after))
+        print_lock_metrics(&before, &after);
+    if (capture)
+        fclose(capture);
+    fflush(stdout);
+    return 0;
+}